@@ -0,0 +1,730 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DicomHeader.h"
+#include "FileMemoryMap.h"
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <DicomFormat/DicomInstanceHasher.h>
+#include <DicomFormat/DicomMap.h>
+#include <OrthancException.h>
+#include <SerializationToolbox.h>
+
+#include <algorithm>
+
+
+static const uint32_t TAG_TRANSFER_SYNTAX_UID = 0x00020010;
+static const uint32_t TAG_SOP_INSTANCE_UID = 0x00080018;
+static const uint32_t TAG_PATIENT_ID = 0x00100020;
+static const uint32_t TAG_STUDY_INSTANCE_UID = 0x0020000d;
+static const uint32_t TAG_SERIES_INSTANCE_UID = 0x0020000e;
+
+// Group of "Pixel Data", "Float Pixel Data" and "Double Float Pixel Data"
+static const uint16_t GROUP_PIXEL_DATA = 0x7fe0;
+
+static const uint32_t TAG_ITEM = 0xfffee000;
+static const uint32_t TAG_ITEM_DELIMITATION = 0xfffee00d;
+static const uint32_t TAG_SEQUENCE_DELIMITATION = 0xfffee0dd;
+
+static const uint32_t UNDEFINED_LENGTH = 0xffffffff;
+
+// Growth of the prefix of the files that is read to find the identifiers
+static const uintmax_t INITIAL_PREFIX_SIZE = 16 * 1024;
+static const uintmax_t MAX_PREFIX_SIZE = 16 * 1024 * 1024;
+
+// Same limit as in the call to "OrthancPluginDicomBufferToJson()"
+static const uint32_t MAX_STRING_LENGTH = 256;
+
+static const unsigned int MAX_SEQUENCE_DEPTH = 32;
+
+
+namespace
+{
+  enum Status
+  {
+    Status_Success,
+    Status_Incomplete,
+    Status_Invalid
+  };
+
+  struct Element
+  {
+    uint32_t  tag_;
+    char      vr_[2];
+    uint32_t  length_;
+  };
+
+
+  class DatasetReader
+  {
+  private:
+    const uint8_t*  buffer_;
+    size_t          size_;
+
+    uint16_t ReadUInt16(size_t offset,
+                        bool bigEndian) const
+    {
+      if (bigEndian)
+      {
+        return ((static_cast<uint16_t>(buffer_[offset]) << 8) |
+                static_cast<uint16_t>(buffer_[offset + 1]));
+      }
+      else
+      {
+        return (static_cast<uint16_t>(buffer_[offset]) |
+                (static_cast<uint16_t>(buffer_[offset + 1]) << 8));
+      }
+    }
+
+    uint32_t ReadUInt32(size_t offset,
+                        bool bigEndian) const
+    {
+      if (bigEndian)
+      {
+        return ((static_cast<uint32_t>(ReadUInt16(offset, true)) << 16) |
+                static_cast<uint32_t>(ReadUInt16(offset + 2, true)));
+      }
+      else
+      {
+        return (static_cast<uint32_t>(ReadUInt16(offset, false)) |
+                (static_cast<uint32_t>(ReadUInt16(offset + 2, false)) << 16));
+      }
+    }
+
+    static bool HasLongLength(const char vr[2])
+    {
+      // PS3.5 Table 7.1-1: VRs with a 32-bit length after 2 reserved bytes
+      static const char* const LONG_VRS[] = {
+        "OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV"
+      };
+
+      for (size_t i = 0; i < sizeof(LONG_VRS) / sizeof(LONG_VRS[0]); i++)
+      {
+        if (vr[0] == LONG_VRS[i][0] &&
+            vr[1] == LONG_VRS[i][1])
+        {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+  public:
+    DatasetReader(const void* buffer,
+                  size_t size) :
+      buffer_(reinterpret_cast<const uint8_t*>(buffer)),
+      size_(size)
+    {
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+
+    bool PeekGroup(uint16_t& group,
+                   size_t offset,
+                   bool bigEndian) const
+    {
+      if (offset + 2 > size_)
+      {
+        return false;
+      }
+      else
+      {
+        group = ReadUInt16(offset, bigEndian);
+        return true;
+      }
+    }
+
+    Status ReadElementHeader(Element& element,
+                             size_t& offset,
+                             bool explicitVR,
+                             bool bigEndian) const
+    {
+      if (offset + 8 > size_)
+      {
+        return Status_Incomplete;
+      }
+
+      element.tag_ = ((static_cast<uint32_t>(ReadUInt16(offset, bigEndian)) << 16) |
+                      static_cast<uint32_t>(ReadUInt16(offset + 2, bigEndian)));
+
+      if (!explicitVR ||
+          (element.tag_ >> 16) == 0xfffe)  // Items and delimiters have no VR
+      {
+        element.vr_[0] = 0;
+        element.vr_[1] = 0;
+        element.length_ = ReadUInt32(offset + 4, bigEndian);
+        offset += 8;
+        return Status_Success;
+      }
+
+      element.vr_[0] = static_cast<char>(buffer_[offset + 4]);
+      element.vr_[1] = static_cast<char>(buffer_[offset + 5]);
+
+      if (element.vr_[0] < 'A' || element.vr_[0] > 'Z' ||
+          element.vr_[1] < 'A' || element.vr_[1] > 'Z')
+      {
+        return Status_Invalid;  // Not an explicit VR, the transfer syntax is wrong
+      }
+
+      if (HasLongLength(element.vr_))
+      {
+        if (offset + 12 > size_)
+        {
+          return Status_Incomplete;
+        }
+
+        element.length_ = ReadUInt32(offset + 8, bigEndian);
+        offset += 12;
+      }
+      else
+      {
+        element.length_ = ReadUInt16(offset + 6, bigEndian);
+        offset += 8;
+      }
+
+      return Status_Success;
+    }
+
+    Status SkipValue(size_t& offset,
+                     uint32_t length) const
+    {
+      if (offset + length > size_)
+      {
+        return Status_Incomplete;
+      }
+      else
+      {
+        offset += length;
+        return Status_Success;
+      }
+    }
+
+    // Skips the items of a value with undefined length (sequence, or
+    // encapsulated pixel data), up to the sequence delimitation item
+    Status SkipUndefinedLength(size_t& offset,
+                               bool explicitVR,
+                               bool bigEndian,
+                               unsigned int depth) const
+    {
+      if (depth > MAX_SEQUENCE_DEPTH)
+      {
+        return Status_Invalid;
+      }
+
+      for (;;)
+      {
+        Element item;
+        Status status = ReadElementHeader(item, offset, false, bigEndian);
+        if (status != Status_Success)
+        {
+          return status;
+        }
+
+        if (item.tag_ == TAG_SEQUENCE_DELIMITATION)
+        {
+          return Status_Success;
+        }
+        else if (item.tag_ != TAG_ITEM)
+        {
+          return Status_Invalid;
+        }
+        else if (item.length_ != UNDEFINED_LENGTH)
+        {
+          status = SkipValue(offset, item.length_);
+        }
+        else
+        {
+          status = SkipItem(offset, explicitVR, bigEndian, depth);
+        }
+
+        if (status != Status_Success)
+        {
+          return status;
+        }
+      }
+    }
+
+    // Skips the elements of an item with undefined length, up to the
+    // item delimitation item
+    Status SkipItem(size_t& offset,
+                    bool explicitVR,
+                    bool bigEndian,
+                    unsigned int depth) const
+    {
+      for (;;)
+      {
+        Element element;
+        Status status = ReadElementHeader(element, offset, explicitVR, bigEndian);
+        if (status != Status_Success)
+        {
+          return status;
+        }
+
+        if (element.tag_ == TAG_ITEM_DELIMITATION)
+        {
+          return Status_Success;
+        }
+
+        status = SkipElementValue(offset, element, explicitVR, bigEndian, depth + 1);
+        if (status != Status_Success)
+        {
+          return status;
+        }
+      }
+    }
+
+    Status SkipElementValue(size_t& offset,
+                            const Element& element,
+                            bool explicitVR,
+                            bool bigEndian,
+                            unsigned int depth) const
+    {
+      if (element.length_ != UNDEFINED_LENGTH)
+      {
+        return SkipValue(offset, element.length_);
+      }
+      else if (explicitVR &&
+               element.vr_[0] == 'U' &&
+               element.vr_[1] == 'N')
+      {
+        // PS3.5 Section 6.2.2: An UN value of undefined length is a
+        // sequence encoded using the implicit VR little endian syntax
+        return SkipUndefinedLength(offset, false, false, depth);
+      }
+      else
+      {
+        return SkipUndefinedLength(offset, explicitVR, bigEndian, depth);
+      }
+    }
+
+    std::string ReadString(size_t offset,
+                           uint32_t length) const
+    {
+      assert(offset + length <= size_);
+
+      // Remove the padding
+      while (length > 0 &&
+             (buffer_[offset + length - 1] == ' ' ||
+              buffer_[offset + length - 1] == '\0'))
+      {
+        length--;
+      }
+
+      return std::string(reinterpret_cast<const char*>(buffer_) + offset, length);
+    }
+  };
+}
+
+
+static bool IsPlainAscii(const std::string& value)
+{
+  // Values that would be converted by the Orthanc core according to
+  // "Specific Character Set", or that are multi-valued, are left to
+  // the Orthanc core
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    if (value[i] < 32 ||
+        value[i] > 126 ||
+        value[i] == '\\')
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+// Skips the meta-header, and gives the encoding of the dataset that follows
+static DicomHeader::ParseStatus ReadMetaHeader(size_t& offset,
+                                               bool& explicitVR,
+                                               bool& bigEndian,
+                                               const void* dicom,
+                                               size_t size)
+{
+  const char* bytes = reinterpret_cast<const char*>(dicom);
+
+  if (size < 132)
+  {
+    return DicomHeader::ParseStatus_Incomplete;
+  }
+  else if (bytes[128] != 'D' ||
+           bytes[129] != 'I' ||
+           bytes[130] != 'C' ||
+           bytes[131] != 'M')
+  {
+    return DicomHeader::ParseStatus_NotDicom;
+  }
+
+  DatasetReader reader(dicom, size);
+
+  // The meta-header is always encoded using explicit VR little endian
+  std::string transferSyntax;
+  offset = 132;
+
+  for (;;)
+  {
+    uint16_t group;
+    if (!reader.PeekGroup(group, offset, false))
+    {
+      return DicomHeader::ParseStatus_Incomplete;
+    }
+    else if (group != 0x0002)
+    {
+      break;
+    }
+
+    Element element;
+    Status status = reader.ReadElementHeader(element, offset, true, false);
+    if (status == Status_Incomplete)
+    {
+      return DicomHeader::ParseStatus_Incomplete;
+    }
+    else if (status != Status_Success ||
+             element.length_ == UNDEFINED_LENGTH)
+    {
+      return DicomHeader::ParseStatus_Unsupported;
+    }
+    else if (offset + element.length_ > size)
+    {
+      return DicomHeader::ParseStatus_Incomplete;
+    }
+
+    if (element.tag_ == TAG_TRANSFER_SYNTAX_UID)
+    {
+      transferSyntax = reader.ReadString(offset, element.length_);
+    }
+
+    offset += element.length_;
+  }
+
+  if (transferSyntax == "1.2.840.10008.1.2")
+  {
+    explicitVR = false;
+    bigEndian = false;
+  }
+  else if (transferSyntax == "1.2.840.10008.1.2.2")
+  {
+    explicitVR = true;
+    bigEndian = true;
+  }
+  else if (transferSyntax.empty() ||
+           transferSyntax == "1.2.840.10008.1.2.1.99")  // Deflated explicit VR little endian
+  {
+    return DicomHeader::ParseStatus_Unsupported;
+  }
+  else
+  {
+    // Explicit VR little endian, which is also used by all the
+    // transfer syntaxes with encapsulated pixel data
+    explicitVR = true;
+    bigEndian = false;
+  }
+
+  return DicomHeader::ParseStatus_Success;
+}
+
+
+DicomHeader::ParseStatus DicomHeader::ParseHeader(const void* dicom,
+                                                  size_t size)
+{
+  patientId_.clear();
+  studyInstanceUid_.clear();
+  seriesInstanceUid_.clear();
+  sopInstanceUid_.clear();
+  headerSize_ = 0;
+
+  size_t offset;
+  bool explicitVR, bigEndian;
+
+  ParseStatus meta = ReadMetaHeader(offset, explicitVR, bigEndian, dicom, size);
+  if (meta != ParseStatus_Success)
+  {
+    return meta;
+  }
+
+  DatasetReader reader(dicom, size);
+
+  // Walk the top-level elements of the dataset, which are sorted by
+  // increasing tag, until the Series Instance UID has been passed
+  for (;;)
+  {
+    Element element;
+    size_t next = offset;
+    Status status = reader.ReadElementHeader(element, next, explicitVR, bigEndian);
+
+    if (status == Status_Incomplete)
+    {
+      return ParseStatus_Incomplete;
+    }
+    else if (status != Status_Success)
+    {
+      return ParseStatus_Unsupported;
+    }
+    else if (element.tag_ > TAG_SERIES_INSTANCE_UID)
+    {
+      break;
+    }
+
+    if (element.tag_ == TAG_SOP_INSTANCE_UID ||
+        element.tag_ == TAG_PATIENT_ID ||
+        element.tag_ == TAG_STUDY_INSTANCE_UID ||
+        element.tag_ == TAG_SERIES_INSTANCE_UID)
+    {
+      if (element.length_ == UNDEFINED_LENGTH ||
+          element.length_ > MAX_STRING_LENGTH)
+      {
+        return ParseStatus_Unsupported;
+      }
+      else if (next + element.length_ > size)
+      {
+        return ParseStatus_Incomplete;
+      }
+
+      const std::string value = reader.ReadString(next, element.length_);
+      if (!IsPlainAscii(value))
+      {
+        return ParseStatus_Unsupported;
+      }
+
+      switch (element.tag_)
+      {
+        case TAG_SOP_INSTANCE_UID:
+          sopInstanceUid_ = value;
+          break;
+
+        case TAG_PATIENT_ID:
+          patientId_ = value;
+          break;
+
+        case TAG_STUDY_INSTANCE_UID:
+          studyInstanceUid_ = value;
+          break;
+
+        default:
+          seriesInstanceUid_ = value;
+          break;
+      }
+
+      offset = next + element.length_;
+
+      if (element.tag_ == TAG_SERIES_INSTANCE_UID)
+      {
+        break;
+      }
+    }
+    else
+    {
+      status = reader.SkipElementValue(next, element, explicitVR, bigEndian, 0);
+      if (status == Status_Incomplete)
+      {
+        return ParseStatus_Incomplete;
+      }
+      else if (status != Status_Success)
+      {
+        return ParseStatus_Unsupported;
+      }
+
+      offset = next;
+    }
+  }
+
+  if (studyInstanceUid_.empty() ||
+      seriesInstanceUid_.empty() ||
+      sopInstanceUid_.empty())
+  {
+    // Let the Orthanc core deal with malformed files
+    return ParseStatus_Unsupported;
+  }
+  else
+  {
+    headerSize_ = offset;
+    return ParseStatus_Success;
+  }
+}
+
+
+DicomHeader::ParseStatus DicomHeader::LocatePixelData(size_t& offset,
+                                                      const void* dicom,
+                                                      size_t size)
+{
+  bool explicitVR, bigEndian;
+
+  ParseStatus meta = ReadMetaHeader(offset, explicitVR, bigEndian, dicom, size);
+  if (meta != ParseStatus_Success)
+  {
+    return meta;
+  }
+
+  DatasetReader reader(dicom, size);
+
+  for (;;)
+  {
+    uint16_t group;
+    if (!reader.PeekGroup(group, offset, bigEndian))
+    {
+      return ParseStatus_Incomplete;
+    }
+    else if (group >= GROUP_PIXEL_DATA)
+    {
+      return ParseStatus_Success;
+    }
+
+    Element element;
+    size_t next = offset;
+    Status status = reader.ReadElementHeader(element, next, explicitVR, bigEndian);
+
+    if (status == Status_Success)
+    {
+      status = reader.SkipElementValue(next, element, explicitVR, bigEndian, 0);
+    }
+
+    if (status == Status_Incomplete)
+    {
+      return ParseStatus_Incomplete;
+    }
+    else if (status != Status_Success)
+    {
+      return ParseStatus_Unsupported;
+    }
+
+    offset = next;
+  }
+}
+
+
+bool DicomHeader::ParseUsingOrthanc(const void* dicom,
+                                    size_t size)
+{
+  patientId_.clear();
+  studyInstanceUid_.clear();
+  seriesInstanceUid_.clear();
+  sopInstanceUid_.clear();
+  headerSize_ = 0;
+
+  if (size > 0 &&
+      Orthanc::DicomMap::IsDicomFile(dicom, size))
+  {
+    try
+    {
+      OrthancPlugins::OrthancString s;
+      s.Assign(OrthancPluginDicomBufferToJson(OrthancPlugins::GetGlobalContext(), dicom, size,
+                                              OrthancPluginDicomToJsonFormat_Short,
+                                              OrthancPluginDicomToJsonFlags_None, MAX_STRING_LENGTH));
+
+      Json::Value json;
+      s.ToJson(json);
+
+      static const char* const PATIENT_ID = "0010,0020";
+      static const char* const STUDY_INSTANCE_UID = "0020,000d";
+      static const char* const SERIES_INSTANCE_UID = "0020,000e";
+      static const char* const SOP_INSTANCE_UID = "0008,0018";
+
+      if (json.isMember(PATIENT_ID))
+      {
+        patientId_ = Orthanc::SerializationToolbox::ReadString(json, PATIENT_ID);
+      }
+
+      studyInstanceUid_ = Orthanc::SerializationToolbox::ReadString(json, STUDY_INSTANCE_UID);
+      seriesInstanceUid_ = Orthanc::SerializationToolbox::ReadString(json, SERIES_INSTANCE_UID);
+      sopInstanceUid_ = Orthanc::SerializationToolbox::ReadString(json, SOP_INSTANCE_UID);
+      return true;
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return false;
+    }
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+bool DicomHeader::Parse(const void* dicom,
+                        size_t size)
+{
+  switch (ParseHeader(dicom, size))
+  {
+    case ParseStatus_Success:
+      return true;
+
+    case ParseStatus_NotDicom:
+      return false;
+
+    default:
+      return ParseUsingOrthanc(dicom, size);
+  }
+}
+
+
+bool DicomHeader::ParseFile(const std::string& path,
+                            uintmax_t fileSize)
+{
+  if (fileSize == 0)
+  {
+    return false;
+  }
+
+  for (uintmax_t prefix = INITIAL_PREFIX_SIZE; ; prefix *= 4)
+  {
+    const uintmax_t length = std::min(prefix, fileSize);
+
+    FileMemoryMap reader(path, 0, length);
+
+    switch (ParseHeader(reader.data(), reader.length()))
+    {
+      case ParseStatus_Success:
+        return true;
+
+      case ParseStatus_NotDicom:
+        return false;
+
+      case ParseStatus_Incomplete:
+        if (reader.length() < fileSize &&
+            prefix < MAX_PREFIX_SIZE)
+        {
+          continue;  // Read a larger prefix
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    break;
+  }
+
+  FileMemoryMap reader(path);
+  return (reader.length() != 0 &&
+          ParseUsingOrthanc(reader.data(), reader.length()));
+}
+
+
+std::string DicomHeader::HashInstance() const
+{
+  Orthanc::DicomInstanceHasher hasher(patientId_, studyInstanceUid_, seriesInstanceUid_, sopInstanceUid_);
+  return hasher.HashInstance();
+}
@@ -0,0 +1,116 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * The four DICOM tags that identify an instance in Orthanc (Patient
+ * ID, Study/Series/SOP Instance UIDs). They are read by a streaming
+ * parser that stops as soon as they have been seen, and that only
+ * falls back to the Orthanc core for unusual encodings.
+ **/
+class DicomHeader
+{
+public:
+  enum ParseStatus
+  {
+    ParseStatus_Success,
+    ParseStatus_Incomplete,    // More bytes are needed to reach the identifiers
+    ParseStatus_Unsupported,   // Encoding not handled by the streaming parser
+    ParseStatus_NotDicom
+  };
+
+private:
+  std::string  patientId_;
+  std::string  studyInstanceUid_;
+  std::string  seriesInstanceUid_;
+  std::string  sopInstanceUid_;
+  size_t       headerSize_;
+
+public:
+  DicomHeader() :
+    headerSize_(0)
+  {
+  }
+
+  // Streaming parser for the explicit/implicit little endian and
+  // explicit big endian transfer syntaxes. The buffer can be a
+  // prefix of the DICOM file.
+  ParseStatus ParseHeader(const void* dicom,
+                          size_t size);
+
+  // Walks the top-level elements of a DICOM file until its pixel
+  // data, whose offset is the size of the prefix of the file that
+  // contains all the other attributes. Returns "Incomplete" if the
+  // buffer ends before the pixel data.
+  static ParseStatus LocatePixelData(size_t& offset,
+                                     const void* dicom,
+                                     size_t size);
+
+  // Slow path, through the DICOM-to-JSON conversion of the Orthanc
+  // core. The buffer must contain the whole DICOM file.
+  bool ParseUsingOrthanc(const void* dicom,
+                         size_t size);
+
+  // Uses the streaming parser, and falls back to the Orthanc core if
+  // needed. Returns "false" iff. this is not a DICOM file.
+  bool Parse(const void* dicom,
+             size_t size);
+
+  // Same as "Parse()", but only reads the beginning of the file,
+  // growing the prefix until the identifiers have been seen. The
+  // whole file is only read if falling back to the Orthanc core.
+  bool ParseFile(const std::string& path,
+                 uintmax_t fileSize);
+
+  const std::string& GetPatientId() const
+  {
+    return patientId_;
+  }
+
+  const std::string& GetStudyInstanceUid() const
+  {
+    return studyInstanceUid_;
+  }
+
+  const std::string& GetSeriesInstanceUid() const
+  {
+    return seriesInstanceUid_;
+  }
+
+  const std::string& GetSopInstanceUid() const
+  {
+    return sopInstanceUid_;
+  }
+
+  // Number of bytes read by the streaming parser to find the
+  // identifiers (0 if they were obtained from the Orthanc core)
+  size_t GetHeaderSize() const
+  {
+    return headerSize_;
+  }
+
+  // Orthanc identifier of the instance
+  std::string HashInstance() const;
+};
@@ -0,0 +1,89 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DicomHeaderCache.h"
+
+#include <OrthancException.h>
+
+#include <string.h>
+
+
+DicomHeaderCache::DicomHeaderCache(size_t maxEntries,
+                                   size_t maxPrefixSize) :
+  maxEntries_(maxEntries),
+  maxPrefixSize_(maxPrefixSize)
+{
+  if (maxEntries == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+void DicomHeaderCache::Store(const DicomHeader& header,
+                             const std::string& instanceId,
+                             const void* dicom,
+                             uintmax_t size)
+{
+  const size_t prefixSize = header.GetHeaderSize();
+
+  if (prefixSize == 0 ||              // Parsed by the Orthanc core, the key would be the whole file
+      prefixSize > maxPrefixSize_ ||
+      prefixSize > size)
+  {
+    return;
+  }
+
+  Entry entry;
+  entry.size_ = size;
+  entry.prefix_.assign(reinterpret_cast<const char*>(dicom), prefixSize);
+  entry.header_ = header;
+  entry.instanceId_ = instanceId;
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  entries_.push_front(entry);
+
+  while (entries_.size() > maxEntries_)
+  {
+    entries_.pop_back();
+  }
+}
+
+
+bool DicomHeaderCache::Lookup(DicomHeader& header,
+                              std::string& instanceId,
+                              const void* dicom,
+                              uintmax_t size)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (std::list<Entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+  {
+    if (it->size_ == size &&
+        memcmp(it->prefix_.c_str(), dicom, it->prefix_.size()) == 0)
+    {
+      header = it->header_;
+      instanceId = it->instanceId_;
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,69 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "DicomHeader.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+
+
+/**
+ * Short-lived cache of the parsed DICOM headers, so that a file that
+ * is uploaded by the scanner is not parsed again when Orthanc hands
+ * it back to "StorageCreate()". The key is the size of the buffer,
+ * together with the exact bytes that were read by the streaming
+ * parser: As the identifiers only depend on those bytes, a hit can
+ * never give back the identifiers of another instance.
+ **/
+class DicomHeaderCache : public boost::noncopyable
+{
+private:
+  struct Entry
+  {
+    uintmax_t    size_;
+    std::string  prefix_;
+    DicomHeader  header_;
+    std::string  instanceId_;
+  };
+
+  boost::mutex       mutex_;
+  size_t             maxEntries_;
+  size_t             maxPrefixSize_;
+  std::list<Entry>   entries_;   // Most recent first
+
+public:
+  DicomHeaderCache(size_t maxEntries,
+                   size_t maxPrefixSize);
+
+  // "dicom" must point to (at least) the first "header.GetHeaderSize()"
+  // bytes of a DICOM file of "size" bytes
+  void Store(const DicomHeader& header,
+             const std::string& instanceId,
+             const void* dicom,
+             uintmax_t size);
+
+  bool Lookup(DicomHeader& header,
+              std::string& instanceId,
+              const void* dicom,
+              uintmax_t size);
+};
@@ -0,0 +1,285 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DirectoryCrawler.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/thread.hpp>
+
+
+void DirectoryCrawler::Push(size_t worker,
+                            const boost::filesystem::path& directory)
+{
+  {
+    boost::mutex::scoped_lock lock(idleMutex_);
+    pending_++;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(queues_[worker]->mutex_);
+    queues_[worker]->directories_.push_back(directory);
+  }
+
+  idleCondition_.notify_one();
+}
+
+
+bool DirectoryCrawler::Pop(boost::filesystem::path& directory,
+                           size_t worker)
+{
+  WorkQueue& queue = *queues_[worker];
+
+  boost::mutex::scoped_lock lock(queue.mutex_);
+  if (queue.directories_.empty())
+  {
+    return false;
+  }
+  else
+  {
+    directory = queue.directories_.back();
+    queue.directories_.pop_back();
+    return true;
+  }
+}
+
+
+bool DirectoryCrawler::Steal(boost::filesystem::path& directory,
+                             size_t thief)
+{
+  for (size_t i = 1; i < queues_.size(); i++)
+  {
+    WorkQueue& victim = *queues_[(thief + i) % queues_.size()];
+
+    boost::mutex::scoped_lock lock(victim.mutex_);
+    if (!victim.directories_.empty())
+    {
+      // Steal the oldest directory, which is the closest to the root
+      // and is thus likely to contain the largest subtree
+      directory = victim.directories_.front();
+      victim.directories_.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void DirectoryCrawler::ListDirectory(size_t worker,
+                                     DirectoryReader& reader,
+                                     const boost::filesystem::path& directory)
+{
+  // The clock is read before the modification time, so that any
+  // change after the listing gets a more recent modification time
+  const std::time_t now = std::time(NULL);
+
+  std::time_t time;
+  std::vector<DirectoryReader::Entry> entries;
+  DirectoryReader::Status status = reader.ReadModificationTime(time, directory.string());
+
+  if (status == DirectoryReader::Status_Success)
+  {
+    std::list<std::string> subdirectories;
+    if (visitor_.LookupDirectory(subdirectories, directory.string(), time))
+    {
+      for (std::list<std::string>::const_iterator it = subdirectories.begin();
+           it != subdirectories.end(); ++it)
+      {
+        Push(worker, *it);
+      }
+
+      return;
+    }
+
+    status = reader.List(entries, directory.string());
+  }
+
+  if (status != DirectoryReader::Status_Success)
+  {
+    if (status == DirectoryReader::Status_Failure)
+    {
+      LOG(WARNING) << "Indexer plugin cannot read directory: " << directory.string();
+      visitor_.VisitFailure(directory.string());
+    }
+
+    return;
+  }
+
+  // With a granularity of one second, an entry could be added after
+  // the listing without changing the modification time of the
+  // directory. The same holds if the clock of the server of a remote
+  // filesystem lags behind the local clock, up to "clockSkew_".
+  bool isStable = (time < now - 1 - static_cast<std::time_t>(clockSkew_));
+
+  std::list<std::string> subdirectories;
+
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const DirectoryReader::Entry& entry = entries[i];
+
+    if (entry.status_ != DirectoryReader::Status_Success)
+    {
+      visitor_.VisitFailure(entry.path_);
+      isStable = false;
+    }
+    else if (entry.type_ == DirectoryReader::Type_File)
+    {
+      visitor_.VisitFile(entry.path_, entry.metadata_);
+    }
+    else if (entry.type_ == DirectoryReader::Type_Directory)
+    {
+      Push(worker, entry.path_);
+      subdirectories.push_back(entry.path_);
+    }
+  }
+
+  visitor_.VisitDirectory(directory.string(), time, isStable, subdirectories);
+}
+
+
+void DirectoryCrawler::Worker(size_t worker)
+{
+  DirectoryReader reader(engine_);
+
+  for (;;)
+  {
+    if (stop_)
+    {
+      break;
+    }
+
+    boost::filesystem::path directory;
+
+    if (Pop(directory, worker) ||
+        Steal(directory, worker))
+    {
+      try
+      {
+        ListDirectory(worker, reader, directory);
+      }
+      catch (...)
+      {
+        LOG(ERROR) << "Native exception while crawling directory: " << directory.string();
+        visitor_.VisitFailure(directory.string());
+      }
+
+      boost::mutex::scoped_lock lock(idleMutex_);
+      assert(pending_ > 0);
+      pending_--;
+
+      if (pending_ == 0)
+      {
+        idleCondition_.notify_all();
+      }
+    }
+    else
+    {
+      boost::mutex::scoped_lock lock(idleMutex_);
+
+      if (pending_ == 0)
+      {
+        break;  // The whole tree has been visited
+      }
+      else
+      {
+        // Some directory is still being listed by another thread,
+        // and may produce new subdirectories to be stolen
+        idleCondition_.timed_wait(lock, boost::posix_time::milliseconds(10));
+      }
+    }
+  }
+
+  boost::mutex::scoped_lock lock(idleMutex_);
+  systemCalls_ += reader.GetSystemCallsCount();
+}
+
+
+DirectoryCrawler::DirectoryCrawler(IVisitor& visitor,
+                                   const bool& stop,
+                                   unsigned int threadsCount,
+                                   DirectoryReader::Engine engine) :
+  visitor_(visitor),
+  stop_(stop),
+  engine_(engine),
+  pending_(0),
+  systemCalls_(0),
+  clockSkew_(0)
+{
+  if (threadsCount == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  queues_.resize(threadsCount);
+  for (size_t i = 0; i < queues_.size(); i++)
+  {
+    queues_[i] = new WorkQueue;
+  }
+}
+
+
+DirectoryCrawler::~DirectoryCrawler()
+{
+  for (size_t i = 0; i < queues_.size(); i++)
+  {
+    delete queues_[i];
+  }
+}
+
+
+bool DirectoryCrawler::Run(const std::list<std::string>& folders)
+{
+  // The folders are pushed in the same order as the original stack
+  // walk, so that a single thread visits them in the same order
+  for (std::list<std::string>::const_iterator it = folders.begin();
+       it != folders.end(); ++it)
+  {
+    Push(0, *it);
+  }
+
+  boost::thread_group threads;
+  for (size_t i = 1; i < queues_.size(); i++)
+  {
+    threads.create_thread(boost::bind(&DirectoryCrawler::Worker, this, i));
+  }
+
+  Worker(0);
+  threads.join_all();
+
+  for (size_t i = 0; i < queues_.size(); i++)
+  {
+    queues_[i]->directories_.clear();  // In the case of a stop
+  }
+
+  {
+    boost::mutex::scoped_lock lock(idleMutex_);
+    pending_ = 0;
+  }
+
+  return !stop_;
+}
+
+
+uint64_t DirectoryCrawler::GetSystemCallsCount()
+{
+  boost::mutex::scoped_lock lock(idleMutex_);
+  return systemCalls_;
+}
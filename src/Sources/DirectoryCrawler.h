@@ -0,0 +1,136 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "DirectoryReader.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <ctime>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+
+/**
+ * Recursive walk over a set of folders. Each crawler thread owns a
+ * deque of directories still to be listed: it pops from the back of
+ * its own deque (depth-first, as the original single-threaded walk),
+ * and steals from the front of the deque of the other threads once
+ * it runs out of work. With one thread, the walk is done in the
+ * calling thread. Each thread lists its directories with its own
+ * DirectoryReader.
+ **/
+class DirectoryCrawler : public boost::noncopyable
+{
+public:
+  class IVisitor : public boost::noncopyable
+  {
+  public:
+    virtual ~IVisitor()
+    {
+    }
+
+    // Can be invoked concurrently from several crawler threads
+    virtual void VisitFile(const std::string& path,
+                           const FileMetadata& metadata) = 0;
+
+    // A directory could not be listed, or a file could not be
+    // accessed: Its content is unknown for this walk. Paths that
+    // vanished during the walk are not reported.
+    virtual void VisitFailure(const std::string& path) = 0;
+
+    // Invoked before listing a directory, with its modification
+    // time. Returning "true" means that its entries have not changed
+    // since a previous walk: The directory is not listed, and only the
+    // given subdirectories are walked.
+    virtual bool LookupDirectory(std::list<std::string>& subdirectories,
+                                 const std::string& path,
+                                 const std::time_t time) = 0;
+
+    // Invoked once a directory has been listed, after all its files
+    // have been visited. "isStable" is "false" if its modification
+    // time cannot be trusted to detect the changes that happened
+    // after the listing, or if some entry could not be accessed.
+    virtual void VisitDirectory(const std::string& path,
+                                const std::time_t time,
+                                bool isStable,
+                                const std::list<std::string>& subdirectories) = 0;
+  };
+
+private:
+  struct WorkQueue
+  {
+    boost::mutex                          mutex_;
+    std::deque<boost::filesystem::path>  directories_;
+  };
+
+  IVisitor&                 visitor_;
+  const bool&               stop_;
+  DirectoryReader::Engine   engine_;
+  std::vector<WorkQueue*>   queues_;
+  boost::mutex              idleMutex_;
+  boost::condition_variable idleCondition_;
+  size_t                    pending_;  // Directories pushed, but not fully listed yet
+  uint64_t                  systemCalls_;
+  unsigned int              clockSkew_;
+
+  void Push(size_t worker,
+            const boost::filesystem::path& directory);
+
+  bool Pop(boost::filesystem::path& directory,
+           size_t worker);
+
+  bool Steal(boost::filesystem::path& directory,
+             size_t thief);
+
+  void ListDirectory(size_t worker,
+                     DirectoryReader& reader,
+                     const boost::filesystem::path& directory);
+
+  void Worker(size_t worker);
+
+public:
+  DirectoryCrawler(IVisitor& visitor,
+                   const bool& stop,
+                   unsigned int threadsCount,
+                   DirectoryReader::Engine engine = DirectoryReader::Engine_Auto);
+
+  ~DirectoryCrawler();
+
+  // Maximum lag of the clocks of the servers of the remote
+  // filesystems behind the local clock, in seconds. The directories
+  // that were modified within this margin are not reported as stable.
+  void SetClockSkew(unsigned int seconds)
+  {
+    clockSkew_ = seconds;
+  }
+
+  // Returns "false" iff. the walk was interrupted by the "stop" flag
+  bool Run(const std::list<std::string>& folders);
+
+  // System calls issued by the readers of the threads, since the
+  // construction of the crawler (for the benchmarks)
+  uint64_t GetSystemCallsCount();
+};
@@ -0,0 +1,793 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DirectoryReader.h"
+
+#include <OrthancException.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <string.h>
+
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <sys/statfs.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  if defined(STATX_TYPE) && defined(SYS_getdents64)
+#    define HAS_STATX_ENGINE 1
+#  endif
+#endif
+
+#if HAS_STATX_ENGINE == 1 && HAVE_LINUX_IO_URING_H == 1
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  if defined(IO_URING_OP_SUPPORTED)  // Linux >= 5.6, where io_uring can run statx()
+#    define HAS_IO_URING_ENGINE 1
+#  endif
+#endif
+
+
+// Number of statx() in flight for each crawler thread
+static const unsigned int RING_CAPACITY = 64;
+
+static const size_t GETDENTS_BUFFER_SIZE = 64 * 1024;
+
+
+static bool IsVanished(const boost::filesystem::filesystem_error& e)
+{
+  // The path was removed since it was listed by its parent directory
+  return (e.code() == boost::system::errc::no_such_file_or_directory ||
+          e.code() == boost::system::errc::not_a_directory);
+}
+
+
+static bool IsSkipped(const DirectoryReader::Entry& entry)
+{
+  return (entry.status_ == DirectoryReader::Status_Vanished ||
+          (entry.status_ == DirectoryReader::Status_Success &&
+           entry.type_ == DirectoryReader::Type_Other));
+}
+
+
+#if !defined(_WIN32)
+
+static bool IsVanished(int error)
+{
+  return (error == ENOENT ||
+          error == ENOTDIR);
+}
+
+#endif
+
+
+// Type and metadata of a path, following the symbolic links
+static DirectoryReader::Status ReadStatus(DirectoryReader::Type& type,
+                                          FileMetadata& metadata,
+                                          uint64_t& systemCalls,
+                                          const std::string& path)
+{
+  type = DirectoryReader::Type_Other;
+
+#if defined(_WIN32)
+  try
+  {
+    systemCalls++;
+    const boost::filesystem::file_status status = boost::filesystem::status(path);
+
+    switch (status.type())
+    {
+      case boost::filesystem::regular_file:
+      case boost::filesystem::reparse_file:
+        type = DirectoryReader::Type_File;
+        systemCalls += 2;
+        metadata.time_ = boost::filesystem::last_write_time(path);
+        metadata.size_ = boost::filesystem::file_size(path);
+        break;
+
+      case boost::filesystem::directory_file:
+        type = DirectoryReader::Type_Directory;
+        break;
+
+      case boost::filesystem::file_not_found:
+        return DirectoryReader::Status_Vanished;
+
+      default:
+        break;
+    }
+
+    return DirectoryReader::Status_Success;
+  }
+  catch (boost::filesystem::filesystem_error& e)
+  {
+    return (IsVanished(e) ? DirectoryReader::Status_Vanished : DirectoryReader::Status_Failure);
+  }
+#else
+  struct stat info;
+
+  systemCalls++;
+  if (stat(path.c_str(), &info) != 0)
+  {
+    return (IsVanished(errno) ? DirectoryReader::Status_Vanished : DirectoryReader::Status_Failure);
+  }
+
+  if (S_ISREG(info.st_mode))
+  {
+    type = DirectoryReader::Type_File;
+    metadata.time_ = info.st_mtime;
+#  if defined(__APPLE__)
+    metadata.nanoseconds_ = static_cast<uint32_t>(info.st_mtimespec.tv_nsec);
+#  else
+    metadata.nanoseconds_ = static_cast<uint32_t>(info.st_mtim.tv_nsec);
+#  endif
+    metadata.size_ = static_cast<uintmax_t>(info.st_size);
+    metadata.inode_ = static_cast<uint64_t>(info.st_ino);
+  }
+  else if (S_ISDIR(info.st_mode))
+  {
+    type = DirectoryReader::Type_Directory;
+  }
+
+  return DirectoryReader::Status_Success;
+#endif
+}
+
+
+#if HAS_STATX_ENGINE == 1
+
+static const unsigned int STATX_MASK = STATX_TYPE | STATX_MTIME | STATX_SIZE | STATX_INO;
+
+
+static bool IsNetworkFilesystem(int fd)
+{
+  struct statfs info;
+  if (fstatfs(fd, &info) != 0)
+  {
+    return false;
+  }
+
+  switch (static_cast<uint32_t>(info.f_type))
+  {
+    case 0x6969u:      // NFS
+    case 0x517bu:      // SMB
+    case 0xff534d42u:  // CIFS
+    case 0xfe534d42u:  // SMB2
+    case 0x00c36400u:  // Ceph
+    case 0x47504653u:  // GPFS
+    case 0x0bd00bd0u:  // Lustre
+    case 0x65735546u:  // FUSE (sshfs, s3fs...)
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+
+// Layout of the records returned by getdents64(), which has no
+// wrapper in the older versions of glibc
+struct LinuxDirent64
+{
+  uint64_t        d_ino;
+  int64_t         d_off;
+  unsigned short  d_reclen;
+  unsigned char   d_type;
+  char            d_name[1];
+};
+
+
+class DirectoryDescriptor : public boost::noncopyable
+{
+private:
+  int fd_;
+
+public:
+  explicit DirectoryDescriptor(const std::string& path)
+  {
+    fd_ = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  ~DirectoryDescriptor()
+  {
+    if (fd_ >= 0)
+    {
+      close(fd_);
+    }
+  }
+
+  bool IsValid() const
+  {
+    return fd_ >= 0;
+  }
+
+  int Get() const
+  {
+    return fd_;
+  }
+};
+
+#endif
+
+
+#if HAS_IO_URING_ENGINE == 1
+
+/**
+ * Minimal io_uring, using the raw system calls (no dependency on
+ * liburing). The ring is only used by the thread that owns the
+ * reader, so the only synchronization is the one with the kernel.
+ **/
+class DirectoryReader::IoUring : public boost::noncopyable
+{
+private:
+  int            fd_;
+  unsigned int   capacity_;
+  void*          sqRing_;
+  size_t         sqRingSize_;
+  void*          cqRing_;
+  size_t         cqRingSize_;
+  io_uring_sqe*  sqes_;
+  size_t         sqesSize_;
+  unsigned int*  sqHead_;
+  unsigned int*  sqTail_;
+  unsigned int*  sqMask_;
+  unsigned int*  sqArray_;
+  unsigned int*  cqHead_;
+  unsigned int*  cqTail_;
+  unsigned int*  cqMask_;
+  io_uring_cqe*  cqes_;
+
+  IoUring() :
+    fd_(-1),
+    capacity_(0),
+    sqRing_(NULL),
+    sqRingSize_(0),
+    cqRing_(NULL),
+    cqRingSize_(0),
+    sqes_(NULL),
+    sqesSize_(0)
+  {
+  }
+
+  static void* Map(size_t size,
+                   int fd,
+                   off_t offset)
+  {
+    void* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (ring == MAP_FAILED ? NULL : ring);
+  }
+
+  bool IsStatxSupported()
+  {
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&buffer[0]);
+
+    return (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+            probe->last_op >= IORING_OP_STATX &&
+            (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED));
+  }
+
+public:
+  // Returns NULL if io_uring is not available, which is the case with
+  // the older kernels, or if it is disabled by "kernel.io_uring_disabled"
+  // or by the seccomp profile of a container
+  static IoUring* Create(unsigned int capacity)
+  {
+    std::unique_ptr<IoUring> ring(new IoUring);
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd_ = static_cast<int>(syscall(__NR_io_uring_setup, capacity, &params));
+    if (ring->fd_ < 0)
+    {
+      return NULL;
+    }
+
+    ring->capacity_ = params.sq_entries;
+    ring->sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      // Both rings share a single mapping
+      ring->sqRingSize_ = std::max(ring->sqRingSize_, ring->cqRingSize_);
+      ring->cqRingSize_ = 0;
+    }
+
+    ring->sqRing_ = Map(ring->sqRingSize_, ring->fd_, IORING_OFF_SQ_RING);
+    if (ring->sqRing_ == NULL)
+    {
+      return NULL;
+    }
+
+    if (ring->cqRingSize_ != 0)
+    {
+      ring->cqRing_ = Map(ring->cqRingSize_, ring->fd_, IORING_OFF_CQ_RING);
+      if (ring->cqRing_ == NULL)
+      {
+        return NULL;
+      }
+    }
+
+    ring->sqes_ = reinterpret_cast<io_uring_sqe*>(Map(ring->sqesSize_, ring->fd_, IORING_OFF_SQES));
+    if (ring->sqes_ == NULL ||
+        !ring->IsStatxSupported())
+    {
+      return NULL;
+    }
+
+    uint8_t* sq = reinterpret_cast<uint8_t*>(ring->sqRing_);
+    ring->sqHead_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+    ring->sqTail_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+    ring->sqMask_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+    ring->sqArray_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+
+    uint8_t* cq = reinterpret_cast<uint8_t*>(ring->cqRing_ == NULL ? ring->sqRing_ : ring->cqRing_);
+    ring->cqHead_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+    ring->cqTail_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+    ring->cqMask_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+    ring->cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return ring.release();
+  }
+
+  ~IoUring()
+  {
+    if (sqes_ != NULL)
+    {
+      munmap(sqes_, sqesSize_);
+    }
+
+    if (cqRing_ != NULL)
+    {
+      munmap(cqRing_, cqRingSize_);
+    }
+
+    if (sqRing_ != NULL)
+    {
+      munmap(sqRing_, sqRingSize_);
+    }
+
+    if (fd_ >= 0)
+    {
+      close(fd_);
+    }
+  }
+
+  // Runs one statx() per name, relative to the "directory" descriptor.
+  // "errors" receives 0 or the opposite of the error code. Returns
+  // once all the calls have completed, so that the kernel no longer
+  // writes into "results".
+  void Statx(std::vector<struct statx>& results,
+             std::vector<int>& errors,
+             uint64_t& systemCalls,
+             int directory,
+             int flags,
+             const std::vector<const char*>& names)
+  {
+    results.resize(names.size());
+    errors.resize(names.size());
+
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    while (completed < names.size())
+    {
+      // Fill the free slots of the submission queue. The kernel only
+      // consumes the entries in io_uring_enter(), as there is no
+      // polling thread.
+      unsigned int tail = *sqTail_;
+
+      while (submitted < names.size() &&
+             submitted - completed < capacity_)
+      {
+        const unsigned int index = tail & *sqMask_;
+
+        io_uring_sqe& sqe = sqes_[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_STATX;
+        sqe.fd = directory;
+        sqe.addr = reinterpret_cast<uint64_t>(names[submitted]);
+        sqe.len = STATX_MASK;
+        sqe.off = reinterpret_cast<uint64_t>(&results[submitted]);
+        sqe.statx_flags = flags;
+        sqe.user_data = submitted;
+
+        sqArray_[index] = index;
+        tail++;
+        submitted++;
+      }
+
+      __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+
+      const unsigned int toSubmit = tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+
+      systemCalls++;
+      if (syscall(__NR_io_uring_enter, fd_, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR &&
+          errno != EAGAIN &&
+          errno != EBUSY)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError,
+                                        "Error in io_uring: " + std::string(strerror(errno)));
+      }
+
+      unsigned int head = *cqHead_;
+      const unsigned int available = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+      while (head != available)
+      {
+        const io_uring_cqe& cqe = cqes_[head & *cqMask_];
+        errors[cqe.user_data] = cqe.res;
+        head++;
+        completed++;
+      }
+
+      __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    }
+  }
+};
+
+#else
+
+class DirectoryReader::IoUring : public boost::noncopyable
+{
+};
+
+#endif
+
+
+DirectoryReader::Status DirectoryReader::ListWithBoost(std::vector<Entry>& entries,
+                                                       const std::string& directory)
+{
+  boost::filesystem::directory_iterator current;
+
+  try
+  {
+    current = boost::filesystem::directory_iterator(directory);
+  }
+  catch (boost::filesystem::filesystem_error& e)
+  {
+    return (IsVanished(e) ? Status_Vanished : Status_Failure);
+  }
+
+  const boost::filesystem::directory_iterator end;
+
+  while (current != end)
+  {
+    Entry entry;
+    entry.path_ = current->path().string();
+    entry.status_ = ReadStatus(entry.type_, entry.metadata_, systemCalls_, entry.path_);
+
+    if (!IsSkipped(entry))
+    {
+      entries.push_back(entry);
+    }
+
+    ++current;
+  }
+
+  return Status_Success;
+}
+
+
+DirectoryReader::Status DirectoryReader::ListWithStatx(std::vector<Entry>& entries,
+                                                       const std::string& directory)
+{
+#if HAS_STATX_ENGINE == 1
+  systemCalls_++;
+  DirectoryDescriptor fd(directory);
+  if (!fd.IsValid())
+  {
+    return (IsVanished(errno) ? Status_Vanished : Status_Failure);
+  }
+
+  // Same separator as "boost::filesystem::path::operator/", as the
+  // paths of the files are the keys of the database
+  std::string prefix = directory;
+  if (prefix.empty() ||
+      prefix[prefix.size() - 1] != '/')
+  {
+    prefix += '/';
+  }
+
+  const size_t first = entries.size();
+
+  // Indices of the entries whose type and metadata are read by statx()
+  std::vector<size_t> pending;
+
+  for (;;)
+  {
+    systemCalls_++;
+    const long count = syscall(SYS_getdents64, fd.Get(), &buffer_[0], buffer_.size());
+
+    if (count < 0)
+    {
+      entries.resize(first);
+      return (IsVanished(errno) ? Status_Vanished : Status_Failure);
+    }
+    else if (count == 0)
+    {
+      break;
+    }
+
+    for (long offset = 0; offset < count; )
+    {
+      const LinuxDirent64& record = *reinterpret_cast<const LinuxDirent64*>(&buffer_[offset]);
+      offset += record.d_reclen;
+
+      const char* name = record.d_name;
+      if (strcmp(name, ".") == 0 ||
+          strcmp(name, "..") == 0)
+      {
+        continue;
+      }
+
+      Entry entry;
+      entry.path_ = prefix + name;
+      entry.status_ = Status_Success;
+
+      switch (record.d_type)
+      {
+        case DT_DIR:
+          entry.type_ = Type_Directory;
+          entries.push_back(entry);
+          break;
+
+        case DT_REG:
+        case DT_LNK:      // Followed by statx()
+        case DT_UNKNOWN:  // Filesystems that do not store the type in their directories
+          entry.type_ = Type_Other;
+          pending.push_back(entries.size());
+          entries.push_back(entry);
+          break;
+
+        default:
+          break;
+      }
+    }
+  }
+
+  if (!pending.empty())
+  {
+    systemCalls_++;
+    const bool isNetwork = IsNetworkFilesystem(fd.Get());
+
+    // The walk only looks for changes, so there is no need to
+    // revalidate the attributes cached by the client of a network
+    // filesystem, which would cost one round-trip per file
+    const int flags = (isNetwork ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT);
+
+    std::vector<const char*> names(pending.size());
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+      names[i] = entries[pending[i]].path_.c_str() + prefix.size();
+    }
+
+    std::vector<struct statx> results;
+    std::vector<int> errors;
+
+#if HAS_IO_URING_ENGINE == 1
+    if (ring_.get() != NULL &&
+        (!adaptive_ || isNetwork))
+    {
+      ring_->Statx(results, errors, systemCalls_, fd.Get(), flags, names);
+    }
+    else
+#endif
+    {
+      results.resize(names.size());
+      errors.resize(names.size());
+
+      for (size_t i = 0; i < names.size(); i++)
+      {
+        systemCalls_++;
+        errors[i] = (statx(fd.Get(), names[i], flags, STATX_MASK, &results[i]) == 0 ? 0 : -errno);
+      }
+    }
+
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+      Entry& entry = entries[pending[i]];
+
+      if (errors[i] != 0)
+      {
+        entry.status_ = (IsVanished(-errors[i]) ? Status_Vanished : Status_Failure);
+      }
+      else if (S_ISREG(results[i].stx_mode))
+      {
+        entry.type_ = Type_File;
+        entry.metadata_.time_ = static_cast<std::time_t>(results[i].stx_mtime.tv_sec);
+        entry.metadata_.nanoseconds_ = results[i].stx_mtime.tv_nsec;
+        entry.metadata_.size_ = static_cast<uintmax_t>(results[i].stx_size);
+
+        // The inodes of the network filesystems can change across the
+        // mounts (e.g. CIFS with "noserverino", FUSE without "use_ino")
+        entry.metadata_.inode_ = (isNetwork ? 0 : results[i].stx_ino);
+      }
+      else if (S_ISDIR(results[i].stx_mode))
+      {
+        entry.type_ = Type_Directory;
+      }
+    }
+
+    entries.erase(std::remove_if(entries.begin() + first, entries.end(), IsSkipped), entries.end());
+  }
+
+  return Status_Success;
+#else
+  throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+#endif
+}
+
+
+DirectoryReader::DirectoryReader(Engine engine) :
+  engine_(Engine_Boost),
+  adaptive_(false),
+  systemCalls_(0)
+{
+#if HAS_IO_URING_ENGINE == 1
+  if (engine == Engine_Auto ||
+      engine == Engine_IoUring)
+  {
+    ring_.reset(IoUring::Create(RING_CAPACITY));
+
+    if (ring_.get() != NULL)
+    {
+      engine_ = Engine_IoUring;
+      adaptive_ = (engine == Engine_Auto);
+    }
+  }
+#endif
+
+#if HAS_STATX_ENGINE == 1
+  if (engine != Engine_Boost &&
+      ring_.get() == NULL)
+  {
+    engine_ = Engine_Statx;
+  }
+#endif
+
+  if (engine_ != Engine_Boost)
+  {
+    buffer_.resize(GETDENTS_BUFFER_SIZE);
+  }
+}
+
+
+DirectoryReader::~DirectoryReader()
+{
+}
+
+
+bool DirectoryReader::IsSupported(Engine engine)
+{
+  switch (engine)
+  {
+    case Engine_Auto:
+    case Engine_Boost:
+      return true;
+
+    case Engine_Statx:
+#if HAS_STATX_ENGINE == 1
+      return true;
+#else
+      return false;
+#endif
+
+    case Engine_IoUring:
+    {
+      DirectoryReader reader(Engine_IoUring);
+      return reader.GetEngine() == Engine_IoUring;
+    }
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+const char* DirectoryReader::GetEngineName(Engine engine)
+{
+  switch (engine)
+  {
+    case Engine_Auto:
+      return "auto";
+
+    case Engine_Boost:
+      return "boost";
+
+    case Engine_Statx:
+      return "statx";
+
+    case Engine_IoUring:
+      return "io_uring";
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+DirectoryReader::Status DirectoryReader::ReadModificationTime(std::time_t& time,
+                                                              const std::string& path)
+{
+#if HAS_STATX_ENGINE == 1
+  if (engine_ != Engine_Boost)
+  {
+    struct statx info;
+
+    systemCalls_++;
+    if (statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, STATX_MTIME, &info) == 0)
+    {
+      time = static_cast<std::time_t>(info.stx_mtime.tv_sec);
+      return Status_Success;
+    }
+    else
+    {
+      return (IsVanished(errno) ? Status_Vanished : Status_Failure);
+    }
+  }
+#endif
+
+  try
+  {
+    systemCalls_++;
+    time = boost::filesystem::last_write_time(path);
+    return Status_Success;
+  }
+  catch (boost::filesystem::filesystem_error& e)
+  {
+    return (IsVanished(e) ? Status_Vanished : Status_Failure);
+  }
+}
+
+
+bool DirectoryReader::ReadFileMetadata(FileMetadata& metadata,
+                                       const std::string& path)
+{
+  Type type;
+  uint64_t systemCalls = 0;
+  return (ReadStatus(type, metadata, systemCalls, path) == Status_Success &&
+          type == Type_File);
+}
+
+
+DirectoryReader::Status DirectoryReader::List(std::vector<Entry>& entries,
+                                              const std::string& directory)
+{
+  entries.clear();
+
+  if (engine_ == Engine_Boost)
+  {
+    return ListWithBoost(entries, directory);
+  }
+  else
+  {
+    return ListWithStatx(entries, directory);
+  }
+}
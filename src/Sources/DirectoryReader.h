@@ -0,0 +1,133 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "FileMetadata.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <ctime>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Listing of a directory, together with the metadata of its entries,
+ * for the crawler. Each crawler thread owns its reader.
+ *
+ * The portable engine lists the directory with boost::filesystem, and
+ * reads the type and the metadata of each entry with one "stat()"
+ * (three calls to boost::filesystem on Windows). On Linux, the
+ * directory is listed by "getdents64()" on a single descriptor, whose
+ * entries give the type of the subdirectories for free, and the
+ * metadata of each file is read by one "statx()" relative to this
+ * descriptor. The io_uring engine submits these "statx()" in batches:
+ * Many of them are in flight at once, for one system call per batch,
+ * which hides the latency of the network filesystems. On network
+ * filesystems, the attributes cached by the client are trusted
+ * (AT_STATX_DONT_SYNC), as the walk only looks for changes.
+ **/
+class DirectoryReader : public boost::noncopyable
+{
+public:
+  enum Engine
+  {
+    Engine_Auto,     // Best engine available, io_uring being only used on network filesystems
+    Engine_Boost,    // boost::filesystem
+    Engine_Statx,    // getdents64() and one statx() per file (Linux)
+    Engine_IoUring   // getdents64() and batches of statx() submitted through io_uring (Linux)
+  };
+
+  enum Status
+  {
+    Status_Success,
+    Status_Vanished,  // Removed since it was listed by its parent directory
+    Status_Failure
+  };
+
+  enum Type
+  {
+    Type_File,
+    Type_Directory,
+    Type_Other
+  };
+
+  struct Entry
+  {
+    std::string   path_;
+    Status        status_;
+    Type          type_;      // Symbolic links are followed
+    FileMetadata  metadata_;  // Only for the files
+  };
+
+private:
+  class IoUring;
+
+  Engine                    engine_;
+  bool                      adaptive_;  // Only use io_uring on network filesystems
+  std::unique_ptr<IoUring>  ring_;
+  std::vector<char>         buffer_;
+  uint64_t                  systemCalls_;
+
+  Status ListWithBoost(std::vector<Entry>& entries,
+                       const std::string& directory);
+
+  Status ListWithStatx(std::vector<Entry>& entries,
+                       const std::string& directory);
+
+public:
+  explicit DirectoryReader(Engine engine);
+
+  ~DirectoryReader();
+
+  static bool IsSupported(Engine engine);
+
+  static const char* GetEngineName(Engine engine);
+
+  // The engine that is actually used, once the engines that are not
+  // available on this system have been skipped
+  Engine GetEngine() const
+  {
+    return engine_;
+  }
+
+  Status ReadModificationTime(std::time_t& time,
+                              const std::string& path);
+
+  // Metadata of a single file, with one system call. Returns "false"
+  // if the path is not a regular file, or cannot be accessed.
+  static bool ReadFileMetadata(FileMetadata& metadata,
+                               const std::string& path);
+
+  // Lists the files and the directories, skipping the other types of
+  // entries. The status of each entry tells whether it could be
+  // accessed. The order is the one of the filesystem.
+  Status List(std::vector<Entry>& entries,
+              const std::string& directory);
+
+  // The system calls issued by the reader so far. With the Boost
+  // engine, the ones that list the directory are not counted.
+  uint64_t GetSystemCallsCount() const
+  {
+    return systemCalls_;
+  }
+};
@@ -0,0 +1,262 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DirectoryWatcher.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <stack>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <poll.h>
+#  include <sys/inotify.h>
+#  include <unistd.h>
+#endif
+
+
+#if defined(__linux__)
+static const uint32_t WATCH_MASK = (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+#endif
+
+
+bool DirectoryWatcher::IsSupported()
+{
+#if defined(__linux__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+DirectoryWatcher::DirectoryWatcher(IListener& listener,
+                                   unsigned int settleMilliseconds) :
+  listener_(listener),
+  fd_(-1),
+  settleMilliseconds_(settleMilliseconds)
+{
+#if defined(__linux__)
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError,
+                                    "Cannot initialize inotify, errno " + boost::lexical_cast<std::string>(errno));
+  }
+#else
+  throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented,
+                                  "Watching directories is only available on Linux");
+#endif
+}
+
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+#if defined(__linux__)
+  if (fd_ >= 0)
+  {
+    close(fd_);
+  }
+#endif
+}
+
+
+void DirectoryWatcher::AddWatch(const std::string& directory)
+{
+#if defined(__linux__)
+  int wd = inotify_add_watch(fd_, directory.c_str(), WATCH_MASK);
+  if (wd >= 0)
+  {
+    // If the directory was moved, the kernel gives back the same
+    // watch descriptor, whose path must be updated
+    watches_[wd] = directory;
+  }
+  else if (errno == ENOSPC)
+  {
+    LOG(WARNING) << "Indexer plugin has reached the limit on inotify watches, the changes in "
+                 << directory << " will only be detected by the periodic rescans "
+                 << "(consider increasing \"fs.inotify.max_user_watches\")";
+  }
+  else
+  {
+    LOG(WARNING) << "Indexer plugin cannot watch directory: " << directory;
+  }
+#endif
+}
+
+
+void DirectoryWatcher::AddTree(const std::string& root)
+{
+  std::stack<boost::filesystem::path> s;
+  s.push(root);
+
+  while (!s.empty())
+  {
+    boost::filesystem::path d = s.top();
+    s.pop();
+
+    AddWatch(d.string());
+
+    try
+    {
+      boost::filesystem::directory_iterator current(d);
+      const boost::filesystem::directory_iterator end;
+
+      while (current != end)
+      {
+        try
+        {
+          if (boost::filesystem::is_directory(current->status()))
+          {
+            s.push(current->path());
+          }
+        }
+        catch (boost::filesystem::filesystem_error&)
+        {
+        }
+
+        ++current;
+      }
+    }
+    catch (boost::filesystem::filesystem_error&)
+    {
+      LOG(WARNING) << "Indexer plugin cannot read directory: " << d.string();
+    }
+  }
+}
+
+
+void DirectoryWatcher::ReadEvents()
+{
+#if defined(__linux__)
+  char buffer[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  for (;;)
+  {
+    ssize_t length = read(fd_, buffer, sizeof(buffer));
+    if (length <= 0)
+    {
+      return;  // EAGAIN: No more event for now
+    }
+
+    const boost::posix_time::ptime deadline = (boost::posix_time::microsec_clock::universal_time() +
+                                               boost::posix_time::milliseconds(settleMilliseconds_));
+
+    for (const char* p = buffer; p < buffer + length; )
+    {
+      const struct inotify_event& event = *reinterpret_cast<const struct inotify_event*>(p);
+      p += sizeof(struct inotify_event) + event.len;
+
+      if (event.mask & IN_Q_OVERFLOW)
+      {
+        LOG(WARNING) << "Indexer plugin has lost inotify events, resynchronizing";
+        listener_.OnResynchronize();
+        continue;
+      }
+
+      WatchDescriptors::iterator directory = watches_.find(event.wd);
+      if (directory == watches_.end())
+      {
+        continue;
+      }
+
+      if (event.mask & IN_IGNORED)
+      {
+        watches_.erase(directory);  // The directory was removed or unmounted
+        continue;
+      }
+
+      if (event.len == 0)
+      {
+        continue;
+      }
+
+      const std::string path = (boost::filesystem::path(directory->second) / event.name).string();
+
+      if (event.mask & IN_ISDIR)
+      {
+        if (event.mask & (IN_CREATE | IN_MOVED_TO))
+        {
+          AddTree(path);
+          listener_.OnDirectoryAdded(path);
+        }
+        else if (event.mask & IN_MOVED_FROM)
+        {
+          // The files of the moved subtree are not reported individually
+          listener_.OnResynchronize();
+        }
+      }
+      else if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+      {
+        pending_[path] = deadline;
+      }
+      else if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+      {
+        pending_.erase(path);
+        listener_.OnFileRemoved(path);
+      }
+    }
+  }
+#endif
+}
+
+
+void DirectoryWatcher::FlushPendingFiles()
+{
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  PendingFiles::iterator it = pending_.begin();
+  while (it != pending_.end())
+  {
+    if (it->second <= now)
+    {
+      const std::string path = it->first;
+      pending_.erase(it++);
+      listener_.OnFileWritten(path);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+
+void DirectoryWatcher::ProcessEvents(unsigned int timeoutMilliseconds)
+{
+#if defined(__linux__)
+  struct pollfd fd;
+  fd.fd = fd_;
+  fd.events = POLLIN;
+  fd.revents = 0;
+
+  if (poll(&fd, 1, static_cast<int>(timeoutMilliseconds)) > 0 &&
+      (fd.revents & POLLIN))
+  {
+    ReadEvents();
+  }
+
+  FlushPendingFiles();
+#endif
+}
@@ -0,0 +1,94 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <map>
+#include <string>
+
+
+/**
+ * Change feed over the indexed folders, based upon inotify. Only
+ * available on Linux, check "IsSupported()" before construction.
+ **/
+class DirectoryWatcher : public boost::noncopyable
+{
+public:
+  class IListener : public boost::noncopyable
+  {
+  public:
+    virtual ~IListener()
+    {
+    }
+
+    // A file was closed after writing, or was moved into a watched
+    // directory. This is only reported once the file has not changed
+    // for the settle delay, which avoids parsing partial files.
+    virtual void OnFileWritten(const std::string& path) = 0;
+
+    virtual void OnFileRemoved(const std::string& path) = 0;
+
+    // A whole subtree appeared (new directory, or directory moved in),
+    // and must be crawled as its content was not reported
+    virtual void OnDirectoryAdded(const std::string& path) = 0;
+
+    // A subtree disappeared, or some events were lost by the kernel:
+    // The index must be reconciled with the filesystem
+    virtual void OnResynchronize() = 0;
+  };
+
+private:
+  typedef std::map<int, std::string>                         WatchDescriptors;
+  typedef std::map<std::string, boost::posix_time::ptime>    PendingFiles;
+
+  IListener&        listener_;
+  int               fd_;
+  unsigned int      settleMilliseconds_;
+  WatchDescriptors  watches_;
+  PendingFiles      pending_;
+
+  void AddWatch(const std::string& directory);
+
+  void ReadEvents();
+
+  void FlushPendingFiles();
+
+public:
+  DirectoryWatcher(IListener& listener,
+                   unsigned int settleMilliseconds);
+
+  ~DirectoryWatcher();
+
+  static bool IsSupported();
+
+  // Recursively registers watches on the given directory
+  void AddTree(const std::string& root);
+
+  size_t GetWatchesCount() const
+  {
+    return watches_.size();
+  }
+
+  // Waits for at most "timeoutMilliseconds" for filesystem events,
+  // and invokes the listener for each settled change
+  void ProcessEvents(unsigned int timeoutMilliseconds);
+};
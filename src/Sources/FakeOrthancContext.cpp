@@ -0,0 +1,398 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "FakeOrthancContext.h"
+
+#include "DicomHeader.h"
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Toolbox.h>
+
+#include <boost/thread/mutex.hpp>
+#include <list>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace FakeOrthancContext
+{
+  struct Attachment
+  {
+    std::string  uuid_;
+    uint64_t     size_;
+  };
+
+  static boost::mutex                          mutex_;
+  static OrthancPluginContext                  context_;
+  static bool                                  isContextInitialized_ = false;
+  static std::string                           configuration_ = "{}";
+  static _OrthancPluginRegisterStorageArea2    storageArea_;
+  static bool                                  hasStorageArea_ = false;
+  static std::list<OrthancPluginOnChangeCallback>  changeCallbacks_;
+  static std::map<std::string, Attachment>     instances_;  // Orthanc identifier -> DICOM attachment
+
+
+  static void Free(void* buffer)
+  {
+    free(buffer);
+  }
+
+
+  static char* CopyString(const std::string& source)
+  {
+    char* target = reinterpret_cast<char*>(malloc(source.size() + 1));
+    if (target != NULL)
+    {
+      memcpy(target, source.c_str(), source.size() + 1);
+    }
+
+    return target;
+  }
+
+
+  static OrthancPluginErrorCode AnswerJson(OrthancPluginMemoryBuffer* target,
+                                           const Json::Value& answer)
+  {
+    std::string s;
+    OrthancPlugins::WriteFastJson(s, answer);
+
+    target->data = malloc(s.empty() ? 1 : s.size());
+    if (target->data == NULL)
+    {
+      target->size = 0;
+      return OrthancPluginErrorCode_NotEnoughMemory;
+    }
+    else
+    {
+      memcpy(target->data, s.c_str(), s.size());
+      target->size = static_cast<uint32_t>(s.size());
+      return OrthancPluginErrorCode_Success;
+    }
+  }
+
+
+  static OrthancPluginErrorCode PostInstance(OrthancPluginMemoryBuffer* target,
+                                             const void* dicom,
+                                             uint32_t size)
+  {
+    DicomHeader header;
+    if (!header.Parse(dicom, size))
+    {
+      return OrthancPluginErrorCode_BadFileFormat;
+    }
+
+    const std::string instanceId = header.HashInstance();
+
+    Json::Value answer = Json::objectValue;
+    answer["ID"] = instanceId;
+
+    OrthancPluginStorageCreate create;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (instances_.find(instanceId) != instances_.end())
+      {
+        // Same as the default "OverwriteInstances = false" of Orthanc
+        answer["Status"] = "AlreadyStored";
+        return AnswerJson(target, answer);
+      }
+      else if (!hasStorageArea_)
+      {
+        return OrthancPluginErrorCode_Plugin;
+      }
+
+      create = storageArea_.create;
+    }
+
+    Attachment attachment;
+    attachment.uuid_ = Orthanc::Toolbox::GenerateUuid();
+    attachment.size_ = size;
+
+    OrthancPluginErrorCode code = create(attachment.uuid_.c_str(), dicom, size, OrthancPluginContentType_Dicom);
+    if (code != OrthancPluginErrorCode_Success)
+    {
+      return code;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      instances_[instanceId] = attachment;
+    }
+
+    answer["Status"] = "Success";
+    return AnswerJson(target, answer);
+  }
+
+
+  static OrthancPluginErrorCode DeleteInstance(const std::string& instanceId)
+  {
+    Attachment attachment;
+    OrthancPluginStorageRemove remove;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      std::map<std::string, Attachment>::iterator found = instances_.find(instanceId);
+      if (found == instances_.end())
+      {
+        return OrthancPluginErrorCode_UnknownResource;
+      }
+
+      attachment = found->second;
+      instances_.erase(found);
+
+      if (!hasStorageArea_)
+      {
+        return OrthancPluginErrorCode_Plugin;
+      }
+
+      remove = storageArea_.remove;
+    }
+
+    return remove(attachment.uuid_.c_str(), OrthancPluginContentType_Dicom);
+  }
+
+
+  static OrthancPluginErrorCode DicomBufferToJson(const _OrthancPluginDicomToJson& params)
+  {
+    DicomHeader header;
+    if (params.buffer == NULL ||
+        header.ParseHeader(params.buffer, params.size) != DicomHeader::ParseStatus_Success)
+    {
+      return OrthancPluginErrorCode_BadFileFormat;
+    }
+
+    // "Short" format, which is the one used by this plugin
+    Json::Value json = Json::objectValue;
+    json["0008,0018"] = header.GetSopInstanceUid();
+    json["0020,000d"] = header.GetStudyInstanceUid();
+    json["0020,000e"] = header.GetSeriesInstanceUid();
+
+    if (!header.GetPatientId().empty())
+    {
+      json["0010,0020"] = header.GetPatientId();
+    }
+
+    std::string s;
+    OrthancPlugins::WriteFastJson(s, json);
+
+    *params.result = CopyString(s);
+    return (*params.result == NULL ? OrthancPluginErrorCode_NotEnoughMemory : OrthancPluginErrorCode_Success);
+  }
+
+
+  static OrthancPluginErrorCode InvokeService(OrthancPluginContext* context,
+                                              _OrthancPluginService service,
+                                              const void* params)
+  {
+    switch (service)
+    {
+      case _OrthancPluginService_LogInfo:
+        return OrthancPluginErrorCode_Success;
+
+      case _OrthancPluginService_LogWarning:
+        fprintf(stderr, "W: %s\n", reinterpret_cast<const char*>(params));
+        return OrthancPluginErrorCode_Success;
+
+      case _OrthancPluginService_LogError:
+        fprintf(stderr, "E: %s\n", reinterpret_cast<const char*>(params));
+        return OrthancPluginErrorCode_Success;
+
+      case _OrthancPluginService_SetPluginProperty:
+        return OrthancPluginErrorCode_Success;
+
+      case _OrthancPluginService_CreateMemoryBuffer64:
+      {
+        const _OrthancPluginCreateMemoryBuffer64& p =
+          *reinterpret_cast<const _OrthancPluginCreateMemoryBuffer64*>(params);
+
+        // Same as the Orthanc core, that never gives back a NULL pointer
+        p.target->data = malloc(p.size == 0 ? 1 : p.size);
+        if (p.target->data == NULL)
+        {
+          p.target->size = 0;
+          return OrthancPluginErrorCode_NotEnoughMemory;
+        }
+        else
+        {
+          p.target->size = p.size;
+          return OrthancPluginErrorCode_Success;
+        }
+      }
+
+      case _OrthancPluginService_GetConfiguration:
+      {
+        const _OrthancPluginRetrieveDynamicString& p =
+          *reinterpret_cast<const _OrthancPluginRetrieveDynamicString*>(params);
+
+        boost::mutex::scoped_lock lock(mutex_);
+        *p.result = CopyString(configuration_);
+        return (*p.result == NULL ? OrthancPluginErrorCode_NotEnoughMemory : OrthancPluginErrorCode_Success);
+      }
+
+      case _OrthancPluginService_RegisterStorageArea2:
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        storageArea_ = *reinterpret_cast<const _OrthancPluginRegisterStorageArea2*>(params);
+        hasStorageArea_ = true;
+        return OrthancPluginErrorCode_Success;
+      }
+
+      case _OrthancPluginService_RegisterOnChangeCallback:
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        changeCallbacks_.push_back(reinterpret_cast<const _OrthancPluginOnChangeCallback*>(params)->callback);
+        return OrthancPluginErrorCode_Success;
+      }
+
+      case _OrthancPluginService_RestApiPost:
+      case _OrthancPluginService_RestApiPostAfterPlugins:
+      {
+        const _OrthancPluginRestApiPostPut& p = *reinterpret_cast<const _OrthancPluginRestApiPostPut*>(params);
+
+        if (strcmp(p.uri, "/instances") == 0)
+        {
+          return PostInstance(p.target, p.body, p.bodySize);
+        }
+        else
+        {
+          return OrthancPluginErrorCode_UnknownResource;
+        }
+      }
+
+      case _OrthancPluginService_RestApiDelete:
+      case _OrthancPluginService_RestApiDeleteAfterPlugins:
+      {
+        static const char* const PREFIX = "/instances/";
+
+        const char* uri = reinterpret_cast<const char*>(params);
+
+        if (strncmp(uri, PREFIX, strlen(PREFIX)) == 0)
+        {
+          return DeleteInstance(uri + strlen(PREFIX));
+        }
+        else
+        {
+          return OrthancPluginErrorCode_UnknownResource;
+        }
+      }
+
+      case _OrthancPluginService_DicomBufferToJson:
+        return DicomBufferToJson(*reinterpret_cast<const _OrthancPluginDicomToJson*>(params));
+
+      default:
+        return OrthancPluginErrorCode_NotImplemented;
+    }
+  }
+
+
+  OrthancPluginContext* GetContext()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!isContextInitialized_)
+    {
+      context_.pluginsManager = NULL;
+      context_.orthancVersion = "mainline";
+      context_.Free = Free;
+      context_.InvokeService = InvokeService;
+      isContextInitialized_ = true;
+    }
+
+    return &context_;
+  }
+
+
+  OrthancPluginContext* Install()
+  {
+    OrthancPluginContext* context = GetContext();
+
+    if (!OrthancPlugins::HasGlobalContext())
+    {
+      OrthancPlugins::SetGlobalContext(context);
+    }
+
+    return OrthancPlugins::GetGlobalContext();
+  }
+
+
+  void SetConfiguration(const Json::Value& configuration)
+  {
+    std::string s;
+    OrthancPlugins::WriteFastJson(s, configuration);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    configuration_ = s;
+  }
+
+
+  bool LookupStorageArea(OrthancPluginStorageCreate& create,
+                         OrthancPluginStorageReadWhole& readWhole,
+                         OrthancPluginStorageReadRange& readRange,
+                         OrthancPluginStorageRemove& remove)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (hasStorageArea_)
+    {
+      create = storageArea_.create;
+      readWhole = storageArea_.readWhole;
+      readRange = storageArea_.readRange;
+      remove = storageArea_.remove;
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  void SignalChange(OrthancPluginChangeType changeType)
+  {
+    std::list<OrthancPluginOnChangeCallback> callbacks;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      callbacks = changeCallbacks_;
+    }
+
+    for (std::list<OrthancPluginOnChangeCallback>::const_iterator
+           it = callbacks.begin(); it != callbacks.end(); ++it)
+    {
+      (*it) (changeType, OrthancPluginResourceType_None, NULL);
+    }
+  }
+
+
+  void ListAttachments(std::map<std::string, uint64_t>& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target.clear();
+    for (std::map<std::string, Attachment>::const_iterator
+           it = instances_.begin(); it != instances_.end(); ++it)
+    {
+      target[it->second.uuid_] = it->second.size_;
+    }
+  }
+}
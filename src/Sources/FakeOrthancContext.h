@@ -0,0 +1,70 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <json/value.h>
+
+#include <map>
+#include <string>
+
+
+/**
+ * Plugin context that implements the services of the Orthanc core
+ * that are used by this plugin locally, so that the plugin can run
+ * without Orthanc (unit tests and benchmarks):
+ *
+ *  - Memory buffers, logging, and the configuration file.
+ *  - Registration of the storage area and of the change callbacks,
+ *    that are kept so that they can be driven by the caller.
+ *  - "POST /instances" and "DELETE /instances/{id}", that go through
+ *    the registered storage area as in Orthanc (without indexing).
+ *  - "DicomBufferToJson", restricted to the identifiers of the
+ *    instances that are read by the streaming parser.
+ *
+ * The other services fail with "NotImplemented".
+ **/
+namespace FakeOrthancContext
+{
+  // Gives the context without installing it, to be provided to
+  // "OrthancPluginInitialize()" that installs it itself
+  OrthancPluginContext* GetContext();
+
+  // Installs the fake context as the global context of the C++
+  // wrapper, which can only be done once per process
+  OrthancPluginContext* Install();
+
+  // Content of the configuration file of Orthanc
+  void SetConfiguration(const Json::Value& configuration);
+
+  // The storage area registered by the plugin, if any
+  bool LookupStorageArea(OrthancPluginStorageCreate& create,
+                         OrthancPluginStorageReadWhole& readWhole,
+                         OrthancPluginStorageReadRange& readRange,
+                         OrthancPluginStorageRemove& remove);
+
+  // Invokes the change callbacks registered by the plugin
+  void SignalChange(OrthancPluginChangeType changeType);
+
+  // Instances stored through "POST /instances": Maps the UUID of
+  // their DICOM attachment to the size of this attachment
+  void ListAttachments(std::map<std::string, uint64_t>& target);
+}
@@ -20,13 +20,37 @@
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/exception/diagnostic_information.hpp>
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <string>
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 #include <SystemToolbox.h>
 #include <Logging.h>
 
-int FileMemoryMap::alignment = boost::iostreams::mapped_file::alignment();
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+const uintmax_t FileMemoryMap::MAP_THRESHOLD = 256 * 1024;
+
+static bool IsMapping(FileMemoryMap::Mode mode, uintmax_t length)
+{
+  switch (mode)
+  {
+    case FileMemoryMap::Mode_Auto:
+      return length >= FileMemoryMap::MAP_THRESHOLD;
+
+    case FileMemoryMap::Mode_Read:
+      return false;
+
+    default:
+      return true;
+  }
+}
 
 // Special cases:
 // 1) offset positive, length positive, they overflow (in this case don't throw exception,
@@ -34,10 +58,8 @@ int FileMemoryMap::alignment = boost::iostreams::mapped_file::alignment();
 // that no overflow happened)
 // 2) offset zero or positive, length 0 (deduce length)
 // 3) file not readable at all: throws OrthancException
-FileMemoryMap::FileMemoryMap(const std::string& location, uintmax_t offset, uintmax_t length)
+static void TrimRange(uintmax_t& offset, uintmax_t& length, uintmax_t file_size)
 {
-  uintmax_t file_size = Orthanc::SystemToolbox::GetFileSize(location);
-
   // Handle full and partial overflow cases
   if (offset > file_size) {
     offset = file_size;
@@ -48,61 +70,207 @@ FileMemoryMap::FileMemoryMap(const std::string& location, uintmax_t offset, uint
   {
     length = file_size - offset;
   }
+}
+
+#if defined(_WIN32)
+
+FileMemoryMap::FileMemoryMap(const std::string& location, uintmax_t offset, uintmax_t length, Mode mode) :
+  data_start(NULL),
+  data_length(0),
+  using_mapping(false)
+{
+  TrimRange(offset, length, Orthanc::SystemToolbox::GetFileSize(location));
 
   // Handle the empty file case early
   if (length == 0) {
-    using_mapping = false;
-    data_start = 0;
-    data_length = length;
     return;
   }
 
-  boost::iostreams::mapped_file_params params;
-  params.path = location.c_str();
+  if (IsMapping(mode, length))
+  {
+    boost::iostreams::mapped_file_params params;
+    params.path = location.c_str();
+
+    // offset must be a multiple of alignment, so start from the previous boundary if needed.
+    // reserve_for_padding_offset in range [0, alignment)
+    const uintmax_t alignment = boost::iostreams::mapped_file::alignment();
+    const uintmax_t reserve_for_padding_offset = offset % alignment;
+    params.offset = offset - reserve_for_padding_offset;
+    params.length = length + reserve_for_padding_offset;
+
+    try
+    {
+      mapped_data.open(params);
+
+      // Success: use Boost mapping
+      using_mapping = true;
+      data_start = &mapped_data.data()[reserve_for_padding_offset];
+      data_length = length;
+      return;
+    }
+    catch (const boost::exception &e)
+    {
+      LOG(INFO) << "Failed mapping file, will read conventionally. Exception: " << boost::diagnostic_information(e);
+    }
+  }
+
+  Orthanc::SystemToolbox::ReadFileRange(non_mapped_data, location, offset, offset + length, true);
+  data_start = non_mapped_data.c_str();
+  data_length = length;
+}
+
+FileMemoryMap::~FileMemoryMap()
+{
+  if (using_mapping)
+  {
+    mapped_data.close();
+  }
+}
 
-  // If changing to use mapped_file_source, remove this line:
-  params.flags = boost::iostreams::mapped_file::priv;
+#else
 
-  // offset must be a multiple of alignment, so start from the previous page if needed.
-  // reserve_for_padding_offset in range [0, alignment)
-  int reserve_for_padding_offset = (alignment - (offset % alignment)) % alignment;
-  params.offset = offset - reserve_for_padding_offset;
-  params.length = length + reserve_for_padding_offset;
+class FileDescriptor : public boost::noncopyable
+{
+private:
+  int fd;
 
-  try
+public:
+  explicit FileDescriptor(const std::string& location)
   {
-    mapped_data.open(params);
+    fd = open(location.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot open file: " + location);
+    }
+  }
 
-    // Success: use Boost mapping
-    using_mapping = true;
-    data_start = &mapped_data.data()[reserve_for_padding_offset];
-    data_length = length;
+  ~FileDescriptor()
+  {
+    close(fd);
   }
-  catch (const boost::exception &e)
+
+  int get() const
   {
-    LOG(INFO) << "Failed mapping file, will read conventionally. Exception: " << boost::diagnostic_information(e);
-    using_mapping = false;
-    Orthanc::SystemToolbox::ReadFileRange(non_mapped_data, location, offset, offset + length, true);
-    data_start = const_cast<char *>(&non_mapped_data[0]);
-    data_length = length;
+    return fd;
   }
-}
+};
 
-char *FileMemoryMap::data()
+static void ReadConventionally(char *target, int fd, uintmax_t offset, uintmax_t length)
 {
-  return data_start;
+  while (length > 0)
+  {
+    // Linux transfers at most about 2GB per call
+    const size_t chunk = static_cast<size_t>(std::min<uintmax_t>(length, 1024 * 1024 * 1024));
+    const ssize_t count = pread(fd, target, chunk, offset);
+
+    if (count < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (count <= 0)
+    {
+      // I/O error, or the file was truncated in the meantime
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    target += count;
+    offset += count;
+    length -= count;
+  }
 }
 
-uintmax_t FileMemoryMap::length()
+FileMemoryMap::FileMemoryMap(const std::string& location, uintmax_t offset, uintmax_t length, Mode mode) :
+  data_start(NULL),
+  data_length(0),
+  using_mapping(false),
+  mapping_start(NULL),
+  mapping_length(0)
 {
-  return data_length;
+  FileDescriptor fd(location);
+
+  struct stat info;
+  if (fstat(fd.get(), &info) != 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                    "Cannot read the size of file: " + location);
+  }
+
+  TrimRange(offset, length, static_cast<uintmax_t>(info.st_size));
+
+  // Handle the empty file case early
+  if (length == 0) {
+    return;
+  }
+
+  if (IsMapping(mode, length))
+  {
+    // offset must be a multiple of the page size, so start from the previous page if needed.
+    // reserve_for_padding_offset in range [0, page size)
+    static const uintmax_t alignment = sysconf(_SC_PAGESIZE);
+    const uintmax_t reserve_for_padding_offset = offset % alignment;
+
+    int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+    if (mode != Mode_MapOnDemand)
+    {
+      flags |= MAP_POPULATE;  // Loads all the pages, instead of faulting them one by one
+    }
+#endif
+
+    void *start = mmap(NULL, length + reserve_for_padding_offset, PROT_READ, flags,
+                       fd.get(), offset - reserve_for_padding_offset);
+
+    if (start != MAP_FAILED)
+    {
+      using_mapping = true;
+      mapping_start = start;
+      mapping_length = length + reserve_for_padding_offset;
+      data_start = reinterpret_cast<const char *>(start) + reserve_for_padding_offset;
+      data_length = length;
+
+      // The kernel reads ahead aggressively, and drops the pages once read
+      madvise(mapping_start, mapping_length, MADV_SEQUENTIAL);
+
+#if !defined(MAP_POPULATE)
+      if (mode != Mode_MapOnDemand)
+      {
+        madvise(mapping_start, mapping_length, MADV_WILLNEED);
+      }
+#endif
+      return;
+    }
+
+    LOG(INFO) << "Failed mapping file, will read conventionally: " << location;
+  }
+
+  non_mapped_data.reset(new char[length]);
+  ReadConventionally(non_mapped_data.get(), fd.get(), offset, length);
+  data_start = non_mapped_data.get();
+  data_length = length;
 }
 
 FileMemoryMap::~FileMemoryMap()
 {
   if (using_mapping)
   {
-    mapped_data.close();
+    munmap(mapping_start, mapping_length);
   }
-  // else: non_mapped_data.clear(); for early resource freeing
+}
+
+#endif
+
+const char *FileMemoryMap::data() const
+{
+  return data_start;
+}
+
+uintmax_t FileMemoryMap::length() const
+{
+  return data_length;
+}
+
+bool FileMemoryMap::is_mapped() const
+{
+  return using_mapping;
 }
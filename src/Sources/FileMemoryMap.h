@@ -16,33 +16,58 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  **/
 
+#pragma once
+
 #include <boost/noncopyable.hpp>
 #include <boost/iostreams/device/mapped_file.hpp>
 
-// Uses mapped_file with flags instead of mapped_file_source
-// so that the data array can be modified, and the changes won't be saved to the file.
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+// Read-only view of a range of a file. Small ranges are read into memory,
+// as mapping them costs more than copying them. Larger ranges are mapped
+// read-only and shared with the page cache, so no page is copied.
 class FileMemoryMap : public boost::noncopyable
 {
 public:
+  enum Mode
+  {
+    Mode_Auto,         // Read below MAP_THRESHOLD bytes, mapped above
+    Mode_Read,         // Always read into memory
+    Mode_Map,          // Always mapped, all the pages are loaded upfront
+    Mode_MapOnDemand   // Always mapped, the pages are loaded when accessed
+  };
+
+  // Smallest range that is mapped by Mode_Auto, as measured by the
+  // "FileMemoryMap" benchmarks of IndexerBenchmarks
+  static const uintmax_t MAP_THRESHOLD;
+
   // Throws OrthancException if could not read at all
   // If length = 0, the whole file after offset.
   // On overflow of end-of-file pointer, trims. Please call length() to check for this.
-  FileMemoryMap(const std::string& location, uintmax_t offset = 0, uintmax_t length = 0);
+  // Use Mode_MapOnDemand if only a part of a large range will be accessed.
+  FileMemoryMap(const std::string& location, uintmax_t offset = 0, uintmax_t length = 0, Mode mode = Mode_Auto);
 
-  char *data();
+  const char *data() const;
   // equal to "length" in constructor unless
   // 1) "length" was 0 (constructor deduces length)
   // 2) offset + length is greater than file size
-  uintmax_t length();
+  uintmax_t length() const;
+  bool is_mapped() const;
   ~FileMemoryMap();
 
 private:
-  static int alignment;
-
-  char *data_start;
+  const char *data_start;
   uintmax_t data_length;
 
   bool using_mapping;
-  boost::iostreams::mapped_file mapped_data;
+#if defined(_WIN32)
+  boost::iostreams::mapped_file_source mapped_data;
   std::string non_mapped_data;
+#else
+  void *mapping_start;
+  size_t mapping_length;
+  std::unique_ptr<char[]> non_mapped_data;  // Not zero-filled, unlike std::string
+#endif
 };
@@ -0,0 +1,53 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <ctime>
+#include <stdint.h>
+
+
+/**
+ * Metadata of an indexed file, as read by a single "stat()", that
+ * tells whether the file has changed since the previous scan.
+ **/
+struct FileMetadata
+{
+  std::time_t  time_;         // Modification time, in seconds
+  uint32_t     nanoseconds_;  // Sub-second part of the modification time, 0 if not supported
+  uintmax_t    size_;
+  uint64_t     inode_;        // 0 if unknown, or not stable across the mounts (network filesystems)
+
+  FileMetadata() :
+    time_(0),
+    nanoseconds_(0),
+    size_(0),
+    inode_(0)
+  {
+  }
+
+  FileMetadata(std::time_t time,
+               uintmax_t size) :
+    time_(time),
+    nanoseconds_(0),
+    size_(size),
+    inode_(0)
+  {
+  }
+};
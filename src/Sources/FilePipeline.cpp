@@ -0,0 +1,177 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "FilePipeline.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <memory>
+
+
+// The identification only holds paths, whereas the uploads are kept
+// short so that the memory of the files read by the upload threads is
+// bounded by the number of these threads
+static const size_t FILES_PER_IDENTIFICATION_THREAD = 64;
+static const size_t UPLOADS_PER_UPLOAD_THREAD = 2;
+
+
+void FilePipeline::IdentificationWorker()
+{
+  File file;
+
+  while (files_.Dequeue(file))
+  {
+    if (stop_)
+    {
+      continue;  // Drop the pending files
+    }
+
+    try
+    {
+      std::unique_ptr<IUpload> upload(handler_.Identify(file.path_, file.metadata_));
+
+      if (upload.get() != NULL)
+      {
+        uploads_.Enqueue(upload.release());
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Cannot identify file " << file.path_ << ": " << e.What();
+    }
+    catch (...)
+    {
+      LOG(ERROR) << "Native exception while identifying file: " << file.path_;
+    }
+  }
+}
+
+
+void FilePipeline::UploadWorker()
+{
+  IUpload* item = NULL;
+
+  while (uploads_.Dequeue(item))
+  {
+    std::unique_ptr<IUpload> upload(item);
+
+    if (stop_)
+    {
+      continue;  // Drop the pending uploads
+    }
+
+    try
+    {
+      upload->Upload();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Cannot upload file to Orthanc: " << e.What();
+    }
+    catch (...)
+    {
+      LOG(ERROR) << "Native exception while uploading file to Orthanc";
+    }
+  }
+}
+
+
+FilePipeline::FilePipeline(IHandler& handler,
+                           const bool& stop,
+                           unsigned int identificationThreadsCount,
+                           unsigned int uploadThreadsCount) :
+  handler_(handler),
+  stop_(stop),
+  files_(FILES_PER_IDENTIFICATION_THREAD * identificationThreadsCount),
+  uploads_(UPLOADS_PER_UPLOAD_THREAD * uploadThreadsCount),
+  finished_(false)
+{
+  if (identificationThreadsCount == 0 ||
+      uploadThreadsCount == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  identificationThreads_.resize(identificationThreadsCount);
+  for (size_t i = 0; i < identificationThreads_.size(); i++)
+  {
+    identificationThreads_[i] = new boost::thread(&FilePipeline::IdentificationWorker, this);
+  }
+
+  uploadThreads_.resize(uploadThreadsCount);
+  for (size_t i = 0; i < uploadThreads_.size(); i++)
+  {
+    uploadThreads_[i] = new boost::thread(&FilePipeline::UploadWorker, this);
+  }
+}
+
+
+FilePipeline::~FilePipeline()
+{
+  Finish();
+}
+
+
+void FilePipeline::Push(const std::string& path,
+                        const FileMetadata& metadata)
+{
+  if (finished_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  File file;
+  file.path_ = path;
+  file.metadata_ = metadata;
+  files_.Enqueue(file);
+}
+
+
+void FilePipeline::Finish()
+{
+  if (finished_)
+  {
+    return;
+  }
+
+  finished_ = true;
+
+  // The identification threads must be done before closing the
+  // queue of the uploads, as they might still enqueue some upload
+  files_.Close();
+
+  for (size_t i = 0; i < identificationThreads_.size(); i++)
+  {
+    identificationThreads_[i]->join();
+    delete identificationThreads_[i];
+  }
+
+  identificationThreads_.clear();
+
+  uploads_.Close();
+
+  for (size_t i = 0; i < uploadThreads_.size(); i++)
+  {
+    uploadThreads_[i]->join();
+    delete uploadThreads_[i];
+  }
+
+  uploadThreads_.clear();
+}
@@ -0,0 +1,166 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "FileMetadata.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+
+/**
+ * Staged processing of the files found by the crawler. The files are
+ * first identified by a pool of threads (CPU-bound parsing and
+ * database accesses), then the resulting uploads are done by another
+ * pool of threads (I/O-bound reading of the whole file and REST calls
+ * to Orthanc). Each stage reads from a bounded queue, so that a slow
+ * stage blocks the previous one instead of accumulating work.
+ **/
+class FilePipeline : public boost::noncopyable
+{
+public:
+  class IUpload : public boost::noncopyable
+  {
+  public:
+    virtual ~IUpload()
+    {
+    }
+
+    virtual void Upload() = 0;
+  };
+
+  class IHandler : public boost::noncopyable
+  {
+  public:
+    virtual ~IHandler()
+    {
+    }
+
+    // Invoked concurrently by the identification threads. Returns the
+    // upload to be done by the upload threads, or NULL if none.
+    virtual IUpload* Identify(const std::string& path,
+                              const FileMetadata& metadata) = 0;
+  };
+
+private:
+  struct File
+  {
+    std::string   path_;
+    FileMetadata  metadata_;
+  };
+
+  template <typename T>
+  class BoundedQueue : public boost::noncopyable
+  {
+  private:
+    boost::mutex               mutex_;
+    boost::condition_variable  notEmpty_;
+    boost::condition_variable  notFull_;
+    std::deque<T>              items_;
+    size_t                     maxSize_;
+    bool                       closed_;
+
+  public:
+    explicit BoundedQueue(size_t maxSize) :
+      maxSize_(maxSize),
+      closed_(false)
+    {
+    }
+
+    // Blocks while the queue is full
+    void Enqueue(const T& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (items_.size() >= maxSize_)
+      {
+        notFull_.wait(lock);
+      }
+
+      items_.push_back(item);
+      notEmpty_.notify_one();
+    }
+
+    // Blocks while the queue is empty. Returns "false" once the queue
+    // is closed and empty.
+    bool Dequeue(T& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (items_.empty())
+      {
+        if (closed_)
+        {
+          return false;
+        }
+
+        notEmpty_.wait(lock);
+      }
+
+      item = items_.front();
+      items_.pop_front();
+      notFull_.notify_one();
+      return true;
+    }
+
+    void Close()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      closed_ = true;
+      notEmpty_.notify_all();
+    }
+  };
+
+  IHandler&                    handler_;
+  const bool&                  stop_;
+  BoundedQueue<File>           files_;
+  BoundedQueue<IUpload*>       uploads_;
+  std::vector<boost::thread*>  identificationThreads_;
+  std::vector<boost::thread*>  uploadThreads_;
+  bool                         finished_;
+
+  void IdentificationWorker();
+
+  void UploadWorker();
+
+public:
+  FilePipeline(IHandler& handler,
+               const bool& stop,
+               unsigned int identificationThreadsCount,
+               unsigned int uploadThreadsCount);
+
+  // Waits for the pending files, if "Finish()" was not called
+  ~FilePipeline();
+
+  // Can be invoked concurrently from several crawler threads. Blocks
+  // while too many files are waiting for their identification.
+  void Push(const std::string& path,
+            const FileMetadata& metadata);
+
+  // Waits until all the files are identified and uploaded. If the
+  // "stop" flag is set, the pending files are dropped.
+  void Finish();
+};
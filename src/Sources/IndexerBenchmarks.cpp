@@ -0,0 +1,1060 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DicomHeader.h"
+#include "DicomHeaderCache.h"
+#include "DirectoryCrawler.h"
+#include "FakeOrthancContext.h"
+#include "FileMemoryMap.h"
+#include "IndexerDatabase.h"
+#include "MappedFilesCache.h"
+#include "ReadAheadPrefetcher.h"
+#include "StorageArea.h"
+#include "SyntheticCorpus.h"
+
+#include <DicomFormat/DicomInstanceHasher.h>
+#include <Logging.h>
+#include <OrthancFramework.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if ORTHANC_ENABLE_DCMTK == 1
+#  include <DicomParsing/ParsedDicomFile.h>
+#  include <SerializationToolbox.h>
+#endif
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+
+/**
+ * Minimal harness in the spirit of Google Benchmark. The body of a
+ * benchmark does its setup, then loops "while (state.KeepRunning())".
+ * It is run again with more iterations until the loop lasts for the
+ * minimum time.
+ **/
+class BenchmarkState : public boost::noncopyable
+{
+private:
+  typedef std::chrono::steady_clock  Clock;
+
+  uint64_t           maxIterations_;
+  uint64_t           iterations_;
+  uint64_t           items_;
+  uint64_t           bytes_;
+  std::string        label_;
+  Clock::time_point  start_;
+  Clock::time_point  end_;
+
+public:
+  explicit BenchmarkState(uint64_t maxIterations) :
+    maxIterations_(maxIterations),
+    iterations_(0),
+    items_(0),
+    bytes_(0)
+  {
+  }
+
+  bool KeepRunning()
+  {
+    if (iterations_ == 0)
+    {
+      start_ = Clock::now();
+    }
+
+    if (iterations_ < maxIterations_)
+    {
+      iterations_++;
+      return true;
+    }
+    else
+    {
+      end_ = Clock::now();
+      return false;
+    }
+  }
+
+  // Counters accumulated by the body of the benchmark, reported per second
+  void AddItemsProcessed(uint64_t items)
+  {
+    items_ += items;
+  }
+
+  void AddBytesProcessed(uint64_t bytes)
+  {
+    bytes_ += bytes;
+  }
+
+  // Free text printed after the counters, as in Google Benchmark
+  void SetLabel(const std::string& label)
+  {
+    label_ = label;
+  }
+
+  uint64_t GetIterations() const
+  {
+    return maxIterations_;
+  }
+
+  const std::string& GetLabel() const
+  {
+    return label_;
+  }
+
+  uint64_t GetItemsProcessed() const
+  {
+    return items_;
+  }
+
+  uint64_t GetBytesProcessed() const
+  {
+    return bytes_;
+  }
+
+  double GetSeconds() const
+  {
+    return std::chrono::duration<double>(end_ - start_).count();
+  }
+};
+
+
+typedef boost::function<void (BenchmarkState&)>  BenchmarkFunction;
+
+
+static void RunBenchmark(const std::string& name,
+                         const BenchmarkFunction& function,
+                         double minTime)
+{
+  static const uint64_t MAX_ITERATIONS = 1000000000;
+
+  uint64_t iterations = 1;
+
+  for (;;)
+  {
+    BenchmarkState state(iterations);
+    function(state);
+
+    const double seconds = state.GetSeconds();
+
+    if (seconds >= minTime ||
+        iterations >= MAX_ITERATIONS)
+    {
+      printf("%-44s %10llu %14.0f ns", name.c_str(), static_cast<unsigned long long>(iterations),
+             seconds * 1e9 / static_cast<double>(iterations));
+
+      if (state.GetItemsProcessed() != 0)
+      {
+        printf(" %14.0f items/s", static_cast<double>(state.GetItemsProcessed()) / seconds);
+      }
+
+      if (state.GetBytesProcessed() != 0)
+      {
+        printf(" %10.1f MB/s", static_cast<double>(state.GetBytesProcessed()) / seconds / (1024.0 * 1024.0));
+      }
+
+      if (!state.GetLabel().empty())
+      {
+        printf(" %s", state.GetLabel().c_str());
+      }
+
+      printf("\n");
+      fflush(stdout);
+      return;
+    }
+
+    // Same growth as Google Benchmark, with a margin of 40%
+    double multiplier = (seconds <= minTime / 100.0 ? 100.0 : minTime * 1.4 / seconds);
+    if (multiplier < 2.0)
+    {
+      multiplier = 2.0;
+    }
+
+    iterations = static_cast<uint64_t>(static_cast<double>(iterations) * multiplier);
+    if (iterations > MAX_ITERATIONS)
+    {
+      iterations = MAX_ITERATIONS;
+    }
+  }
+}
+
+
+
+/**
+ * Data shared by the benchmarks, created once before running them
+ **/
+class Fixture : public boost::noncopyable
+{
+private:
+  std::string                       folder_;
+  std::unique_ptr<SyntheticCorpus>  corpus_;
+  std::vector<uintmax_t>            sizes_;
+  std::string                       largeFile_;
+  IndexerDatabase                   database_;
+  bool                              isCacheEnabled_;
+  std::vector<std::string>          paths_;
+  std::vector<std::string>          uuids_;
+  IndexerDatabase                   insertions_;
+  uint64_t                          countInsertions_;
+
+public:
+  static const uintmax_t LARGE_FILE_SIZE = 64 * 1024 * 1024;
+
+  Fixture(const std::string& parent,
+          const SyntheticCorpus::Parameters& parameters,
+          unsigned int rows) :
+    isCacheEnabled_(false),
+    countInsertions_(0)
+  {
+    folder_ = (boost::filesystem::path(parent) /
+               boost::filesystem::unique_path("indexer-benchmarks-%%%%-%%%%-%%%%")).string();
+    boost::filesystem::create_directories(folder_);
+
+    printf("Generating the synthetic corpus in: %s\n", folder_.c_str());
+    corpus_.reset(new SyntheticCorpus(folder_ + "/corpus", parameters));
+
+    for (size_t i = 0; i < corpus_->GetDicomFiles().size(); i++)
+    {
+      sizes_.push_back(boost::filesystem::file_size(corpus_->GetDicomFiles() [i]));
+    }
+
+    printf("  %u DICOM files, %u other files, %u directories, %.1f MB\n",
+           static_cast<unsigned int>(corpus_->GetDicomFiles().size()),
+           static_cast<unsigned int>(corpus_->GetOtherFiles().size()),
+           static_cast<unsigned int>(corpus_->GetDirectoriesCount()),
+           static_cast<double>(corpus_->GetTotalSize()) / (1024.0 * 1024.0));
+
+    // Large file for the range reads, similar to a whole-slide image
+    largeFile_ = folder_ + "/large.dcm";
+    const std::string large = SyntheticCorpus::CreateInstance("LARGE", "1.2.3", "1.2.3.4", "1.2.3.4.5", LARGE_FILE_SIZE);
+    Orthanc::SystemToolbox::WriteFile(large.c_str(), large.size(), largeFile_, false);
+
+    printf("Generating the database with %u files\n", rows);
+    database_.Open(folder_ + "/indexer.db", 4);
+    database_.SetWriteBatch(1000, 1000);
+
+    for (unsigned int i = 0; i < rows; i++)
+    {
+      const std::string series = "1.2.3." + boost::lexical_cast<std::string>(i / 100);
+      const std::string sop = series + "." + boost::lexical_cast<std::string>(i % 100);
+
+      Orthanc::DicomInstanceHasher hasher("PATIENT", "1.2.3", series, sop);
+      paths_.push_back("/archive/series" + boost::lexical_cast<std::string>(i / 100) +
+                       "/" + boost::lexical_cast<std::string>(i) + ".dcm");
+      database_.AddDicomInstance(paths_.back(), FileMetadata(42, 1024), hasher.HashInstance());
+    }
+
+    database_.FlushWriteBatch();
+
+    for (unsigned int i = 0; i < rows; i++)
+    {
+      const std::string series = "1.2.3." + boost::lexical_cast<std::string>(i / 100);
+      const std::string sop = series + "." + boost::lexical_cast<std::string>(i % 100);
+
+      Orthanc::DicomInstanceHasher hasher("PATIENT", "1.2.3", series, sop);
+      uuids_.push_back(Orthanc::Toolbox::GenerateUuid());
+      database_.AddAttachment(uuids_.back(), hasher.HashInstance());
+    }
+
+    insertions_.Open(folder_ + "/insertions.db", 1);
+
+    printf("\n%-44s %10s %17s\n", "Benchmark", "Iterations", "Time");
+  }
+
+  ~Fixture()
+  {
+    corpus_.reset();
+
+    try
+    {
+      boost::filesystem::remove_all(folder_);
+    }
+    catch (...)
+    {
+    }
+  }
+
+  const SyntheticCorpus& GetCorpus() const
+  {
+    return *corpus_;
+  }
+
+  uintmax_t GetDicomFileSize(size_t index) const
+  {
+    return sizes_[index];
+  }
+
+  const std::string& GetLargeFile() const
+  {
+    return largeFile_;
+  }
+
+  IndexerDatabase& GetDatabase()
+  {
+    return database_;
+  }
+
+  void EnableCache()
+  {
+    if (!isCacheEnabled_)
+    {
+      database_.EnableCache(256 * 1024 * 1024);
+      isCacheEnabled_ = true;
+    }
+  }
+
+  const std::vector<std::string>& GetPaths() const
+  {
+    return paths_;
+  }
+
+  const std::vector<std::string>& GetUuids() const
+  {
+    return uuids_;
+  }
+
+  IndexerDatabase& GetInsertionsDatabase()
+  {
+    return insertions_;
+  }
+
+  std::string GenerateInsertionPath()
+  {
+    countInsertions_++;
+    return ("/insertions/series" + boost::lexical_cast<std::string>(countInsertions_ / 100) +
+            "/" + boost::lexical_cast<std::string>(countInsertions_) + ".dcm");
+  }
+};
+
+
+static std::unique_ptr<Fixture>  fixture_;
+
+// Linear congruential generator, so that the runs are reproducible
+static size_t NextRandom(uint64_t& seed,
+                         size_t modulo)
+{
+  seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+  return static_cast<size_t>((seed >> 33) % modulo);
+}
+
+
+
+/**
+ * Walk of the directories, as done by "MonitorDirectories()"
+ **/
+class CrawlVisitor : public DirectoryCrawler::IVisitor
+{
+private:
+  std::atomic<uint64_t>                          files_;
+  bool                                           prune_;
+  boost::mutex                                   mutex_;
+  std::map<std::string, std::list<std::string> > directories_;
+
+public:
+  explicit CrawlVisitor(bool prune) :
+    files_(0),
+    prune_(prune)
+  {
+  }
+
+  void Reset()
+  {
+    files_ = 0;
+  }
+
+  uint64_t GetFilesCount() const
+  {
+    return files_;
+  }
+
+  virtual void VisitFile(const std::string& path,
+                         const FileMetadata& metadata) ORTHANC_OVERRIDE
+  {
+    files_++;
+  }
+
+  virtual void VisitFailure(const std::string& path) ORTHANC_OVERRIDE
+  {
+  }
+
+  virtual bool LookupDirectory(std::list<std::string>& subdirectories,
+                               const std::string& path,
+                               const std::time_t time) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::map<std::string, std::list<std::string> >::const_iterator found = directories_.find(path);
+    if (prune_ &&
+        found != directories_.end())
+    {
+      subdirectories = found->second;
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  virtual void VisitDirectory(const std::string& path,
+                              const std::time_t time,
+                              bool isStable,
+                              const std::list<std::string>& subdirectories) ORTHANC_OVERRIDE
+  {
+    if (prune_)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      directories_[path] = subdirectories;
+    }
+  }
+};
+
+
+static void BenchmarkCrawl(BenchmarkState& state,
+                           unsigned int threads,
+                           bool prune,
+                           DirectoryReader::Engine engine)
+{
+  static const bool NEVER_STOP = false;
+
+  CrawlVisitor visitor(prune);
+
+  std::list<std::string> folders;
+  folders.push_back(fixture_->GetCorpus().GetRoot());
+
+  if (prune)
+  {
+    // First walk to record the directories, as the previous scan would
+    DirectoryCrawler crawler(visitor, NEVER_STOP, threads, engine);
+    crawler.Run(folders);
+  }
+
+  uint64_t files = 0;
+  uint64_t systemCalls = 0;
+
+  while (state.KeepRunning())
+  {
+    visitor.Reset();
+
+    DirectoryCrawler crawler(visitor, NEVER_STOP, threads, engine);
+    crawler.Run(folders);
+
+    state.AddItemsProcessed(prune ? 0 : visitor.GetFilesCount());
+
+    files += visitor.GetFilesCount();
+    systemCalls += crawler.GetSystemCallsCount();
+  }
+
+  if (files != 0)
+  {
+    char label[64];
+    sprintf(label, "%6.2f syscalls/file", static_cast<double>(systemCalls) / static_cast<double>(files));
+    state.SetLabel(label);
+  }
+}
+
+
+/**
+ * Identification of the DICOM files (equivalent of "ComputeInstanceId()")
+ **/
+static void BenchmarkParseFile(BenchmarkState& state)
+{
+  const std::vector<std::string>& files = fixture_->GetCorpus().GetDicomFiles();
+  size_t next = 0;
+
+  while (state.KeepRunning())
+  {
+    DicomHeader header;
+    if (!header.ParseFile(files[next], fixture_->GetDicomFileSize(next)))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    header.HashInstance();
+
+    state.AddItemsProcessed(1);
+    state.AddBytesProcessed(header.GetHeaderSize());
+    next = (next + 1) % files.size();
+  }
+}
+
+
+static void BenchmarkParseHeader(BenchmarkState& state)
+{
+  const std::string dicom = SyntheticCorpus::CreateInstance("PATIENT", "1.2.3", "1.2.3.4", "1.2.3.4.5", 1024);
+
+  while (state.KeepRunning())
+  {
+    DicomHeader header;
+    if (header.ParseHeader(dicom.c_str(), dicom.size()) != DicomHeader::ParseStatus_Success)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    state.AddItemsProcessed(1);
+  }
+}
+
+
+#if ORTHANC_ENABLE_DCMTK == 1
+/**
+ * The fallback of "DicomHeader::ParseUsingOrthanc()", as done by the
+ * Orthanc core for "OrthancPluginDicomBufferToJson()": The whole file
+ * is parsed by DCMTK and converted to JSON, which is then parsed again
+ * to read the identifiers. The fake Orthanc context cannot be used
+ * here, as its conversion is built on "DicomHeader::ParseHeader()".
+ **/
+static void BenchmarkParseJson(BenchmarkState& state)
+{
+  const std::string dicom = SyntheticCorpus::CreateInstance("PATIENT", "1.2.3", "1.2.3.4", "1.2.3.4.5", 1024);
+
+  while (state.KeepRunning())
+  {
+    Orthanc::ParsedDicomFile parsed(dicom);
+
+    Json::Value json;
+    parsed.DatasetToJson(json, Orthanc::DicomToJsonFormat_Short, Orthanc::DicomToJsonFlags_None,
+                         256 /* same limit as "ParseUsingOrthanc()" */);
+
+    std::string s;
+    Orthanc::Toolbox::WriteFastJson(s, json);
+
+    Json::Value identifiers;
+    if (!Orthanc::Toolbox::ReadJson(identifiers, s) ||
+        Orthanc::SerializationToolbox::ReadString(identifiers, "0020,000e") != "1.2.3.4")
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    state.AddItemsProcessed(1);
+  }
+}
+#endif
+
+
+static void BenchmarkHashInstance(BenchmarkState& state)
+{
+  const std::string dicom = SyntheticCorpus::CreateInstance("PATIENT", "1.2.3", "1.2.3.4", "1.2.3.4.5", 1024);
+
+  DicomHeader header;
+  header.ParseHeader(dicom.c_str(), dicom.size());
+
+  while (state.KeepRunning())
+  {
+    header.HashInstance();
+    state.AddItemsProcessed(1);
+  }
+}
+
+
+static void BenchmarkHeaderCache(BenchmarkState& state)
+{
+  const std::string dicom = SyntheticCorpus::CreateInstance("PATIENT", "1.2.3", "1.2.3.4", "1.2.3.4.5", 1024);
+
+  DicomHeader header;
+  header.ParseHeader(dicom.c_str(), dicom.size());
+
+  DicomHeaderCache cache(64, 64 * 1024);
+  cache.Store(header, header.HashInstance(), dicom.c_str(), dicom.size());
+
+  while (state.KeepRunning())
+  {
+    DicomHeader found;
+    std::string instanceId;
+    if (!cache.Lookup(found, instanceId, dicom.c_str(), dicom.size()))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    state.AddItemsProcessed(1);
+  }
+}
+
+
+/**
+ * Operations of "IndexerDatabase"
+ **/
+static void BenchmarkLookupFile(BenchmarkState& state)
+{
+  const std::vector<std::string>& paths = fixture_->GetPaths();
+  uint64_t seed = 0;
+
+  while (state.KeepRunning())
+  {
+    std::string instanceId;
+    if (fixture_->GetDatabase().LookupFile(instanceId, paths[NextRandom(seed, paths.size())], FileMetadata(42, 1024)) !=
+        IndexerDatabase::FileStatus_AlreadyStored)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    state.AddItemsProcessed(1);
+  }
+}
+
+
+static void BenchmarkLookupAttachment(BenchmarkState& state,
+                                      bool cache)
+{
+  if (cache)
+  {
+    fixture_->EnableCache();
+  }
+
+  const std::vector<std::string>& uuids = fixture_->GetUuids();
+  uint64_t seed = 0;
+
+  while (state.KeepRunning())
+  {
+    std::string path;
+    if (!fixture_->GetDatabase().LookupAttachment(path, uuids[NextRandom(seed, uuids.size())]))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    state.AddItemsProcessed(1);
+  }
+}
+
+
+static void BenchmarkTouchFile(BenchmarkState& state)
+{
+  const std::vector<std::string>& paths = fixture_->GetPaths();
+  uint64_t seed = 0;
+
+  IndexerDatabase& database = fixture_->GetDatabase();
+  database.StartScan();
+
+  while (state.KeepRunning())
+  {
+    database.TouchFile(paths[NextRandom(seed, paths.size())], FileMetadata(42, 1024));
+    state.AddItemsProcessed(1);
+  }
+
+  database.FlushWriteBatch();
+}
+
+
+static void BenchmarkAddDicomInstance(BenchmarkState& state,
+                                      unsigned int batchSize)
+{
+  IndexerDatabase& database = fixture_->GetInsertionsDatabase();
+  database.SetWriteBatch(batchSize, 1000);
+
+  while (state.KeepRunning())
+  {
+    const std::string path = fixture_->GenerateInsertionPath();
+    Orthanc::DicomInstanceHasher hasher("PATIENT", "1.2.3", "1.2.3.4", path);
+    database.AddDicomInstance(path, FileMetadata(42, 1024), hasher.HashInstance());
+    state.AddItemsProcessed(1);
+  }
+
+  database.FlushWriteBatch();
+}
+
+
+/**
+ * Reads of the storage area, from the indexed files
+ **/
+static void BenchmarkReadWhole(BenchmarkState& state,
+                               bool large)
+{
+  const std::vector<std::string>& files = fixture_->GetCorpus().GetDicomFiles();
+  size_t next = 0;
+
+  while (state.KeepRunning())
+  {
+    OrthancPluginMemoryBuffer64 buffer;
+    StorageArea::ReadWholeFromPath(&buffer, large ? fixture_->GetLargeFile() : files[next]);
+    state.AddBytesProcessed(buffer.size);
+    free(buffer.data);
+
+    next = (next + 1) % files.size();
+  }
+}
+
+
+enum ReadRangeMode
+{
+  ReadRangeMode_Path,    // Open and close the file for each range
+  ReadRangeMode_Open,    // Kept open, as an indexed file
+  ReadRangeMode_Mapped   // Kept mapped, as a file received by Orthanc
+};
+
+
+static void BenchmarkReadRange(BenchmarkState& state,
+                               size_t rangeSize,
+                               ReadRangeMode mode)
+{
+  std::vector<char> target(rangeSize);
+  const uintmax_t maxStart = Fixture::LARGE_FILE_SIZE - rangeSize;
+  uint64_t seed = 0;
+
+  // Kept across the runs of the benchmark, as the files that are read
+  // by a viewer: The pages are only faulted in once. The large file is
+  // a bit larger than its pixel data. One cache per mode, as a cached
+  // file stays either open or mapped.
+  static MappedFilesCache openCache(2 * Fixture::LARGE_FILE_SIZE, 1);
+  static MappedFilesCache mappedCache(2 * Fixture::LARGE_FILE_SIZE, 1);
+
+  while (state.KeepRunning())
+  {
+    OrthancPluginMemoryBuffer64 buffer;
+    buffer.data = &target[0];
+    buffer.size = rangeSize;
+
+    switch (mode)
+    {
+      case ReadRangeMode_Path:
+        StorageArea::ReadRangeFromPath(&buffer, fixture_->GetLargeFile(), NextRandom(seed, maxStart));
+        break;
+
+      case ReadRangeMode_Open:
+        openCache.ReadRange(&buffer, fixture_->GetLargeFile(), NextRandom(seed, maxStart), false);
+        break;
+
+      case ReadRangeMode_Mapped:
+        mappedCache.ReadRange(&buffer, fixture_->GetLargeFile(), NextRandom(seed, maxStart), true);
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    state.AddBytesProcessed(rangeSize);
+  }
+}
+
+
+
+static void EvictFromPageCache(const std::string& path)
+{
+#if defined(__linux__)
+  // Only drops the clean pages, which needs no privilege
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#endif
+}
+
+
+/**
+ * Reads of the instances of a series in the order of their names, as
+ * a viewer scrolling through it, with the files out of the page cache.
+ * The prefetcher is created for each pass, as it does not load again
+ * the files it has already loaded.
+ **/
+static void BenchmarkReadSeries(BenchmarkState& state,
+                                unsigned int readAhead)
+{
+  std::map<std::string, std::vector<std::string> > series;
+
+  const std::vector<std::string>& files = fixture_->GetCorpus().GetDicomFiles();
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    series[boost::filesystem::path(files[i]).parent_path().string()].push_back(files[i]);
+  }
+
+  std::map<std::string, std::vector<std::string> >::iterator current = series.begin();
+
+  while (state.KeepRunning())
+  {
+    std::vector<std::string>& instances = current->second;
+    std::sort(instances.begin(), instances.end());
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      EvictFromPageCache(instances[i]);
+    }
+
+    std::unique_ptr<ReadAheadPrefetcher> prefetcher;
+    if (readAhead != 0)
+    {
+      prefetcher.reset(new ReadAheadPrefetcher(readAhead, 16 * 1024 * 1024));
+    }
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      if (prefetcher.get() != NULL)
+      {
+        prefetcher->Access(instances[i]);
+      }
+
+      OrthancPluginMemoryBuffer64 buffer;
+      StorageArea::ReadWholeFromPath(&buffer, instances[i]);
+      state.AddBytesProcessed(buffer.size);
+      free(buffer.data);
+    }
+
+    ++current;
+    if (current == series.end())
+    {
+      current = series.begin();
+    }
+  }
+}
+
+
+/**
+ * Strategies of FileMemoryMap, to choose FileMemoryMap::MAP_THRESHOLD.
+ * Only one byte of each page of the range is accessed, so that the
+ * processing of the data does not hide the cost of the strategy.
+ **/
+static void BenchmarkFileMemoryMap(BenchmarkState& state,
+                                   size_t rangeSize,
+                                   FileMemoryMap::Mode mode)
+{
+  const uintmax_t maxStart = Fixture::LARGE_FILE_SIZE - rangeSize;
+  uint64_t seed = 0;
+  volatile uint8_t sink = 0;  // Prevents the optimizer from removing the accesses
+
+  while (state.KeepRunning())
+  {
+    FileMemoryMap reader(fixture_->GetLargeFile(), NextRandom(seed, maxStart), rangeSize, mode);
+
+    for (size_t i = 0; i < reader.length(); i += 4096)
+    {
+      sink = reader.data()[i];
+    }
+
+    state.AddBytesProcessed(reader.length());
+  }
+
+  (void) sink;
+}
+
+
+static bool ParseOption(std::string& value,
+                        const std::string& argument,
+                        const std::string& name)
+{
+  const std::string prefix = "--" + name + "=";
+  if (argument.compare(0, prefix.size(), prefix) == 0)
+  {
+    value = argument.substr(prefix.size());
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+#if ORTHANC_ENABLE_DCMTK == 1
+  // Loads the dictionary of DCMTK, for "Identify/Json"
+  Orthanc::InitializeFramework("", false /* loadPrivateDictionary */);
+#else
+  Orthanc::Logging::Initialize();
+#endif
+
+  std::string filter;
+  std::string folder = boost::filesystem::temp_directory_path().string();
+  double minTime = 0.5;
+  unsigned int rows = 100000;
+  SyntheticCorpus::Parameters parameters;
+
+  try
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      const std::string argument = argv[i];
+      std::string value;
+
+      if (ParseOption(value, argument, "filter"))
+      {
+        filter = value;
+      }
+      else if (ParseOption(value, argument, "folder"))
+      {
+        folder = value;
+      }
+      else if (ParseOption(value, argument, "min-time"))
+      {
+        minTime = boost::lexical_cast<double>(value);
+      }
+      else if (ParseOption(value, argument, "rows"))
+      {
+        rows = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "patients"))
+      {
+        parameters.patients_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "studies"))
+      {
+        parameters.studiesPerPatient_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "series"))
+      {
+        parameters.seriesPerStudy_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "instances"))
+      {
+        parameters.instancesPerSeries_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "pixel-size"))
+      {
+        parameters.pixelDataSize_ = boost::lexical_cast<size_t>(value);
+      }
+      else if (ParseOption(value, argument, "noise"))
+      {
+        parameters.noisePerDirectory_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "layout") &&
+               (value == "series" || value == "study" || value == "flat"))
+      {
+        parameters.layout_ = (value == "series" ? SyntheticCorpus::Layout_Series :
+                              value == "study" ? SyntheticCorpus::Layout_Study :
+                              SyntheticCorpus::Layout_Flat);
+      }
+      else
+      {
+        fprintf(stderr, "Usage: %s [--filter=substring] [--min-time=seconds] [--folder=path] [--rows=N]\n"
+                "       [--patients=N] [--studies=N] [--series=N] [--instances=N] [--pixel-size=bytes]\n"
+                "       [--noise=N] [--layout=series|study|flat]\n", argv[0]);
+        return -1;
+      }
+    }
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    fprintf(stderr, "Bad value in the command line\n");
+    return -1;
+  }
+
+  // The storage area allocates its buffers through the plugin SDK
+  FakeOrthancContext::Install();
+
+  std::vector<std::pair<std::string, BenchmarkFunction> > benchmarks;
+  benchmarks.push_back(std::make_pair("Crawl/threads:1", boost::bind(BenchmarkCrawl, _1, 1, false, DirectoryReader::Engine_Auto)));
+  benchmarks.push_back(std::make_pair("Crawl/threads:2", boost::bind(BenchmarkCrawl, _1, 2, false, DirectoryReader::Engine_Auto)));
+  benchmarks.push_back(std::make_pair("Crawl/threads:4", boost::bind(BenchmarkCrawl, _1, 4, false, DirectoryReader::Engine_Auto)));
+  benchmarks.push_back(std::make_pair("Crawl/threads:8", boost::bind(BenchmarkCrawl, _1, 8, false, DirectoryReader::Engine_Auto)));
+  benchmarks.push_back(std::make_pair("Crawl/pruned/threads:1", boost::bind(BenchmarkCrawl, _1, 1, true, DirectoryReader::Engine_Auto)));
+  benchmarks.push_back(std::make_pair("Crawl/pruned/threads:4", boost::bind(BenchmarkCrawl, _1, 4, true, DirectoryReader::Engine_Auto)));
+
+  // Same walk with each engine of DirectoryReader, with the count of
+  // the system calls (the Boost engine only counts its "stat()")
+  const DirectoryReader::Engine ENGINES[] = {
+    DirectoryReader::Engine_Boost,
+    DirectoryReader::Engine_Statx,
+    DirectoryReader::Engine_IoUring
+  };
+
+  for (size_t i = 0; i < sizeof(ENGINES) / sizeof(DirectoryReader::Engine); i++)
+  {
+    if (DirectoryReader::IsSupported(ENGINES[i]))
+    {
+      const std::string name = std::string("Crawl/engine:") + DirectoryReader::GetEngineName(ENGINES[i]);
+      benchmarks.push_back(std::make_pair(name + "/threads:1", boost::bind(BenchmarkCrawl, _1, 1, false, ENGINES[i])));
+      benchmarks.push_back(std::make_pair(name + "/threads:4", boost::bind(BenchmarkCrawl, _1, 4, false, ENGINES[i])));
+    }
+  }
+  benchmarks.push_back(std::make_pair("Identify/ParseFile", BenchmarkParseFile));
+  benchmarks.push_back(std::make_pair("Identify/ParseHeader", BenchmarkParseHeader));
+#if ORTHANC_ENABLE_DCMTK == 1
+  benchmarks.push_back(std::make_pair("Identify/Json", BenchmarkParseJson));
+#endif
+  benchmarks.push_back(std::make_pair("Identify/HashInstance", BenchmarkHashInstance));
+  benchmarks.push_back(std::make_pair("Identify/HeaderCache", BenchmarkHeaderCache));
+  benchmarks.push_back(std::make_pair("Database/LookupFile", BenchmarkLookupFile));
+  benchmarks.push_back(std::make_pair("Database/LookupAttachment/cache:off", boost::bind(BenchmarkLookupAttachment, _1, false)));
+  benchmarks.push_back(std::make_pair("Database/LookupAttachment/cache:on", boost::bind(BenchmarkLookupAttachment, _1, true)));
+  benchmarks.push_back(std::make_pair("Database/TouchFile", BenchmarkTouchFile));
+  benchmarks.push_back(std::make_pair("Database/AddDicomInstance/batch:1", boost::bind(BenchmarkAddDicomInstance, _1, 1)));
+  benchmarks.push_back(std::make_pair("Database/AddDicomInstance/batch:1000", boost::bind(BenchmarkAddDicomInstance, _1, 1000)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadWhole/corpus", boost::bind(BenchmarkReadWhole, _1, false)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadWhole/64MB", boost::bind(BenchmarkReadWhole, _1, true)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/4KB", boost::bind(BenchmarkReadRange, _1, 4 * 1024, ReadRangeMode_Path)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/64KB", boost::bind(BenchmarkReadRange, _1, 64 * 1024, ReadRangeMode_Path)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/1MB", boost::bind(BenchmarkReadRange, _1, 1024 * 1024, ReadRangeMode_Path)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/open/4KB", boost::bind(BenchmarkReadRange, _1, 4 * 1024, ReadRangeMode_Open)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/open/64KB", boost::bind(BenchmarkReadRange, _1, 64 * 1024, ReadRangeMode_Open)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/open/1MB", boost::bind(BenchmarkReadRange, _1, 1024 * 1024, ReadRangeMode_Open)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/mapped/4KB", boost::bind(BenchmarkReadRange, _1, 4 * 1024, ReadRangeMode_Mapped)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/mapped/64KB", boost::bind(BenchmarkReadRange, _1, 64 * 1024, ReadRangeMode_Mapped)));
+  benchmarks.push_back(std::make_pair("StorageArea/ReadRange/mapped/1MB", boost::bind(BenchmarkReadRange, _1, 1024 * 1024, ReadRangeMode_Mapped)));
+
+  if (ReadAheadPrefetcher::IsSupported())
+  {
+    benchmarks.push_back(std::make_pair("StorageArea/ReadSeries/cold", boost::bind(BenchmarkReadSeries, _1, 0)));
+    benchmarks.push_back(std::make_pair("StorageArea/ReadSeries/cold/read-ahead:8", boost::bind(BenchmarkReadSeries, _1, 8)));
+  }
+
+  const size_t MAP_SIZES[] = { 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+  for (size_t i = 0; i < sizeof(MAP_SIZES) / sizeof(size_t); i++)
+  {
+    const std::string size = boost::lexical_cast<std::string>(MAP_SIZES[i] / 1024) + "KB";
+    benchmarks.push_back(std::make_pair("FileMemoryMap/read/" + size,
+                                        boost::bind(BenchmarkFileMemoryMap, _1, MAP_SIZES[i], FileMemoryMap::Mode_Read)));
+    benchmarks.push_back(std::make_pair("FileMemoryMap/map/" + size,
+                                        boost::bind(BenchmarkFileMemoryMap, _1, MAP_SIZES[i], FileMemoryMap::Mode_Map)));
+  }
+
+  int result = 0;
+
+  try
+  {
+    fixture_.reset(new Fixture(folder, parameters, rows));
+
+    for (size_t i = 0; i < benchmarks.size(); i++)
+    {
+      if (benchmarks[i].first.find(filter) != std::string::npos)
+      {
+        RunBenchmark(benchmarks[i].first, benchmarks[i].second, minTime);
+      }
+    }
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    fprintf(stderr, "Error: %s\n", e.What());
+    result = -1;
+  }
+
+  fixture_.reset();
+
+#if ORTHANC_ENABLE_DCMTK == 1
+  Orthanc::FinalizeFramework();
+#else
+  Orthanc::Logging::Finalize();
+#endif
+
+  return result;
+}
@@ -19,233 +19,1401 @@
 
 #include "IndexerDatabase.h"
 
+#include "IndexerMetrics.h"
+
 #include <EmbeddedResources.h>
+#include <Logging.h>
 #include <SQLite/Transaction.h>
 
+#include <boost/lexical_cast.hpp>
+
+
+static const int64_t GLOBAL_PROPERTY_DATABASE_SCHEMA_VERSION = 1;
+static const unsigned int CURRENT_DATABASE_SCHEMA_VERSION = 2;
+
+
+static bool SplitPath(std::string& parent,
+                      std::string& name,
+                      const std::string& path)
+{
+  // Only the slash is considered as a separator, so that the full
+  // path is always rebuilt exactly. The paths without slash are
+  // stored as a whole.
+  size_t pos = path.rfind('/');
+  if (pos == std::string::npos)
+  {
+    return false;
+  }
+  else
+  {
+    parent = path.substr(0, pos);
+    name = path.substr(pos + 1);
+    return true;
+  }
+}
+
+
+static int DecodeHexadecimal(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  else if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  else
+  {
+    return -1;
+  }
+}
+
+
+static void BindInstanceId(Orthanc::SQLite::Statement& statement,
+                           int col,
+                           const std::string& instanceId)
+{
+  // The Orthanc identifiers are SHA-1 hashes formatted as 5 groups of
+  // 8 lowercase hexadecimal digits, which are stored as 20-byte blobs
+  static const size_t HASH_SIZE = 20;
+
+  if (instanceId.size() == 2 * HASH_SIZE + 4)
+  {
+    uint8_t hash[HASH_SIZE];
+    size_t pos = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < HASH_SIZE && ok; i++)
+    {
+      if (i != 0 &&
+          i % 4 == 0)
+      {
+        ok = (instanceId[pos] == '-');
+        pos++;
+      }
+
+      const int high = DecodeHexadecimal(instanceId[pos]);
+      const int low = DecodeHexadecimal(instanceId[pos + 1]);
+      ok = (ok && high >= 0 && low >= 0);
+      hash[i] = static_cast<uint8_t>(high * 16 + low);
+      pos += 2;
+    }
+
+    if (ok)
+    {
+      statement.BindBlob(col, hash, HASH_SIZE);
+      return;
+    }
+  }
+
+  statement.BindString(col, instanceId);
+}
+
+
+static std::string ColumnInstanceId(Orthanc::SQLite::Statement& statement,
+                                    int col)
+{
+  if (statement.GetColumnType(col) == Orthanc::SQLite::COLUMN_TYPE_BLOB)
+  {
+    static const char HEXADECIMAL[] = "0123456789abcdef";
+
+    std::string hash;
+    if (!statement.ColumnBlobAsString(col, &hash) ||
+        hash.size() != 20)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
+    }
+
+    std::string instanceId;
+    instanceId.reserve(44);
+
+    for (size_t i = 0; i < hash.size(); i++)
+    {
+      if (i != 0 &&
+          i % 4 == 0)
+      {
+        instanceId.push_back('-');
+      }
+
+      const uint8_t value = static_cast<uint8_t>(hash[i]);
+      instanceId.push_back(HEXADECIMAL[value / 16]);
+      instanceId.push_back(HEXADECIMAL[value % 16]);
+    }
+
+    return instanceId;
+  }
+  else
+  {
+    return statement.ColumnString(col);
+  }
+}
+
+
+int64_t IndexerDatabase::GetDirectory(const std::string& path)
+{
+  // "mutex_" must be locked by the caller, so this is the only thread
+  // that can add directories
+
+  {
+    boost::shared_lock<boost::shared_mutex> lock(directoriesMutex_);
+
+    std::unordered_map<std::string, int64_t>::const_iterator found = directoryIds_.find(path);
+    if (found != directoryIds_.end())
+    {
+      return found->second;
+    }
+  }
+
+  std::string parentPath, name;
+  int64_t parent = 0;
+
+  if (SplitPath(parentPath, name, path))
+  {
+    parent = GetDirectory(parentPath);
+  }
+  else
+  {
+    name = path;
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT INTO Directories(parent, name) VALUES(?, ?)");
+    statement.BindInt64(0, parent);
+    statement.BindString(1, name);
+    statement.Run();
+  }
+
+  const int64_t id = db_.GetLastInsertRowId();
+
+  {
+    boost::unique_lock<boost::shared_mutex> lock(directoriesMutex_);
+    directoryIds_[path] = id;
+    directoryPaths_[id] = path;
+  }
+
+  return id;
+}
+
+
+bool IndexerDatabase::LookupKey(int64_t& directory,
+                                std::string& name,
+                                const std::string& path)
+{
+  std::string parent;
+
+  if (SplitPath(parent, name, path))
+  {
+    boost::shared_lock<boost::shared_mutex> lock(directoriesMutex_);
+
+    std::unordered_map<std::string, int64_t>::const_iterator found = directoryIds_.find(parent);
+    if (found == directoryIds_.end())
+    {
+      return false;
+    }
+    else
+    {
+      directory = found->second;
+      return true;
+    }
+  }
+  else
+  {
+    directory = 0;
+    name = path;
+    return true;
+  }
+}
+
+
+std::string IndexerDatabase::GetPath(int64_t directory,
+                                     const std::string& name)
+{
+  if (directory == 0)
+  {
+    return name;
+  }
+  else
+  {
+    boost::shared_lock<boost::shared_mutex> lock(directoriesMutex_);
+
+    std::unordered_map<int64_t, std::string>::const_iterator found = directoryPaths_.find(directory);
+    if (found == directoryPaths_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
+    }
+    else
+    {
+      return found->second + "/" + name;
+    }
+  }
+}
+
+
+void IndexerDatabase::LoadDirectories()
+{
+  boost::unique_lock<boost::shared_mutex> lock(directoriesMutex_);
+
+  directoryIds_.clear();
+  directoryPaths_.clear();
+
+  // As directories are never removed, a parent always has a smaller
+  // identifier than its children
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT id, parent, name FROM Directories ORDER BY id");
+
+  while (statement.Step())
+  {
+    const int64_t id = statement.ColumnInt64(0);
+    const int64_t parent = statement.ColumnInt64(1);
+
+    std::string path;
+    if (parent == 0)
+    {
+      path = statement.ColumnString(2);
+    }
+    else
+    {
+      std::unordered_map<int64_t, std::string>::const_iterator found = directoryPaths_.find(parent);
+      if (found == directoryPaths_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_Database,
+                                        "Corrupted table of directories in the Indexer plugin");
+      }
+
+      path = found->second + "/" + statement.ColumnString(2);
+    }
+
+    directoryIds_[path] = id;
+    directoryPaths_[id] = path;
+  }
+}
+
+
+void IndexerDatabase::AddFileInternal(const std::string& path,
+                                      const FileMetadata& metadata,
+                                      bool isDicom,
+                                      const std::string& instanceId)
+{
+  // "mutex_" must be locked by the caller
+
+  OpenBatch();
+
+  int64_t directory = 0;
+  std::string name, parent;
+
+  if (SplitPath(parent, name, path))
+  {
+    directory = GetDirectory(parent);
+  }
+  else
+  {
+    name = path;
+  }
+
+  {
+    // No nested transaction here: If this statement fails, SQLite
+    // only rolls back the statement, and the batch remains valid
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT INTO Files VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    statement.BindInt64(0, directory);
+    statement.BindString(1, name);
+    statement.BindInt64(2, metadata.time_);
+    statement.BindInt64(3, metadata.size_);
+    statement.BindInt64(4, isDicom);
+    BindInstanceId(statement, 5, instanceId);
+    statement.BindInt64(6, generation_);
+    statement.BindInt64(7, metadata.nanoseconds_);
+    statement.BindInt64(8, metadata.inode_);
+    statement.Run();
+  }
+
+  {
+    boost::mutex::scoped_lock lock(pendingMutex_);
+    pendingPaths_.insert(path);
+  }
+
+  CommitBatchIfFull();
+}
+
+
+void IndexerDatabase::OpenBatch()
+{
+  // "mutex_" must be locked by the caller
+
+  if (batch_.get() == NULL)
+  {
+    batch_.reset(new Orthanc::SQLite::Transaction(db_));
+    batch_->Begin();
+    batchSize_ = 0;
+    batchStart_ = boost::posix_time::microsec_clock::universal_time();
+  }
+}
+
+
+void IndexerDatabase::CommitBatchIfFull()
+{
+  // "mutex_" must be locked by the caller
+
+  batchSize_++;
+
+  if (batchSize_ >= maxBatchSize_ ||
+      boost::posix_time::microsec_clock::universal_time() - batchStart_ >=
+      boost::posix_time::milliseconds(maxBatchMilliseconds_))
+  {
+    CommitBatch();
+  }
+}
+
+
+void IndexerDatabase::CommitBatch()
+{
+  // "mutex_" must be locked by the caller
+
+  if (batch_.get() != NULL)
+  {
+    std::unique_ptr<Orthanc::SQLite::Transaction> batch(batch_.release());
+
+    try
+    {
+      batch->Commit();
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      // The directories that were created by the batch are lost
+      batch.reset();
+      LoadDirectories();
+
+      {
+        boost::mutex::scoped_lock lock(pendingMutex_);
+        pendingPaths_.clear();
+      }
+
+      throw;
+    }
+
+    // The pending paths are only released once they are visible to the
+    // readers: Until then, their lookups wait on "mutex_" for the commit
+    {
+      boost::mutex::scoped_lock lock(pendingMutex_);
+      pendingPaths_.clear();
+    }
+  }
+}
+
+
+static size_t EstimateCacheEntry(const std::string& key,
+                                 const std::string& value)
+{
+  // Rough overhead of a node of the hash table, with its two strings
+  return key.size() + value.size() + 96;
+}
+
+
+bool IndexerDatabase::LookupCache(std::string& path,
+                                  uint64_t& version,
+                                  const std::string& uuid)
+{
+  boost::shared_lock<boost::shared_mutex> lock(cacheMutex_);
+
+  version = cacheVersion_;
+
+  if (cacheBudget_ == 0)
+  {
+    return false;
+  }
+
+  Dictionary::const_iterator instance = cachedAttachments_.find(uuid);
+  if (instance == cachedAttachments_.end())
+  {
+    return false;
+  }
+
+  Dictionary::const_iterator found = cachedPaths_.find(instance->second);
+  if (found == cachedPaths_.end())
+  {
+    return false;
+  }
+  else
+  {
+    path = found->second;
+    return true;
+  }
+}
+
+
+void IndexerDatabase::StoreCache(const std::string& uuid,
+                                 const std::string& instanceId,
+                                 const std::string& path,
+                                 uint64_t version)
+{
+  boost::unique_lock<boost::shared_mutex> lock(cacheMutex_);
+
+  if (cacheBudget_ == 0 ||
+      version != cacheVersion_)  // Some write happened since the SQL query
+  {
+    return;
+  }
+
+  if (cachedAttachments_.find(uuid) == cachedAttachments_.end())
+  {
+    const size_t size = EstimateCacheEntry(uuid, instanceId);
+    if (cacheSize_ + size <= cacheBudget_)
+    {
+      cachedAttachments_[uuid] = instanceId;
+      cacheSize_ += size;
+    }
+  }
+
+  if (cachedPaths_.find(instanceId) == cachedPaths_.end())
+  {
+    const size_t size = EstimateCacheEntry(instanceId, path);
+    if (cacheSize_ + size <= cacheBudget_)
+    {
+      cachedPaths_[instanceId] = path;
+      cacheSize_ += size;
+    }
+  }
+}
+
+
+void IndexerDatabase::InvalidateCachedAttachment(const std::string& uuid)
+{
+  boost::unique_lock<boost::shared_mutex> lock(cacheMutex_);
+  cacheVersion_++;
+
+  Dictionary::iterator found = cachedAttachments_.find(uuid);
+  if (found != cachedAttachments_.end())
+  {
+    cacheSize_ -= EstimateCacheEntry(found->first, found->second);
+    cachedAttachments_.erase(found);
+  }
+}
+
+
+void IndexerDatabase::InvalidateCachedPath(const std::string& instanceId,
+                                           const std::string& path)
+{
+  boost::unique_lock<boost::shared_mutex> lock(cacheMutex_);
+  cacheVersion_++;
+
+  // The instance might have other copies, that will be looked up
+  // again in the database
+  Dictionary::iterator found = cachedPaths_.find(instanceId);
+  if (found != cachedPaths_.end() &&
+      found->second == path)
+  {
+    cacheSize_ -= EstimateCacheEntry(found->first, found->second);
+    cachedPaths_.erase(found);
+  }
+}
+
+
+IndexerDatabase::ReadConnection::ReadConnection(IndexerDatabase& database,
+                                                bool writer) :
+  database_(database),
+  connection_(NULL)
+{
+  boost::mutex::scoped_lock lock(database_.readersMutex_);
+
+  if (writer ||
+      database_.readers_.empty())
+  {
+    lock.unlock();
+    writerLock_.reset(new boost::mutex::scoped_lock(database_.mutex_));
+    connection_ = &database_.db_;
+  }
+  else
+  {
+    while (database_.availableReaders_.empty())
+    {
+      database_.readersAvailable_.wait(lock);
+    }
+
+    connection_ = database_.availableReaders_.top();
+    database_.availableReaders_.pop();
+  }
+}
+
+
+IndexerDatabase::ReadConnection::~ReadConnection()
+{
+  if (writerLock_.get() == NULL)
+  {
+    {
+      boost::mutex::scoped_lock lock(database_.readersMutex_);
+      database_.availableReaders_.push(connection_);
+    }
+
+    database_.readersAvailable_.notify_one();
+  }
+}
+
+
+static bool HasColumn(Orthanc::SQLite::Connection& db,
+                      const std::string& table,
+                      const std::string& column)
+{
+  Orthanc::SQLite::Statement statement(db, "PRAGMA table_info(" + table + ")");
+
+  while (statement.Step())
+  {
+    if (statement.ColumnString(1) == column)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void IndexerDatabase::UpgradeFromVersion1()
+{
+  // Called inside the transaction of "Initialize()"
+
+  if (!HasColumn(db_, "Files", "generation"))
+  {
+    db_.Execute("ALTER TABLE Files ADD COLUMN generation INTEGER NOT NULL DEFAULT 0");
+  }
+
+  db_.Execute("DROP INDEX IF EXISTS InstancesIndex;");
+  db_.Execute("ALTER TABLE Files RENAME TO FilesV1;");
+  db_.Execute("ALTER TABLE Attachments RENAME TO AttachmentsV1;");
+
+  {
+    std::string sql;
+    Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE);
+    db_.Execute(sql);
+  }
+
+  LoadDirectories();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT path, time, size, isDicom, instanceId, generation FROM FilesV1");
+
+    while (statement.Step())
+    {
+      const std::string path = statement.ColumnString(0);
+
+      int64_t directory = 0;
+      std::string name, parent;
+
+      if (SplitPath(parent, name, path))
+      {
+        directory = GetDirectory(parent);
+      }
+      else
+      {
+        name = path;
+      }
+
+      Orthanc::SQLite::Statement insert(db_, SQLITE_FROM_HERE,
+                                        "INSERT INTO Files VALUES(?, ?, ?, ?, ?, ?, ?, NULL, NULL)");
+      insert.BindInt64(0, directory);
+      insert.BindString(1, name);
+      insert.BindInt64(2, statement.ColumnInt64(1));
+      insert.BindInt64(3, statement.ColumnInt64(2));
+      insert.BindInt64(4, statement.ColumnInt64(3));
+      BindInstanceId(insert, 5, statement.ColumnString(4));
+      insert.BindInt64(6, statement.ColumnInt64(5));
+      insert.Run();
+    }
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT uuid, instanceId FROM AttachmentsV1");
+
+    while (statement.Step())
+    {
+      Orthanc::SQLite::Statement insert(db_, SQLITE_FROM_HERE,
+                                        "INSERT INTO Attachments VALUES(?, ?)");
+      insert.BindString(0, statement.ColumnString(0));
+      BindInstanceId(insert, 1, statement.ColumnString(1));
+      insert.Run();
+    }
+  }
+
+  db_.Execute("DROP TABLE FilesV1;");
+  db_.Execute("DROP TABLE AttachmentsV1;");
+}
+
+
+void IndexerDatabase::Initialize(bool exclusive)
+{
+  bool upgraded = false;
+
+  {
+    Orthanc::SQLite::Transaction transaction(db_);
+    transaction.Begin();
+
+    if (!db_.DoesTableExist("Attachments"))
+    {
+      std::string sql;
+      Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE);
+      db_.Execute(sql);
+    }
+    else if (!db_.DoesTableExist("GlobalProperties"))
+    {
+      // Database created by a previous version of the plugin
+      LOG(WARNING) << "Upgrading the database of the Indexer plugin to version "
+                   << CURRENT_DATABASE_SCHEMA_VERSION << " of its schema, this might take a while";
+      UpgradeFromVersion1();
+      upgraded = true;
+    }
+    else
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "SELECT value FROM GlobalProperties WHERE property=?");
+      statement.BindInt64(0, GLOBAL_PROPERTY_DATABASE_SCHEMA_VERSION);
+
+      if (!statement.Step() ||
+          statement.ColumnString(0) != boost::lexical_cast<std::string>(CURRENT_DATABASE_SCHEMA_VERSION))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleDatabaseVersion,
+                                        "Unsupported version of the database of the Indexer plugin");
+      }
+
+      if (!HasColumn(db_, "Directories", "time"))
+      {
+        db_.Execute("ALTER TABLE Directories ADD COLUMN time INTEGER");
+      }
+
+      if (!HasColumn(db_, "Files", "nanoseconds"))
+      {
+        // The existing files keep NULL, which matches any value
+        db_.Execute("ALTER TABLE Files ADD COLUMN nanoseconds INTEGER");
+        db_.Execute("ALTER TABLE Files ADD COLUMN inode INTEGER");
+      }
+    }
+
+    LoadDirectories();
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "SELECT COALESCE(MAX(generation), 0) FROM Files");
+      statement.Step();
+      generation_ = statement.ColumnInt64(0);
+    }
+
+    transaction.Commit();
+  }
+
+  if (upgraded)
+  {
+    // Give back the space of the tables of the previous version
+    db_.Execute("VACUUM;");
+  }
+    
+  // Performance tuning of SQLite with PRAGMAs
+  // http://www.sqlite.org/pragma.html
+  db_.Execute("PRAGMA SYNCHRONOUS=NORMAL;");
+  db_.Execute("PRAGMA JOURNAL_MODE=WAL;");
+
+  if (exclusive)
+  {
+    // Only if there is no reader connection, as an exclusive lock
+    // would prevent them from accessing the database
+    db_.Execute("PRAGMA LOCKING_MODE=EXCLUSIVE;");
+  }
+
+  db_.Execute("PRAGMA WAL_AUTOCHECKPOINT=1000;");
+}
+
+
+IndexerDatabase::IndexerDatabase() :
+  batchSize_(0),
+  maxBatchSize_(1),
+  maxBatchMilliseconds_(0),
+  generation_(0),
+  cacheBudget_(0),
+  cacheSize_(0),
+  cacheVersion_(0)
+{
+}
+
+
+IndexerDatabase::~IndexerDatabase()
+{
+  try
+  {
+    FlushWriteBatch();
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    // The files of the batch will be examined again at the next scan
+  }
+
+  for (size_t i = 0; i < readers_.size(); i++)
+  {
+    delete readers_[i];
+  }
+}
+
+
+void IndexerDatabase::Open(const std::string& path,
+                           unsigned int readersCount)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  db_.Open(path);
+  Initialize(readersCount == 0);
+
+  boost::mutex::scoped_lock readersLock(readersMutex_);
+
+  for (unsigned int i = 0; i < readersCount; i++)
+  {
+    std::unique_ptr<Orthanc::SQLite::Connection> reader(new Orthanc::SQLite::Connection);
+    reader->Open(path);
+
+    // The writer connection might hold a lock for a short time while
+    // checkpointing the WAL, in which case the readers must wait
+    reader->Execute("PRAGMA BUSY_TIMEOUT=1000;");
+    reader->Execute("PRAGMA QUERY_ONLY=1;");
+
+    readers_.push_back(reader.get());
+    availableReaders_.push(reader.release());
+  }
+}
+  
+
+void IndexerDatabase::OpenInMemory()
+{
+  // An in-memory database cannot be shared between connections
+  boost::mutex::scoped_lock lock(mutex_);
+  db_.OpenInMemory();
+  Initialize(true);
+}
+  
+
+void IndexerDatabase::SetWriteBatch(unsigned int maxSize,
+                                    unsigned int maxMilliseconds)
+{
+  if (maxSize == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  maxBatchSize_ = maxSize;
+  maxBatchMilliseconds_ = maxMilliseconds;
+}
+
+
+void IndexerDatabase::FlushWriteBatch()
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseFlushWriteBatch);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  CommitBatch();
+}
+
+
+void IndexerDatabase::EnableCache(size_t maxBytes)
+{
+  // No write can happen while the mirror is loaded
+  boost::mutex::scoped_lock lock(mutex_);
+  CommitBatch();
+
+  boost::unique_lock<boost::shared_mutex> cacheLock(cacheMutex_);
+  cacheBudget_ = maxBytes;
+  cacheSize_ = 0;
+  cacheVersion_++;
+  cachedAttachments_.clear();
+  cachedPaths_.clear();
+
+  if (maxBytes != 0)
+  {
+    Orthanc::SQLite::Transaction transaction(db_);
+    transaction.Begin();
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "SELECT Attachments.uuid, Attachments.instanceId, Files.directory, Files.name "
+                                           "FROM Attachments INNER JOIN Files ON Attachments.instanceId = Files.instanceId");
+
+      while (statement.Step())
+      {
+        const std::string uuid = statement.ColumnString(0);
+        const std::string instanceId = ColumnInstanceId(statement, 1);
+        const std::string path = GetPath(statement.ColumnInt64(2), statement.ColumnString(3));
+
+        const size_t size = (EstimateCacheEntry(uuid, instanceId) +
+                             EstimateCacheEntry(instanceId, path));
+        if (cacheSize_ + size > maxBytes)
+        {
+          break;  // The remaining attachments will be looked up in the database
+        }
+
+        if (cachedAttachments_.find(uuid) == cachedAttachments_.end())
+        {
+          cachedAttachments_[uuid] = instanceId;
+          cacheSize_ += EstimateCacheEntry(uuid, instanceId);
+        }
+
+        if (cachedPaths_.find(instanceId) == cachedPaths_.end())
+        {
+          cachedPaths_[instanceId] = path;
+          cacheSize_ += EstimateCacheEntry(instanceId, path);
+        }
+      }
+    }
+
+    transaction.Commit();
+  }
+}
+
+
+size_t IndexerDatabase::GetCacheSize()
+{
+  boost::shared_lock<boost::shared_mutex> lock(cacheMutex_);
+  return cachedAttachments_.size();
+}
+  
+
+IndexerDatabase::FileStatus IndexerDatabase::LookupFile(std::string& oldInstanceId,
+                                                        const std::string& path,
+                                                        const FileMetadata& metadata)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseLookupFile);
+
+  bool pending;
+
+  {
+    boost::mutex::scoped_lock lock(pendingMutex_);
+    pending = (pendingPaths_.find(path) != pendingPaths_.end());
+  }
+
+  int64_t directory;
+  std::string name;
+  if (!LookupKey(directory, name, path))
+  {
+    return FileStatus_New;  // Unknown directory
+  }
+
+  // The uncommitted rows are only visible from the writer connection
+  ReadConnection connection(*this, pending);
+    
+  FileStatus result;
+  
+  Orthanc::SQLite::Transaction transaction(connection.GetConnection());
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                         "SELECT time, size, isDicom, instanceId, nanoseconds, inode "
+                                         "FROM Files WHERE directory=? AND name=?");
+    statement.BindInt64(0, directory);
+    statement.BindString(1, name);
+
+    if (statement.Step())
+    {
+      // A file replaced by another one with the same size and
+      // modification time (e.g. "rsync --times") has another inode
+      const int64_t inode = (statement.ColumnIsNull(5) ? 0 : statement.ColumnInt64(5));
+
+      if (metadata.time_ == static_cast<std::time_t>(statement.ColumnInt64(0)) &&
+          metadata.size_ == static_cast<uintmax_t>(statement.ColumnInt64(1)) &&
+          (statement.ColumnIsNull(4) ||
+           metadata.nanoseconds_ == static_cast<uint32_t>(statement.ColumnInt64(4))) &&
+          (inode == 0 ||
+           metadata.inode_ == 0 ||
+           metadata.inode_ == static_cast<uint64_t>(inode)))
+      {
+        if (statement.ColumnBool(2))
+        {
+          result = FileStatus_AlreadyStored;
+        }
+        else
+        {
+          result = FileStatus_NotDicom;
+        }
+      }
+      else
+      {
+        result = FileStatus_Modified;
+        oldInstanceId = ColumnInstanceId(statement, 3);
+      }
+    }
+    else
+    {
+      result = FileStatus_New;
+    }
+  }
+
+  transaction.Commit();
+
+  return result;
+}
+  
+
+bool IndexerDatabase::RemoveFile(const std::string& path)
+{
+  std::string instanceId;
+  return RemoveFile(instanceId, path);
+}
+
+
+bool IndexerDatabase::RemoveFile(std::string& instanceId,
+                                 const std::string& path)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseRemoveFile);
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // The removals are not batched, as the caller deletes the instance
+  // from Orthanc right after, and the storage area must see the change
+  CommitBatch();
+
+  int64_t directory;
+  std::string name;
+  if (!LookupKey(directory, name, path))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+  }
+    
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT instanceId FROM Files WHERE directory=? AND name=?");
+    statement.BindInt64(0, directory);
+    statement.BindString(1, name);
+      
+    if (statement.Step())
+    {
+      instanceId = ColumnInstanceId(statement, 0);
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+  }
+
+  bool isLastInstance;
+    
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT COUNT(*) FROM Files WHERE instanceId=?");
+    BindInstanceId(statement, 0, instanceId);
+      
+    if (statement.Step())
+    {
+      int64_t count = statement.ColumnInt64(0);
+      if (count == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+      else
+      {
+        isLastInstance = (count == 1);
+      }
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+    
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "DELETE FROM Files WHERE directory=? AND name=?");
+    statement.BindInt64(0, directory);
+    statement.BindString(1, name);
+    statement.Run();
+  }
+    
+  transaction.Commit();
+
+  InvalidateCachedPath(instanceId, path);
+  return isLastInstance;
+}
+
+
+void IndexerDatabase::AddDicomInstance(const std::string& path,
+                                       const FileMetadata& metadata,
+                                       const std::string& instanceId)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseAddFile);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  AddFileInternal(path, metadata, true, instanceId);
+}               
+
+
+void IndexerDatabase::AddNonDicomFile(const std::string& path,
+                                      const FileMetadata& metadata)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseAddFile);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  AddFileInternal(path, metadata, false, "");
+}
+
+
+void IndexerDatabase::Apply(IFileVisitor& visitor)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+    
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT directory, name, isDicom, instanceId FROM Files");
+
+  while (statement.Step())
+  {
+    visitor.VisitInstance(GetPath(statement.ColumnInt64(0), statement.ColumnString(1)),
+                          statement.ColumnBool(2), ColumnInstanceId(statement, 3));
+  }
+        
+  transaction.Commit();
+}
+
+
+int64_t IndexerDatabase::StartScan()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  generation_++;
+  return generation_;
+}
+
+
+void IndexerDatabase::TouchFile(const std::string& path,
+                                const FileMetadata& metadata)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseTouchFile);
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  int64_t directory;
+  std::string name;
+  if (!LookupKey(directory, name, path))
+  {
+    return;  // Not indexed
+  }
+
+  OpenBatch();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "UPDATE Files SET generation=?, nanoseconds=?, inode=COALESCE(NULLIF(?, 0), inode) "
+                                         "WHERE directory=? AND name=?");
+    statement.BindInt64(0, generation_);
+    statement.BindInt64(1, metadata.nanoseconds_);
+    statement.BindInt64(2, metadata.inode_);
+    statement.BindInt64(3, directory);
+    statement.BindString(4, name);
+    statement.Run();
+  }
+
+  CommitBatchIfFull();
+}
+
+
+void IndexerDatabase::ApplyStale(IFileVisitor& visitor,
+                                 int64_t generation)
+{
+  ReadConnection connection(*this, false);
+    
+  Orthanc::SQLite::Transaction transaction(connection.GetConnection());
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                         "SELECT directory, name, isDicom, instanceId FROM Files WHERE generation<?");
+    statement.BindInt64(0, generation);
+
+    while (statement.Step())
+    {
+      visitor.VisitInstance(GetPath(statement.ColumnInt64(0), statement.ColumnString(1)),
+                            statement.ColumnBool(2), ColumnInstanceId(statement, 3));
+    }
+  }
+
+  transaction.Commit();
+}
+
+
+bool IndexerDatabase::LookupDirectory(std::list<std::string>& subdirectories,
+                                      const std::string& path,
+                                      const std::time_t time)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseLookupDirectory);
+
+  int64_t directory;
+
+  {
+    boost::shared_lock<boost::shared_mutex> lock(directoriesMutex_);
+
+    std::unordered_map<std::string, int64_t>::const_iterator found = directoryIds_.find(path);
+    if (found == directoryIds_.end())
+    {
+      return false;
+    }
+    else
+    {
+      directory = found->second;
+    }
+  }
+
+  ReadConnection connection(*this, false);
 
-void IndexerDatabase::AddFileInternal(const std::string& path,
-                                      const std::time_t time,
-                                      const uintmax_t size,
-                                      bool isDicom,
-                                      const std::string& instanceId)
-{
-  Orthanc::SQLite::Transaction transaction(db_);
+  Orthanc::SQLite::Transaction transaction(connection.GetConnection());
   transaction.Begin();
 
-  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                       "INSERT INTO Files VALUES(?, ?, ?, ?, ?)");
-  statement.BindString(0, path);
-  statement.BindInt64(1, time);
-  statement.BindInt64(2, size);
-  statement.BindInt64(3, isDicom);
-  statement.BindString(4, instanceId);
-  statement.Run();
+  bool unchanged;
 
-  transaction.Commit();
-}
+  {
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                         "SELECT time FROM Directories WHERE id=?");
+    statement.BindInt64(0, directory);
 
+    unchanged = (statement.Step() &&
+                 !statement.ColumnIsNull(0) &&
+                 statement.ColumnInt64(0) == static_cast<int64_t>(time));
+  }
 
-void IndexerDatabase::Initialize()
-{
+  if (unchanged)
   {
-    Orthanc::SQLite::Transaction transaction(db_);
-    transaction.Begin();
+    subdirectories.clear();
 
-    if (!db_.DoesTableExist("Attachments"))
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                         "SELECT name FROM Directories WHERE parent=?");
+    statement.BindInt64(0, directory);
+
+    while (statement.Step())
     {
-      std::string sql;
-      Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE);
-      db_.Execute(sql);
+      subdirectories.push_back(path + "/" + statement.ColumnString(0));
     }
-
-    transaction.Commit();
   }
-    
-  // Performance tuning of SQLite with PRAGMAs
-  // http://www.sqlite.org/pragma.html
-  db_.Execute("PRAGMA SYNCHRONOUS=NORMAL;");
-  db_.Execute("PRAGMA JOURNAL_MODE=WAL;");
-  db_.Execute("PRAGMA LOCKING_MODE=EXCLUSIVE;");
-  db_.Execute("PRAGMA WAL_AUTOCHECKPOINT=1000;");
+
+  transaction.Commit();
+  return unchanged;
 }
 
 
-void IndexerDatabase::Open(const std::string& path)
+void IndexerDatabase::StoreDirectory(const std::string& path,
+                                     const std::time_t time,
+                                     bool isStable,
+                                     const std::list<std::string>& subdirectories)
 {
-  boost::mutex::scoped_lock lock(mutex_);
-  db_.Open(path);
-  Initialize();
-}
-  
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseStoreDirectory);
 
-void IndexerDatabase::OpenInMemory()
-{
   boost::mutex::scoped_lock lock(mutex_);
-  db_.OpenInMemory();
-  Initialize();
-}
-  
 
-IndexerDatabase::FileStatus IndexerDatabase::LookupFile(std::string& oldInstanceId,
-                                                        const std::string& path,
-                                                        const std::time_t time,
-                                                        const uintmax_t size)
-{
-  boost::mutex::scoped_lock lock(mutex_);
-    
-  FileStatus result;
-  
-  Orthanc::SQLite::Transaction transaction(db_);
-  transaction.Begin();
+  OpenBatch();
+
+  const int64_t directory = GetDirectory(path);
 
+  if (path.empty() ||
+      path[path.size() - 1] == '/')
   {
-    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "SELECT time, size, isDicom, instanceId FROM Files WHERE path=?");
-    statement.BindString(0, path);
+    // Non-canonical path (e.g. trailing slash in the configuration):
+    // Its files are indexed below another directory, so that
+    // "TouchDirectory()" would not find them
+    isStable = false;
+  }
 
-    if (statement.Step())
+#if defined(_WIN32)
+  if (path.find('\\') != std::string::npos)
+  {
+    isStable = false;  // Same as above, as only the slash is a separator
+  }
+#endif
+
+  std::set<std::string> names;
+
+  for (std::list<std::string>::const_iterator it = subdirectories.begin();
+       it != subdirectories.end(); ++it)
+  {
+    std::string parent, name;
+    if (SplitPath(parent, name, *it) &&
+        parent == path)
     {
-      if (time == static_cast<std::time_t>(statement.ColumnInt64(0)) &&
-          size == static_cast<uintmax_t>(statement.ColumnInt64(1)))
-      {
-        if (statement.ColumnBool(2))
-        {
-          result = FileStatus_AlreadyStored;
-        }
-        else
-        {
-          result = FileStatus_NotDicom;
-        }
-      }
-      else
-      {
-        result = FileStatus_Modified;
-        oldInstanceId = statement.ColumnString(3);
-      }
+      GetDirectory(*it);
+      names.insert(name);
     }
     else
     {
-      result = FileStatus_New;
+      // "LookupDirectory()" would not give back this subdirectory
+      isStable = false;
     }
   }
 
-  transaction.Commit();
+  {
+    // The subdirectories that have disappeared must be listed if
+    // they are created again, whatever their modification time
+    std::list<int64_t> removed;
 
-  return result;
-}
-  
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "SELECT id, name FROM Directories WHERE parent=? AND time IS NOT NULL");
+      statement.BindInt64(0, directory);
 
-bool IndexerDatabase::RemoveFile(const std::string& path)
-{
-  boost::mutex::scoped_lock lock(mutex_);
-    
-  Orthanc::SQLite::Transaction transaction(db_);
-  transaction.Begin();
+      while (statement.Step())
+      {
+        if (names.find(statement.ColumnString(1)) == names.end())
+        {
+          removed.push_back(statement.ColumnInt64(0));
+        }
+      }
+    }
 
-  std::string instanceId;
+    for (std::list<int64_t>::const_iterator it = removed.begin(); it != removed.end(); ++it)
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "UPDATE Directories SET time=NULL WHERE id=?");
+      statement.BindInt64(0, *it);
+      statement.Run();
+    }
+  }
 
   {
     Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "SELECT instanceId FROM Files WHERE path=?");
-    statement.BindString(0, path);
-      
-    if (statement.Step())
+                                         "UPDATE Directories SET time=? WHERE id=?");
+    if (isStable)
     {
-      instanceId = statement.ColumnString(0);
+      statement.BindInt64(0, time);
     }
     else
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+      statement.BindNull(0);
     }
+
+    statement.BindInt64(1, directory);
+    statement.Run();
   }
 
-  bool isLastInstance;
-    
+  CommitBatchIfFull();
+}
+
+
+void IndexerDatabase::TouchDirectory(const std::string& path)
+{
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseTouchDirectory);
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  int64_t directory;
+
   {
-    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "SELECT COUNT(*) FROM Files WHERE instanceId=?");
-    statement.BindString(0, instanceId);
-      
-    if (statement.Step())
+    boost::shared_lock<boost::shared_mutex> directoriesLock(directoriesMutex_);
+
+    std::unordered_map<std::string, int64_t>::const_iterator found = directoryIds_.find(path);
+    if (found == directoryIds_.end())
     {
-      int64_t count = statement.ColumnInt64(0);
-      if (count == 0)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }
-      else
-      {
-        isLastInstance = (count == 1);
-      }
+      return;  // No indexed file
     }
     else
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      directory = found->second;
     }
   }
-    
+
+  OpenBatch();
+
   {
     Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "DELETE FROM Files WHERE path=?");
-    statement.BindString(0, path);
+                                         "UPDATE Files SET generation=? WHERE directory=?");
+    statement.BindInt64(0, generation_);
+    statement.BindInt64(1, directory);
     statement.Run();
   }
-    
-  transaction.Commit();
-  return isLastInstance;
-}
-
 
-void IndexerDatabase::AddDicomInstance(const std::string& path,
-                                       const std::time_t time,
-                                       const uintmax_t size,
-                                       const std::string& instanceId)
-{
-  boost::mutex::scoped_lock lock(mutex_);
-  AddFileInternal(path, time, size, true, instanceId);
-}               
+  CommitBatchIfFull();
+}
 
 
-void IndexerDatabase::AddNonDicomFile(const std::string& path,
-                                      const std::time_t time,
-                                      const uintmax_t size)
+void IndexerDatabase::RemoveFiles(std::set<std::string>& orphanInstances,
+                                  const std::list<std::string>& paths)
 {
   boost::mutex::scoped_lock lock(mutex_);
-  AddFileInternal(path, time, size, false, "");
-}
 
+  CommitBatch();
 
-void IndexerDatabase::Apply(IFileVisitor& visitor)
-{
-  boost::mutex::scoped_lock lock(mutex_);
-    
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
 
-  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                       "SELECT path, isDicom, instanceId FROM Files");
+  std::set<std::string> instances;
+  std::list<std::pair<std::string, std::string> > removed;  // (instanceId, path)
 
-  while (statement.Step())
+  for (std::list<std::string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+  {
+    int64_t directory;
+    std::string name;
+    if (!LookupKey(directory, name, *it))
+    {
+      continue;  // Not indexed
+    }
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "SELECT instanceId FROM Files WHERE directory=? AND name=?");
+      statement.BindInt64(0, directory);
+      statement.BindString(1, name);
+
+      if (!statement.Step())
+      {
+        continue;  // Already removed
+      }
+
+      const std::string instanceId = ColumnInstanceId(statement, 0);
+      if (!instanceId.empty())
+      {
+        instances.insert(instanceId);
+        removed.push_back(std::make_pair(instanceId, *it));
+      }
+    }
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "DELETE FROM Files WHERE directory=? AND name=?");
+      statement.BindInt64(0, directory);
+      statement.BindString(1, name);
+      statement.Run();
+    }
+  }
+
+  // Once all the files are removed, look for the instances without copy
+  for (std::set<std::string>::const_iterator it = instances.begin(); it != instances.end(); ++it)
   {
-    visitor.VisitInstance(statement.ColumnString(0), statement.ColumnBool(1), statement.ColumnString(2));
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT COUNT(*) FROM Files WHERE instanceId=?");
+    BindInstanceId(statement, 0, *it);
+
+    if (statement.Step() &&
+        statement.ColumnInt64(0) == 0)
+    {
+      orphanInstances.insert(*it);
+    }
   }
-        
+
   transaction.Commit();
+
+  for (std::list<std::pair<std::string, std::string> >::const_iterator
+         it = removed.begin(); it != removed.end(); ++it)
+  {
+    InvalidateCachedPath(it->first, it->second);
+  }
 }
 
 
 bool IndexerDatabase::CountTimesAttached(int64_t &t,
                                         const std::string& instanceId)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  ReadConnection connection(*this, false);
     
-  Orthanc::SQLite::Transaction transaction(db_);
+  Orthanc::SQLite::Transaction transaction(connection.GetConnection());
   transaction.Begin();
 
   {
-    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
                                          "SELECT COUNT(*) FROM Attachments WHERE instanceId=?");
-    statement.BindString(0, instanceId);
+    BindInstanceId(statement, 0, instanceId);
 
     if (!statement.Step())
     {
@@ -262,7 +1430,13 @@ bool IndexerDatabase::CountTimesAttached(int64_t &t,
 bool IndexerDatabase::AddAttachment(const std::string& uuid,
                                     const std::string& instanceId)
 {
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseAddAttachment);
+
   boost::mutex::scoped_lock lock(mutex_);
+
+  // Once Orthanc has stored the attachment, it cannot be registered
+  // again, so it must be durable immediately, together with its file
+  CommitBatch();
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -270,7 +1444,7 @@ bool IndexerDatabase::AddAttachment(const std::string& uuid,
   {
     Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
                                          "SELECT COUNT(*) FROM Files WHERE instanceId=?");
-    statement.BindString(0, instanceId);
+    BindInstanceId(statement, 0, instanceId);
       
     if (!statement.Step() ||
         statement.ColumnInt64(0) == 0)
@@ -283,7 +1457,7 @@ bool IndexerDatabase::AddAttachment(const std::string& uuid,
     Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
                                          "INSERT INTO Attachments VALUES(?, ?)");
     statement.BindString(0, uuid);
-    statement.BindString(1, instanceId);
+    BindInstanceId(statement, 1, instanceId);
     statement.Run();
   }
   
@@ -295,22 +1469,30 @@ bool IndexerDatabase::AddAttachment(const std::string& uuid,
 bool IndexerDatabase::LookupAttachment(std::string& path,
                                        const std::string& uuid)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseLookupAttachment);
+
+  uint64_t version;
+  if (LookupCache(path, version, uuid))
+  {
+    return true;
+  }
+
+  ReadConnection connection(*this, false);
     
-  Orthanc::SQLite::Transaction transaction(db_);
+  Orthanc::SQLite::Transaction transaction(connection.GetConnection());
   transaction.Begin();
 
   bool found = true;
   std::string instanceId;
     
   {
-    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
                                          "SELECT instanceId FROM Attachments WHERE uuid=?");
     statement.BindString(0, uuid);
       
     if (statement.Step())
     {
-      instanceId = statement.ColumnString(0);
+      instanceId = ColumnInstanceId(statement, 0);
     }
     else
     {
@@ -320,13 +1502,13 @@ bool IndexerDatabase::LookupAttachment(std::string& path,
 
   if (found)
   {
-    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "SELECT path FROM Files WHERE instanceId=?");
-    statement.BindString(0, instanceId);
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                         "SELECT directory, name FROM Files WHERE instanceId=?");
+    BindInstanceId(statement, 0, instanceId);
 
     if (statement.Step())
     {
-      path = statement.ColumnString(0);
+      path = GetPath(statement.ColumnInt64(0), statement.ColumnString(1));
     }
     else
     {
@@ -335,13 +1517,25 @@ bool IndexerDatabase::LookupAttachment(std::string& path,
   }
 
   transaction.Commit();
+
+  if (found)
+  {
+    StoreCache(uuid, instanceId, path, version);
+  }
+
   return found;
 }
 
 
 void IndexerDatabase::RemoveAttachment(const std::string& uuid)
 {
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_DatabaseRemoveAttachment);
+
   boost::mutex::scoped_lock lock(mutex_);
+
+  // The removal must be visible to the readers before "StorageRemove"
+  // counts the remaining attachments of the file
+  CommitBatch();
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -354,6 +1548,104 @@ void IndexerDatabase::RemoveAttachment(const std::string& uuid)
   }
     
   transaction.Commit();
+
+  InvalidateCachedAttachment(uuid);
+}
+
+
+void IndexerDatabase::AppendNotification(const std::string& filepath,
+                                         bool added)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // The notification must be durable immediately
+  CommitBatch();
+    
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT added FROM Notifications WHERE filepath=? ORDER BY sequence DESC LIMIT 1");
+    statement.BindString(0, filepath);
+
+    if (statement.Step() &&
+        statement.ColumnBool(0) == added)
+    {
+      transaction.Commit();
+      return;  // Same notification already pending
+    }
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT INTO Notifications(filepath, added) VALUES(?, ?)");
+    statement.BindString(0, filepath);
+    statement.BindInt64(1, added);
+    statement.Run();
+  }
+
+  transaction.Commit();
+}
+
+
+void IndexerDatabase::GetNotifications(std::list<Notification>& target,
+                                       unsigned int limit)
+{
+  target.clear();
+
+  ReadConnection connection(*this, false);
+
+  Orthanc::SQLite::Transaction transaction(connection.GetConnection());
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                         "SELECT sequence, filepath, added FROM Notifications ORDER BY sequence LIMIT ?");
+    statement.BindInt64(0, limit);
+
+    while (statement.Step())
+    {
+      Notification notification;
+      notification.sequence_ = statement.ColumnInt64(0);
+      notification.filepath_ = statement.ColumnString(1);
+      notification.added_ = statement.ColumnBool(2);
+      target.push_back(notification);
+    }
+  }
+
+  transaction.Commit();
+}
+
+
+unsigned int IndexerDatabase::CountNotifications()
+{
+  ReadConnection connection(*this, false);
+
+  Orthanc::SQLite::Statement statement(connection.GetConnection(), SQLITE_FROM_HERE,
+                                       "SELECT COUNT(*) FROM Notifications");
+  statement.Step();
+  return static_cast<unsigned int>(statement.ColumnInt64(0));
+}
+
+
+void IndexerDatabase::RemoveNotification(int64_t sequence)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  CommitBatch();
+    
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "DELETE FROM Notifications WHERE sequence=?");
+    statement.BindInt64(0, sequence);
+    statement.Run();
+  }
+
+  transaction.Commit();
 }
 
 
@@ -19,11 +19,24 @@
 
 #pragma once
 
+#include "FileMetadata.h"
+
 #include <OrthancFramework.h>  // To have ORTHANC_ENABLE_SQLITE defined
 #include <SQLite/Connection.h>
+#include <SQLite/Transaction.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include <list>
+#include <memory>
+#include <set>
+#include <stack>
+#include <unordered_map>
+#include <vector>
 
 
 class IndexerDatabase : public boost::noncopyable
@@ -37,6 +50,13 @@ public:
     FileStatus_NotDicom
   };
 
+  struct Notification
+  {
+    int64_t      sequence_;
+    std::string  filepath_;
+    bool         added_;
+  };
+
   class IFileVisitor : public boost::noncopyable
   {
   public:
@@ -51,46 +71,226 @@ public:
 
 
 private:
+  /**
+   * Read-only access to the database, for the lookups that are done
+   * by the storage area and the scanner. It uses one connection from
+   * the pool of readers, so that the lookups run concurrently with
+   * the writer thanks to the WAL mode of SQLite. If the pool is empty
+   * (in-memory database), it falls back to the writer connection.
+   **/
+  class ReadConnection : public boost::noncopyable
+  {
+  private:
+    IndexerDatabase&                            database_;
+    std::unique_ptr<boost::mutex::scoped_lock>  writerLock_;
+    Orthanc::SQLite::Connection*                connection_;
+
+  public:
+    // If "writer" is "true", the writer connection is used, which
+    // gives access to the uncommitted rows of the write batch
+    ReadConnection(IndexerDatabase& database,
+                   bool writer);
+
+    ~ReadConnection();
+
+    Orthanc::SQLite::Connection& GetConnection()
+    {
+      return *connection_;
+    }
+  };
+
   boost::mutex                 mutex_;
-  Orthanc::SQLite::Connection  db_;
+  Orthanc::SQLite::Connection  db_;   // Single writer connection, protected by "mutex_"
+
+  boost::mutex                               readersMutex_;
+  boost::condition_variable                  readersAvailable_;
+  std::vector<Orthanc::SQLite::Connection*>  readers_;
+  std::stack<Orthanc::SQLite::Connection*>   availableReaders_;
+
+  // Write batch of the scanner, protected by "mutex_"
+  std::unique_ptr<Orthanc::SQLite::Transaction>  batch_;
+  unsigned int                                   batchSize_;
+  boost::posix_time::ptime                       batchStart_;
+  unsigned int                                   maxBatchSize_;
+  unsigned int                                   maxBatchMilliseconds_;
+
+  // Generation of the current scan, protected by "mutex_"
+  int64_t                                        generation_;
+
+  // In-memory copy of the "Directories" table (full path <-> id),
+  // protected by "directoriesMutex_". The directories are only added
+  // by the writer connection, and are never removed.
+  boost::shared_mutex                       directoriesMutex_;
+  std::unordered_map<std::string, int64_t>  directoryIds_;
+  std::unordered_map<int64_t, std::string>  directoryPaths_;
+
+  // Optional in-memory mirror of the "LookupAttachment()" results,
+  // protected by "cacheMutex_". The writers invalidate the entries
+  // after their commit, and increment "cacheVersion_", so that a
+  // reader that started its SQL query before cannot store stale data.
+  typedef std::unordered_map<std::string, std::string>  Dictionary;
+
+  boost::shared_mutex  cacheMutex_;
+  size_t               cacheBudget_;    // In bytes, 0 if disabled
+  size_t               cacheSize_;
+  uint64_t             cacheVersion_;
+  Dictionary           cachedAttachments_;   // uuid -> instanceId
+  Dictionary           cachedPaths_;         // instanceId -> path
+
+  // Paths with an uncommitted row, protected by "pendingMutex_"
+  boost::mutex                 pendingMutex_;
+  std::set<std::string>        pendingPaths_;
   
-  void Initialize();
+  void Initialize(bool exclusive);
+
+  void UpgradeFromVersion1();
+
+  void LoadDirectories();
+
+  // Creates the directory and its parents if needed, "mutex_" must be locked
+  int64_t GetDirectory(const std::string& path);
+
+  // Returns "false" iff. the directory of this path is not indexed
+  bool LookupKey(int64_t& directory,
+                 std::string& name,
+                 const std::string& path);
+
+  std::string GetPath(int64_t directory,
+                      const std::string& name);
+
+  void OpenBatch();
+
+  void CommitBatch();
+
+  void CommitBatchIfFull();
+
+  bool LookupCache(std::string& path,
+                   uint64_t& version,
+                   const std::string& uuid);
+
+  void StoreCache(const std::string& uuid,
+                  const std::string& instanceId,
+                  const std::string& path,
+                  uint64_t version);
+
+  void InvalidateCachedAttachment(const std::string& uuid);
+
+  void InvalidateCachedPath(const std::string& instanceId,
+                            const std::string& path);
 
   void AddFileInternal(const std::string& path,
-                       const std::time_t time,
-                       const uintmax_t size,
+                       const FileMetadata& metadata,
                        bool isDicom,
                        const std::string& instanceId);
 
 public:
-  void Open(const std::string& path);
+  IndexerDatabase();
+
+  ~IndexerDatabase();
+
+  // "readersCount" is the number of read-only connections that are
+  // opened next to the writer connection
+  void Open(const std::string& path,
+            unsigned int readersCount);
 
   void OpenInMemory();  // For unit tests
 
+  /**
+   * The files that are added by "AddDicomInstance()" and
+   * "AddNonDicomFile()" are grouped into a single transaction, that
+   * is committed after "maxSize" files or "maxMilliseconds", or by
+   * "FlushWriteBatch()". Losing an uncommitted batch only causes the
+   * files to be examined again at the next scan. The attachments and
+   * the removals are always committed immediately, together with the
+   * pending batch. A "maxSize" of 1 disables batching (the default).
+   **/
+  void SetWriteBatch(unsigned int maxSize,
+                     unsigned int maxMilliseconds);
+
+  // Commits the pending batch, if any
+  void FlushWriteBatch();
+
+  // Mirrors the attachments in memory, so that "LookupAttachment()"
+  // usually does not access SQLite. The mirror is loaded from the
+  // database, and is kept coherent by the methods of this class. It
+  // stops growing once it reaches "maxBytes" (approximately).
+  void EnableCache(size_t maxBytes);
+
+  size_t GetCacheSize();
+
   bool CountTimesAttached(int64_t &t,
                           const std::string &instanceId);
 
+  // The sub-second part of the modification time and the inode are
+  // only compared if they are known on both sides, as they were not
+  // recorded by the previous versions of the plugin
   FileStatus LookupFile(std::string& oldInstanceId,
                         const std::string& path,
-                        const std::time_t time,
-                        const uintmax_t size);
+                        const FileMetadata& metadata);
 
   // Returns "true" iff. this file was the last copy of some DICOM instance
   bool RemoveFile(const std::string& path);
 
+  // Same as above, also giving back the instance ID of the removed file
+  bool RemoveFile(std::string& instanceId,
+                  const std::string& path);
+
   void AddDicomInstance(const std::string& path,
-                        const std::time_t time,
-                        const uintmax_t size,
+                        const FileMetadata& metadata,
                         const std::string& instanceId);
   
   void AddNonDicomFile(const std::string& path,
-                       const std::time_t time,
-                       const uintmax_t size);
+                       const FileMetadata& metadata);
 
   // Warning: The visitor is invoked in mutual exclusion, so it
   // shouldn't do lengthy operations
   void Apply(IFileVisitor& visitor);
 
+  /**
+   * Mark-and-sweep detection of the deleted files. Each scan starts a
+   * new generation, that is stamped on the files that are added or
+   * touched during the scan. Once the scan is over, the files with an
+   * older generation were not seen by the scan.
+   **/
+  int64_t StartScan();
+
+  // Stamps the current generation on a file that has not changed
+  // since the last scan (batched as the insertions), and records the
+  // metadata that the previous versions of the plugin did not store
+  void TouchFile(const std::string& path,
+                 const FileMetadata& metadata);
+
+  // Visits the files that were not seen since the given generation,
+  // using a read-only connection
+  void ApplyStale(IFileVisitor& visitor,
+                  int64_t generation);
+
+  /**
+   * Pruning of the directories whose entries have not changed since
+   * the previous scan. "LookupDirectory()" returns "true" iff. the
+   * directory was fully listed with the same modification time, in
+   * which case its known subdirectories are given back. Once a
+   * directory is listed, "StoreDirectory()" records its modification
+   * time (if "isStable") and its subdirectories (batched as the
+   * insertions). "TouchDirectory()" stamps the current generation on
+   * all the files of a directory that was not listed.
+   **/
+  bool LookupDirectory(std::list<std::string>& subdirectories,
+                       const std::string& path,
+                       const std::time_t time);
+
+  void StoreDirectory(const std::string& path,
+                      const std::time_t time,
+                      bool isStable,
+                      const std::list<std::string>& subdirectories);
+
+  void TouchDirectory(const std::string& path);
+
+  // Removes a set of files in a single transaction, giving back the
+  // DICOM instances that have lost their last copy
+  void RemoveFiles(std::set<std::string>& orphanInstances,
+                   const std::list<std::string>& paths);
+
   // Returns "false" iff. this instance has not been previously
   // registerded using "AddDicomInstance()", which indicates the
   // import of an external DICOM file
@@ -102,6 +302,21 @@ public:
 
   void RemoveAttachment(const std::string& uuid);
 
+  // Durable outbox of the notifications to caMicroscope. A
+  // notification that is identical to the last pending one for the
+  // same file is not appended twice.
+  void AppendNotification(const std::string& filepath,
+                          bool added);
+
+  // Gives back the oldest pending notifications, by sequence number
+  void GetNotifications(std::list<Notification>& target,
+                        unsigned int limit);
+
+  void RemoveNotification(int64_t sequence);
+
+  // Number of pending notifications
+  unsigned int CountNotifications();
+
   unsigned int GetFilesCount();  // For unit testing
 
   unsigned int GetAttachmentsCount();  // For unit testing
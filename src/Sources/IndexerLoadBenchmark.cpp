@@ -0,0 +1,749 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+/**
+ * Load test of the storage area of the plugin. The plugin is
+ * initialized against the fake Orthanc context, indexes a synthetic
+ * corpus, then its storage callbacks are invoked concurrently by
+ * several threads that replay a mix of C-STORE (new DICOM instances),
+ * WADO (whole and range reads) and deletions. The mix can be recorded
+ * to a file, and replayed later.
+ **/
+
+
+#include "FakeOrthancContext.h"
+#include "SyntheticCorpus.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+extern "C"
+{
+  ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext* context);
+
+  ORTHANC_PLUGINS_API void OrthancPluginFinalize();
+}
+
+
+enum OperationType
+{
+  OperationType_Store = 0,
+  OperationType_ReadWhole = 1,
+  OperationType_ReadRange = 2,
+  OperationType_Remove = 3
+};
+
+static const size_t OPERATION_TYPES_COUNT = 4;
+
+// Name of the operations in the traces, and of the invoked callbacks
+static const char* const OPERATION_NAMES[OPERATION_TYPES_COUNT] = {
+  "store", "read-whole", "read-range", "remove"
+};
+
+static const char* const CALLBACK_NAMES[OPERATION_TYPES_COUNT] = {
+  "StorageCreate", "StorageReadWhole", "StorageReadRange", "StorageRemove"
+};
+
+
+struct Operation
+{
+  OperationType  type_;
+  uint64_t       size_;  // Size of the new instance, or of the range
+};
+
+
+static void ReadTrace(std::vector<Operation>& target,
+                      const std::string& path)
+{
+  std::ifstream f(path.c_str());
+  if (!f.good())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Cannot read trace: " + path);
+  }
+
+  std::string line;
+  while (std::getline(f, line))
+  {
+    std::vector<std::string> tokens;
+    Orthanc::Toolbox::TokenizeString(tokens, Orthanc::Toolbox::StripSpaces(line), ' ');
+
+    if (tokens.empty() ||
+        tokens[0].empty() ||
+        tokens[0][0] == '#')
+    {
+      continue;
+    }
+
+    Operation operation;
+    operation.size_ = 0;
+
+    bool found = false;
+    for (size_t i = 0; i < OPERATION_TYPES_COUNT; i++)
+    {
+      if (tokens[0] == OPERATION_NAMES[i])
+      {
+        operation.type_ = static_cast<OperationType>(i);
+        found = true;
+      }
+    }
+
+    if (!found ||
+        tokens.size() > 2)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad line in the trace: " + line);
+    }
+
+    if (tokens.size() == 2)
+    {
+      try
+      {
+        operation.size_ = boost::lexical_cast<uint64_t>(tokens[1]);
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad line in the trace: " + line);
+      }
+    }
+
+    target.push_back(operation);
+  }
+}
+
+
+static void WriteTrace(const std::string& path,
+                       const std::vector<Operation>& operations)
+{
+  std::ofstream f(path.c_str());
+
+  f << "# Operations on the storage area of the Indexer plugin: \"store <size>\", "
+    << "\"read-whole\", \"read-range <size>\" and \"remove\"" << std::endl;
+
+  for (size_t i = 0; i < operations.size(); i++)
+  {
+    f << OPERATION_NAMES[operations[i].type_];
+
+    if (operations[i].type_ == OperationType_Store ||
+        operations[i].type_ == OperationType_ReadRange)
+    {
+      f << " " << operations[i].size_;
+    }
+
+    f << std::endl;
+  }
+}
+
+
+// Linear congruential generator, so that the runs are reproducible
+static size_t NextRandom(uint64_t& seed,
+                         size_t modulo)
+{
+  seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+  return static_cast<size_t>((seed >> 33) % modulo);
+}
+
+
+static void GenerateMix(std::vector<Operation>& target,
+                        size_t count,
+                        const unsigned int weights[OPERATION_TYPES_COUNT],
+                        uint64_t storeSize,
+                        uint64_t rangeSize)
+{
+  unsigned int total = 0;
+  for (size_t i = 0; i < OPERATION_TYPES_COUNT; i++)
+  {
+    total += weights[i];
+  }
+
+  if (total == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "Empty mix of operations");
+  }
+
+  uint64_t seed = 42;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    size_t value = NextRandom(seed, total);
+
+    Operation operation;
+    operation.type_ = OperationType_Store;
+
+    for (size_t j = 0; j < OPERATION_TYPES_COUNT; j++)
+    {
+      if (value < weights[j])
+      {
+        operation.type_ = static_cast<OperationType>(j);
+        break;
+      }
+      else
+      {
+        value -= weights[j];
+      }
+    }
+
+    operation.size_ = (operation.type_ == OperationType_Store ? storeSize :
+                       operation.type_ == OperationType_ReadRange ? rangeSize : 0);
+    target.push_back(operation);
+  }
+}
+
+
+/**
+ * Attachments known to the plugin. The indexed ones are only read,
+ * whereas the ones created by the "store" operations can be removed.
+ **/
+class AttachmentsPool : public boost::noncopyable
+{
+private:
+  struct Attachment
+  {
+    std::string  uuid_;
+    uint64_t     size_;
+  };
+
+  boost::shared_mutex      mutex_;
+  std::vector<Attachment>  indexed_;
+  std::vector<Attachment>  stored_;
+
+public:
+  void AddIndexed(const std::string& uuid,
+                  uint64_t size)
+  {
+    Attachment attachment;
+    attachment.uuid_ = uuid;
+    attachment.size_ = size;
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    indexed_.push_back(attachment);
+  }
+
+  void AddStored(const std::string& uuid,
+                 uint64_t size)
+  {
+    Attachment attachment;
+    attachment.uuid_ = uuid;
+    attachment.size_ = size;
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    stored_.push_back(attachment);
+  }
+
+  bool PickRandom(std::string& uuid,
+                  uint64_t& size,
+                  uint64_t& seed)
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    const size_t count = indexed_.size() + stored_.size();
+    if (count == 0)
+    {
+      return false;
+    }
+
+    const size_t index = NextRandom(seed, count);
+    const Attachment& attachment = (index < indexed_.size() ? indexed_[index] : stored_[index - indexed_.size()]);
+    uuid = attachment.uuid_;
+    size = attachment.size_;
+    return true;
+  }
+
+  bool RemoveRandomStored(std::string& uuid,
+                          uint64_t& seed)
+  {
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+    if (stored_.empty())
+    {
+      return false;
+    }
+
+    const size_t index = NextRandom(seed, stored_.size());
+    uuid = stored_[index].uuid_;
+    stored_[index] = stored_.back();
+    stored_.pop_back();
+    return true;
+  }
+};
+
+
+class LoadGenerator : public boost::noncopyable
+{
+private:
+  typedef std::chrono::steady_clock  Clock;
+
+  struct Statistics
+  {
+    std::vector<double>  latencies_;  // In microseconds
+    unsigned int         errors_;
+    unsigned int         skipped_;
+
+    Statistics() :
+      errors_(0),
+      skipped_(0)
+    {
+    }
+  };
+
+  const std::vector<Operation>&  operations_;
+  AttachmentsPool&               pool_;
+  OrthancPluginStorageCreate     create_;
+  OrthancPluginStorageReadWhole  readWhole_;
+  OrthancPluginStorageReadRange  readRange_;
+  OrthancPluginStorageRemove     remove_;
+  std::atomic<size_t>            next_;
+  std::atomic<unsigned int>      countStored_;
+  boost::mutex                   mutex_;
+  Statistics                     statistics_[OPERATION_TYPES_COUNT];
+
+  // Returns "false" if there was nothing to do
+  bool Execute(double& latency,
+               OrthancPluginErrorCode& code,
+               const Operation& operation,
+               uint64_t& seed,
+               std::vector<char>& buffer)
+  {
+    std::string uuid;
+    uint64_t size;
+
+    switch (operation.type_)
+    {
+      case OperationType_Store:
+      {
+        // Instance received by the DICOM server of Orthanc, that is
+        // not indexed yet
+        const std::string suffix = boost::lexical_cast<std::string>(countStored_++);
+        const std::string dicom = SyntheticCorpus::CreateInstance(
+          "LOAD", "1.2.826.0.1.3680043.10.1047.9", "1.2.826.0.1.3680043.10.1047.9." + suffix,
+          "1.2.826.0.1.3680043.10.1047.9." + suffix + ".1", operation.size_);
+        uuid = Orthanc::Toolbox::GenerateUuid();
+
+        const Clock::time_point start = Clock::now();
+        code = create_(uuid.c_str(), dicom.c_str(), dicom.size(), OrthancPluginContentType_Dicom);
+        latency = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+        if (code == OrthancPluginErrorCode_Success)
+        {
+          pool_.AddStored(uuid, dicom.size());
+        }
+
+        return true;
+      }
+
+      case OperationType_ReadWhole:
+      {
+        if (!pool_.PickRandom(uuid, size, seed))
+        {
+          return false;
+        }
+
+        OrthancPluginMemoryBuffer64 target;
+        target.data = NULL;
+        target.size = 0;
+
+        const Clock::time_point start = Clock::now();
+        code = readWhole_(&target, uuid.c_str(), OrthancPluginContentType_Dicom);
+        latency = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+        if (code == OrthancPluginErrorCode_Success)
+        {
+          free(target.data);
+        }
+
+        return true;
+      }
+
+      case OperationType_ReadRange:
+      {
+        if (!pool_.PickRandom(uuid, size, seed))
+        {
+          return false;
+        }
+
+        // The buffer is allocated by Orthanc before calling the plugin
+        const uint64_t length = std::min(operation.size_, size);
+        const uint64_t start = (length == size ? 0 : NextRandom(seed, size - length));
+
+        buffer.resize(length + 1);
+
+        OrthancPluginMemoryBuffer64 target;
+        target.data = &buffer[0];
+        target.size = length;
+
+        const Clock::time_point before = Clock::now();
+        code = readRange_(&target, uuid.c_str(), OrthancPluginContentType_Dicom, start);
+        latency = std::chrono::duration<double, std::micro>(Clock::now() - before).count();
+
+        return true;
+      }
+
+      case OperationType_Remove:
+      {
+        if (!pool_.RemoveRandomStored(uuid, seed))
+        {
+          return false;
+        }
+
+        const Clock::time_point start = Clock::now();
+        code = remove_(uuid.c_str(), OrthancPluginContentType_Dicom);
+        latency = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+        return true;
+      }
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+  void Worker(unsigned int thread)
+  {
+    Statistics statistics[OPERATION_TYPES_COUNT];
+    std::vector<char> buffer;
+    uint64_t seed = thread;
+
+    for (;;)
+    {
+      const size_t index = next_++;
+      if (index >= operations_.size())
+      {
+        break;
+      }
+
+      const Operation& operation = operations_[index];
+      Statistics& target = statistics[operation.type_];
+
+      double latency;
+      OrthancPluginErrorCode code;
+
+      if (!Execute(latency, code, operation, seed, buffer))
+      {
+        target.skipped_++;
+      }
+      else if (code == OrthancPluginErrorCode_Success)
+      {
+        target.latencies_.push_back(latency);
+      }
+      else
+      {
+        target.errors_++;
+      }
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (size_t i = 0; i < OPERATION_TYPES_COUNT; i++)
+    {
+      statistics_[i].latencies_.insert(statistics_[i].latencies_.end(),
+                                       statistics[i].latencies_.begin(), statistics[i].latencies_.end());
+      statistics_[i].errors_ += statistics[i].errors_;
+      statistics_[i].skipped_ += statistics[i].skipped_;
+    }
+  }
+
+  static double GetPercentile(const std::vector<double>& sorted,
+                              double percentile)
+  {
+    if (sorted.empty())
+    {
+      return 0;
+    }
+    else
+    {
+      size_t index = static_cast<size_t>(percentile / 100.0 * static_cast<double>(sorted.size()));
+      return sorted[std::min(index, sorted.size() - 1)];
+    }
+  }
+
+public:
+  LoadGenerator(const std::vector<Operation>& operations,
+                AttachmentsPool& pool) :
+    operations_(operations),
+    pool_(pool),
+    next_(0),
+    countStored_(0)
+  {
+    if (!FakeOrthancContext::LookupStorageArea(create_, readWhole_, readRange_, remove_))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls, "The plugin has no storage area");
+    }
+  }
+
+  void Run(unsigned int threads)
+  {
+    const Clock::time_point start = Clock::now();
+
+    boost::thread_group group;
+    for (unsigned int i = 0; i < threads; i++)
+    {
+      group.create_thread(boost::bind(&LoadGenerator::Worker, this, i));
+    }
+
+    group.join_all();
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("\n%-18s %10s %8s %8s %12s %12s %12s\n", "Callback", "Calls", "Errors", "Skipped",
+           "p50 (us)", "p99 (us)", "Max (us)");
+
+    for (size_t i = 0; i < OPERATION_TYPES_COUNT; i++)
+    {
+      std::vector<double>& latencies = statistics_[i].latencies_;
+      std::sort(latencies.begin(), latencies.end());
+
+      printf("%-18s %10u %8u %8u %12.1f %12.1f %12.1f\n", CALLBACK_NAMES[i],
+             static_cast<unsigned int>(latencies.size()), statistics_[i].errors_, statistics_[i].skipped_,
+             GetPercentile(latencies, 50), GetPercentile(latencies, 99),
+             latencies.empty() ? 0.0 : latencies.back());
+    }
+
+    printf("\n%u operations by %u threads in %.2f seconds (%.0f operations/s)\n",
+           static_cast<unsigned int>(operations_.size()), threads, seconds,
+           static_cast<double>(operations_.size()) / seconds);
+  }
+};
+
+
+static bool ParseOption(std::string& value,
+                        const std::string& argument,
+                        const std::string& name)
+{
+  const std::string prefix = "--" + name + "=";
+  if (argument.compare(0, prefix.size(), prefix) == 0)
+  {
+    value = argument.substr(prefix.size());
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  Orthanc::Logging::Initialize();
+
+  std::string folder = boost::filesystem::temp_directory_path().string();
+  std::string trace;
+  std::string record;
+  unsigned int threads = 8;
+  size_t operationsCount = 10000;
+  unsigned int weights[OPERATION_TYPES_COUNT] = { 5, 5, 85, 5 };
+  uint64_t storeSize = 256 * 1024;
+  uint64_t rangeSize = 64 * 1024;
+  unsigned int cacheSize = 0;
+  unsigned int readCacheSize = 0;
+  SyntheticCorpus::Parameters parameters;
+
+  try
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      const std::string argument = argv[i];
+      std::string value;
+
+      if (ParseOption(value, argument, "folder"))
+      {
+        folder = value;
+      }
+      else if (ParseOption(value, argument, "trace"))
+      {
+        trace = value;
+      }
+      else if (ParseOption(value, argument, "record"))
+      {
+        record = value;
+      }
+      else if (ParseOption(value, argument, "threads"))
+      {
+        threads = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "operations"))
+      {
+        operationsCount = boost::lexical_cast<size_t>(value);
+      }
+      else if (ParseOption(value, argument, "store"))
+      {
+        weights[OperationType_Store] = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "read-whole"))
+      {
+        weights[OperationType_ReadWhole] = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "read-range"))
+      {
+        weights[OperationType_ReadRange] = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "remove"))
+      {
+        weights[OperationType_Remove] = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "store-size"))
+      {
+        storeSize = boost::lexical_cast<uint64_t>(value);
+      }
+      else if (ParseOption(value, argument, "range-size"))
+      {
+        rangeSize = boost::lexical_cast<uint64_t>(value);
+      }
+      else if (ParseOption(value, argument, "cache-size"))
+      {
+        cacheSize = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "read-cache-size"))
+      {
+        readCacheSize = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "patients"))
+      {
+        parameters.patients_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "instances"))
+      {
+        parameters.instancesPerSeries_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (ParseOption(value, argument, "pixel-size"))
+      {
+        parameters.pixelDataSize_ = boost::lexical_cast<size_t>(value);
+      }
+      else
+      {
+        fprintf(stderr, "Usage: %s [--folder=path] [--threads=N] [--cache-size=MB] [--read-cache-size=MB]\n"
+                "       [--trace=path | [--operations=N] [--store=weight] [--read-whole=weight]\n"
+                "                       [--read-range=weight] [--remove=weight]\n"
+                "                       [--store-size=bytes] [--range-size=bytes] [--record=path]]\n"
+                "       [--patients=N] [--instances=N] [--pixel-size=bytes]\n", argv[0]);
+        return -1;
+      }
+    }
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    fprintf(stderr, "Bad value in the command line\n");
+    return -1;
+  }
+
+  const std::string root = (boost::filesystem::path(folder) /
+                            boost::filesystem::unique_path("indexer-load-%%%%-%%%%-%%%%")).string();
+
+  int result = 0;
+
+  try
+  {
+    std::vector<Operation> operations;
+
+    if (trace.empty())
+    {
+      GenerateMix(operations, operationsCount, weights, storeSize, rangeSize);
+    }
+    else
+    {
+      ReadTrace(operations, trace);
+    }
+
+    if (!record.empty())
+    {
+      WriteTrace(record, operations);
+    }
+
+    printf("Generating the synthetic corpus in: %s\n", root.c_str());
+    boost::filesystem::create_directories(root);
+    boost::filesystem::create_directories(root + "/storage");
+    boost::filesystem::create_directories(root + "/index");
+
+    SyntheticCorpus corpus(root + "/corpus", parameters);
+
+    Json::Value configuration = Json::objectValue;
+    configuration["StorageDirectory"] = root + "/storage";
+    configuration["IndexDirectory"] = root + "/index";
+    configuration["Indexer"] = Json::objectValue;
+    configuration["Indexer"]["Enable"] = true;
+    configuration["Indexer"]["Folders"] = Json::arrayValue;
+    configuration["Indexer"]["Folders"].append(corpus.GetRoot());
+    configuration["Indexer"]["Interval"] = 3600;  // No rescan during the load
+    configuration["Indexer"]["CacheSize"] = cacheSize;
+    configuration["Indexer"]["ReadCacheSize"] = readCacheSize;
+    FakeOrthancContext::SetConfiguration(configuration);
+
+    if (OrthancPluginInitialize(FakeOrthancContext::GetContext()) != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_Plugin, "Cannot initialize the plugin");
+    }
+
+    // Index the corpus, through the scan thread of the plugin
+    printf("Indexing %u DICOM files\n", static_cast<unsigned int>(corpus.GetDicomFiles().size()));
+    FakeOrthancContext::SignalChange(OrthancPluginChangeType_OrthancStarted);
+
+    std::map<std::string, uint64_t> attachments;
+
+    for (;;)
+    {
+      FakeOrthancContext::ListAttachments(attachments);
+      if (attachments.size() >= corpus.GetDicomFiles().size())
+      {
+        break;
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+
+    AttachmentsPool pool;
+    for (std::map<std::string, uint64_t>::const_iterator it = attachments.begin(); it != attachments.end(); ++it)
+    {
+      pool.AddIndexed(it->first, it->second);
+    }
+
+    LoadGenerator generator(operations, pool);
+    generator.Run(threads);
+
+    FakeOrthancContext::SignalChange(OrthancPluginChangeType_OrthancStopped);
+    OrthancPluginFinalize();
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    fprintf(stderr, "Error: %s\n", e.What());
+    result = -1;
+  }
+
+  try
+  {
+    boost::filesystem::remove_all(root);
+  }
+  catch (...)
+  {
+  }
+
+  Orthanc::Logging::Finalize();
+
+  return result;
+}
@@ -0,0 +1,288 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "IndexerMetrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+
+
+namespace IndexerMetrics
+{
+  struct Descriptor
+  {
+    const char*  family_;
+    const char*  label_;   // Name and value of the label, if any
+    const char*  value_;
+    const char*  help_;    // Only read for the first metric of a family
+  };
+
+
+  // The metrics of the same family must be consecutive
+  static const Descriptor COUNTERS[Counter_Last + 1] = {
+    { "indexer_files_examined_total", "status", "new", "Files examined by the scans, by status in the database" },
+    { "indexer_files_examined_total", "status", "modified", NULL },
+    { "indexer_files_examined_total", "status", "already_stored", NULL },
+    { "indexer_files_examined_total", "status", "not_dicom", NULL },
+    { "indexer_files_identified_total", "result", "dicom", "New or modified files identified by the scans" },
+    { "indexer_files_identified_total", "result", "other", NULL },
+    { "indexer_files_uploaded_total", NULL, NULL, "DICOM files uploaded to Orthanc by the scans" },
+    { "indexer_files_upload_failures_total", NULL, NULL, "DICOM files that could not be uploaded to Orthanc" },
+    { "indexer_files_failures_total", NULL, NULL, "Files that could not be examined by the scans" },
+    { "indexer_scans_total", "result", "completed", "Scans of the indexed folders" },
+    { "indexer_scans_total", "result", "interrupted", NULL },
+    { "indexer_storage_bytes_total", "callback", "create", "Bytes written or read by the storage area" },
+    { "indexer_storage_bytes_total", "callback", "read_whole", NULL },
+    { "indexer_storage_bytes_total", "callback", "read_range", NULL },
+    { "indexer_storage_errors_total", "callback", "create", "Failed calls to the storage area" },
+    { "indexer_storage_errors_total", "callback", "read_whole", NULL },
+    { "indexer_storage_errors_total", "callback", "read_range", NULL },
+    { "indexer_storage_errors_total", "callback", "remove", NULL },
+    { "indexer_read_cache_total", "result", "hit", "Reads of ranges from the cache of memory-mapped files" },
+    { "indexer_read_cache_total", "result", "miss", NULL },
+    { "indexer_read_ahead_files_total", NULL, NULL, "Files loaded into the page cache ahead of the reads of a series" },
+    { "indexer_notifications_total", "result", "sent", "Deliveries of the notifications to caMicroscope" },
+    { "indexer_notifications_total", "result", "retried", NULL },
+    { "indexer_notifications_total", "result", "dropped", NULL }
+  };
+
+  static const Descriptor HISTOGRAMS[Histogram_Last + 1] = {
+    { "indexer_scan_duration_seconds", NULL, NULL, "Duration of the scans of the indexed folders" },
+    { "indexer_database_duration_seconds", "operation", "lookup_file", "Duration of the operations on the database" },
+    { "indexer_database_duration_seconds", "operation", "add_file", NULL },
+    { "indexer_database_duration_seconds", "operation", "touch_file", NULL },
+    { "indexer_database_duration_seconds", "operation", "remove_file", NULL },
+    { "indexer_database_duration_seconds", "operation", "lookup_directory", NULL },
+    { "indexer_database_duration_seconds", "operation", "store_directory", NULL },
+    { "indexer_database_duration_seconds", "operation", "touch_directory", NULL },
+    { "indexer_database_duration_seconds", "operation", "add_attachment", NULL },
+    { "indexer_database_duration_seconds", "operation", "lookup_attachment", NULL },
+    { "indexer_database_duration_seconds", "operation", "remove_attachment", NULL },
+    { "indexer_database_duration_seconds", "operation", "flush_write_batch", NULL },
+    { "indexer_storage_duration_seconds", "callback", "create", "Duration of the calls to the storage area" },
+    { "indexer_storage_duration_seconds", "callback", "read_whole", NULL },
+    { "indexer_storage_duration_seconds", "callback", "read_range", NULL },
+    { "indexer_storage_duration_seconds", "callback", "remove", NULL }
+  };
+
+
+  // Upper bounds of the buckets, in microseconds (1-2.5-5 series
+  // from 10us to 1000s). The last bucket is "+Inf".
+  static const uint64_t BUCKETS[] = {
+    10, 25, 50,
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000,
+    1000000000
+  };
+
+  static const size_t BUCKETS_COUNT = sizeof(BUCKETS) / sizeof(uint64_t) + 1;
+
+  static const size_t SHARDS_COUNT = 16;
+
+
+  struct HistogramValues
+  {
+    std::atomic<uint64_t>  buckets_[BUCKETS_COUNT];
+    std::atomic<uint64_t>  sum_;  // In microseconds
+  };
+
+
+  // The alignment keeps the shards of two threads on distinct cache lines
+  struct alignas(64) Shard
+  {
+    std::atomic<uint64_t>  counters_[Counter_Last + 1];
+    HistogramValues        histograms_[Histogram_Last + 1];
+  };
+
+
+  // Zero-initialized, as a static variable
+  static Shard                shards_[SHARDS_COUNT];
+  static std::atomic<size_t>  nextShard_;
+
+
+  static Shard& GetShard()
+  {
+    static thread_local size_t shard = (nextShard_++) % SHARDS_COUNT;
+    return shards_[shard];
+  }
+
+
+  void Increment(Counter counter,
+                 uint64_t value)
+  {
+    GetShard().counters_[counter].fetch_add(value, std::memory_order_relaxed);
+  }
+
+
+  void Observe(Histogram histogram,
+               uint64_t microseconds)
+  {
+    const size_t bucket = std::lower_bound(BUCKETS, BUCKETS + BUCKETS_COUNT - 1, microseconds) - BUCKETS;
+
+    HistogramValues& values = GetShard().histograms_[histogram];
+    values.buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    values.sum_.fetch_add(microseconds, std::memory_order_relaxed);
+  }
+
+
+  uint64_t GetCounter(Counter counter)
+  {
+    uint64_t value = 0;
+
+    for (size_t i = 0; i < SHARDS_COUNT; i++)
+    {
+      value += shards_[i].counters_[counter].load(std::memory_order_relaxed);
+    }
+
+    return value;
+  }
+
+
+  static void GetHistogram(uint64_t (&buckets)[BUCKETS_COUNT],
+                           uint64_t& sum,
+                           Histogram histogram)
+  {
+    std::fill(buckets, buckets + BUCKETS_COUNT, 0);
+    sum = 0;
+
+    for (size_t i = 0; i < SHARDS_COUNT; i++)
+    {
+      const HistogramValues& values = shards_[i].histograms_[histogram];
+
+      for (size_t j = 0; j < BUCKETS_COUNT; j++)
+      {
+        buckets[j] += values.buckets_[j].load(std::memory_order_relaxed);
+      }
+
+      sum += values.sum_.load(std::memory_order_relaxed);
+    }
+  }
+
+
+  uint64_t GetCount(Histogram histogram)
+  {
+    uint64_t buckets[BUCKETS_COUNT];
+    uint64_t sum;
+    GetHistogram(buckets, sum, histogram);
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < BUCKETS_COUNT; i++)
+    {
+      count += buckets[i];
+    }
+
+    return count;
+  }
+
+
+  static void FormatHeader(std::string& target,
+                           const Descriptor& descriptor,
+                           const char* type)
+  {
+    if (descriptor.help_ != NULL)
+    {
+      target += "# HELP " + std::string(descriptor.family_) + " " + descriptor.help_ + "\n";
+      target += "# TYPE " + std::string(descriptor.family_) + " " + type + "\n";
+    }
+  }
+
+
+  // Gives back the labels, with the additional label (if any)
+  static std::string FormatLabels(const Descriptor& descriptor,
+                                  const std::string& additional)
+  {
+    std::string s;
+
+    if (descriptor.label_ != NULL)
+    {
+      s = std::string(descriptor.label_) + "=\"" + descriptor.value_ + "\"";
+    }
+
+    if (!additional.empty())
+    {
+      s += (s.empty() ? "" : ",") + additional;
+    }
+
+    return (s.empty() ? s : "{" + s + "}");
+  }
+
+
+  static std::string FormatSeconds(uint64_t microseconds)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.6f", static_cast<double>(microseconds) / 1000000.0);
+    return buffer;
+  }
+
+
+  void Format(std::string& target)
+  {
+    for (size_t i = 0; i <= Counter_Last; i++)
+    {
+      const Descriptor& descriptor = COUNTERS[i];
+      FormatHeader(target, descriptor, "counter");
+      target += descriptor.family_ + FormatLabels(descriptor, "") + " " +
+        std::to_string(GetCounter(static_cast<Counter>(i))) + "\n";
+    }
+
+    for (size_t i = 0; i <= Histogram_Last; i++)
+    {
+      const Descriptor& descriptor = HISTOGRAMS[i];
+      FormatHeader(target, descriptor, "histogram");
+
+      uint64_t buckets[BUCKETS_COUNT];
+      uint64_t sum;
+      GetHistogram(buckets, sum, static_cast<Histogram>(i));
+
+      // The buckets of Prometheus are cumulative
+      uint64_t count = 0;
+      for (size_t j = 0; j < BUCKETS_COUNT; j++)
+      {
+        count += buckets[j];
+
+        const std::string bound = (j + 1 == BUCKETS_COUNT ? "+Inf" : FormatSeconds(BUCKETS[j]));
+        target += std::string(descriptor.family_) + "_bucket" + FormatLabels(descriptor, "le=\"" + bound + "\"") +
+          " " + std::to_string(count) + "\n";
+      }
+
+      target += std::string(descriptor.family_) + "_sum" + FormatLabels(descriptor, "") + " " + FormatSeconds(sum) + "\n";
+      target += std::string(descriptor.family_) + "_count" + FormatLabels(descriptor, "") + " " + std::to_string(count) + "\n";
+    }
+  }
+
+
+  void FormatGauge(std::string& target,
+                   const std::string& name,
+                   const std::string& help,
+                   double value)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%g", value);
+
+    target += "# HELP " + name + " " + help + "\n";
+    target += "# TYPE " + name + " gauge\n";
+    target += name + " " + buffer + "\n";
+  }
+}
@@ -0,0 +1,143 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * Counters and latency histograms of the plugin, that are exposed in
+ * the text format of Prometheus. Each thread updates its own shard of
+ * atomics (relaxed increments on cache lines that are not shared with
+ * the other threads, in general), and the shards are only summed when
+ * the metrics are formatted, so the instrumentation can stay enabled.
+ **/
+namespace IndexerMetrics
+{
+  enum Counter
+  {
+    // Status of the files examined by the scans, in the database
+    Counter_FilesNew,
+    Counter_FilesModified,
+    Counter_FilesAlreadyStored,
+    Counter_FilesNotDicom,
+
+    // Identification of the new and modified files
+    Counter_FilesIdentifiedDicom,
+    Counter_FilesIdentifiedOther,
+
+    Counter_FilesUploaded,
+    Counter_FilesUploadFailed,
+    Counter_FilesFailed,   // Could not be examined by the scan
+
+    Counter_ScansCompleted,
+    Counter_ScansInterrupted,
+
+    Counter_StorageCreateBytes,
+    Counter_StorageReadWholeBytes,
+    Counter_StorageReadRangeBytes,
+
+    Counter_StorageCreateErrors,
+    Counter_StorageReadWholeErrors,
+    Counter_StorageReadRangeErrors,
+    Counter_StorageRemoveErrors,
+
+    // Reads of ranges through the memory mappings of the indexed files
+    Counter_ReadCacheHits,
+    Counter_ReadCacheMisses,
+
+    Counter_ReadAheadFiles,   // Files loaded ahead of the reads of a series
+
+    Counter_NotificationsSent,
+    Counter_NotificationsRetried,
+    Counter_NotificationsDropped,
+
+    Counter_Last = Counter_NotificationsDropped
+  };
+
+  enum Histogram
+  {
+    Histogram_Scan,
+
+    Histogram_DatabaseLookupFile,
+    Histogram_DatabaseAddFile,
+    Histogram_DatabaseTouchFile,
+    Histogram_DatabaseRemoveFile,
+    Histogram_DatabaseLookupDirectory,
+    Histogram_DatabaseStoreDirectory,
+    Histogram_DatabaseTouchDirectory,
+    Histogram_DatabaseAddAttachment,
+    Histogram_DatabaseLookupAttachment,
+    Histogram_DatabaseRemoveAttachment,
+    Histogram_DatabaseFlushWriteBatch,
+
+    Histogram_StorageCreate,
+    Histogram_StorageReadWhole,
+    Histogram_StorageReadRange,
+    Histogram_StorageRemove,
+
+    Histogram_Last = Histogram_StorageRemove
+  };
+
+  void Increment(Counter counter,
+                 uint64_t value = 1);
+
+  void Observe(Histogram histogram,
+               uint64_t microseconds);
+
+  uint64_t GetCounter(Counter counter);
+
+  // Number of observations of a histogram
+  uint64_t GetCount(Histogram histogram);
+
+  // Appends all the counters and histograms
+  void Format(std::string& target);
+
+  // Appends a gauge whose value is computed by the caller
+  void FormatGauge(std::string& target,
+                   const std::string& name,
+                   const std::string& help,
+                   double value);
+
+  // Observes the lifetime of the object
+  class Timer : public boost::noncopyable
+  {
+  private:
+    Histogram                              histogram_;
+    std::chrono::steady_clock::time_point  start_;
+
+  public:
+    explicit Timer(Histogram histogram) :
+      histogram_(histogram),
+      start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~Timer()
+    {
+      Observe(histogram_, std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+    }
+  };
+}
@@ -0,0 +1,262 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MappedFilesCache.h"
+
+#include "IndexerMetrics.h"
+#include "StorageArea.h"
+
+#include <OrthancException.h>
+
+#include <string.h>
+
+#if !defined(_WIN32)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+
+#if defined(_WIN32)
+
+class MappedFilesCache::CachedFile : public boost::noncopyable
+{
+public:
+  uint64_t GetMappedSize() const
+  {
+    return 0;
+  }
+};
+
+#else
+
+class MappedFilesCache::CachedFile : public boost::noncopyable
+{
+private:
+  int       fd_;
+  void*     data_;        // NULL if not mapped
+  uint64_t  mappedSize_;
+
+public:
+  // Takes the ownership of the descriptor, even if the mapping fails
+  CachedFile(int fd,
+             uint64_t mappedSize) :
+    fd_(fd),
+    data_(NULL),
+    mappedSize_(mappedSize)
+  {
+    if (mappedSize != 0)
+    {
+      data_ = mmap(NULL, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+      if (data_ == MAP_FAILED)
+      {
+        close(fd_);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory,
+                                        "Cannot map a file into memory");
+      }
+    }
+  }
+
+  ~CachedFile()
+  {
+    if (data_ != NULL)
+    {
+      munmap(data_, mappedSize_);
+    }
+
+    close(fd_);
+  }
+
+  uint64_t GetMappedSize() const
+  {
+    return mappedSize_;
+  }
+
+  void ReadRange(OrthancPluginMemoryBuffer64 *target,
+                 uint64_t rangeStart) const
+  {
+    if (data_ == NULL)
+    {
+      StorageArea::ReadRangeFromDescriptor(target, fd_, rangeStart);
+    }
+    else if (rangeStart > mappedSize_ ||
+             target->size > mappedSize_ - rangeStart)
+    {
+      // Same error as a short read of the file
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+    else if (target->size != 0)
+    {
+      memcpy(target->data, reinterpret_cast<const uint8_t*>(data_) + rangeStart, target->size);
+    }
+  }
+};
+
+#endif
+
+
+MappedFilesCache::CachedFilePtr MappedFilesCache::Lookup(uint64_t& generation,
+                                                         const std::string& path)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  generation = generation_;
+
+  std::unordered_map<std::string, Entries::iterator>::iterator found = index_.find(path);
+  if (found == index_.end())
+  {
+    return CachedFilePtr();
+  }
+  else
+  {
+    // Move the entry to the front of the LRU list
+    entries_.splice(entries_.begin(), entries_, found->second);
+    return found->second->second;
+  }
+}
+
+
+void MappedFilesCache::Store(const std::string& path,
+                             const CachedFilePtr& file,
+                             uint64_t generation)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (generation != generation_ ||
+      index_.find(path) != index_.end())
+  {
+    // The file was invalidated while being opened (the descriptor
+    // could be stale), or another thread has opened it in the meantime
+    return;
+  }
+
+  entries_.push_front(std::make_pair(path, file));
+  index_[path] = entries_.begin();
+  mappedBytes_ += file->GetMappedSize();
+
+  // The most recent file is always kept. The evicted files are only
+  // closed once the readers that are reading from them are done.
+  while (entries_.size() > 1 &&
+         (mappedBytes_ > maxBytes_ ||
+          entries_.size() > maxFiles_))
+  {
+    mappedBytes_ -= entries_.back().second->GetMappedSize();
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+
+MappedFilesCache::MappedFilesCache(uint64_t maxBytes,
+                                   size_t maxFiles) :
+  maxBytes_(maxBytes),
+  maxFiles_(maxFiles),
+  mappedBytes_(0),
+  generation_(0)
+{
+  if (maxBytes == 0 ||
+      maxFiles == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+void MappedFilesCache::ReadRange(OrthancPluginMemoryBuffer64 *target,
+                                 const std::string& path,
+                                 uint64_t rangeStart,
+                                 bool isOwned)
+{
+#if defined(_WIN32)
+  StorageArea::ReadRangeFromPath(target, path, rangeStart);
+#else
+  uint64_t generation;
+  CachedFilePtr file = Lookup(generation, path);
+
+  if (file.get() != NULL)
+  {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_ReadCacheHits);
+  }
+  else
+  {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_ReadCacheMisses);
+
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot open file: " + path);
+    }
+
+    uint64_t mappedSize = 0;
+
+    if (isOwned)
+    {
+      struct stat info;
+      if (fstat(fd, &info) != 0)
+      {
+        close(fd);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+
+      const uint64_t size = static_cast<uint64_t>(info.st_size);
+      if (size <= maxBytes_)
+      {
+        mappedSize = size;  // Empty files are not mapped
+      }
+    }
+
+    file.reset(new CachedFile(fd, mappedSize));
+    Store(path, file, generation);
+  }
+
+  file->ReadRange(target, rangeStart);
+#endif
+}
+
+
+void MappedFilesCache::Invalidate(const std::string& path)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  generation_++;
+
+  std::unordered_map<std::string, Entries::iterator>::iterator found = index_.find(path);
+  if (found != index_.end())
+  {
+    mappedBytes_ -= found->second->second->GetMappedSize();
+    entries_.erase(found->second);
+    index_.erase(found);
+  }
+}
+
+
+uint64_t MappedFilesCache::GetMappedBytes()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return mappedBytes_;
+}
+
+
+size_t MappedFilesCache::GetCachedFiles()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return entries_.size();
+}
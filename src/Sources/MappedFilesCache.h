@@ -0,0 +1,96 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+
+/**
+ * Open descriptors of the files that were recently read by ranges,
+ * shared by all the threads of the storage area. The viewers of
+ * whole-slide images read many tiles from the same few instances:
+ * Once a file is open, each of its ranges is read by one "pread()".
+ *
+ * The files that belong to the plugin (the instances received by
+ * Orthanc, that are written in its storage directory) are also mapped
+ * in memory, and their ranges are copied out of the mapping without
+ * any system call. The indexed files are never mapped, as another
+ * program can truncate them at any time: Copying out of the mapping
+ * would then raise SIGBUS, whereas "pread()" reports a short read.
+ *
+ * The least recently used files are closed beyond "maxFiles" files or
+ * "maxBytes" mapped bytes, and a file that is larger than "maxBytes"
+ * is not mapped. A file must be invalidated before it is modified or
+ * removed through the plugin, and as soon as its modification is
+ * detected by a scan (until then, a file that was replaced is read
+ * from its previous version).
+ *
+ * The cache is not available on Windows, where all the reads go
+ * through "StorageArea::ReadRangeFromPath()".
+ **/
+class MappedFilesCache : public boost::noncopyable
+{
+private:
+  class CachedFile;
+
+  typedef std::shared_ptr<CachedFile>                       CachedFilePtr;
+  typedef std::list<std::pair<std::string, CachedFilePtr> >  Entries;
+
+  boost::mutex                                         mutex_;
+  uint64_t                                             maxBytes_;
+  size_t                                               maxFiles_;
+  uint64_t                                             mappedBytes_;
+  uint64_t                                             generation_;  // Incremented by each invalidation
+  Entries                                              entries_;     // Most recent first
+  std::unordered_map<std::string, Entries::iterator>  index_;
+
+  CachedFilePtr Lookup(uint64_t& generation,
+                       const std::string& path);
+
+  void Store(const std::string& path,
+             const CachedFilePtr& file,
+             uint64_t generation);
+
+public:
+  MappedFilesCache(uint64_t maxBytes,
+                   size_t maxFiles);
+
+  // Same contract as "StorageArea::ReadRangeFromPath()". "isOwned"
+  // tells whether the file belongs to the plugin, and can be mapped.
+  void ReadRange(OrthancPluginMemoryBuffer64 *target,
+                 const std::string& path,
+                 uint64_t rangeStart,
+                 bool isOwned);
+
+  void Invalidate(const std::string& path);
+
+  uint64_t GetMappedBytes();
+
+  size_t GetCachedFiles();
+};
@@ -17,21 +17,28 @@
  **/
 
 
+#include "DicomHeaderCache.h"
+#include "DirectoryCrawler.h"
+#include "DirectoryReader.h"
+#include "DirectoryWatcher.h"
+#include "FilePipeline.h"
 #include "IndexerDatabase.h"
+#include "IndexerMetrics.h"
+#include "MappedFilesCache.h"
+#include "ReadAheadPrefetcher.h"
+#include "ScanController.h"
 #include "StorageArea.h"
 #include "FileMemoryMap.h"
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
-#include <DicomFormat/DicomInstanceHasher.h>
-#include <DicomFormat/DicomMap.h>
 #include <Logging.h>
-#include <SerializationToolbox.h>
 #include <SystemToolbox.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
-#include <stack>
+
+#include <set>
 
 #include "camic_interact.h"
 
@@ -39,46 +46,97 @@ static std::list<std::string>        folders_;
 static IndexerDatabase               database_;
 static std::unique_ptr<StorageArea>  storageArea_;
 static unsigned int                  intervalSeconds_;
+static unsigned int                  scanThreads_;
+static unsigned int                  identificationThreads_;
+static unsigned int                  uploadThreads_;
+static bool                          watch_;
+static unsigned int                  rescanIntervalSeconds_;
+static unsigned int                  fullScanIntervalSeconds_;
+static unsigned int                  clockSkewSeconds_;
+static bool                          headerOnlyUpload_;
 static boost::filesystem::path       realStoragePath;
+static ScanController                scanController_;
+
+// Open files that are read by ranges, NULL if disabled
+static std::unique_ptr<MappedFilesCache>  mappedFiles_;
+
+// Read-ahead of the series being read, NULL if disabled
+static std::unique_ptr<ReadAheadPrefetcher>  prefetcher_;
+
+// Headers of the files uploaded by "ProcessFile()", that Orthanc will
+// hand back to "StorageCreate()"
+static DicomHeaderCache              headerCache_(64 /* entries */, 64 * 1024 /* max bytes per header */);
 
 
-static bool ComputeInstanceId(std::string& instanceId,
-                              const void* dicom,
-                              size_t size)
+static bool IsUnderFolder(const std::string& path,
+                          const std::string& folder)
 {
-  if (size > 0 &&
-      Orthanc::DicomMap::IsDicomFile(dicom, size))
+  if (path.size() < folder.size() ||
+      path.compare(0, folder.size(), folder) != 0)
   {
-    try
-    {
-      OrthancPlugins::OrthancString s;
-      s.Assign(OrthancPluginDicomBufferToJson(OrthancPlugins::GetGlobalContext(), dicom, size,
-                                              OrthancPluginDicomToJsonFormat_Short,
-                                              OrthancPluginDicomToJsonFlags_None, 256));
-    
-      Json::Value json;
-      s.ToJson(json);
-    
-      static const char* const PATIENT_ID = "0010,0020";
-      static const char* const STUDY_INSTANCE_UID = "0020,000d";
-      static const char* const SERIES_INSTANCE_UID = "0020,000e";
-      static const char* const SOP_INSTANCE_UID = "0008,0018";
-    
-      Orthanc::DicomInstanceHasher hasher(
-        json.isMember(PATIENT_ID) ? Orthanc::SerializationToolbox::ReadString(json, PATIENT_ID) : "",
-        Orthanc::SerializationToolbox::ReadString(json, STUDY_INSTANCE_UID),
-        Orthanc::SerializationToolbox::ReadString(json, SERIES_INSTANCE_UID),
-        Orthanc::SerializationToolbox::ReadString(json, SOP_INSTANCE_UID));
+    return false;
+  }
+  else
+  {
+    return (path.size() == folder.size() ||
+            path[folder.size()] == '/' ||
+            path[folder.size()] == '\\' ||
+            (!folder.empty() && (folder[folder.size() - 1] == '/' ||
+                                 folder[folder.size() - 1] == '\\')));
+  }
+}
+
+
+static void ReadRangeFromPath(OrthancPluginMemoryBuffer64 *target,
+                              const std::string& path,
+                              uint64_t rangeStart)
+{
+  if (mappedFiles_.get() == NULL)
+  {
+    StorageArea::ReadRangeFromPath(target, path, rangeStart);
+  }
+  else
+  {
+    // Only the instances received by Orthanc belong to the plugin, the
+    // indexed files can be truncated by another program at any time
+    mappedFiles_->ReadRange(target, path, rangeStart,
+                            IsUnderFolder(path, realStoragePath.string()));
+  }
+}
+
+
+static void InvalidateMappedFile(const std::string& path)
+{
+  if (mappedFiles_.get() != NULL)
+  {
+    mappedFiles_->Invalidate(path);
+  }
+}
+
 
-      instanceId = hasher.HashInstance();
+static bool IdentifyBuffer(DicomHeader& header,
+                           std::string& instanceId,
+                           const void* dicom,
+                           size_t size)
+{
+  if (headerCache_.Lookup(header, instanceId, dicom, size))
+  {
+    return true;
+  }
+
+  try
+  {
+    if (header.Parse(dicom, size))
+    {
+      instanceId = header.HashInstance();
       return true;
     }
-    catch (Orthanc::OrthancException&)
+    else
     {
       return false;
     }
   }
-  else
+  catch (Orthanc::OrthancException&)
   {
     return false;
   }
@@ -86,197 +144,699 @@ static bool ComputeInstanceId(std::string& instanceId,
 
 
 
-static void ProcessFile(const std::string& path,
-                        const std::time_t time,
-                        const uintmax_t size)
+static bool IdentifyFile(DicomHeader& header,
+                         std::string& instanceId,
+                         const std::string& path,
+                         const uintmax_t size)
 {
-  std::string oldInstanceId;
-  IndexerDatabase::FileStatus status = database_.LookupFile(oldInstanceId, path, time, size);
-
-  if (status == IndexerDatabase::FileStatus_New ||
-      status == IndexerDatabase::FileStatus_Modified)
+  // Errors while reading the file are propagated, so that the file
+  // is not marked as non-DICOM and is examined again at the next pass
+  if (header.ParseFile(path, size))
   {
-    if (status == IndexerDatabase::FileStatus_Modified)
+    try
+    {
+      instanceId = header.HashInstance();
+      return true;
+    }
+    catch (Orthanc::OrthancException&)
     {
-      database_.RemoveFile(path);
     }
+  }
 
-    FileMemoryMap reader = FileMemoryMap(path);
+  return false;
+}
 
-    std::string instanceId;
-    if ((reader.length() != 0) &&
-        ComputeInstanceId(instanceId, reader.data(), reader.length()))
+
+// Registers the instances whose file is being uploaded without its
+// pixel data, so that "StorageCreate()" never keeps such a partial file
+// as if it had been received by Orthanc
+class PartialUpload : public boost::noncopyable
+{
+private:
+  static boost::mutex                 mutex_;
+  static std::multiset<std::string>   instances_;
+
+  std::string  instanceId_;
+
+public:
+  explicit PartialUpload(const std::string& instanceId) :
+    instanceId_(instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    instances_.insert(instanceId_);
+  }
+
+  ~PartialUpload()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    instances_.erase(instances_.find(instanceId_));
+  }
+
+  static bool IsPending(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return instances_.find(instanceId) != instances_.end();
+  }
+};
+
+boost::mutex                PartialUpload::mutex_;
+std::multiset<std::string>  PartialUpload::instances_;
+
+
+// Sends a file to Orthanc, once it has been identified and registered
+// into the database. Done by the upload threads of the pipeline, if any.
+class FileUpload : public FilePipeline::IUpload
+{
+private:
+  std::string  path_;
+  bool         isDicom_;
+  DicomHeader  header_;
+  std::string  instanceId_;
+  std::string  oldInstanceId_;  // Empty, unless the file was modified
+
+public:
+  FileUpload(const std::string& path,
+             bool isDicom,
+             const DicomHeader& header,
+             const std::string& instanceId,
+             const std::string& oldInstanceId) :
+    path_(path),
+    isDicom_(isDicom),
+    header_(header),
+    instanceId_(instanceId),
+    oldInstanceId_(oldInstanceId)
+  {
+  }
+
+  virtual void Upload() ORTHANC_OVERRIDE
+  {
+    if (!oldInstanceId_.empty())
     {
-      LOG(INFO) << "New DICOM file detected by the indexer plugin: " << path;
+      OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId_, false);
+    }
 
-      // The following line must be *before* the "RestApiDelete()" to
-      // deal with the case of having two copies of the same DICOM
-      // file in the indexed folders, but with different timestamps
-      database_.AddDicomInstance(path, time, size, instanceId);
-        
-      if (status == IndexerDatabase::FileStatus_Modified)
-      {
-        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
-      }
-    
+    if (isDicom_)
+    {
       try
       {
+        // The pixel data can be left out of the upload, as Orthanc reads
+        // the instance back from the indexed file through the storage
+        // area. Only the pages of the file before the pixel data are read.
+        FileMemoryMap reader(path_, 0, 0, headerOnlyUpload_ ?
+                             FileMemoryMap::Mode_MapOnDemand : FileMemoryMap::Mode_Auto);
+
+        size_t size = reader.length();
+        std::unique_ptr<PartialUpload> partial;
+
+        size_t pixelDataOffset;
+        if (headerOnlyUpload_ &&
+            DicomHeader::LocatePixelData(pixelDataOffset, reader.data(), reader.length()) ==
+            DicomHeader::ParseStatus_Success)
+        {
+          size = pixelDataOffset;
+          partial.reset(new PartialUpload(instanceId_));
+        }
+
+        headerCache_.Store(header_, instanceId_, reader.data(), size);
+
         Json::Value upload;
-        OrthancPlugins::RestApiPost(upload, "/instances", reader.data(), reader.length(), false);
+        OrthancPlugins::RestApiPost(upload, "/instances", reader.data(), size, false);
+        IndexerMetrics::Increment(IndexerMetrics::Counter_FilesUploaded);
       }
       catch (Orthanc::OrthancException&)
       {
+        IndexerMetrics::Increment(IndexerMetrics::Counter_FilesUploadFailed);
       }
     }
+  }
+};
+
+
+// Updates the database for a file found in the indexed folders, and
+// gives back the upload to be done, if any
+static FilePipeline::IUpload* ExamineFile(const std::string& path,
+                                          const FileMetadata& metadata)
+{
+  std::string oldInstanceId;
+  IndexerDatabase::FileStatus status = database_.LookupFile(oldInstanceId, path, metadata);
+
+  switch (status)
+  {
+    case IndexerDatabase::FileStatus_New:
+      IndexerMetrics::Increment(IndexerMetrics::Counter_FilesNew);
+      break;
+
+    case IndexerDatabase::FileStatus_Modified:
+      IndexerMetrics::Increment(IndexerMetrics::Counter_FilesModified);
+      break;
+
+    case IndexerDatabase::FileStatus_AlreadyStored:
+      IndexerMetrics::Increment(IndexerMetrics::Counter_FilesAlreadyStored);
+      break;
+
+    case IndexerDatabase::FileStatus_NotDicom:
+      IndexerMetrics::Increment(IndexerMetrics::Counter_FilesNotDicom);
+      break;
+
+    default:
+      break;
+  }
+
+  if (status == IndexerDatabase::FileStatus_AlreadyStored ||
+      status == IndexerDatabase::FileStatus_NotDicom)
+  {
+    // The file has been seen by the current scan
+    database_.TouchFile(path, metadata);
+    return NULL;
+  }
+
+  if (status == IndexerDatabase::FileStatus_Modified)
+  {
+    InvalidateMappedFile(path);
+    database_.RemoveFile(path);
+  }
+  else
+  {
+    oldInstanceId.clear();
+  }
+
+  // Only the beginning of the file is read to identify it
+  DicomHeader header;
+  std::string instanceId;
+  if (IdentifyFile(header, instanceId, path, metadata.size_))
+  {
+    LOG(INFO) << "New DICOM file detected by the indexer plugin: " << path;
+    IndexerMetrics::Increment(IndexerMetrics::Counter_FilesIdentifiedDicom);
+
+    // The file must be registered *before* the "RestApiDelete()" of
+    // the upload, to deal with the case of having two copies of the
+    // same DICOM file in the indexed folders, but with different
+    // timestamps
+    database_.AddDicomInstance(path, metadata, instanceId);
+    return new FileUpload(path, true, header, instanceId, oldInstanceId);
+  }
+  else
+  {
+    LOG(INFO) << "Skipping indexing of non-DICOM file: " << path;
+    IndexerMetrics::Increment(IndexerMetrics::Counter_FilesIdentifiedOther);
+    database_.AddNonDicomFile(path, metadata);
+
+    if (oldInstanceId.empty())
+    {
+      return NULL;
+    }
     else
     {
-      LOG(INFO) << "Skipping indexing of non-DICOM file: " << path;
-      database_.AddNonDicomFile(path, time, size);
+      return new FileUpload(path, false, DicomHeader(), "", oldInstanceId);
+    }
+  }
+}
 
-      if (status == IndexerDatabase::FileStatus_Modified)
-      {
-        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
-      }
+
+static void ProcessFile(const std::string& path,
+                        const FileMetadata& metadata)
+{
+  std::unique_ptr<FilePipeline::IUpload> upload(ExamineFile(path, metadata));
+
+  if (upload.get() != NULL)
+  {
+    upload->Upload();
+  }
+}
+
+
+static void ProcessRemovedFile(const std::string& path)
+{
+  InvalidateMappedFile(path);
+
+  std::string instanceId;
+  bool isLastInstance;
+
+  try
+  {
+    isLastInstance = database_.RemoveFile(instanceId, path);
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    if (e.GetErrorCode() == Orthanc::ErrorCode_InexistentItem)
+    {
+      return;  // This file was not indexed
+    }
+    else
+    {
+      throw;
     }
   }
+
+  if (isLastInstance &&
+      !instanceId.empty())
+  {
+    LOG(INFO) << "DICOM file removed from the indexed folders: " << path;
+    OrthancPlugins::RestApiDelete("/instances/" + instanceId, false);
+  }
 }
 
 
-static void LookupDeletedFiles()
+static bool IsUnderFolders(const std::string& path,
+                           const std::list<std::string>& folders)
+{
+  for (std::list<std::string>::const_iterator it = folders.begin(); it != folders.end(); ++it)
+  {
+    if (IsUnderFolder(path, *it))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+// "scanned" are the paths that were walked by the scan, which can
+// be a subset of the indexed folders
+static void LookupDeletedFiles(int64_t generation,
+                               const std::list<std::string>& scanned,
+                               const std::list<std::string>& failures)
 {
   class Visitor : public IndexerDatabase::IFileVisitor
   {
   private:
-    typedef std::pair<std::string, std::string>  DeletedDicom;
-    
-    std::list<DeletedDicom>  deletedDicom_;
+    const std::list<std::string>&  scanned_;
+    const std::list<std::string>&  failures_;
+    std::list<std::string>         deleted_;
     
   public:
+    Visitor(const std::list<std::string>& scanned,
+            const std::list<std::string>& failures) :
+      scanned_(scanned),
+      failures_(failures)
+    {
+    }
+
     virtual void VisitInstance(const std::string& path,
                                bool isDicom,
                                const std::string& instanceId) ORTHANC_OVERRIDE
     {
-      if (!Orthanc::SystemToolbox::IsRegularFile(path) &&
-          isDicom)
+      if (IsUnderFolders(path, scanned_))
       {
-        deletedDicom_.push_back(std::make_pair(path, instanceId));
+        // Not seen by the scan, unless its folder could not be read
+        if (!IsUnderFolders(path, failures_))
+        {
+          deleted_.push_back(path);
+        }
+      }
+      else if (IsUnderFolders(path, folders_))
+      {
+        // Indexed folder that was not walked by this scan
+      }
+      else if (isDicom &&
+               !Orthanc::SystemToolbox::IsRegularFile(path))
+      {
+        // File outside of the indexed folders (e.g. received by
+        // Orthanc in its storage directory), that is never scanned
+        deleted_.push_back(path);
       }
     }
 
-    void ExecuteDelete()
+    const std::list<std::string>& GetDeleted() const
     {
-      for (std::list<DeletedDicom>::const_iterator
-             it = deletedDicom_.begin(); it != deletedDicom_.end(); ++it)
-      {
-        const std::string& path = it->first;
-        const std::string& instanceId = it->second;
-        if (database_.RemoveFile(path))
-        {
-
-          OrthancPlugins::RestApiDelete("/instances/" + instanceId, false);      
-        }
-      }
+      return deleted_;
     }
   };  
 
-  Visitor visitor;
-  database_.Apply(visitor);
-  visitor.ExecuteDelete();
+  Visitor visitor(scanned, failures);
+  database_.ApplyStale(visitor, generation);
+
+  std::set<std::string> orphanInstances;
+  for (std::list<std::string>::const_iterator it = visitor.GetDeleted().begin();
+       it != visitor.GetDeleted().end(); ++it)
+  {
+    InvalidateMappedFile(*it);
+  }
+
+  database_.RemoveFiles(orphanInstances, visitor.GetDeleted());
+
+  for (std::set<std::string>::const_iterator it = orphanInstances.begin();
+       it != orphanInstances.end(); ++it)
+  {
+    LOG(INFO) << "DICOM instance removed from the indexed folders: " << *it;
+    OrthancPlugins::RestApiDelete("/instances/" + *it, false);
+  }
 }
 
 
+class ScanVisitor :
+  public DirectoryCrawler::IVisitor,
+  public FilePipeline::IHandler
+{
+private:
+  struct Directory
+  {
+    std::string             path_;
+    std::time_t             time_;
+    bool                    isStable_;
+    std::list<std::string>  subdirectories_;
+  };
+
+  bool                    prune_;
+  const bool&             stop_;
+  bool                    fromWatcher_;
+  boost::mutex            mutex_;
+  std::list<std::string>  failures_;
+  std::set<std::string>   failedDirectories_;
+  std::list<Directory>    directories_;
+
+  // Must be the last member, as its threads use the members above
+  std::unique_ptr<FilePipeline>  pipeline_;
+
+public:
+  // The crawler threads are suspended while the scans are paused. The
+  // walks of the new directories found by the watcher are not counted
+  // in the progress of the scans, and their files are processed by
+  // the watcher thread, as without identification threads: These
+  // directories are usually small, and a new pipeline for each of
+  // them would start and join its threads for a few files.
+  ScanVisitor(bool prune,
+              const bool& stop,
+              bool fromWatcher) :
+    prune_(prune),
+    stop_(stop),
+    fromWatcher_(fromWatcher)
+  {
+    if (identificationThreads_ != 0 &&
+        !fromWatcher)
+    {
+      pipeline_.reset(new FilePipeline(*this, stop, identificationThreads_, uploadThreads_));
+    }
+  }
+
+  virtual void VisitFile(const std::string& path,
+                         const FileMetadata& metadata) ORTHANC_OVERRIDE
+  {
+    if (!scanController_.WaitWhilePaused(stop_))
+    {
+      return;  // The crawler is stopping
+    }
+
+    if (!fromWatcher_)
+    {
+      scanController_.VisitFile();
+    }
+
+    if (pipeline_.get() != NULL)
+    {
+      pipeline_->Push(path, metadata);
+      return;
+    }
+
+    try
+    {
+      ProcessFile(path, metadata);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << e.What();
+      VisitFailure(path);
+    }
+  }
+
+  virtual FilePipeline::IUpload* Identify(const std::string& path,
+                                          const FileMetadata& metadata) ORTHANC_OVERRIDE
+  {
+    try
+    {
+      return ExamineFile(path, metadata);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << e.What();
+      VisitFailure(path);
+      return NULL;
+    }
+  }
+
+  virtual void VisitFailure(const std::string& path) ORTHANC_OVERRIDE
+  {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_FilesFailed);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    failures_.push_back(path);
+    failedDirectories_.insert(boost::filesystem::path(path).parent_path().string());
+  }
+
+  virtual bool LookupDirectory(std::list<std::string>& subdirectories,
+                               const std::string& path,
+                               const std::time_t time) ORTHANC_OVERRIDE
+  {
+    // If stopping, the crawler does not list the directory anyway
+    scanController_.WaitWhilePaused(stop_);
+
+    if (!fromWatcher_)
+    {
+      scanController_.VisitDirectory(path);
+    }
+
+    if (prune_ &&
+        database_.LookupDirectory(subdirectories, path, time))
+    {
+      // No entry was added or removed since the previous scan, so
+      // its files are not examined until the next full scan
+      database_.TouchDirectory(path);
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  virtual void VisitDirectory(const std::string& path,
+                              const std::time_t time,
+                              bool isStable,
+                              const std::list<std::string>& subdirectories) ORTHANC_OVERRIDE
+  {
+    if (fullScanIntervalSeconds_ != 0)
+    {
+      // Recorded by "Finish()", once the files of the directory have
+      // left the pipeline and their failures are known
+      Directory directory;
+      directory.path_ = path;
+      directory.time_ = time;
+      directory.isStable_ = isStable;
+      directory.subdirectories_ = subdirectories;
+
+      boost::mutex::scoped_lock lock(mutex_);
+      directories_.push_back(directory);
+    }
+  }
+
+  // Waits for the files in the pipeline, then records the listed directories
+  void Finish()
+  {
+    if (pipeline_.get() != NULL)
+    {
+      pipeline_->Finish();
+    }
+
+    for (std::list<Directory>::const_iterator it = directories_.begin(); it != directories_.end(); ++it)
+    {
+      // Some file of this directory could not be processed
+      const bool failed = (failedDirectories_.find(it->path_) != failedDirectories_.end());
+
+      database_.StoreDirectory(it->path_, it->time_, it->isStable_ && !failed, it->subdirectories_);
+    }
+
+    directories_.clear();
+  }
+
+  // The files below these paths must not be considered as deleted
+  const std::list<std::string>& GetFailures() const
+  {
+    return failures_;
+  }
+};
+
+
 static void MonitorDirectories(bool* stop, unsigned int intervalSeconds)
 {
+  boost::posix_time::ptime lastFullScan;  // Not a date time
+
+  // The first scan after the startup walks all the folders
+  std::list<std::string> targets;
+  bool requested = false;
+
   for (;;)
   {
-    std::stack<boost::filesystem::path> s;
+    if (!scanController_.WaitWhilePaused(*stop))
+    {
+      return;
+    }
+
+    const bool allFolders = targets.empty();
+    const std::list<std::string>& scanned = (allFolders ? folders_ : targets);
+
+    const int64_t generation = database_.StartScan();
+    const boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+
+    // The first scan after the startup is always a full scan, as well
+    // as the scans that are requested through the REST API
+    const bool prune = (allFolders &&
+                        !requested &&
+                        fullScanIntervalSeconds_ != 0 &&
+                        !lastFullScan.is_not_a_date_time() &&
+                        now - lastFullScan < boost::posix_time::seconds(fullScanIntervalSeconds_));
+
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    scanController_.StartScan(scanned, allFolders, prune);
+
+    ScanVisitor visitor(prune, *stop, false /* not from the watcher */);
+    bool completed;
 
-    for (std::list<std::string>::const_iterator it = folders_.begin();
-         it != folders_.end(); ++it)
     {
-      s.push(*it);
+      DirectoryCrawler crawler(visitor, *stop, scanThreads_);
+      crawler.SetClockSkew(clockSkewSeconds_);
+      completed = crawler.Run(scanned);
     }
 
-    while (!s.empty())
+    try
     {
-      if (*stop)
-      {
-        return;
-      }
-      
-      boost::filesystem::path d = s.top();
-      s.pop();
+      // Commit the files that were found during this pass
+      visitor.Finish();
+      database_.FlushWriteBatch();
 
-      boost::filesystem::directory_iterator current;
-    
-      try
+      if (completed)
       {
-        current = boost::filesystem::directory_iterator(d);
-      }
-      catch (boost::filesystem::filesystem_error&)
-      {
-        LOG(WARNING) << "Indexer plugin cannot read directory: " << d.string();
-        continue;
-      }
+        LookupDeletedFiles(generation, scanned, visitor.GetFailures());
 
-      const boost::filesystem::directory_iterator end;
-    
-      while (current != end)
-      {
-        try
-        {
-          const boost::filesystem::file_status status = boost::filesystem::status(current->path());
-          
-          switch (status.type())
-          {
-            case boost::filesystem::regular_file:
-            case boost::filesystem::reparse_file:
-              try
-              {
-                ProcessFile(current->path().string(),
-                            boost::filesystem::last_write_time(current->path()),
-                            boost::filesystem::file_size(current->path()));
-              }
-              catch (Orthanc::OrthancException& e)
-              {
-                LOG(ERROR) << e.What();
-              }              
-              break;
-          
-            case boost::filesystem::directory_file:
-              s.push(current->path());
-              break;
-          
-            default:
-              break;
-          }
-        }
-        catch (boost::filesystem::filesystem_error&)
+        if (allFolders &&
+            !prune)
         {
+          lastFullScan = now;
         }
-
-        ++current;
       }
     }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << e.What();
+    }
+
+    IndexerMetrics::Observe(IndexerMetrics::Histogram_Scan,
+                            (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds());
+    scanController_.FinishScan(completed);
+
+    if (!completed)
+    {
+      IndexerMetrics::Increment(IndexerMetrics::Counter_ScansInterrupted);
+      return;
+    }
+
+    IndexerMetrics::Increment(IndexerMetrics::Counter_ScansCompleted);
+
+    if (!scanController_.WaitForNextScan(targets, requested, intervalSeconds, *stop))
+    {
+      return;
+    }
+  }
+}
+
+
+class WatchListener : public DirectoryWatcher::IListener
+{
+private:
+  const bool&  stop_;
+
+public:
+  explicit WatchListener(const bool& stop) :
+    stop_(stop)
+  {
+  }
+
+  // While the scans are paused, the changes are not processed either
+  // (the events are queued by the kernel meanwhile)
+  virtual void OnFileWritten(const std::string& path) ORTHANC_OVERRIDE
+  {
+    if (!scanController_.WaitWhilePaused(stop_))
+    {
+      return;
+    }
+
+    FileMetadata metadata;
+    if (DirectoryReader::ReadFileMetadata(metadata, path))
+    {
+      ProcessFile(path, metadata);
+    }
+    else
+    {
+      // The file was removed in the meantime
+    }
+  }
+
+  virtual void OnFileRemoved(const std::string& path) ORTHANC_OVERRIDE
+  {
+    if (scanController_.WaitWhilePaused(stop_))
+    {
+      ProcessRemovedFile(path);
+    }
+  }
+
+  virtual void OnDirectoryAdded(const std::string& path) ORTHANC_OVERRIDE
+  {
+    std::list<std::string> folders;
+    folders.push_back(path);
+
+    // Interrupted if Orthanc stops, the rest of the directory being
+    // indexed by the next scan
+    ScanVisitor visitor(false /* no pruning of a new directory */, stop_, true /* from the watcher */);
+    DirectoryCrawler crawler(visitor, stop_, 1);
+    crawler.SetClockSkew(clockSkewSeconds_);
+    crawler.Run(folders);
+    visitor.Finish();
+  }
+
+  virtual void OnResynchronize() ORTHANC_OVERRIDE
+  {
+    // Wake up the monitoring thread for an immediate full rescan
+    scanController_.RequestScan("");
+  }
+};
 
+
+static void WatchDirectories(bool* stop)
+{
+  static const unsigned int SETTLE_MILLISECONDS = 2000;
+
+  WatchListener listener(*stop);
+  std::unique_ptr<DirectoryWatcher> watcher;
+
+  try
+  {
+    watcher.reset(new DirectoryWatcher(listener, SETTLE_MILLISECONDS));
+
+    for (std::list<std::string>::const_iterator it = folders_.begin();
+         it != folders_.end(); ++it)
+    {
+      watcher->AddTree(*it);
+    }
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(ERROR) << "The Indexer plugin cannot watch the folders, only periodic rescans will be done: " << e.What();
+    return;
+  }
+
+  LOG(WARNING) << "The Indexer plugin is watching " << watcher->GetWatchesCount() << " directories";
+
+  while (!*stop)
+  {
     try
     {
-      LookupDeletedFiles();
+      watcher->ProcessEvents(100);
+      database_.FlushWriteBatch();
     }
     catch (Orthanc::OrthancException& e)
     {
       LOG(ERROR) << e.What();
     }
-    
-    for (unsigned int i = 0; i < intervalSeconds * 10; i++)
-    {
-      if (*stop)
-      {
-        return;
-      }
-      
-      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
-    }
   }
 }
 
@@ -286,11 +846,16 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
                                             int64_t size,
                                             OrthancPluginContentType type)
 {
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_StorageCreate);
+  IndexerMetrics::Increment(IndexerMetrics::Counter_StorageCreateBytes, size);
+
   try
   {
+    // The header is parsed once, and shared by all the steps below
+    DicomHeader header;
     std::string instanceId;
     if (type != OrthancPluginContentType_Dicom ||
-      !ComputeInstanceId(instanceId, content, size))
+      !IdentifyBuffer(header, instanceId, content, size))
     {
       // caMicroscope plugin: This must be an Orthanc cache file.
       // Keep it alive with the main Orthanc's database, no sooner, no earlier.
@@ -321,18 +886,28 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
 
       // __builtin_fprintf(stderr, "Check race condition: entered branch\n");
 
-      boost::filesystem::path dicom = realStoragePath;
-      std::string subdir_name = folder_name((const char *) content, size);
-      if (subdir_name != "")
+      if (PartialUpload::IsPending(instanceId))
       {
-        dicom /= subdir_name;
+        // The indexed file was removed while its header was being
+        // uploaded: Orthanc must not store an instance without pixel data
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                        "Indexed file removed during its upload: " + instanceId);
       }
+
+      boost::filesystem::path dicom = realStoragePath;
+      dicom /= folder_name(header.GetSeriesInstanceUid());
       dicom /= std::string(uuid) + ".dcm";
       storageArea_->Create(uuid, content, size, &dicom);
 
-      // Metadata for saving to database
-      std::time_t write_time = boost::filesystem::last_write_time(dicom);
+      // Metadata for saving to database, as the scans will read it
       std::string filepath_string = dicom.string();
+      FileMetadata metadata;
+      if (!DirectoryReader::ReadFileMetadata(metadata, filepath_string))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                        "Cannot read the metadata of the stored file: " + filepath_string);
+      }
+      metadata.size_ = size;
 
       // Fix race condition
       // Orthanc has a quirk to sometimes call StorageCreate twice for new files
@@ -363,15 +938,14 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
       // database_.AddDicomInstance is designed for files found by the indexing thread
       // as it saves the filepath
       database_.AddDicomInstance(filepath_string,
-        write_time,
-        size,
+        metadata,
         instanceId);
       // __builtin_fprintf(stderr, "Check race condition: changed branch\n");
 
       // Pretend to have received it now from processing from Orthanc
       database_.AddAttachment(uuid, instanceId);
       // Notify caMicroscope of the newly received DICOM file
-      camic_notifier::notify("/fs/addedFile?filepath=" + camic_notifier::escape(dicom.lexically_relative(realStoragePath).string()));
+      camic_notifier::notify_added(dicom.lexically_relative(realStoragePath).string());
 
     }
     
@@ -380,10 +954,12 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
   catch (Orthanc::OrthancException& e)
   {
     LOG(ERROR) << e.What();
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageCreateErrors);
     return static_cast<OrthancPluginErrorCode>(e.GetErrorCode());
   }
   catch (...)
   {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageCreateErrors);
     return OrthancPluginErrorCode_InternalError;
   }
 }
@@ -404,27 +980,37 @@ static OrthancPluginErrorCode StorageReadRange(OrthancPluginMemoryBuffer64 *targ
                                                OrthancPluginContentType type,
                                                uint64_t rangeStart)
 {
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_StorageReadRange);
+
   try
   {
     std::string externalPath;
     if (LookupExternalDicom(externalPath, uuid, type))
     {
-      StorageArea::ReadRangeFromPath(target, externalPath, rangeStart);
+      if (prefetcher_.get() != NULL)
+      {
+        prefetcher_->Access(externalPath);
+      }
+
+      ReadRangeFromPath(target, externalPath, rangeStart);
     }
     else
     {
-      storageArea_->ReadRange(target, uuid, rangeStart);
+      ReadRangeFromPath(target, storageArea_->GetPath(uuid), rangeStart);
     }
-    
+
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageReadRangeBytes, target->size);
     return OrthancPluginErrorCode_Success;
   }
   catch (Orthanc::OrthancException& e)
   {
     LOG(ERROR) << e.What();
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageReadRangeErrors);
     return static_cast<OrthancPluginErrorCode>(e.GetErrorCode());
   }
   catch (...)
   {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageReadRangeErrors);
     return OrthancPluginErrorCode_InternalError;
   }
 }
@@ -434,11 +1020,18 @@ static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64 *targ
                                                const char *uuid,
                                                OrthancPluginContentType type)
 {
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_StorageReadWhole);
+
   try
   {
     std::string externalPath;
     if (LookupExternalDicom(externalPath, uuid, type))
     {
+      if (prefetcher_.get() != NULL)
+      {
+        prefetcher_->Access(externalPath);
+      }
+
       StorageArea::ReadWholeFromPath(target, externalPath);
     }
     else
@@ -446,15 +1039,18 @@ static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64 *targ
       storageArea_->ReadWhole(target, uuid);
     }
 
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageReadWholeBytes, target->size);
     return OrthancPluginErrorCode_Success;
   }
   catch (Orthanc::OrthancException& e)
   {
     LOG(ERROR) << e.What();
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageReadWholeErrors);
     return static_cast<OrthancPluginErrorCode>(e.GetErrorCode());
   }
   catch (...)
   {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageReadWholeErrors);
     return OrthancPluginErrorCode_InternalError;
   }
 }
@@ -463,6 +1059,8 @@ static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64 *targ
 static OrthancPluginErrorCode StorageRemove(const char *uuid,
                                             OrthancPluginContentType type)
 {
+  IndexerMetrics::Timer timer(IndexerMetrics::Histogram_StorageRemove);
+
   try
   {
     std::string externalPath;
@@ -475,24 +1073,26 @@ static OrthancPluginErrorCode StorageRemove(const char *uuid,
 
       // Count the number of times a file is recorded as attachment (a file registered with how many UUIDs)
       std::string instanceId;
-      database_.LookupFile(instanceId, externalPath, 0, 0);
+      database_.LookupFile(instanceId, externalPath, FileMetadata());
       int64_t times;
       database_.CountTimesAttached(times, instanceId);
 
       if (times == 0) {
+        InvalidateMappedFile(externalPath);
+
         // Delete the file
         boost::filesystem::path boostPath(externalPath);
         if (boost::filesystem::exists(boostPath))
         {
           try {
-            // Small race condition here for the next two lines, they should execute as one statement
             boost::filesystem::remove(boostPath);
-            database_.RemoveFile(externalPath);
           } catch(...) {
             fprintf(stderr, "file removal failed for %s\n", externalPath.c_str());
           }
         }
-        camic_notifier::notify("/fs/deletedFile?filepath=" + camic_notifier::escape(boostPath.lexically_relative(realStoragePath).string()));
+        camic_notifier::notify_deleted(boostPath.lexically_relative(realStoragePath).string());
+
+        // Only once: a second removal would fail as an unknown file
         database_.RemoveFile(externalPath);
       }
     }
@@ -500,6 +1100,7 @@ static OrthancPluginErrorCode StorageRemove(const char *uuid,
     {
 
       database_.RemoveAttachment(uuid);
+      InvalidateMappedFile(storageArea_->GetPath(uuid));
       storageArea_->RemoveAttachment(uuid);
     }
     
@@ -508,27 +1109,167 @@ static OrthancPluginErrorCode StorageRemove(const char *uuid,
   catch (Orthanc::OrthancException& e)
   {
     LOG(ERROR) << e.What();
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageRemoveErrors);
     return static_cast<OrthancPluginErrorCode>(e.GetErrorCode());
   }
   catch (...)
   {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_StorageRemoveErrors);
     return OrthancPluginErrorCode_InternalError;
   }
 }
 
 
+// "GET /indexer/metrics", in the text format of Prometheus
+static void ServeMetrics(OrthancPluginRestOutput* output,
+                         const char* url,
+                         const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "GET");
+    return;
+  }
+
+  std::string metrics;
+  IndexerMetrics::Format(metrics);
+  IndexerMetrics::FormatGauge(metrics, "indexer_notifications_pending",
+                              "Notifications to caMicroscope waiting in the outbox",
+                              database_.CountNotifications());
+
+  if (mappedFiles_.get() != NULL)
+  {
+    IndexerMetrics::FormatGauge(metrics, "indexer_read_cache_bytes",
+                                "Bytes of the indexed files that are mapped in memory",
+                                static_cast<double>(mappedFiles_->GetMappedBytes()));
+  }
+
+  OrthancPluginAnswerBuffer(context, output, metrics.c_str(), metrics.size(), "text/plain; version=0.0.4");
+}
+
+
+// The subpaths must be normalized as the paths built by the crawler,
+// so that the database has a single entry for each file
+static std::string NormalizeScanPath(const std::string& path)
+{
+  boost::filesystem::path normalized = boost::filesystem::path(path).lexically_normal();
+  if (normalized.filename() == ".")
+  {
+    normalized = normalized.parent_path();  // Trailing separator
+  }
+
+  if (!IsUnderFolders(normalized.string(), folders_))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Not in the folders indexed by the Indexer plugin: " + path);
+  }
+
+  if (!boost::filesystem::is_directory(normalized))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Not a directory: " + path);
+  }
+
+  return normalized.string();
+}
+
+
+// "GET /indexer/scan" gives the progress of the scans. "POST
+// /indexer/scan" requests an immediate scan of all the folders, or
+// of the folder given as "Path" in the JSON body.
+static void ServeScan(OrthancPluginRestOutput* output,
+                      const char* url,
+                      const OrthancPluginHttpRequest* request)
+{
+  static const char* const PATH = "Path";
+
+  if (request->method == OrthancPluginHttpMethod_Post)
+  {
+    std::string path;
+
+    if (request->bodySize != 0)
+    {
+      Json::Value body;
+      if (!OrthancPlugins::ReadJson(body, request->body, request->bodySize) ||
+          body.type() != Json::objectValue ||
+          (body.isMember(PATH) && body[PATH].type() != Json::stringValue))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                        "Expected a JSON object, with an optional \"" + std::string(PATH) + "\" string");
+      }
+
+      if (body.isMember(PATH))
+      {
+        path = NormalizeScanPath(body[PATH].asString());
+      }
+    }
+
+    scanController_.RequestScan(path);
+  }
+  else if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET,POST");
+    return;
+  }
+
+  Json::Value answer;
+  scanController_.Format(answer);
+  OrthancPlugins::AnswerJson(answer, output);
+}
+
+
+// "POST /indexer/scan/pause" and "POST /indexer/scan/resume"
+static void ServeScanControl(OrthancPluginRestOutput* output,
+                             const char* url,
+                             const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "POST");
+    return;
+  }
+
+  if (std::string(request->groups[0]) == "pause")
+  {
+    LOG(WARNING) << "The scans of the Indexer plugin are paused";
+    scanController_.Pause();
+  }
+  else
+  {
+    LOG(WARNING) << "The scans of the Indexer plugin are resumed";
+    scanController_.Resume();
+  }
+
+  Json::Value answer;
+  scanController_.Format(answer);
+  OrthancPlugins::AnswerJson(answer, output);
+}
+
+
 static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
                                                OrthancPluginResourceType resourceType,
                                                const char* resourceId)
 {
   static bool stop_;
   static boost::thread thread_;
+  static boost::thread watchThread_;
 
   switch (changeType)
   {
     case OrthancPluginChangeType_OrthancStarted:
       stop_ = false;
-      thread_ = boost::thread(MonitorDirectories, &stop_, intervalSeconds_);
+
+      if (watch_)
+      {
+        // The periodic full rescans are only a safety net for the changes missed by inotify
+        thread_ = boost::thread(MonitorDirectories, &stop_, rescanIntervalSeconds_);
+        watchThread_ = boost::thread(WatchDirectories, &stop_);
+      }
+      else
+      {
+        thread_ = boost::thread(MonitorDirectories, &stop_, intervalSeconds_);
+      }
       break;
 
     case OrthancPluginChangeType_OrthancStopped:
@@ -537,6 +1278,13 @@ static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeTyp
       {
         thread_.join();
       }
+
+      if (watchThread_.joinable())
+      {
+        watchThread_.join();
+      }
+
+      camic_notifier::finalize();
       
       break;
 
@@ -591,10 +1339,42 @@ extern "C"
         static const char* const ORTHANC_STORAGE = "OrthancStorage";
         static const char* const STORAGE_DIRECTORY = "StorageDirectory";
         static const char* const INTERVAL = "Interval";
+        static const char* const SCAN_THREADS = "ScanThreads";
+        static const char* const IDENTIFICATION_THREADS = "IdentificationThreads";
+        static const char* const UPLOAD_THREADS = "UploadThreads";
+        static const char* const WATCH = "Watch";
+        static const char* const RESCAN_INTERVAL = "RescanInterval";
+        static const char* const FULL_SCAN_INTERVAL = "FullScanInterval";
+        static const char* const CLOCK_SKEW = "ClockSkew";
+        static const char* const READ_CONNECTIONS = "ReadConnections";
+        static const char* const WRITE_BATCH_SIZE = "WriteBatchSize";
+        static const char* const CACHE_SIZE = "CacheSize";
+        static const char* const READ_CACHE_SIZE = "ReadCacheSize";
+        static const char* const READ_CACHE_FILES = "ReadCacheFiles";
+        static const char* const READ_AHEAD_FILES = "ReadAheadFiles";
+        static const char* const READ_AHEAD_SIZE = "ReadAheadSize";
+        static const char* const HEADER_ONLY_UPLOAD = "HeaderOnlyUpload";
         static const char *const STORE_DICOM = "StoreDICOM";
         static const char *const STORAGE_COMPRESSION = "StorageCompression";
 
         intervalSeconds_ = indexer.GetUnsignedIntegerValue(INTERVAL, 10 /* 10 seconds by default */);
+        scanThreads_ = indexer.GetUnsignedIntegerValue(SCAN_THREADS, 1 /* single-threaded scan by default */);
+
+        if (scanThreads_ == 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                          "The Indexer plugin needs at least one scan thread: " + std::string(SCAN_THREADS));
+        }
+
+        identificationThreads_ = indexer.GetUnsignedIntegerValue(IDENTIFICATION_THREADS, 4);
+        uploadThreads_ = indexer.GetUnsignedIntegerValue(UPLOAD_THREADS, 2);
+
+        if (identificationThreads_ != 0 &&
+            uploadThreads_ == 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                          "The Indexer plugin needs at least one upload thread: " + std::string(UPLOAD_THREADS));
+        }
         
         if (!indexer.LookupListOfStrings(folders_, FOLDERS, true) ||
             folders_.empty())
@@ -609,6 +1389,50 @@ extern "C"
           LOG(WARNING) << "The Indexer plugin will monitor the content of folder: " << *it;
         }
 
+        LOG(WARNING) << "Number of threads used by the Indexer plugin to scan the folders: " << scanThreads_;
+
+        if (identificationThreads_ == 0)
+        {
+          LOG(WARNING) << "The files are identified and uploaded by the scan threads of the Indexer plugin";
+        }
+        else
+        {
+          LOG(WARNING) << "Number of threads used by the Indexer plugin to identify the files: " << identificationThreads_
+                       << ", and to upload them to Orthanc: " << uploadThreads_;
+        }
+
+        headerOnlyUpload_ = indexer.GetBooleanValue(HEADER_ONLY_UPLOAD, false);
+
+        if (headerOnlyUpload_)
+        {
+          LOG(WARNING) << "The Indexer plugin only uploads the DICOM attributes before the pixel data to Orthanc";
+        }
+
+        watch_ = indexer.GetBooleanValue(WATCH, false);
+        rescanIntervalSeconds_ = indexer.GetUnsignedIntegerValue(RESCAN_INTERVAL, 3600 /* 1 hour by default */);
+        fullScanIntervalSeconds_ = indexer.GetUnsignedIntegerValue(FULL_SCAN_INTERVAL, 0 /* every scan is full by default */);
+        clockSkewSeconds_ = indexer.GetUnsignedIntegerValue(CLOCK_SKEW, 2 /* seconds */);
+
+        if (fullScanIntervalSeconds_ != 0)
+        {
+          LOG(WARNING) << "The Indexer plugin will only list the modified directories, with a full scan every "
+                       << fullScanIntervalSeconds_ << " seconds";
+        }
+
+        if (watch_ &&
+            !DirectoryWatcher::IsSupported())
+        {
+          LOG(WARNING) << "Watching the indexed folders is only available on Linux, "
+                       << "falling back to periodic rescans";
+          watch_ = false;
+        }
+
+        if (watch_)
+        {
+          LOG(WARNING) << "The Indexer plugin will watch the folders for changes, with a full rescan every "
+                       << rescanIntervalSeconds_ << " seconds";
+        }
+
         std::string path;
         if (!indexer.LookupStringValue(path, DATABASE))
         {
@@ -622,8 +1446,78 @@ extern "C"
           path = (boost::filesystem::path(folder) / "indexer-plugin.db").string();
         }
         
-        LOG(WARNING) << "Path to the database of the Indexer plugin: " << path;
-        database_.Open(path);
+        const unsigned int readConnections = indexer.GetUnsignedIntegerValue(
+          READ_CONNECTIONS, 4 /* 4 read-only connections by default */);
+
+        LOG(WARNING) << "Path to the database of the Indexer plugin: " << path
+                     << " (with " << readConnections << " read-only connections)";
+        database_.Open(path, readConnections);
+
+        // Deliver the notifications to caMicroscope, including those left by the previous run
+        camic_notifier::start(database_);
+
+        const unsigned int writeBatchSize = indexer.GetUnsignedIntegerValue(
+          WRITE_BATCH_SIZE, 1000 /* files per transaction by default */);
+
+        if (writeBatchSize == 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                          "The Indexer plugin needs a positive batch size: " + std::string(WRITE_BATCH_SIZE));
+        }
+
+        // The batch is also committed after 1 second, so that the storage
+        // area does not wait too long for the files found by the scanner
+        database_.SetWriteBatch(writeBatchSize, 1000 /* milliseconds */);
+
+        const unsigned int cacheSize = indexer.GetUnsignedIntegerValue(
+          CACHE_SIZE, 0 /* no in-memory mirror of the attachments by default */);
+
+        if (cacheSize != 0)
+        {
+          LOG(WARNING) << "The Indexer plugin mirrors its attachments in memory, up to "
+                       << cacheSize << "MB";
+          database_.EnableCache(static_cast<size_t>(cacheSize) * 1024 * 1024);
+        }
+
+        const unsigned int readCacheSize = indexer.GetUnsignedIntegerValue(
+          READ_CACHE_SIZE, 0 /* no memory mapping of the files read by ranges by default */);
+        const unsigned int readCacheFiles = indexer.GetUnsignedIntegerValue(READ_CACHE_FILES, 256);
+
+        if (readCacheSize != 0)
+        {
+          if (readCacheFiles == 0)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "The Indexer plugin needs a positive number of files: " + std::string(READ_CACHE_FILES));
+          }
+
+          LOG(WARNING) << "The Indexer plugin keeps the files read by ranges mapped in memory, up to "
+                       << readCacheSize << "MB and " << readCacheFiles << " files";
+          mappedFiles_.reset(new MappedFilesCache(static_cast<uint64_t>(readCacheSize) * 1024 * 1024, readCacheFiles));
+        }
+
+        const unsigned int readAheadFiles = indexer.GetUnsignedIntegerValue(
+          READ_AHEAD_FILES, 0 /* no read-ahead of the series by default */);
+        const unsigned int readAheadSize = indexer.GetUnsignedIntegerValue(READ_AHEAD_SIZE, 16 /* MB */);
+
+        if (readAheadFiles != 0)
+        {
+          if (readAheadSize == 0)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "The Indexer plugin needs a positive size: " + std::string(READ_AHEAD_SIZE));
+          }
+          else if (!ReadAheadPrefetcher::IsSupported())
+          {
+            LOG(WARNING) << "The read-ahead of the series is only available on Linux, it is disabled";
+          }
+          else
+          {
+            LOG(WARNING) << "The Indexer plugin loads the next " << readAheadFiles
+                         << " files of the series being read, up to " << readAheadSize << "MB per file";
+            prefetcher_.reset(new ReadAheadPrefetcher(readAheadFiles, static_cast<uint64_t>(readAheadSize) * 1024 * 1024));
+          }
+        }
 
         // caMicroscope: the "root" of the storageArea_ is now used only for non-DICOM files,
         // which are probably cache files, if any. To destroy them when the main Orthanc
@@ -666,6 +1560,9 @@ extern "C"
 
       OrthancPluginRegisterOnChangeCallback(context, OnChangeCallback);
       OrthancPluginRegisterStorageArea2(context, StorageCreate, StorageReadWhole, StorageReadRange, StorageRemove);
+      OrthancPlugins::RegisterRestCallback<ServeMetrics>("/indexer/metrics", true);
+      OrthancPlugins::RegisterRestCallback<ServeScan>("/indexer/scan", true);
+      OrthancPlugins::RegisterRestCallback<ServeScanControl>("/indexer/scan/(pause|resume)", true);
     }
     else
     {
@@ -679,6 +1576,8 @@ extern "C"
   ORTHANC_PLUGINS_API void OrthancPluginFinalize()
   {
     OrthancPlugins::LogWarning("Folder indexer plugin is finalizing");
+    prefetcher_.reset();
+    mappedFiles_.reset();
   }
 
 
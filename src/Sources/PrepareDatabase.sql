@@ -1,10 +1,39 @@
+-- Version of the database schema is stored as property 1
+CREATE TABLE GlobalProperties(
+       property INTEGER PRIMARY KEY,
+       value TEXT
+       );
+
+INSERT INTO GlobalProperties VALUES(1, '2');
+
+-- Interned directories, so that the paths are not repeated in each
+-- row of "Files". The full path of a directory is the full path of
+-- its parent, a slash, then its name. The top-level directories have
+-- "0" as parent, and their name is their full path.
+CREATE TABLE Directories(
+       id INTEGER PRIMARY KEY,
+       parent INTEGER NOT NULL,
+       name TEXT NOT NULL,
+       time INTEGER  -- Modification time when last fully listed, NULL if unknown
+       );
+
+CREATE UNIQUE INDEX DirectoriesIndex ON Directories(parent, name);
+
+-- The "instanceId" columns contain the Orthanc identifiers as 20-byte
+-- blobs, and the other strings as text (empty for non-DICOM files).
+-- The files whose path contains no slash have "0" as directory.
 CREATE TABLE Files(
-       path TEXT PRIMARY KEY NOT NULL,
+       directory INTEGER NOT NULL,
+       name TEXT NOT NULL,
        time INTEGER NOT NULL,
        size INTEGER NOT NULL,
        isDicom INTEGER NOT NULL,
-       instanceId TEXT NOT NULL
-       );
+       instanceId NOT NULL,
+       generation INTEGER NOT NULL DEFAULT 0,  -- Last scan that has seen the file
+       nanoseconds INTEGER,  -- Sub-second part of "time", NULL if unknown
+       inode INTEGER,        -- NULL or 0 if unknown
+       PRIMARY KEY(directory, name)
+       ) WITHOUT ROWID;
 
 CREATE TABLE Attachments(
        uuid TEXT PRIMARY KEY NOT NULL,
@@ -12,3 +41,14 @@ CREATE TABLE Attachments(
        );
 
 CREATE INDEX InstancesIndex ON Files(instanceId);
+
+-- Outbox of the notifications to caMicroscope, replayed in the order
+-- of their sequence number until they are delivered. This table is
+-- kept by the upgrades from version 1 of the schema.
+CREATE TABLE IF NOT EXISTS Notifications(
+       sequence INTEGER PRIMARY KEY AUTOINCREMENT,
+       filepath TEXT NOT NULL,
+       added INTEGER NOT NULL
+       );
+
+CREATE INDEX IF NOT EXISTS NotificationsIndex ON Notifications(filepath);
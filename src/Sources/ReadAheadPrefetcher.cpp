@@ -0,0 +1,338 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ReadAheadPrefetcher.h"
+
+#include "IndexerMetrics.h"
+
+#include <OrthancException.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+
+// Two distinct files of a directory that are read within this delay
+// are taken as a walk through the series
+static const boost::posix_time::time_duration SEQUENCE_WINDOW = boost::posix_time::seconds(10);
+
+// The files of a directory that has not been read for this delay may
+// have been evicted from the page cache, they can be loaded again
+static const boost::posix_time::time_duration EXPIRATION = boost::posix_time::seconds(60);
+
+// The files that are added to a directory are seen after this delay
+static const boost::posix_time::time_duration LISTING_LIFETIME = boost::posix_time::seconds(10);
+
+static const size_t MAX_DIRECTORIES = 256;
+
+// A directory with more entries is not a series (e.g. the root of an
+// indexed folder), its listing is abandoned beyond this number
+static const size_t MAX_LISTED_FILES = 10000;
+
+// The oldest pending read-ahead is dropped beyond this number
+static const size_t MAX_JOBS = 16;
+
+
+static bool SplitPath(std::string& directory,
+                      std::string& file,
+                      const std::string& path)
+{
+  const size_t separator = path.find_last_of("/\\");
+
+  if (separator == std::string::npos ||
+      separator == 0 ||
+      separator + 1 == path.size())
+  {
+    return false;
+  }
+  else
+  {
+    directory = path.substr(0, separator);
+    file = path.substr(separator + 1);
+    return true;
+  }
+}
+
+
+void ReadAheadPrefetcher::Worker()
+{
+  for (;;)
+  {
+    Job job;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (jobs_.empty() &&
+             !stop_)
+      {
+        condition_.wait(lock);
+      }
+
+      if (stop_)
+      {
+        return;
+      }
+
+      job = jobs_.front();
+      jobs_.pop_front();
+    }
+
+    try
+    {
+      PrefetchNext((boost::filesystem::path(job.directory_) / job.file_).string());
+    }
+    catch (...)
+    {
+      // The directory was removed in the meantime, or cannot be listed
+    }
+  }
+}
+
+
+void ReadAheadPrefetcher::Advise(const std::string& path)
+{
+#if defined(__linux__)
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    // Asynchronous: the kernel starts reading, without waiting for the pages
+    if (posix_fadvise(fd, 0, maxBytesPerFile_, POSIX_FADV_WILLNEED) == 0)
+    {
+      IndexerMetrics::Increment(IndexerMetrics::Counter_ReadAheadFiles);
+    }
+
+    close(fd);
+  }
+#endif
+}
+
+
+bool ReadAheadPrefetcher::IsSupported()
+{
+#if defined(__linux__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+ReadAheadPrefetcher::ReadAheadPrefetcher(unsigned int maxFiles,
+                                         uint64_t maxBytesPerFile) :
+  maxFiles_(maxFiles),
+  maxBytesPerFile_(maxBytesPerFile),
+  stop_(false)
+{
+  if (maxFiles == 0 ||
+      maxBytesPerFile == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  thread_ = boost::thread(&ReadAheadPrefetcher::Worker, this);
+}
+
+
+ReadAheadPrefetcher::~ReadAheadPrefetcher()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+    condition_.notify_all();
+  }
+
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+}
+
+
+bool ReadAheadPrefetcher::Access(const std::string& path)
+{
+  std::string directory, file;
+  if (!IsSupported() ||
+      !SplitPath(directory, file, path))
+  {
+    return false;
+  }
+
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (directories_.size() >= MAX_DIRECTORIES &&
+      directories_.find(directory) == directories_.end())
+  {
+    // Forget the directory that was read the least recently
+    std::unordered_map<std::string, Directory>::iterator oldest = directories_.begin();
+    for (std::unordered_map<std::string, Directory>::iterator it = directories_.begin();
+         it != directories_.end(); ++it)
+    {
+      if (it->second.lastAccess_ < oldest->second.lastAccess_)
+      {
+        oldest = it;
+      }
+    }
+
+    directories_.erase(oldest);
+  }
+
+  Directory& state = directories_[directory];
+
+  if (!state.lastAccess_.is_not_a_date_time() &&
+      now - state.lastAccess_ > EXPIRATION)
+  {
+    state = Directory();
+  }
+
+  const bool sequence = (!state.lastFile_.empty() &&
+                         state.lastFile_ != file &&
+                         now - state.lastAccess_ <= SEQUENCE_WINDOW);
+
+  state.lastFile_ = file;
+  state.lastAccess_ = now;
+  state.prefetched_.insert(file);
+
+  if (!sequence ||
+      state.tooLarge_)
+  {
+    return false;
+  }
+
+  // A pending read-ahead of the same directory now starts from this file
+  for (std::deque<Job>::iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+  {
+    if (it->directory_ == directory)
+    {
+      it->file_ = file;
+      return true;
+    }
+  }
+
+  if (jobs_.size() >= MAX_JOBS)
+  {
+    jobs_.pop_front();
+  }
+
+  Job job;
+  job.directory_ = directory;
+  job.file_ = file;
+  jobs_.push_back(job);
+  condition_.notify_one();
+
+  return true;
+}
+
+
+unsigned int ReadAheadPrefetcher::PrefetchNext(const std::string& path)
+{
+  std::string directory, file;
+  if (!SplitPath(directory, file, path))
+  {
+    return 0;
+  }
+
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  std::vector<std::string> files;
+  bool listed = false;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::unordered_map<std::string, Directory>::const_iterator found = directories_.find(directory);
+    if (found == directories_.end() ||
+        found->second.tooLarge_)
+    {
+      return 0;  // Evicted since the read-ahead was scheduled, or not a series
+    }
+    else if (!found->second.files_.empty() &&
+             now - found->second.listed_ <= LISTING_LIFETIME)
+    {
+      files = found->second.files_;
+      listed = true;
+    }
+  }
+
+  bool tooLarge = false;
+
+  if (!listed)
+  {
+    // Listed without the lock, as the directory can be large
+    for (boost::filesystem::directory_iterator it(directory);
+         it != boost::filesystem::directory_iterator(); ++it)
+    {
+      if (files.size() == MAX_LISTED_FILES)
+      {
+        tooLarge = true;
+        files.clear();
+        break;
+      }
+
+      files.push_back(it->path().filename().string());
+    }
+
+    std::sort(files.begin(), files.end());
+  }
+
+  // The next files, that were neither read nor loaded yet
+  std::vector<std::string> next;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::unordered_map<std::string, Directory>::iterator found = directories_.find(directory);
+    if (found == directories_.end())
+    {
+      return 0;  // Evicted while being listed
+    }
+
+    Directory& state = found->second;
+
+    if (!listed)
+    {
+      state.files_ = files;
+      state.listed_ = now;
+      state.tooLarge_ = tooLarge;
+    }
+
+    std::vector<std::string>::const_iterator it = std::upper_bound(files.begin(), files.end(), file);
+    for (unsigned int i = 0; i < maxFiles_ && it != files.end(); i++, ++it)
+    {
+      if (state.prefetched_.insert(*it).second)
+      {
+        next.push_back(*it);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < next.size(); i++)
+  {
+    Advise((boost::filesystem::path(directory) / next[i]).string());
+  }
+
+  return static_cast<unsigned int>(next.size());
+}
@@ -0,0 +1,105 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <deque>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/**
+ * Read-ahead of the DICOM files of a series while a viewer scrolls
+ * through it. The files of a series share a directory (the files
+ * received by Orthanc are stored in the folder named after the MD5 of
+ * their Series Instance UID), so reading two distinct files of the
+ * same directory in a short time is taken as the start of a walk
+ * through the series. The background thread then asks the kernel to
+ * load the next files of the directory (in the order of their names)
+ * into the page cache, so that the reads of a series that is not in
+ * the cache are not bounded by the latency of each file. Only
+ * available on Linux (posix_fadvise).
+ **/
+class ReadAheadPrefetcher : public boost::noncopyable
+{
+private:
+  struct Directory
+  {
+    std::string               lastFile_;
+    boost::posix_time::ptime  lastAccess_;
+    boost::posix_time::ptime  listed_;
+    std::vector<std::string>  files_;      // Sorted names, empty if not listed yet
+    std::set<std::string>     prefetched_;  // Including the files that were read
+    bool                      tooLarge_;    // Not a series, never read ahead
+
+    Directory() :
+      tooLarge_(false)
+    {
+    }
+  };
+
+  struct Job
+  {
+    std::string  directory_;
+    std::string  file_;
+  };
+
+  unsigned int                                 maxFiles_;
+  uint64_t                                     maxBytesPerFile_;
+  boost::mutex                                 mutex_;
+  boost::condition_variable                    condition_;
+  bool                                         stop_;
+  std::unordered_map<std::string, Directory>  directories_;
+  std::deque<Job>                              jobs_;
+  boost::thread                                thread_;
+
+  void Worker();
+
+  void Advise(const std::string& path);
+
+public:
+  static bool IsSupported();
+
+  // Starts the background thread. "maxFiles" files are loaded after
+  // the file being read, and at most "maxBytesPerFile" of each file.
+  ReadAheadPrefetcher(unsigned int maxFiles,
+                      uint64_t maxBytesPerFile);
+
+  ~ReadAheadPrefetcher();
+
+  // Invoked by the storage area for each read of a file. Returns
+  // "true" iff. a read-ahead was scheduled.
+  bool Access(const std::string& path);
+
+  // Loads the files that follow "path" in its directory, unless they
+  // were already loaded. Only the directories that are tracked by
+  // "Access()" are read ahead, and the directories that contain too
+  // many files to be a series are ignored. Done by the background
+  // thread, but public for the tests. Returns the number of files.
+  unsigned int PrefetchNext(const std::string& path);
+};
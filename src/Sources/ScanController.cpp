@@ -0,0 +1,269 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ScanController.h"
+
+#include <algorithm>
+
+
+// The "stop" flags of the plugin are polled
+static const boost::posix_time::time_duration POLL_INTERVAL = boost::posix_time::milliseconds(100);
+
+
+static Json::Value FormatPaths(const std::list<std::string>& paths)
+{
+  Json::Value result = Json::arrayValue;
+
+  for (std::list<std::string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+  {
+    result.append(*it);
+  }
+
+  return result;
+}
+
+
+ScanController::ScanController() :
+  paused_(false),
+  fullScanRequested_(false),
+  scanning_(false),
+  allFolders_(false),
+  pruned_(false),
+  visitedFiles_(0),
+  visitedDirectories_(0),
+  hasLastScan_(false)
+{
+  expectedFiles_[0] = 0;
+  expectedFiles_[1] = 0;
+}
+
+
+void ScanController::Pause()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  paused_ = true;
+}
+
+
+void ScanController::Resume()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  paused_ = false;
+  condition_.notify_all();
+}
+
+
+bool ScanController::IsPaused()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return paused_;
+}
+
+
+bool ScanController::WaitWhilePaused(const bool& stop)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  while (paused_ &&
+         !stop)
+  {
+    condition_.timed_wait(lock, POLL_INTERVAL);
+  }
+
+  return !stop;
+}
+
+
+void ScanController::RequestScan(const std::string& path)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (path.empty())
+  {
+    fullScanRequested_ = true;
+  }
+  else if (std::find(requestedPaths_.begin(), requestedPaths_.end(), path) == requestedPaths_.end())
+  {
+    requestedPaths_.push_back(path);
+  }
+
+  condition_.notify_all();
+}
+
+
+bool ScanController::WaitForNextScan(std::list<std::string>& targets,
+                                     bool& requested,
+                                     unsigned int seconds,
+                                     const bool& stop)
+{
+  const boost::posix_time::ptime deadline =
+    boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(seconds);
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (;;)
+  {
+    if (stop)
+    {
+      return false;
+    }
+
+    if (!paused_ &&
+        (fullScanRequested_ || !requestedPaths_.empty()))
+    {
+      // A requested scan of all the folders covers the requested subpaths
+      if (fullScanRequested_)
+      {
+        targets.clear();
+      }
+      else
+      {
+        targets = requestedPaths_;
+      }
+
+      fullScanRequested_ = false;
+      requestedPaths_.clear();
+      requested = true;
+      return true;
+    }
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if (now >= deadline)
+    {
+      // Periodic scan, the requests (if paused) are kept for later
+      targets.clear();
+      requested = false;
+      return true;
+    }
+
+    condition_.timed_wait(lock, std::min(deadline - now, POLL_INTERVAL));
+  }
+}
+
+
+void ScanController::StartScan(const std::list<std::string>& targets,
+                               bool allFolders,
+                               bool pruned)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  scanning_ = true;
+  allFolders_ = allFolders;
+  pruned_ = pruned;
+  targets_ = targets;
+  currentDirectory_.clear();
+  start_ = boost::posix_time::microsec_clock::universal_time();
+  visitedFiles_ = 0;
+  visitedDirectories_ = 0;
+}
+
+
+void ScanController::VisitDirectory(const std::string& path)
+{
+  visitedDirectories_++;
+
+  boost::mutex::scoped_lock lock(mutex_);
+  currentDirectory_ = path;
+}
+
+
+void ScanController::FinishScan(bool completed)
+{
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (completed &&
+      allFolders_)
+  {
+    expectedFiles_[pruned_ ? 1 : 0] = visitedFiles_;
+  }
+
+  lastScan_ = Json::objectValue;
+  lastScan_["Targets"] = FormatPaths(targets_);
+  lastScan_["AllFolders"] = allFolders_;
+  lastScan_["Pruned"] = pruned_;
+  lastScan_["Completed"] = completed;
+  lastScan_["Duration"] = static_cast<double>((now - start_).total_milliseconds()) / 1000.0;
+  lastScan_["VisitedFiles"] = static_cast<Json::UInt64>(visitedFiles_);
+  lastScan_["VisitedDirectories"] = static_cast<Json::UInt64>(visitedDirectories_);
+  lastScan_["End"] = boost::posix_time::to_iso_string(now);
+
+  hasLastScan_ = true;
+  scanning_ = false;
+}
+
+
+void ScanController::Format(Json::Value& target)
+{
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  target = Json::objectValue;
+  target["State"] = (paused_ ? "Paused" : scanning_ ? "Scanning" : "Idle");
+  target["PendingFullScan"] = fullScanRequested_;
+  target["PendingPaths"] = FormatPaths(requestedPaths_);
+
+  if (scanning_)
+  {
+    const uint64_t files = visitedFiles_;
+    const uint64_t expected = expectedFiles_[pruned_ ? 1 : 0];
+    const double elapsed = static_cast<double>((now - start_).total_milliseconds()) / 1000.0;
+
+    Json::Value current = Json::objectValue;
+    current["Targets"] = FormatPaths(targets_);
+    current["AllFolders"] = allFolders_;
+    current["Pruned"] = pruned_;
+    current["CurrentDirectory"] = currentDirectory_;
+    current["VisitedFiles"] = static_cast<Json::UInt64>(files);
+    current["VisitedDirectories"] = static_cast<Json::UInt64>(visitedDirectories_);
+    current["Elapsed"] = elapsed;
+
+    // Extrapolated from the number of files of the previous scan of
+    // the same kind, that is only known for the scans of all the folders
+    if (allFolders_ &&
+        files != 0 &&
+        expected != 0)
+    {
+      current["ExpectedFiles"] = static_cast<Json::UInt64>(expected);
+      current["RemainingSeconds"] = (files >= expected ? 0.0 :
+                                     elapsed * static_cast<double>(expected - files) / static_cast<double>(files));
+    }
+    else
+    {
+      current["ExpectedFiles"] = Json::nullValue;
+      current["RemainingSeconds"] = Json::nullValue;
+    }
+
+    target["CurrentScan"] = current;
+  }
+  else
+  {
+    target["CurrentScan"] = Json::nullValue;
+  }
+
+  if (hasLastScan_)
+  {
+    target["LastScan"] = lastScan_;
+  }
+  else
+  {
+    target["LastScan"] = Json::nullValue;
+  }
+}
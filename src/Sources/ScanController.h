@@ -0,0 +1,115 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <json/value.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <list>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * Schedule and progress of the scans of the indexed folders. The
+ * monitoring thread waits on this object between two scans, which
+ * lets the REST API request an immediate scan (of all the folders,
+ * or of some subpaths only), and pause or resume the scans. While
+ * paused, the crawler threads block before the next directory or
+ * file, so a scan in progress is suspended and not aborted.
+ **/
+class ScanController : public boost::noncopyable
+{
+private:
+  boost::mutex               mutex_;
+  boost::condition_variable  condition_;
+  bool                       paused_;
+  bool                       fullScanRequested_;
+  std::list<std::string>     requestedPaths_;
+
+  // Progress of the current scan
+  bool                       scanning_;
+  bool                       allFolders_;  // All the indexed folders are scanned
+  bool                       pruned_;
+  std::list<std::string>     targets_;
+  std::string                currentDirectory_;
+  boost::posix_time::ptime   start_;
+  std::atomic<uint64_t>      visitedFiles_;
+  std::atomic<uint64_t>      visitedDirectories_;
+
+  // Files visited by the last completed scan of all the folders,
+  // without and with pruning, to estimate the remaining time
+  uint64_t                   expectedFiles_[2];
+
+  // Summary of the last scan
+  bool                       hasLastScan_;
+  Json::Value                lastScan_;
+
+public:
+  ScanController();
+
+  void Pause();
+
+  void Resume();
+
+  bool IsPaused();
+
+  // Blocks while the scans are paused. Returns "false" iff. "stop"
+  // was set in the meantime.
+  bool WaitWhilePaused(const bool& stop);
+
+  // An empty path requests a scan of all the folders
+  void RequestScan(const std::string& path);
+
+  /**
+   * Waits until the next scan is due, i.e. after "seconds" or as soon
+   * as a scan is requested. "targets" receives the requested subpaths
+   * (empty for all the folders), and "requested" is set to "false"
+   * for a periodic scan. Returns "false" iff. "stop" was set.
+   **/
+  bool WaitForNextScan(std::list<std::string>& targets,
+                       bool& requested,
+                       unsigned int seconds,
+                       const bool& stop);
+
+  // "targets" are the scanned paths, "allFolders" means that they are
+  // all the indexed folders
+  void StartScan(const std::list<std::string>& targets,
+                 bool allFolders,
+                 bool pruned);
+
+  void VisitDirectory(const std::string& path);
+
+  void VisitFile()
+  {
+    visitedFiles_++;
+  }
+
+  void FinishScan(bool completed);
+
+  // Current state, progress of the current scan, and summary of the
+  // last scan
+  void Format(Json::Value& target);
+};
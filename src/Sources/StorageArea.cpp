@@ -28,6 +28,13 @@
 
 #include <boost/filesystem.hpp>
 
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
 
 static boost::filesystem::path GetPathInternal(const std::string& root,
                                                const std::string& uuid)
@@ -51,9 +58,8 @@ static boost::filesystem::path GetPathInternal(const std::string& root,
 }
 
 
-static void CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
-                                const char *data,
-                                uintmax_t length)
+static void AllocateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
+                                  uintmax_t length)
 {
   OrthancPluginErrorCode code = OrthancPluginCreateMemoryBuffer64(
     OrthancPlugins::GetGlobalContext(), target, length);
@@ -61,11 +67,6 @@ static void CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
   if (code == OrthancPluginErrorCode_Success)
   {
     assert(length == target->size);
-
-    if (length != 0)
-    {
-      memcpy(target->data, data, length);
-    }
   }
   else
   {
@@ -74,11 +75,18 @@ static void CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
 }
 
 
+#if defined(_WIN32)
+
 void StorageArea::ReadWholeFromPath(OrthancPluginMemoryBuffer64 *target,
                                     const std::string& path)
 {
   FileMemoryMap reader = FileMemoryMap(path);
-  CreateOrthancBuffer(target, reader.data(), reader.length());
+  AllocateOrthancBuffer(target, reader.length());
+
+  if (reader.length() != 0)
+  {
+    memcpy(target->data, reader.data(), reader.length());
+  }
 }   
   
 
@@ -97,6 +105,139 @@ void StorageArea::ReadRangeFromPath(OrthancPluginMemoryBuffer64 *target,
   }
 }
 
+#else
+
+static void ReadFromDescriptor(int fd,
+                               void* target,
+                               uint64_t offset,
+                               uint64_t size)
+{
+  static const size_t CHUNK_SIZE = 8 * 1024 * 1024;
+
+  char* current = reinterpret_cast<char*>(target);
+
+  while (size > 0)
+  {
+    // The chunks are aligned on multiples of CHUNK_SIZE in the file
+    size_t chunk = CHUNK_SIZE - static_cast<size_t>(offset % CHUNK_SIZE);
+    if (chunk > size)
+    {
+      chunk = static_cast<size_t>(size);
+    }
+
+    const ssize_t count = pread(fd, current, chunk, offset);
+
+    if (count < 0 &&
+        errno == EINTR)
+    {
+      continue;
+    }
+    else if (count <= 0)
+    {
+      // I/O error, or the file was truncated in the meantime
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+    else
+    {
+      current += count;
+      offset += count;
+      size -= count;
+    }
+  }
+}
+
+
+/**
+ * Reads the indexed files directly into the buffers of Orthanc, which
+ * avoids the intermediate copy of a memory mapping (the DICOM files
+ * of whole-slide images can weigh several GB).
+ **/
+class FileReader : public boost::noncopyable
+{
+private:
+  int  fd_;
+
+public:
+  explicit FileReader(const std::string& path)
+  {
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot open file: " + path);
+    }
+  }
+
+  ~FileReader()
+  {
+    close(fd_);
+  }
+
+  uint64_t GetSize() const
+  {
+    struct stat info;
+    if (fstat(fd_, &info) != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+    else
+    {
+      return static_cast<uint64_t>(info.st_size);
+    }
+  }
+
+  void Read(void* target,
+            uint64_t offset,
+            uint64_t size)
+  {
+#if defined(__linux__)
+    // Lets the kernel read ahead aggressively, the whole range is needed
+    posix_fadvise(fd_, offset, size, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    ReadFromDescriptor(fd_, target, offset, size);
+  }
+};
+
+
+void StorageArea::ReadWholeFromPath(OrthancPluginMemoryBuffer64 *target,
+                                    const std::string& path)
+{
+  FileReader reader(path);
+
+  const uint64_t size = reader.GetSize();
+  AllocateOrthancBuffer(target, size);
+
+  try
+  {
+    reader.Read(target->data, 0, size);
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    OrthancPluginFreeMemoryBuffer64(OrthancPlugins::GetGlobalContext(), target);
+    throw;
+  }
+}   
+  
+
+void StorageArea::ReadRangeFromPath(OrthancPluginMemoryBuffer64 *target,
+                                    const std::string& path,
+                                    uint64_t rangeStart)
+{
+  FileReader reader(path);
+  reader.Read(target->data, rangeStart, target->size);
+}
+
+
+void StorageArea::ReadRangeFromDescriptor(OrthancPluginMemoryBuffer64 *target,
+                                          int fd,
+                                          uint64_t rangeStart)
+{
+  ReadFromDescriptor(fd, target->data, rangeStart, target->size);
+}
+
+#endif
+
 
 StorageArea::StorageArea(const std::string& root) :
   root_(root)
@@ -38,6 +38,13 @@ public:
                                 const std::string& path,
                                 uint64_t rangeStart);
 
+#if !defined(_WIN32)
+  // Same as "ReadRangeFromPath()", from a file that is already open
+  static void ReadRangeFromDescriptor(OrthancPluginMemoryBuffer64 *target,
+                                      int fd,
+                                      uint64_t rangeStart);
+#endif
+
   explicit StorageArea(const std::string& root);
   
   void Create(const std::string& uuid,
@@ -0,0 +1,257 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "SyntheticCorpus.h"
+
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+static const char* const UID_ROOT = "1.2.826.0.1.3680043.10.1047";
+
+// Minimum width of the generated images, which is doubled for the
+// large images. The pixel data is rounded up to a whole number of rows.
+static const size_t MIN_COLUMNS = 512;
+
+
+static void AddUInt16(std::string& target,
+                      uint16_t value)
+{
+  target.push_back(static_cast<char>(value & 0xff));
+  target.push_back(static_cast<char>(value >> 8));
+}
+
+
+static void AddUInt32(std::string& target,
+                      uint32_t value)
+{
+  AddUInt16(target, static_cast<uint16_t>(value & 0xffff));
+  AddUInt16(target, static_cast<uint16_t>(value >> 16));
+}
+
+
+// Explicit VR little endian, which is also the encoding of the meta-header
+static void AddElement(std::string& target,
+                       uint16_t group,
+                       uint16_t element,
+                       const std::string& vr,
+                       const std::string& value)
+{
+  std::string padded = value;
+  if (padded.size() % 2 == 1)
+  {
+    padded.push_back(vr == "UI" || vr == "OB" ? '\0' : ' ');
+  }
+
+  AddUInt16(target, group);
+  AddUInt16(target, element);
+  target.append(vr);
+
+  if (vr == "OB" || vr == "OW")
+  {
+    AddUInt16(target, 0);
+    AddUInt32(target, static_cast<uint32_t>(padded.size()));
+  }
+  else
+  {
+    AddUInt16(target, static_cast<uint16_t>(padded.size()));
+  }
+
+  target.append(padded);
+}
+
+
+static void AddUnsignedShort(std::string& target,
+                             uint16_t group,
+                             uint16_t element,
+                             uint16_t value)
+{
+  std::string binary;
+  AddUInt16(binary, value);
+  AddElement(target, group, element, "US", binary);
+}
+
+
+std::string SyntheticCorpus::CreateInstance(const std::string& patientId,
+                                            const std::string& studyInstanceUid,
+                                            const std::string& seriesInstanceUid,
+                                            const std::string& sopInstanceUid,
+                                            size_t pixelDataSize)
+{
+  static const char* const SOP_CLASS_UID = "1.2.840.10008.5.1.4.1.1.7";  // Secondary capture
+
+  size_t columns = MIN_COLUMNS;
+  while ((pixelDataSize + columns - 1) / columns > 0xffff)
+  {
+    columns *= 2;
+    if (columns > 0xffff)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+  const size_t rows = (pixelDataSize + columns - 1) / columns;
+
+  std::string meta;
+  AddElement(meta, 0x0002, 0x0001, "OB", std::string("\0\1", 2));
+  AddElement(meta, 0x0002, 0x0002, "UI", SOP_CLASS_UID);
+  AddElement(meta, 0x0002, 0x0003, "UI", sopInstanceUid);
+  AddElement(meta, 0x0002, 0x0010, "UI", "1.2.840.10008.1.2.1");
+
+  std::string dicom(128, '\0');
+  dicom.append("DICM");
+
+  std::string length;
+  AddUInt32(length, static_cast<uint32_t>(meta.size()));
+  AddElement(dicom, 0x0002, 0x0000, "UL", length);
+  dicom.append(meta);
+
+  AddElement(dicom, 0x0008, 0x0016, "UI", SOP_CLASS_UID);
+  AddElement(dicom, 0x0008, 0x0018, "UI", sopInstanceUid);
+  AddElement(dicom, 0x0008, 0x0060, "CS", "OT");
+  AddElement(dicom, 0x0010, 0x0010, "PN", "Synthetic^" + patientId);
+  AddElement(dicom, 0x0010, 0x0020, "LO", patientId);
+  AddElement(dicom, 0x0020, 0x000d, "UI", studyInstanceUid);
+  AddElement(dicom, 0x0020, 0x000e, "UI", seriesInstanceUid);
+  AddUnsignedShort(dicom, 0x0028, 0x0002, 1);  // Samples per pixel
+  AddElement(dicom, 0x0028, 0x0004, "CS", "MONOCHROME2");
+  AddUnsignedShort(dicom, 0x0028, 0x0010, static_cast<uint16_t>(rows));
+  AddUnsignedShort(dicom, 0x0028, 0x0011, static_cast<uint16_t>(columns));
+  AddUnsignedShort(dicom, 0x0028, 0x0100, 8);  // Bits allocated
+  AddUnsignedShort(dicom, 0x0028, 0x0101, 8);  // Bits stored
+  AddUnsignedShort(dicom, 0x0028, 0x0102, 7);  // High bit
+  AddUnsignedShort(dicom, 0x0028, 0x0103, 0);  // Pixel representation
+
+  std::string pixels(rows * columns, '\0');
+  for (size_t i = 0; i < pixels.size(); i++)
+  {
+    pixels[i] = static_cast<char>(i % 251);
+  }
+
+  AddElement(dicom, 0x7fe0, 0x0010, "OB", pixels);
+
+  return dicom;
+}
+
+
+void SyntheticCorpus::AddDirectory(const std::string& path)
+{
+  if (!path.empty() &&
+      !boost::filesystem::exists(path))
+  {
+    AddDirectory(boost::filesystem::path(path).parent_path().string());
+    boost::filesystem::create_directory(path);
+    directories_.push_back(path);
+  }
+}
+
+
+SyntheticCorpus::SyntheticCorpus(const std::string& root,
+                                 const Parameters& parameters) :
+  root_(root),
+  totalSize_(0)
+{
+  if (boost::filesystem::exists(root_))
+  {
+    // Never remove a folder that was not created by this class
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "The synthetic corpus must be created in a new folder: " + root_);
+  }
+
+  AddDirectory(root_);
+
+  for (unsigned int patient = 0; patient < parameters.patients_; patient++)
+  {
+    const std::string patientId = "PATIENT" + boost::lexical_cast<std::string>(patient);
+
+    for (unsigned int study = 0; study < parameters.studiesPerPatient_; study++)
+    {
+      const std::string studyUid = (std::string(UID_ROOT) + "." + boost::lexical_cast<std::string>(patient) +
+                                    "." + boost::lexical_cast<std::string>(study));
+
+      for (unsigned int series = 0; series < parameters.seriesPerStudy_; series++)
+      {
+        const std::string seriesUid = studyUid + "." + boost::lexical_cast<std::string>(series);
+
+        std::string directory;
+        switch (parameters.layout_)
+        {
+          case Layout_Series:
+            directory = root_ + "/" + patientId + "/study" + boost::lexical_cast<std::string>(study) +
+              "/series" + boost::lexical_cast<std::string>(series);
+            break;
+
+          case Layout_Study:
+            directory = root_ + "/" + patientId + "/study" + boost::lexical_cast<std::string>(study);
+            break;
+
+          case Layout_Flat:
+            directory = root_;
+            break;
+
+          default:
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        AddDirectory(directory);
+
+        for (unsigned int instance = 0; instance < parameters.instancesPerSeries_; instance++)
+        {
+          const std::string sopUid = seriesUid + "." + boost::lexical_cast<std::string>(instance);
+          const std::string dicom = CreateInstance(patientId, studyUid, seriesUid, sopUid, parameters.pixelDataSize_);
+
+          const std::string path = (directory + "/" + boost::lexical_cast<std::string>(dicomFiles_.size()) + ".dcm");
+          Orthanc::SystemToolbox::WriteFile(dicom.c_str(), dicom.size(), path, false);
+
+          dicomFiles_.push_back(path);
+          totalSize_ += dicom.size();
+        }
+      }
+    }
+  }
+
+  // Non-DICOM files next to the DICOM files, as found in real archives
+  for (size_t i = 0; i < directories_.size(); i++)
+  {
+    for (unsigned int j = 0; j < parameters.noisePerDirectory_; j++)
+    {
+      const std::string content(1024 + 512 * j, static_cast<char>('a' + j % 26));
+      const std::string path = directories_[i] + "/notes" + boost::lexical_cast<std::string>(j) + ".txt";
+      Orthanc::SystemToolbox::WriteFile(content.c_str(), content.size(), path, false);
+
+      otherFiles_.push_back(path);
+      totalSize_ += content.size();
+    }
+  }
+}
+
+
+SyntheticCorpus::~SyntheticCorpus()
+{
+  try
+  {
+    boost::filesystem::remove_all(root_);
+  }
+  catch (...)
+  {
+  }
+}
@@ -0,0 +1,113 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Tree of generated DICOM files, for the benchmarks. The files are
+ * valid DICOM files (explicit VR little endian) with the identifiers
+ * of the patient, study, series and instance, and pixel data of the
+ * requested size. The tree is removed by the destructor.
+ **/
+class SyntheticCorpus : public boost::noncopyable
+{
+public:
+  enum Layout
+  {
+    Layout_Series,   // root/patient/study/series/instance.dcm
+    Layout_Study,    // root/patient/study/instance.dcm
+    Layout_Flat      // root/instance.dcm
+  };
+
+  struct Parameters
+  {
+    unsigned int  patients_;
+    unsigned int  studiesPerPatient_;
+    unsigned int  seriesPerStudy_;
+    unsigned int  instancesPerSeries_;
+    size_t        pixelDataSize_;
+    unsigned int  noisePerDirectory_;   // Non-DICOM files in each directory
+    Layout        layout_;
+
+    Parameters() :
+      patients_(10),
+      studiesPerPatient_(2),
+      seriesPerStudy_(4),
+      instancesPerSeries_(25),
+      pixelDataSize_(64 * 1024),
+      noisePerDirectory_(1),
+      layout_(Layout_Series)
+    {
+    }
+  };
+
+private:
+  std::string               root_;
+  std::vector<std::string>  dicomFiles_;
+  std::vector<std::string>  otherFiles_;
+  std::vector<std::string>  directories_;
+  uintmax_t                 totalSize_;
+
+  void AddDirectory(const std::string& path);
+
+public:
+  SyntheticCorpus(const std::string& root,
+                  const Parameters& parameters);
+
+  ~SyntheticCorpus();
+
+  static std::string CreateInstance(const std::string& patientId,
+                                    const std::string& studyInstanceUid,
+                                    const std::string& seriesInstanceUid,
+                                    const std::string& sopInstanceUid,
+                                    size_t pixelDataSize);
+
+  const std::string& GetRoot() const
+  {
+    return root_;
+  }
+
+  const std::vector<std::string>& GetDicomFiles() const
+  {
+    return dicomFiles_;
+  }
+
+  const std::vector<std::string>& GetOtherFiles() const
+  {
+    return otherFiles_;
+  }
+
+  size_t GetDirectoriesCount() const
+  {
+    return directories_.size();
+  }
+
+  // Total size of the DICOM and non-DICOM files, in bytes
+  uintmax_t GetTotalSize() const
+  {
+    return totalSize_;
+  }
+};
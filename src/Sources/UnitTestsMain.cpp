@@ -19,66 +19,1224 @@
 
 #include <gtest/gtest.h>
 
+#include "DicomHeaderCache.h"
+#include "DirectoryCrawler.h"
+#include "DirectoryReader.h"
+#include "DirectoryWatcher.h"
+#include "FakeOrthancContext.h"
+#include "FileMemoryMap.h"
+#include "FilePipeline.h"
 #include "IndexerDatabase.h"
+#include "IndexerMetrics.h"
+#include "MappedFilesCache.h"
+#include "ReadAheadPrefetcher.h"
+#include "ScanController.h"
 #include "StorageArea.h"
 
 #include <Logging.h>
 #include <OrthancException.h>
 #include <SystemToolbox.h>
+#include <SQLite/Statement.h>
 #include <Toolbox.h>
 
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#if !defined(_WIN32)
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#endif
+
 
 TEST(StorageArea, Basic)
 {
-  const std::string uuid = Orthanc::Toolbox::GenerateUuid();
-  ASSERT_TRUE(Orthanc::Toolbox::IsUuid(uuid));
+  const std::string uuid = Orthanc::Toolbox::GenerateUuid();
+  ASSERT_TRUE(Orthanc::Toolbox::IsUuid(uuid));
+
+  StorageArea area("StorageAreaTests");
+  
+  area.Create(uuid, "Hello", 5);
+  ASSERT_TRUE(Orthanc::SystemToolbox::IsRegularFile(area.GetPath(uuid)));
+
+  OrthancPluginMemoryBuffer64 s;
+  area.ReadWhole(&s, uuid);
+  ASSERT_EQ(5u, s.size);
+  ASSERT_EQ("Hello", std::string(reinterpret_cast<const char*>(s.data), s.size));
+  free(s.data);
+
+  char data[10];
+  OrthancPluginMemoryBuffer64 buffer;
+  buffer.data = data;
+
+  buffer.size = 1;
+  area.ReadRange(&buffer, uuid, 0);  ASSERT_EQ('H', data[0]);
+  area.ReadRange(&buffer, uuid, 4);  ASSERT_EQ('o', data[0]);
+  ASSERT_THROW(area.ReadRange(&buffer, uuid, 5), Orthanc::OrthancException);
+  
+  buffer.size = 2;
+  area.ReadRange(&buffer, uuid, 0);  ASSERT_EQ('H', data[0]);  ASSERT_EQ('e', data[1]);
+  area.ReadRange(&buffer, uuid, 1);  ASSERT_EQ('e', data[0]);  ASSERT_EQ('l', data[1]);
+  area.ReadRange(&buffer, uuid, 2);  ASSERT_EQ('l', data[0]);  ASSERT_EQ('l', data[1]);
+  area.ReadRange(&buffer, uuid, 3);  ASSERT_EQ('l', data[0]);  ASSERT_EQ('o', data[1]);
+  ASSERT_THROW(area.ReadRange(&buffer, uuid, 4), Orthanc::OrthancException);
+  
+  buffer.size = 3;
+  area.ReadRange(&buffer, uuid, 0);  ASSERT_EQ('H', data[0]);  ASSERT_EQ('e', data[1]);  ASSERT_EQ('l', data[2]);
+  area.ReadRange(&buffer, uuid, 1);  ASSERT_EQ('e', data[0]);  ASSERT_EQ('l', data[1]);  ASSERT_EQ('l', data[2]);
+  area.ReadRange(&buffer, uuid, 2);  ASSERT_EQ('l', data[0]);  ASSERT_EQ('l', data[1]);  ASSERT_EQ('o', data[2]);
+  ASSERT_THROW(area.ReadRange(&buffer, uuid, 3), Orthanc::OrthancException);
+  
+  buffer.size = 5;
+  area.ReadRange(&buffer, uuid, 0);
+  ASSERT_EQ('H', data[0]);
+  ASSERT_EQ('e', data[1]);
+  ASSERT_EQ('l', data[2]);
+  ASSERT_EQ('l', data[3]);
+  ASSERT_EQ('o', data[4]);
+  ASSERT_THROW(area.ReadRange(&buffer, uuid, 1), Orthanc::OrthancException);
+  
+  area.RemoveAttachment(uuid);
+  ASSERT_FALSE(Orthanc::SystemToolbox::IsRegularFile(area.GetPath(uuid)));
+
+  ASSERT_THROW(area.ReadWhole(&buffer, uuid), Orthanc::OrthancException);
+  ASSERT_THROW(area.ReadRange(&buffer, uuid, 0), Orthanc::OrthancException);
+}
+
+
+
+class CrawlerVisitor : public DirectoryCrawler::IVisitor
+{
+private:
+  typedef std::map<std::string, std::pair<std::time_t, std::list<std::string> > >  Directories;
+
+  boost::mutex           mutex_;
+  std::set<std::string>  files_;
+  std::set<std::string>  failures_;
+  bool                   prune_;
+  Directories            directories_;  // Stable directories, as recorded by the previous walks
+  unsigned int           pruned_;
+
+public:
+  CrawlerVisitor() :
+    prune_(false),
+    pruned_(0)
+  {
+  }
+
+  virtual void VisitFile(const std::string& path,
+                         const FileMetadata& metadata) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    ASSERT_EQ(1u, metadata.size_);
+    ASSERT_TRUE(files_.insert(path).second);  // Each file is visited once
+  }
+
+  virtual void VisitFailure(const std::string& path) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    failures_.insert(path);
+  }
+
+  virtual bool LookupDirectory(std::list<std::string>& subdirectories,
+                               const std::string& path,
+                               const std::time_t time) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Directories::const_iterator found = directories_.find(path);
+    if (prune_ &&
+        found != directories_.end() &&
+        found->second.first == time)
+    {
+      subdirectories = found->second.second;
+      pruned_++;
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  virtual void VisitDirectory(const std::string& path,
+                              const std::time_t time,
+                              bool isStable,
+                              const std::list<std::string>& subdirectories) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (isStable)
+    {
+      directories_[path] = std::make_pair(time, subdirectories);
+    }
+    else
+    {
+      directories_.erase(path);
+    }
+  }
+
+  // Starts a new walk, that skips the directories recorded as stable
+  void Reset(bool prune)
+  {
+    files_.clear();
+    failures_.clear();
+    prune_ = prune;
+    pruned_ = 0;
+  }
+
+  size_t GetSize() const
+  {
+    return files_.size();
+  }
+
+  size_t GetFailuresCount() const
+  {
+    return failures_.size();
+  }
+
+  unsigned int GetPrunedCount() const
+  {
+    return pruned_;
+  }
+};
+
+
+TEST(DirectoryCrawler, Threads)
+{
+  const boost::filesystem::path root("DirectoryCrawlerTests");
+  boost::filesystem::remove_all(root);
+
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    for (unsigned int j = 0; j < 4; j++)
+    {
+      const boost::filesystem::path folder = (root / boost::lexical_cast<std::string>(i) /
+                                              boost::lexical_cast<std::string>(j));
+      boost::filesystem::create_directories(folder);
+
+      for (unsigned int k = 0; k < 3; k++)
+      {
+        Orthanc::SystemToolbox::WriteFile("a", 1, (folder / boost::lexical_cast<std::string>(k)).string(), false);
+      }
+    }
+  }
+
+  std::list<std::string> folders;
+  folders.push_back(root.string());
+  folders.push_back((root / "nope").string());
+
+  bool stop = false;
+
+  for (unsigned int threads = 1; threads <= 4; threads++)
+  {
+    CrawlerVisitor visitor;
+    DirectoryCrawler crawler(visitor, stop, threads);
+    ASSERT_TRUE(crawler.Run(folders));
+    ASSERT_EQ(60u, visitor.GetSize());
+    ASSERT_EQ(0u, visitor.GetFailuresCount());  // A missing folder is not a failure
+  }
+
+  {
+    CrawlerVisitor visitor;
+    DirectoryCrawler crawler(visitor, stop, 2, DirectoryReader::Engine_Boost);
+    ASSERT_TRUE(crawler.Run(folders));
+    ASSERT_EQ(60u, visitor.GetSize());
+    ASSERT_EQ(0u, visitor.GetFailuresCount());
+
+    // One "stat()" per entry (60 files and 25 subdirectories), and
+    // one per directory for its modification time (26 directories
+    // and the missing folder). Three calls per file on Windows.
+#if defined(_WIN32)
+    ASSERT_EQ(3u * 60u + 25u + 27u, crawler.GetSystemCallsCount());
+#else
+    ASSERT_EQ(60u + 25u + 27u, crawler.GetSystemCallsCount());
+#endif
+  }
+
+  {
+    stop = true;
+    CrawlerVisitor visitor;
+    DirectoryCrawler crawler(visitor, stop, 2);
+    ASSERT_FALSE(crawler.Run(folders));
+    ASSERT_EQ(0u, visitor.GetSize());
+  }
+
+  CrawlerVisitor visitor;
+  ASSERT_THROW(DirectoryCrawler(visitor, stop, 0), Orthanc::OrthancException);
+
+  boost::filesystem::remove_all(root);
+}
+
+
+TEST(DirectoryCrawler, Pruning)
+{
+  const boost::filesystem::path root("DirectoryCrawlerTests");
+  boost::filesystem::remove_all(root);
+
+  // The modification times are set in the past, so that they can be trusted
+  const std::time_t past = std::time(NULL) - 100;
+
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    for (unsigned int j = 0; j < 4; j++)
+    {
+      const boost::filesystem::path folder = (root / boost::lexical_cast<std::string>(i) /
+                                              boost::lexical_cast<std::string>(j));
+      boost::filesystem::create_directories(folder);
+
+      for (unsigned int k = 0; k < 3; k++)
+      {
+        Orthanc::SystemToolbox::WriteFile("a", 1, (folder / boost::lexical_cast<std::string>(k)).string(), false);
+      }
+
+      boost::filesystem::last_write_time(folder, past);
+    }
+
+    boost::filesystem::last_write_time(root / boost::lexical_cast<std::string>(i), past);
+  }
+
+  boost::filesystem::last_write_time(root, past);
+
+  std::list<std::string> folders;
+  folders.push_back(root.string());
+
+  bool stop = false;
+  CrawlerVisitor visitor;
+
+  {
+    DirectoryCrawler crawler(visitor, stop, 2);
+    ASSERT_TRUE(crawler.Run(folders));
+    ASSERT_EQ(60u, visitor.GetSize());
+    ASSERT_EQ(0u, visitor.GetPrunedCount());
+  }
+
+  {
+    // Nothing has changed: No directory is listed, but all are walked
+    visitor.Reset(true);
+    DirectoryCrawler crawler(visitor, stop, 2);
+    ASSERT_TRUE(crawler.Run(folders));
+    ASSERT_EQ(0u, visitor.GetSize());
+    ASSERT_EQ(26u, visitor.GetPrunedCount());
+  }
+
+  // Adding a file changes the modification time of its directory
+  Orthanc::SystemToolbox::WriteFile("a", 1, (root / "2" / "1" / "new").string(), false);
+
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    // The modification time is too recent to be trusted, so the
+    // directory is listed again by the next walk
+    visitor.Reset(true);
+    DirectoryCrawler crawler(visitor, stop, 1);
+    ASSERT_TRUE(crawler.Run(folders));
+    ASSERT_EQ(4u, visitor.GetSize());
+    ASSERT_EQ(25u, visitor.GetPrunedCount());
+  }
+
+  {
+    // A walk without pruning lists everything
+    visitor.Reset(false);
+    DirectoryCrawler crawler(visitor, stop, 1);
+    ASSERT_TRUE(crawler.Run(folders));
+    ASSERT_EQ(61u, visitor.GetSize());
+  }
+
+  // Modification time written by a server whose clock lags 10 seconds
+  // behind: It is only trusted if the clock skew is smaller than that
+  boost::filesystem::last_write_time(root / "2" / "1", std::time(NULL) - 10);
+
+  for (unsigned int skew = 0; skew <= 20; skew += 20)
+  {
+    visitor.Reset(false);
+
+    {
+      DirectoryCrawler crawler(visitor, stop, 1);
+      crawler.SetClockSkew(skew);
+      ASSERT_TRUE(crawler.Run(folders));
+      ASSERT_EQ(61u, visitor.GetSize());
+    }
+
+    visitor.Reset(true);
+
+    {
+      DirectoryCrawler crawler(visitor, stop, 1);
+      crawler.SetClockSkew(skew);
+      ASSERT_TRUE(crawler.Run(folders));
+      ASSERT_EQ(skew == 0 ? 0u : 4u, visitor.GetSize());
+      ASSERT_EQ(skew == 0 ? 26u : 25u, visitor.GetPrunedCount());
+    }
+  }
+
+  boost::filesystem::remove_all(root);
+}
+
+
+
+TEST(DirectoryReader, Engines)
+{
+  const boost::filesystem::path root("DirectoryReaderTests");
+  boost::filesystem::remove_all(root);
+
+  boost::filesystem::create_directories(root / "a");
+  Orthanc::SystemToolbox::WriteFile("hello", 5, (root / "b").string(), false);
+  Orthanc::SystemToolbox::WriteFile("", 0, (root / "c").string(), false);
+
+  const std::time_t past = std::time(NULL) - 100;
+  boost::filesystem::last_write_time(root / "b", past);
+
+#if !defined(_WIN32)
+  // Modification time with a sub-second part
+  const uint32_t nanoseconds = 123456789;
+
+  struct timespec times[2];
+  times[0].tv_sec = past;
+  times[0].tv_nsec = 0;
+  times[1].tv_sec = past;
+  times[1].tv_nsec = nanoseconds;
+  ASSERT_EQ(0, utimensat(AT_FDCWD, (root / "b").string().c_str(), times, 0));
+
+  struct stat info;
+  ASSERT_EQ(0, stat((root / "b").string().c_str(), &info));
+  const uint64_t inode = info.st_ino;
+
+  // The links are followed, and the dangling ones are skipped
+  boost::filesystem::create_symlink("b", root / "link");
+  boost::filesystem::create_symlink("a", root / "linkToDirectory");
+  boost::filesystem::create_symlink("nope", root / "dangling");
+  const size_t expected = 5;
+#else
+  const uint32_t nanoseconds = 0;
+  const uint64_t inode = 0;
+  const size_t expected = 3;
+#endif
+
+  FileMetadata metadata;
+  ASSERT_TRUE(DirectoryReader::ReadFileMetadata(metadata, (root / "b").string()));
+  ASSERT_EQ(past, metadata.time_);
+  ASSERT_EQ(nanoseconds, metadata.nanoseconds_);
+  ASSERT_EQ(5u, metadata.size_);
+  ASSERT_EQ(inode, metadata.inode_);
+  ASSERT_FALSE(DirectoryReader::ReadFileMetadata(metadata, (root / "a").string()));
+  ASSERT_FALSE(DirectoryReader::ReadFileMetadata(metadata, (root / "nope").string()));
+
+  const DirectoryReader::Engine engines[] = {
+    DirectoryReader::Engine_Auto,
+    DirectoryReader::Engine_Boost,
+    DirectoryReader::Engine_Statx,
+    DirectoryReader::Engine_IoUring
+  };
+
+  for (size_t i = 0; i < sizeof(engines) / sizeof(DirectoryReader::Engine); i++)
+  {
+    if (!DirectoryReader::IsSupported(engines[i]))
+    {
+      continue;
+    }
+
+    DirectoryReader reader(engines[i]);
+    ASSERT_TRUE(engines[i] == DirectoryReader::Engine_Auto ||
+                engines[i] == reader.GetEngine());
+
+    for (unsigned int separator = 0; separator < 2; separator++)
+    {
+      std::vector<DirectoryReader::Entry> entries;
+      ASSERT_EQ(DirectoryReader::Status_Success,
+                reader.List(entries, root.string() + (separator ? "/" : "")));
+
+      std::map<std::string, DirectoryReader::Entry> sorted;
+      for (size_t j = 0; j < entries.size(); j++)
+      {
+        ASSERT_EQ(DirectoryReader::Status_Success, entries[j].status_);
+        sorted[entries[j].path_] = entries[j];
+      }
+
+      ASSERT_EQ(expected, sorted.size());
+      ASSERT_EQ(DirectoryReader::Type_Directory, sorted[(root / "a").string()].type_);
+      ASSERT_EQ(DirectoryReader::Type_File, sorted[(root / "b").string()].type_);
+      ASSERT_EQ(5u, sorted[(root / "b").string()].metadata_.size_);
+      ASSERT_EQ(past, sorted[(root / "b").string()].metadata_.time_);
+      ASSERT_EQ(nanoseconds, sorted[(root / "b").string()].metadata_.nanoseconds_);
+      ASSERT_EQ(inode, sorted[(root / "b").string()].metadata_.inode_);
+      ASSERT_EQ(DirectoryReader::Type_File, sorted[(root / "c").string()].type_);
+      ASSERT_EQ(0u, sorted[(root / "c").string()].metadata_.size_);
+
+#if !defined(_WIN32)
+      ASSERT_EQ(DirectoryReader::Type_File, sorted[(root / "link").string()].type_);
+      ASSERT_EQ(5u, sorted[(root / "link").string()].metadata_.size_);
+      ASSERT_EQ(inode, sorted[(root / "link").string()].metadata_.inode_);
+      ASSERT_EQ(DirectoryReader::Type_Directory, sorted[(root / "linkToDirectory").string()].type_);
+#endif
+    }
+
+    std::time_t time;
+    ASSERT_EQ(DirectoryReader::Status_Success, reader.ReadModificationTime(time, (root / "b").string()));
+    ASSERT_EQ(past, time);
+    ASSERT_EQ(DirectoryReader::Status_Vanished, reader.ReadModificationTime(time, (root / "nope").string()));
+
+    std::vector<DirectoryReader::Entry> entries;
+    ASSERT_EQ(DirectoryReader::Status_Vanished, reader.List(entries, (root / "nope").string()));
+    ASSERT_EQ(DirectoryReader::Status_Vanished, reader.List(entries, (root / "b").string()));  // Not a directory
+    ASSERT_TRUE(entries.empty());
+
+    ASSERT_LT(0u, reader.GetSystemCallsCount());
+  }
+
+  boost::filesystem::remove_all(root);
+}
+
+
+
+class PipelineHandler : public FilePipeline::IHandler
+{
+private:
+  class PendingUpload : public FilePipeline::IUpload
+  {
+  private:
+    PipelineHandler&  that_;
+    std::string       path_;
+
+  public:
+    PendingUpload(PipelineHandler& that,
+           const std::string& path) :
+      that_(that),
+      path_(path)
+    {
+    }
+
+    virtual void Upload() ORTHANC_OVERRIDE
+    {
+      boost::mutex::scoped_lock lock(that_.mutex_);
+      if (!that_.uploaded_.insert(path_).second)
+      {
+        that_.duplicates_++;
+      }
+    }
+  };
+
+  boost::mutex           mutex_;
+  std::set<std::string>  identified_;
+  std::set<std::string>  uploaded_;
+  unsigned int           duplicates_;
+
+public:
+  PipelineHandler() :
+    duplicates_(0)
+  {
+  }
+
+  virtual FilePipeline::IUpload* Identify(const std::string& path,
+                                          const FileMetadata& metadata) ORTHANC_OVERRIDE
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (!identified_.insert(path).second)
+      {
+        duplicates_++;
+      }
+    }
+
+    if (metadata.size_ == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+    else if (metadata.size_ % 2 == 0)
+    {
+      return new PendingUpload(*this, path);
+    }
+    else
+    {
+      return NULL;  // Nothing to upload
+    }
+  }
+
+  size_t GetIdentifiedCount() const
+  {
+    return identified_.size();
+  }
+
+  size_t GetUploadedCount() const
+  {
+    return uploaded_.size();
+  }
+
+  unsigned int GetDuplicatesCount() const
+  {
+    return duplicates_;
+  }
+};
+
+
+TEST(FilePipeline, Basic)
+{
+  bool stop = false;
+
+  {
+    PipelineHandler handler;
+    ASSERT_THROW(FilePipeline(handler, stop, 0, 1), Orthanc::OrthancException);
+    ASSERT_THROW(FilePipeline(handler, stop, 1, 0), Orthanc::OrthancException);
+  }
+
+  for (unsigned int threads = 1; threads <= 4; threads++)
+  {
+    PipelineHandler handler;
+    FilePipeline pipeline(handler, stop, threads, threads);
+
+    // Much more files than the size of the queues
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+      pipeline.Push(boost::lexical_cast<std::string>(i), FileMetadata(42, i % 4 /* size, 0 means failure */));
+    }
+
+    pipeline.Finish();
+    ASSERT_EQ(1000u, handler.GetIdentifiedCount());
+    ASSERT_EQ(250u, handler.GetUploadedCount());
+    ASSERT_EQ(0u, handler.GetDuplicatesCount());
+
+    ASSERT_THROW(pipeline.Push("nope", FileMetadata(42, 2)), Orthanc::OrthancException);
+    pipeline.Finish();
+  }
+
+  {
+    // The pending files are dropped once the stop flag is set
+    PipelineHandler handler;
+    FilePipeline pipeline(handler, stop, 1, 1);
+    stop = true;
+
+    for (unsigned int i = 0; i < 10; i++)
+    {
+      pipeline.Push(boost::lexical_cast<std::string>(i), FileMetadata(42, 2 /* size */));
+    }
+
+    pipeline.Finish();
+    ASSERT_EQ(0u, handler.GetIdentifiedCount());
+    ASSERT_EQ(0u, handler.GetUploadedCount());
+  }
+}
+
+
+
+class WatchListener : public DirectoryWatcher::IListener
+{
+public:
+  std::set<std::string>  written_;
+  std::set<std::string>  removed_;
+  std::set<std::string>  directories_;
+
+  virtual void OnFileWritten(const std::string& path) ORTHANC_OVERRIDE
+  {
+    written_.insert(path);
+  }
+
+  virtual void OnFileRemoved(const std::string& path) ORTHANC_OVERRIDE
+  {
+    removed_.insert(path);
+  }
+
+  virtual void OnDirectoryAdded(const std::string& path) ORTHANC_OVERRIDE
+  {
+    directories_.insert(path);
+  }
+
+  virtual void OnResynchronize() ORTHANC_OVERRIDE
+  {
+  }
+};
+
+
+TEST(DirectoryWatcher, Events)
+{
+  if (!DirectoryWatcher::IsSupported())
+  {
+    return;
+  }
+
+  const boost::filesystem::path root("DirectoryWatcherTests");
+  boost::filesystem::remove_all(root);
+  boost::filesystem::create_directories(root / "a");
+
+  WatchListener listener;
+  DirectoryWatcher watcher(listener, 0 /* no settle delay */);
+  watcher.AddTree(root.string());
+  ASSERT_EQ(2u, watcher.GetWatchesCount());
+
+  const std::string file = (root / "a" / "file").string();
+  Orthanc::SystemToolbox::WriteFile("a", 1, file, false);
+  watcher.ProcessEvents(100);
+  ASSERT_EQ(1u, listener.written_.size());
+  ASSERT_EQ(file, *listener.written_.begin());
+
+  boost::filesystem::remove(file);
+  watcher.ProcessEvents(100);
+  ASSERT_EQ(1u, listener.removed_.size());
+  ASSERT_EQ(file, *listener.removed_.begin());
+
+  const boost::filesystem::path directory = root / "a" / "b";
+  boost::filesystem::create_directories(directory);
+  watcher.ProcessEvents(100);
+  ASSERT_EQ(1u, listener.directories_.size());
+  ASSERT_EQ(directory.string(), *listener.directories_.begin());
+  ASSERT_EQ(3u, watcher.GetWatchesCount());
+
+  // The new directory is watched
+  Orthanc::SystemToolbox::WriteFile("a", 1, (directory / "file").string(), false);
+  watcher.ProcessEvents(100);
+  ASSERT_EQ(2u, listener.written_.size());
+
+  boost::filesystem::remove_all(root);
+}
+
+
+
+TEST(FileMemoryMap, Modes)
+{
+  const boost::filesystem::path root("FileMemoryMapTests");
+  boost::filesystem::remove_all(root);
+  boost::filesystem::create_directories(root);
+
+  // Spans several pages, so that the offsets are not aligned
+  std::string content;
+  for (size_t i = 0; i < 3 * 4096 + 100; i++)
+  {
+    content.push_back(static_cast<char>('a' + i % 26));
+  }
+
+  const std::string path = (root / "file").string();
+  Orthanc::SystemToolbox::WriteFile(content.c_str(), content.size(), path, false);
+
+  const FileMemoryMap::Mode modes[] = {
+    FileMemoryMap::Mode_Auto,
+    FileMemoryMap::Mode_Read,
+    FileMemoryMap::Mode_Map,
+    FileMemoryMap::Mode_MapOnDemand
+  };
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(FileMemoryMap::Mode); i++)
+  {
+    {
+      FileMemoryMap reader(path, 0, 0, modes[i]);
+      ASSERT_EQ(content.size(), reader.length());
+      ASSERT_EQ(content, std::string(reader.data(), reader.length()));
+    }
+
+    {
+      FileMemoryMap reader(path, 5000, 10, modes[i]);
+      ASSERT_EQ(10u, reader.length());
+      ASSERT_EQ(content.substr(5000, 10), std::string(reader.data(), reader.length()));
+    }
+
+    {
+      FileMemoryMap reader(path, 4095, 0, modes[i]);
+      ASSERT_EQ(content.size() - 4095, reader.length());
+      ASSERT_EQ(content.substr(4095), std::string(reader.data(), reader.length()));
+    }
+
+    {
+      // Trimmed at the end of the file
+      FileMemoryMap reader(path, content.size() - 3, 10, modes[i]);
+      ASSERT_EQ(3u, reader.length());
+      ASSERT_EQ(content.substr(content.size() - 3), std::string(reader.data(), reader.length()));
+    }
+
+    {
+      FileMemoryMap reader(path, content.size() + 10, 10, modes[i]);
+      ASSERT_EQ(0u, reader.length());
+      ASSERT_FALSE(reader.is_mapped());
+    }
+  }
+
+  ASSERT_FALSE(FileMemoryMap(path, 0, 0, FileMemoryMap::Mode_Read).is_mapped());
+  ASSERT_EQ(content.size() >= FileMemoryMap::MAP_THRESHOLD,
+            FileMemoryMap(path, 0, 0, FileMemoryMap::Mode_Auto).is_mapped());
+
+#if !defined(_WIN32)
+  ASSERT_TRUE(FileMemoryMap(path, 0, 0, FileMemoryMap::Mode_Map).is_mapped());
+  ASSERT_TRUE(FileMemoryMap(path, 1, 1, FileMemoryMap::Mode_MapOnDemand).is_mapped());
+#endif
+
+  ASSERT_THROW(FileMemoryMap((root / "nope").string()), Orthanc::OrthancException);
+
+  boost::filesystem::remove_all(root);
+}
+
+
+static std::string ReadCachedRange(MappedFilesCache& cache,
+                                   const std::string& path,
+                                   uint64_t start,
+                                   size_t size,
+                                   bool isOwned)
+{
+  std::string s;
+  s.resize(size);
+
+  OrthancPluginMemoryBuffer64 buffer;
+  buffer.data = (size == 0 ? NULL : &s[0]);
+  buffer.size = size;
+  cache.ReadRange(&buffer, path, start, isOwned);
+
+  return s;
+}
+
+
+TEST(MappedFilesCache, Basic)
+{
+  const boost::filesystem::path root("MappedFilesCacheTests");
+  boost::filesystem::remove_all(root);
+  boost::filesystem::create_directories(root);
+
+  const std::string a = (root / "a").string();
+  const std::string b = (root / "b").string();
+  const std::string c = (root / "c").string();
+  const std::string d = (root / "d").string();
+  const std::string empty = (root / "empty").string();
+  Orthanc::SystemToolbox::WriteFile("Hello", 5, a, false);
+  Orthanc::SystemToolbox::WriteFile("World", 5, b, false);
+  Orthanc::SystemToolbox::WriteFile("0123456789abcdef", 16, c, false);
+  Orthanc::SystemToolbox::WriteFile("abc", 3, d, false);
+  Orthanc::SystemToolbox::WriteFile("", 0, empty, false);
+
+  ASSERT_THROW(MappedFilesCache(0, 1), Orthanc::OrthancException);
+  ASSERT_THROW(MappedFilesCache(1, 0), Orthanc::OrthancException);
+
+  MappedFilesCache cache(12 /* bytes */, 2 /* files */);
+
+  ASSERT_EQ("Hel", ReadCachedRange(cache, a, 0, 3, true));
+  ASSERT_EQ("lo", ReadCachedRange(cache, a, 3, 2, true));
+  ASSERT_EQ("", ReadCachedRange(cache, a, 5, 0, true));
+  ASSERT_THROW(ReadCachedRange(cache, a, 4, 2, true), Orthanc::OrthancException);
+  ASSERT_THROW(ReadCachedRange(cache, a, 6, 0, true), Orthanc::OrthancException);
+  ASSERT_THROW(ReadCachedRange(cache, (root / "nope").string(), 0, 1, true), Orthanc::OrthancException);
+  ASSERT_THROW(ReadCachedRange(cache, (root / "nope").string(), 0, 1, false), Orthanc::OrthancException);
+
+#if defined(_WIN32)
+  ASSERT_EQ(0u, cache.GetCachedFiles());
+#else
+  ASSERT_EQ(1u, cache.GetCachedFiles());
+  ASSERT_EQ(5u, cache.GetMappedBytes());
+
+  ASSERT_EQ("orl", ReadCachedRange(cache, b, 1, 3, true));
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(10u, cache.GetMappedBytes());
+
+  // Evicted by the budget of bytes ("a" is the least recently used)
+  ASSERT_EQ("bc", ReadCachedRange(cache, d, 1, 2, true));
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(8u, cache.GetMappedBytes());
+
+  // Evicted by the budget of files ("b" is the least recently used)
+  ASSERT_EQ("He", ReadCachedRange(cache, a, 0, 2, true));
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(8u, cache.GetMappedBytes());
+
+  // Too large or empty files are kept open without being mapped
+  ASSERT_EQ("cdef", ReadCachedRange(cache, c, 12, 4, true));
+  ASSERT_THROW(ReadCachedRange(cache, c, 14, 4, true), Orthanc::OrthancException);
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(5u, cache.GetMappedBytes());
+  ASSERT_EQ("", ReadCachedRange(cache, empty, 0, 0, true));
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(0u, cache.GetMappedBytes());
+
+  // A modified file is only read again once invalidated
+  ASSERT_EQ("He", ReadCachedRange(cache, a, 0, 2, true));
+  ASSERT_EQ(5u, cache.GetMappedBytes());
+  Orthanc::SystemToolbox::WriteFile("Bye", 3, (root / "tmp").string(), false);
+  boost::filesystem::rename(root / "tmp", a);
+  ASSERT_EQ("He", ReadCachedRange(cache, a, 0, 2, true));
+  cache.Invalidate(a);
+  ASSERT_EQ(1u, cache.GetCachedFiles());
+  ASSERT_EQ(0u, cache.GetMappedBytes());
+  ASSERT_EQ("By", ReadCachedRange(cache, a, 0, 2, true));
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(3u, cache.GetMappedBytes());
+
+  cache.Invalidate(a);
+  cache.Invalidate(empty);
+  cache.Invalidate(empty);
+  ASSERT_EQ(0u, cache.GetCachedFiles());
+  ASSERT_EQ(0u, cache.GetMappedBytes());
+
+  // The indexed files are kept open, but never mapped
+  ASSERT_EQ("orl", ReadCachedRange(cache, b, 1, 3, false));
+  ASSERT_EQ("0123", ReadCachedRange(cache, c, 0, 4, false));
+  ASSERT_EQ("", ReadCachedRange(cache, c, 16, 0, false));
+  ASSERT_THROW(ReadCachedRange(cache, c, 14, 4, false), Orthanc::OrthancException);
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+  ASSERT_EQ(0u, cache.GetMappedBytes());
+
+  // An indexed file that is modified in place is read as is, and
+  // reading it once truncated by another program does not crash
+  Orthanc::SystemToolbox::WriteFile("Hi", 2, c, false);
+  ASSERT_EQ("Hi", ReadCachedRange(cache, c, 0, 2, false));
+  Orthanc::SystemToolbox::WriteFile("", 0, c, false);
+  ASSERT_THROW(ReadCachedRange(cache, c, 0, 2, false), Orthanc::OrthancException);
+  ASSERT_EQ(2u, cache.GetCachedFiles());
+
+  cache.Invalidate(b);
+  cache.Invalidate(c);
+  ASSERT_EQ(0u, cache.GetCachedFiles());
+  ASSERT_EQ(0u, cache.GetMappedBytes());
+#endif
+
+  boost::filesystem::remove_all(root);
+}
+
+
+TEST(ReadAheadPrefetcher, Basic)
+{
+  const boost::filesystem::path root("ReadAheadPrefetcherTests");
+  boost::filesystem::remove_all(root);
+  boost::filesystem::create_directories(root / "series1");
+  boost::filesystem::create_directories(root / "series2");
+
+  for (unsigned int i = 0; i < 10; i++)
+  {
+    const std::string name = "0" + boost::lexical_cast<std::string>(i);
+    Orthanc::SystemToolbox::WriteFile("a", 1, (root / "series1" / name).string(), false);
+    Orthanc::SystemToolbox::WriteFile("a", 1, (root / "series2" / name).string(), false);
+  }
+
+  ASSERT_THROW(ReadAheadPrefetcher(0, 1), Orthanc::OrthancException);
+  ASSERT_THROW(ReadAheadPrefetcher(1, 0), Orthanc::OrthancException);
+
+  ReadAheadPrefetcher prefetcher(3 /* files */, 1024 * 1024);
+
+  // Only the directories that are tracked by "Access()" are read ahead
+  const std::string series1 = (root / "series1").string();
+  ASSERT_EQ(0u, prefetcher.PrefetchNext(series1 + "/03"));
+  ASSERT_FALSE(prefetcher.Access(series1 + "/03"));
+
+  ASSERT_EQ(3u, prefetcher.PrefetchNext(series1 + "/03"));  // 04, 05 and 06
+  ASSERT_EQ(0u, prefetcher.PrefetchNext(series1 + "/03"));
+  ASSERT_EQ(2u, prefetcher.PrefetchNext(series1 + "/05"));  // 07 and 08
+  ASSERT_EQ(1u, prefetcher.PrefetchNext(series1 + "/08"));  // 09
+  ASSERT_EQ(0u, prefetcher.PrefetchNext(series1 + "/09"));
+  ASSERT_EQ(0u, prefetcher.PrefetchNext("nope"));
+  ASSERT_FALSE(prefetcher.Access((root / "nope" / "00").string()));
+  ASSERT_ANY_THROW(prefetcher.PrefetchNext((root / "nope" / "00").string()));
+
+  // Only the reads of two distinct files of the same directory start a read-ahead
+  const std::string series2 = (root / "series2").string();
+  ASSERT_FALSE(prefetcher.Access(series2 + "/00"));
+  ASSERT_FALSE(prefetcher.Access(series2 + "/00"));
+  ASSERT_FALSE(prefetcher.Access((root / "other" / "00").string()));
+  ASSERT_EQ(ReadAheadPrefetcher::IsSupported(), prefetcher.Access(series2 + "/01"));
+  ASSERT_EQ(ReadAheadPrefetcher::IsSupported(), prefetcher.Access(series2 + "/02"));
+  ASSERT_FALSE(prefetcher.Access("file"));
+
+  boost::filesystem::remove_all(root);
+}
+
+
+class DicomWriter
+{
+private:
+  std::string  buffer_;
+  bool         explicitVR_;
+  bool         bigEndian_;
+
+  void AddUInt16(uint16_t value,
+                 bool bigEndian)
+  {
+    if (bigEndian)
+    {
+      buffer_.push_back(static_cast<char>(value >> 8));
+      buffer_.push_back(static_cast<char>(value & 0xff));
+    }
+    else
+    {
+      buffer_.push_back(static_cast<char>(value & 0xff));
+      buffer_.push_back(static_cast<char>(value >> 8));
+    }
+  }
+
+  void AddUInt32(uint32_t value,
+                 bool bigEndian)
+  {
+    AddUInt16(static_cast<uint16_t>(bigEndian ? value >> 16 : value & 0xffff), bigEndian);
+    AddUInt16(static_cast<uint16_t>(bigEndian ? value & 0xffff : value >> 16), bigEndian);
+  }
+
+  void AddHeader(uint16_t group,
+                 uint16_t element,
+                 const std::string& vr,
+                 uint32_t length,
+                 bool explicitVR,
+                 bool bigEndian)
+  {
+    AddUInt16(group, bigEndian);
+    AddUInt16(element, bigEndian);
+
+    if (!explicitVR ||
+        group == 0xfffe)
+    {
+      AddUInt32(length, bigEndian);
+    }
+    else
+    {
+      buffer_.append(vr);
+
+      if (vr == "OB" || vr == "OW" || vr == "SQ" || vr == "UN" || vr == "UT")
+      {
+        AddUInt16(0, bigEndian);
+        AddUInt32(length, bigEndian);
+      }
+      else
+      {
+        AddUInt16(static_cast<uint16_t>(length), bigEndian);
+      }
+    }
+  }
+
+public:
+  DicomWriter(const std::string& transferSyntax,
+              bool explicitVR,
+              bool bigEndian) :
+    explicitVR_(explicitVR),
+    bigEndian_(bigEndian)
+  {
+    buffer_.assign(128, '\0');
+    buffer_.append("DICM");
+
+    std::string uid = transferSyntax;
+    if (uid.size() % 2 == 1)
+    {
+      uid.push_back('\0');
+    }
+
+    AddHeader(0x0002, 0x0010, "UI", uid.size(), true, false);
+    buffer_.append(uid);
+  }
+
+  void AddElement(uint16_t group,
+                  uint16_t element,
+                  const std::string& vr,
+                  const std::string& value)
+  {
+    std::string padded = value;
+    if (padded.size() % 2 == 1)
+    {
+      padded.push_back(vr == "UI" ? '\0' : ' ');
+    }
+
+    AddHeader(group, element, vr, padded.size(), explicitVR_, bigEndian_);
+    buffer_.append(padded);
+  }
+
+  // Sequence of undefined length, containing one item of undefined
+  // length, containing one string element
+  void AddSequence(uint16_t group,
+                   uint16_t element)
+  {
+    AddHeader(group, element, "SQ", 0xffffffff, explicitVR_, bigEndian_);
+    AddHeader(0xfffe, 0xe000, "", 0xffffffff, explicitVR_, bigEndian_);
+    AddElement(0x0008, 0x1155, "UI", "1.2.3");
+    AddHeader(0xfffe, 0xe00d, "", 0, explicitVR_, bigEndian_);
+    AddHeader(0xfffe, 0xe0dd, "", 0, explicitVR_, bigEndian_);
+  }
+
+  const std::string& GetBuffer() const
+  {
+    return buffer_;
+  }
+};
+
+
+static std::string CreateSampleDicom(const std::string& transferSyntax,
+                                     bool explicitVR,
+                                     bool bigEndian,
+                                     const std::string& patientId)
+{
+  DicomWriter writer(transferSyntax, explicitVR, bigEndian);
+  writer.AddElement(0x0008, 0x0016, "UI", "1.2.840.10008.5.1.4.1.1.7");
+  writer.AddElement(0x0008, 0x0018, "UI", "1.2.3.4.5");
+  writer.AddSequence(0x0008, 0x1115);
+  writer.AddElement(0x0010, 0x0010, "PN", "Doe^John");
+  writer.AddElement(0x0010, 0x0020, "LO", patientId);
+  writer.AddElement(0x0020, 0x000d, "UI", "1.2.3");
+  writer.AddElement(0x0020, 0x000e, "UI", "1.2.3.4");
+  writer.AddElement(0x0028, 0x0010, "US", "ab");
+  writer.AddElement(0x7fe0, 0x0010, "OW", std::string(1000, 'x'));
+  return writer.GetBuffer();
+}
 
-  StorageArea area("StorageAreaTests");
-  
-  area.Create(uuid, "Hello", 5);
-  ASSERT_TRUE(Orthanc::SystemToolbox::IsRegularFile(area.GetPath(uuid)));
 
-  OrthancPluginMemoryBuffer64 s;
-  area.ReadWhole(&s, uuid);
-  ASSERT_EQ(5u, s.size);
-  ASSERT_EQ("Hello", s.data);
+TEST(DicomHeader, TransferSyntaxes)
+{
+  std::vector<std::string> samples;
+  samples.push_back(CreateSampleDicom("1.2.840.10008.1.2", false, false, "PAT"));
+  samples.push_back(CreateSampleDicom("1.2.840.10008.1.2.1", true, false, "PAT"));
+  samples.push_back(CreateSampleDicom("1.2.840.10008.1.2.2", true, true, "PAT"));
+  samples.push_back(CreateSampleDicom("1.2.840.10008.1.2.4.50", true, false, "PAT"));
 
-  char data[10];
-  OrthancPluginMemoryBuffer64 buffer;
-  buffer.data = data;
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    const std::string& dicom = samples[i];
 
-  buffer.size = 1;
-  area.ReadRange(&buffer, uuid, 0);  ASSERT_EQ('H', data[0]);
-  area.ReadRange(&buffer, uuid, 4);  ASSERT_EQ('o', data[0]);
-  ASSERT_THROW(area.ReadRange(&buffer, uuid, 5), Orthanc::OrthancException);
-  
-  buffer.size = 2;
-  area.ReadRange(&buffer, uuid, 0);  ASSERT_EQ('H', data[0]);  ASSERT_EQ('e', data[1]);
-  area.ReadRange(&buffer, uuid, 1);  ASSERT_EQ('e', data[0]);  ASSERT_EQ('l', data[1]);
-  area.ReadRange(&buffer, uuid, 2);  ASSERT_EQ('l', data[0]);  ASSERT_EQ('l', data[1]);
-  area.ReadRange(&buffer, uuid, 3);  ASSERT_EQ('l', data[0]);  ASSERT_EQ('o', data[1]);
-  ASSERT_THROW(area.ReadRange(&buffer, uuid, 4), Orthanc::OrthancException);
-  
-  buffer.size = 3;
-  area.ReadRange(&buffer, uuid, 0);  ASSERT_EQ('H', data[0]);  ASSERT_EQ('e', data[1]);  ASSERT_EQ('l', data[2]);
-  area.ReadRange(&buffer, uuid, 1);  ASSERT_EQ('e', data[0]);  ASSERT_EQ('l', data[1]);  ASSERT_EQ('l', data[2]);
-  area.ReadRange(&buffer, uuid, 2);  ASSERT_EQ('l', data[0]);  ASSERT_EQ('l', data[1]);  ASSERT_EQ('o', data[2]);
-  ASSERT_THROW(area.ReadRange(&buffer, uuid, 3), Orthanc::OrthancException);
-  
-  buffer.size = 5;
-  area.ReadRange(&buffer, uuid, 0);
-  ASSERT_EQ('H', data[0]);
-  ASSERT_EQ('e', data[1]);
-  ASSERT_EQ('l', data[2]);
-  ASSERT_EQ('l', data[3]);
-  ASSERT_EQ('o', data[4]);
-  ASSERT_THROW(area.ReadRange(&buffer, uuid, 1), Orthanc::OrthancException);
-  
-  area.RemoveAttachment(uuid);
-  ASSERT_FALSE(Orthanc::SystemToolbox::IsRegularFile(area.GetPath(uuid)));
+    DicomHeader header;
+    ASSERT_EQ(DicomHeader::ParseStatus_Success, header.ParseHeader(dicom.c_str(), dicom.size()));
+    ASSERT_EQ("PAT", header.GetPatientId());  // The padding is removed
+    ASSERT_EQ("1.2.3", header.GetStudyInstanceUid());
+    ASSERT_EQ("1.2.3.4", header.GetSeriesInstanceUid());
+    ASSERT_EQ("1.2.3.4.5", header.GetSopInstanceUid());
 
-  ASSERT_THROW(area.ReadWhole(&buffer, uuid), Orthanc::OrthancException);
-  ASSERT_THROW(area.ReadRange(&buffer, uuid, 0), Orthanc::OrthancException);
+    // The pixel data is not read
+    const size_t headerSize = header.GetHeaderSize();
+    ASSERT_LT(headerSize + 1000u, dicom.size());
+
+    for (size_t prefix = 0; prefix < headerSize; prefix++)
+    {
+      ASSERT_EQ(DicomHeader::ParseStatus_Incomplete, header.ParseHeader(dicom.c_str(), prefix));
+    }
+
+    ASSERT_EQ(DicomHeader::ParseStatus_Success, header.ParseHeader(dicom.c_str(), headerSize));
+    ASSERT_EQ("1.2.3.4", header.GetSeriesInstanceUid());
+  }
+}
+
+
+TEST(DicomHeader, Fallback)
+{
+  DicomHeader header;
+
+  std::string dicom = CreateSampleDicom("1.2.840.10008.1.2.1.99", true, false, "PAT");  // Deflated
+  ASSERT_EQ(DicomHeader::ParseStatus_Unsupported, header.ParseHeader(dicom.c_str(), dicom.size()));
+
+  dicom = CreateSampleDicom("1.2.840.10008.1.2.1", true, false, "\xc3\xa9");  // Non-ASCII patient ID
+  ASSERT_EQ(DicomHeader::ParseStatus_Unsupported, header.ParseHeader(dicom.c_str(), dicom.size()));
+
+  dicom = CreateSampleDicom("1.2.840.10008.1.2.1", false, false, "PAT");  // Wrong transfer syntax
+  ASSERT_EQ(DicomHeader::ParseStatus_Unsupported, header.ParseHeader(dicom.c_str(), dicom.size()));
+
+  DicomWriter writer("1.2.840.10008.1.2.1", true, false);  // Missing SOP Instance UID
+  writer.AddElement(0x0020, 0x000d, "UI", "1.2.3");
+  writer.AddElement(0x0020, 0x000e, "UI", "1.2.3.4");
+  writer.AddElement(0x0028, 0x0010, "US", "ab");
+  ASSERT_EQ(DicomHeader::ParseStatus_Unsupported, header.ParseHeader(writer.GetBuffer().c_str(), writer.GetBuffer().size()));
+
+  dicom = std::string(200, 'x');
+  ASSERT_EQ(DicomHeader::ParseStatus_NotDicom, header.ParseHeader(dicom.c_str(), dicom.size()));
+  ASSERT_FALSE(header.Parse(dicom.c_str(), dicom.size()));
+}
+
+
+TEST(DicomHeader, LocatePixelData)
+{
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    const bool explicitVR = (i != 0);
+    const std::string dicom = (i == 0 ? CreateSampleDicom("1.2.840.10008.1.2", false, false, "PAT") :
+                               i == 1 ? CreateSampleDicom("1.2.840.10008.1.2.1", true, false, "PAT") :
+                               i == 2 ? CreateSampleDicom("1.2.840.10008.1.2.2", true, true, "PAT") :
+                               CreateSampleDicom("1.2.840.10008.1.2.4.50", true, false, "PAT"));
+
+    size_t offset;
+    ASSERT_EQ(DicomHeader::ParseStatus_Success, DicomHeader::LocatePixelData(offset, dicom.c_str(), dicom.size()));
+    ASSERT_EQ(dicom.size() - 1000u - (explicitVR ? 12u : 8u), offset);
+
+    // The prefix before the pixel data is enough to identify the instance
+    DicomHeader header;
+    ASSERT_EQ(DicomHeader::ParseStatus_Success, header.ParseHeader(dicom.c_str(), offset));
+    ASSERT_EQ("1.2.3.4.5", header.GetSopInstanceUid());
+
+    ASSERT_EQ(DicomHeader::ParseStatus_Incomplete, DicomHeader::LocatePixelData(offset, dicom.c_str(), offset - 1));
+  }
+
+  DicomWriter writer("1.2.840.10008.1.2.1", true, false);  // No pixel data
+  writer.AddElement(0x0008, 0x0018, "UI", "1.2.3.4.5");
+  writer.AddSequence(0x0040, 0xa730);
+
+  size_t offset;
+  ASSERT_EQ(DicomHeader::ParseStatus_Incomplete, DicomHeader::LocatePixelData(
+              offset, writer.GetBuffer().c_str(), writer.GetBuffer().size()));
+
+  std::string dicom = CreateSampleDicom("1.2.840.10008.1.2.1.99", true, false, "PAT");  // Deflated
+  ASSERT_EQ(DicomHeader::ParseStatus_Unsupported, DicomHeader::LocatePixelData(offset, dicom.c_str(), dicom.size()));
+
+  dicom = std::string(200, 'x');
+  ASSERT_EQ(DicomHeader::ParseStatus_NotDicom, DicomHeader::LocatePixelData(offset, dicom.c_str(), dicom.size()));
+}
+
+
+
+TEST(DicomHeader, ParseFile)
+{
+  // Large element before the identifiers, so that the prefix must grow
+  DicomWriter writer("1.2.840.10008.1.2.1", true, false);
+  writer.AddElement(0x0008, 0x0016, "UI", "1.2.840.10008.5.1.4.1.1.7");
+  writer.AddElement(0x0008, 0x0017, "OB", std::string(100000, 'x'));
+  writer.AddElement(0x0008, 0x0018, "UI", "1.2.3.4.5");
+  writer.AddElement(0x0020, 0x000d, "UI", "1.2.3");
+  writer.AddElement(0x0020, 0x000e, "UI", "1.2.3.4");
+  writer.AddElement(0x7fe0, 0x0010, "OW", std::string(1000000, 'x'));
+
+  const std::string path = "DicomHeaderTests.dcm";
+  Orthanc::SystemToolbox::WriteFile(writer.GetBuffer().c_str(), writer.GetBuffer().size(), path, false);
+
+  DicomHeader header;
+  ASSERT_TRUE(header.ParseFile(path, writer.GetBuffer().size()));
+  ASSERT_TRUE(header.GetPatientId().empty());
+  ASSERT_EQ("1.2.3.4.5", header.GetSopInstanceUid());
+  ASSERT_EQ("1.2.3.4", header.GetSeriesInstanceUid());
+  ASSERT_GT(header.GetHeaderSize(), 100000u);
+
+  const std::string text = "Hello";
+  Orthanc::SystemToolbox::WriteFile(text.c_str(), text.size(), path, false);
+  ASSERT_FALSE(header.ParseFile(path, 0));
+
+  boost::filesystem::remove(path);
+}
+
+
+
+TEST(DicomHeaderCache, Basic)
+{
+  const std::string dicom1 = CreateSampleDicom("1.2.840.10008.1.2.1", true, false, "PAT1");
+  const std::string dicom2 = CreateSampleDicom("1.2.840.10008.1.2.1", true, false, "PAT2");
+  const std::string dicom3 = CreateSampleDicom("1.2.840.10008.1.2.1", true, false, "PAT3");
+  ASSERT_EQ(dicom1.size(), dicom2.size());
+
+  DicomHeader header1;
+  ASSERT_EQ(DicomHeader::ParseStatus_Success, header1.ParseHeader(dicom1.c_str(), dicom1.size()));
+
+  DicomHeaderCache cache(2, 1024);
+
+  DicomHeader header;
+  std::string instanceId;
+  ASSERT_FALSE(cache.Lookup(header, instanceId, dicom1.c_str(), dicom1.size()));
+
+  cache.Store(header1, "instance1", dicom1.c_str(), dicom1.size());
+  ASSERT_TRUE(cache.Lookup(header, instanceId, dicom1.c_str(), dicom1.size()));
+  ASSERT_EQ("instance1", instanceId);
+  ASSERT_EQ("PAT1", header.GetPatientId());
+  ASSERT_EQ("1.2.3.4", header.GetSeriesInstanceUid());
+
+  // Same size, but different identifiers
+  ASSERT_FALSE(cache.Lookup(header, instanceId, dicom2.c_str(), dicom2.size()));
+
+  // The pixel data is not part of the key
+  std::string modified = dicom1;
+  modified[modified.size() - 1] = 'y';
+  ASSERT_TRUE(cache.Lookup(header, instanceId, modified.c_str(), modified.size()));
+  ASSERT_FALSE(cache.Lookup(header, instanceId, modified.c_str(), modified.size() - 1));
+
+  // Eviction of the oldest entries
+  DicomHeader header2, header3;
+  ASSERT_EQ(DicomHeader::ParseStatus_Success, header2.ParseHeader(dicom2.c_str(), dicom2.size()));
+  ASSERT_EQ(DicomHeader::ParseStatus_Success, header3.ParseHeader(dicom3.c_str(), dicom3.size()));
+  cache.Store(header2, "instance2", dicom2.c_str(), dicom2.size());
+  cache.Store(header3, "instance3", dicom3.c_str(), dicom3.size());
+  ASSERT_FALSE(cache.Lookup(header, instanceId, dicom1.c_str(), dicom1.size()));
+  ASSERT_TRUE(cache.Lookup(header, instanceId, dicom2.c_str(), dicom2.size()));
+  ASSERT_EQ("instance2", instanceId);
+  ASSERT_TRUE(cache.Lookup(header, instanceId, dicom3.c_str(), dicom3.size()));
+  ASSERT_EQ("instance3", instanceId);
+
+  // Headers that are too large, or that were parsed by the Orthanc core, are not cached
+  DicomHeaderCache small(2, 16);
+  small.Store(header1, "instance1", dicom1.c_str(), dicom1.size());
+  ASSERT_FALSE(small.Lookup(header, instanceId, dicom1.c_str(), dicom1.size()));
+  small.Store(DicomHeader(), "instance1", dicom1.c_str(), dicom1.size());
+  ASSERT_FALSE(small.Lookup(header, instanceId, dicom1.c_str(), dicom1.size()));
 }
 
 
@@ -167,18 +1325,18 @@ TEST(IndexerDatabase, Files)
   ASSERT_EQ(0u, db.GetAttachmentsCount());
 
   std::string s;
-  ASSERT_EQ(IndexerDatabase::FileStatus_New, db.LookupFile(s, "some/path/to/dicom", 42 /* time */, 5 /* size */));
+  ASSERT_EQ(IndexerDatabase::FileStatus_New, db.LookupFile(s, "some/path/to/dicom", FileMetadata(42, 5)));
 
-  db.AddDicomInstance("some/path/to/dicom", 42 /* time */, 5 /* size */, "instance1");
+  db.AddDicomInstance("some/path/to/dicom", FileMetadata(42, 5), "instance1");
   db.Apply(v);
   ASSERT_EQ(1u, v.GetSize());
   ASSERT_EQ("some/path/to/dicom", v.GetPath(0));
   ASSERT_TRUE(v.IsDicom(0));
   ASSERT_EQ("instance1", v.GetInstanceId(0));
 
-  ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "some/path/to/dicom", 42 /* time */, 5 /* size */));
-  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/dicom", 43 /* time */, 5 /* size */));
-  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/dicom", 42 /* time */, 6 /* size */));
+  ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "some/path/to/dicom", FileMetadata(42, 5)));
+  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/dicom", FileMetadata(43, 5)));
+  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/dicom", FileMetadata(42, 6)));
   
   ASSERT_EQ(1u, db.GetFilesCount());
   ASSERT_EQ(0u, db.GetAttachmentsCount());
@@ -194,9 +1352,9 @@ TEST(IndexerDatabase, Files)
   db.Apply(v);
   ASSERT_EQ(0u, v.GetSize());
 
-  ASSERT_EQ(IndexerDatabase::FileStatus_New, db.LookupFile(s, "some/path/to/text", 42 /* time */, 5 /* size */));
+  ASSERT_EQ(IndexerDatabase::FileStatus_New, db.LookupFile(s, "some/path/to/text", FileMetadata(42, 5)));
 
-  db.AddNonDicomFile("some/path/to/text", 42 /* time */, 5 /* size */);
+  db.AddNonDicomFile("some/path/to/text", FileMetadata(42, 5));
   db.Apply(v);
   ASSERT_EQ(1u, v.GetSize());
   ASSERT_EQ("some/path/to/text", v.GetPath(0));
@@ -206,9 +1364,9 @@ TEST(IndexerDatabase, Files)
   ASSERT_EQ(1u, db.GetFilesCount());
   ASSERT_EQ(0u, db.GetAttachmentsCount());
 
-  ASSERT_EQ(IndexerDatabase::FileStatus_NotDicom, db.LookupFile(s, "some/path/to/text", 42 /* time */, 5 /* size */));
-  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/text", 43 /* time */, 5 /* size */));
-  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/text", 42 /* time */, 6 /* size */));
+  ASSERT_EQ(IndexerDatabase::FileStatus_NotDicom, db.LookupFile(s, "some/path/to/text", FileMetadata(42, 5)));
+  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/text", FileMetadata(43, 5)));
+  ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/text", FileMetadata(42, 6)));
   
   ASSERT_TRUE(db.RemoveFile("some/path/to/text"));
   ASSERT_THROW(db.RemoveFile("some/path/to/text"), Orthanc::OrthancException);
@@ -219,6 +1377,33 @@ TEST(IndexerDatabase, Files)
 
   ASSERT_EQ(0u, db.GetFilesCount());
   ASSERT_EQ(0u, db.GetAttachmentsCount());
+
+  {
+    FileMetadata metadata(42, 5);
+    metadata.nanoseconds_ = 500;
+    metadata.inode_ = 1000;
+    db.AddDicomInstance("some/path/to/dicom", metadata, "instance1");
+
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "some/path/to/dicom", metadata));
+
+    // Modified within the same second
+    FileMetadata other = metadata;
+    other.nanoseconds_ = 501;
+    ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/dicom", other));
+
+    // Replaced by another file with the same size and modification time
+    other = metadata;
+    other.inode_ = 1001;
+    ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "some/path/to/dicom", other));
+
+    // The inodes are not compared if unknown (network filesystems)
+    other.inode_ = 0;
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "some/path/to/dicom", other));
+    db.TouchFile("some/path/to/dicom", other);
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "some/path/to/dicom", metadata));
+
+    ASSERT_TRUE(db.RemoveFile("some/path/to/dicom"));
+  }
 }
 
 
@@ -231,7 +1416,7 @@ TEST(IndexerDatabase, RemoveUsingRestApi)
 
   // Firstly, the plugin detects the new instances on the filesystem
   // and uploads them into Orthanc in the "ProcessFile()" function
-  db.AddDicomInstance("sample.dcm", 42 /* time */, 5 /* size */, "instance1");
+  db.AddDicomInstance("sample.dcm", FileMetadata(42, 5), "instance1");
 
   db.Apply(v);
   ASSERT_EQ(1u, v.GetSize());
@@ -290,8 +1475,8 @@ TEST(IndexerDatabase, RemoveFromFilesystem)
   db.OpenInMemory();
 
   // Firstly, the plugin finds two copies of the same DICOM instance
-  db.AddDicomInstance("copy1.dcm", 42 /* time */, 5 /* size */, "instance1");
-  db.AddDicomInstance("copy2.dcm", 43 /* time */, 6 /* size */, "instance1");
+  db.AddDicomInstance("copy1.dcm", FileMetadata(42, 5), "instance1");
+  db.AddDicomInstance("copy2.dcm", FileMetadata(43, 6), "instance1");
 
   std::set<std::string> s;
   db.Apply(v);
@@ -356,11 +1541,748 @@ TEST(IndexerDatabase, RemoveFromFilesystem)
 }
 
 
+static void ConcurrentLookups(IndexerDatabase* db,
+                              bool* success)
+{
+  for (unsigned int i = 0; i < 100; i++)
+  {
+    std::string path, instanceId;
+    int64_t count;
+    if (!db->LookupAttachment(path, "uuid1") ||
+        path != "sample.dcm" ||
+        db->LookupFile(instanceId, "sample.dcm", FileMetadata(42, 5)) != IndexerDatabase::FileStatus_AlreadyStored ||
+        db->LookupFile(instanceId, "sample.dcm", FileMetadata(43, 5)) != IndexerDatabase::FileStatus_Modified ||
+        instanceId != "instance1" ||
+        !db->CountTimesAttached(count, "instance1") ||
+        count != 1)
+    {
+      *success = false;
+    }
+  }
+}
+
+
+TEST(IndexerDatabase, ReadConnections)
+{
+  const std::string path = "IndexerDatabaseTests.db";
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+
+  {
+    IndexerDatabase db;
+    db.Open(path, 2 /* read-only connections */);
+
+    db.AddDicomInstance("sample.dcm", FileMetadata(42, 5), "instance1");
+    ASSERT_TRUE(db.AddAttachment("uuid1", "instance1"));
+
+    // More threads than read-only connections
+    bool success[4] = { true, true, true, true };
+    boost::thread_group threads;
+
+    for (unsigned int i = 0; i < 4; i++)
+    {
+      threads.create_thread(boost::bind(ConcurrentLookups, &db, &success[i]));
+    }
+
+    // The writer is not blocked by the readers
+    db.AddDicomInstance("other.dcm", FileMetadata(42, 5), "instance2");
+    threads.join_all();
+
+    for (unsigned int i = 0; i < 4; i++)
+    {
+      ASSERT_TRUE(success[i]);
+    }
+
+    // The readers see the writes of the writer connection
+    std::string s;
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "other.dcm", FileMetadata(42, 5)));
+    ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "other.dcm", FileMetadata(43, 5)));
+    ASSERT_EQ("instance2", s);
+    ASSERT_EQ(2u, db.GetFilesCount());
+  }
+
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+}
+
+
+static unsigned int CountCommittedFiles(const std::string& path)
+{
+  // Independent connection, that only sees the committed rows
+  Orthanc::SQLite::Connection db;
+  db.Open(path);
+  Orthanc::SQLite::Statement statement(db, SQLITE_FROM_HERE, "SELECT COUNT(*) FROM Files");
+  statement.Step();
+  return static_cast<unsigned int>(statement.ColumnInt64(0));
+}
+
+
+TEST(IndexerDatabase, WriteBatch)
+{
+  const std::string path = "IndexerDatabaseTests.db";
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+
+  {
+    IndexerDatabase db;
+    ASSERT_THROW(db.SetWriteBatch(0, 1000), Orthanc::OrthancException);
+
+    db.Open(path, 1 /* read-only connection */);
+    db.SetWriteBatch(3, 100000 /* milliseconds */);
+
+    db.AddNonDicomFile("a", FileMetadata(42, 5));
+    db.AddDicomInstance("b", FileMetadata(42, 5), "instance1");
+    ASSERT_EQ(0u, CountCommittedFiles(path));
+
+    // The uncommitted rows are visible to the lookups
+    std::string s;
+    ASSERT_EQ(IndexerDatabase::FileStatus_NotDicom, db.LookupFile(s, "a", FileMetadata(42, 5)));
+    ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "b", FileMetadata(43, 5)));
+    ASSERT_EQ("instance1", s);
+    ASSERT_EQ(2u, db.GetFilesCount());
+
+    // A failing insert does not roll back the batch
+    ASSERT_THROW(db.AddNonDicomFile("a", FileMetadata(42, 5)), Orthanc::OrthancException);
+
+    db.AddNonDicomFile("c", FileMetadata(42, 5));
+    ASSERT_EQ(3u, CountCommittedFiles(path));  // The batch is full
+
+    db.AddNonDicomFile("d", FileMetadata(42, 5));
+    ASSERT_EQ(3u, CountCommittedFiles(path));
+    db.FlushWriteBatch();
+    ASSERT_EQ(4u, CountCommittedFiles(path));
+
+    // The attachments are committed immediately, together with their file
+    db.AddDicomInstance("e", FileMetadata(42, 5), "instance2");
+    ASSERT_TRUE(db.AddAttachment("uuid2", "instance2"));
+    ASSERT_EQ(5u, CountCommittedFiles(path));
+    ASSERT_TRUE(db.LookupAttachment(s, "uuid2"));
+    ASSERT_EQ("e", s);
+
+    // Same for the removals
+    db.AddNonDicomFile("f", FileMetadata(42, 5));
+    ASSERT_FALSE(db.RemoveFile("a"));
+    ASSERT_EQ(5u, CountCommittedFiles(path));
+
+    // The removal of an attachment is visible to the readers, even if
+    // a batch is open (cf. "StorageRemove()")
+    db.AddNonDicomFile("g", FileMetadata(42, 5));
+    int64_t count;
+    ASSERT_TRUE(db.CountTimesAttached(count, "instance2"));
+    ASSERT_EQ(1, count);
+    db.RemoveAttachment("uuid2");
+    ASSERT_EQ(6u, CountCommittedFiles(path));
+    ASSERT_TRUE(db.CountTimesAttached(count, "instance2"));
+    ASSERT_EQ(0, count);
+    ASSERT_FALSE(db.LookupAttachment(s, "uuid2"));
+
+    db.AddNonDicomFile("h", FileMetadata(42, 5));
+  }
+
+  // The pending batch is committed by the destructor
+  ASSERT_EQ(7u, CountCommittedFiles(path));
+
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+}
+
+
+class StaleVisitor : public IndexerDatabase::IFileVisitor
+{
+public:
+  std::list<std::string>  paths_;
+
+  virtual void VisitInstance(const std::string& path,
+                             bool isDicom,
+                             const std::string& instanceId) ORTHANC_OVERRIDE
+  {
+    paths_.push_back(path);
+  }
+};
+
+
+TEST(IndexerDatabase, Generations)
+{
+  const std::string path = "IndexerDatabaseTests.db";
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+
+  {
+    // Database created by a previous version of the plugin, without generations
+    Orthanc::SQLite::Connection db;
+    db.Open(path);
+    db.Execute("CREATE TABLE Files(path TEXT PRIMARY KEY NOT NULL, time INTEGER NOT NULL, "
+               "size INTEGER NOT NULL, isDicom INTEGER NOT NULL, instanceId TEXT NOT NULL);");
+    db.Execute("CREATE TABLE Attachments(uuid TEXT PRIMARY KEY NOT NULL, instanceId NOT NULL);");
+    db.Execute("INSERT INTO Files VALUES('old.dcm', 42, 5, 1, 'instance1');");
+  }
+
+  {
+    IndexerDatabase db;
+    db.Open(path, 1 /* read-only connection */);
+    db.SetWriteBatch(100, 100000 /* milliseconds */);
+
+    int64_t generation = db.StartScan();
+    ASSERT_EQ(1, generation);
+
+    db.AddDicomInstance("copy1.dcm", FileMetadata(42, 5), "instance2");
+    db.AddDicomInstance("copy2.dcm", FileMetadata(42, 5), "instance2");
+    db.AddNonDicomFile("text", FileMetadata(42, 5));
+    db.FlushWriteBatch();
+
+    StaleVisitor v1;
+    db.ApplyStale(v1, generation);
+    ASSERT_EQ(1u, v1.paths_.size());
+    ASSERT_EQ("old.dcm", v1.paths_.front());
+
+    // Second scan, that only sees "text" and "copy1.dcm"
+    generation = db.StartScan();
+    ASSERT_EQ(2, generation);
+    db.TouchFile("text", FileMetadata(42, 5));
+    db.TouchFile("copy1.dcm", FileMetadata(42, 5));
+    db.FlushWriteBatch();
+
+    StaleVisitor v2;
+    db.ApplyStale(v2, generation);
+    ASSERT_EQ(2u, v2.paths_.size());
+
+    std::set<std::string> orphans;
+    v2.paths_.push_back("nope");
+    db.RemoveFiles(orphans, v2.paths_);
+    ASSERT_EQ(1u, orphans.size());
+    ASSERT_TRUE(orphans.find("instance1") != orphans.end());  // "instance2" still has one copy
+    ASSERT_EQ(2u, db.GetFilesCount());
+
+    // Third scan, that sees nothing
+    generation = db.StartScan();
+    StaleVisitor v3;
+    db.ApplyStale(v3, generation);
+    ASSERT_EQ(2u, v3.paths_.size());
+
+    orphans.clear();
+    db.RemoveFiles(orphans, v3.paths_);
+    ASSERT_EQ(1u, orphans.size());
+    ASSERT_TRUE(orphans.find("instance2") != orphans.end());
+    ASSERT_EQ(0u, db.GetFilesCount());
+
+    db.AddNonDicomFile("text", FileMetadata(42, 5));
+  }
+
+  {
+    // The generation is restored from the database
+    IndexerDatabase db;
+    db.Open(path, 0);
+    ASSERT_EQ(4, db.StartScan());
+  }
+
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+}
+
+
+class MapVisitor : public IndexerDatabase::IFileVisitor
+{
+public:
+  std::map<std::string, std::string>  instances_;
+
+  virtual void VisitInstance(const std::string& path,
+                             bool isDicom,
+                             const std::string& instanceId) ORTHANC_OVERRIDE
+  {
+    instances_[path] = instanceId;
+  }
+};
+
+
+static std::string ExecuteScalar(const std::string& path,
+                                 const std::string& sql)
+{
+  Orthanc::SQLite::Connection db;
+  db.Open(path);
+  Orthanc::SQLite::Statement statement(db, sql);
+  statement.Step();
+  return statement.ColumnString(0);
+}
+
+
+TEST(IndexerDatabase, Schema)
+{
+  const std::string path = "IndexerDatabaseTests.db";
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+
+  const std::string orthancId = "0123abcd-4567ef89-00000000-ffffffff-a1b2c3d4";
+
+  std::map<std::string, std::string> files;
+  files["/data/a/1.dcm"] = orthancId;
+  files["/data/a/2.dcm"] = orthancId;
+  files["/data/b/3.dcm"] = "instance1";
+  files["/data/b/4.txt"] = "";
+  files["relative/5.dcm"] = "0123ABCD-4567EF89-00000000-FFFFFFFF-A1B2C3D4";  // Not lowercase
+  files["nodir.dcm"] = "instance2";
+  files["/top.dcm"] = "instance3";
+  files["//double//slash"] = "instance4";
+  files["/data/a/"] = "instance5";
+
+  {
+    // Version 1 of the schema, indexed by the full paths
+    Orthanc::SQLite::Connection db;
+    db.Open(path);
+    db.Execute("CREATE TABLE Files(path TEXT PRIMARY KEY NOT NULL, time INTEGER NOT NULL, "
+               "size INTEGER NOT NULL, isDicom INTEGER NOT NULL, instanceId TEXT NOT NULL, "
+               "generation INTEGER NOT NULL DEFAULT 0);");
+    db.Execute("CREATE TABLE Attachments(uuid TEXT PRIMARY KEY NOT NULL, instanceId NOT NULL);");
+    db.Execute("CREATE INDEX InstancesIndex ON Files(instanceId);");
+    db.Execute("CREATE TABLE Notifications(sequence INTEGER PRIMARY KEY AUTOINCREMENT, "
+               "filepath TEXT NOT NULL, added INTEGER NOT NULL);");
+    db.Execute("CREATE INDEX NotificationsIndex ON Notifications(filepath);");
+    db.Execute("INSERT INTO Notifications(filepath, added) VALUES('pending', 1);");
+
+    for (std::map<std::string, std::string>::const_iterator it = files.begin(); it != files.end(); ++it)
+    {
+      Orthanc::SQLite::Statement statement(db, "INSERT INTO Files VALUES(?, 42, 5, ?, ?, 7)");
+      statement.BindString(0, it->first);
+      statement.BindInt(1, !it->second.empty());
+      statement.BindString(2, it->second);
+      statement.Run();
+    }
+
+    db.Execute("INSERT INTO Attachments VALUES('uuid1', '" + orthancId + "');");
+  }
+
+  {
+    IndexerDatabase db;
+    db.Open(path, 1 /* read-only connection */);
+
+    MapVisitor visitor;
+    db.Apply(visitor);
+    ASSERT_EQ(files, visitor.instances_);
+
+    std::string s;
+    ASSERT_TRUE(db.LookupAttachment(s, "uuid1"));
+    ASSERT_TRUE(s == "/data/a/1.dcm" || s == "/data/a/2.dcm");
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "/data/b/3.dcm", FileMetadata(42, 5)));
+    ASSERT_EQ(IndexerDatabase::FileStatus_NotDicom, db.LookupFile(s, "/data/b/4.txt", FileMetadata(42, 5)));
+    ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "/data/a/1.dcm", FileMetadata(43, 5)));
+    ASSERT_EQ(orthancId, s);
+    ASSERT_EQ(IndexerDatabase::FileStatus_New, db.LookupFile(s, "/data/c/6.dcm", FileMetadata(42, 5)));
+    ASSERT_EQ(8, db.StartScan());  // The generations are preserved
+
+    // The sub-second part of the modification time is unknown, until
+    // the next scan records it
+    FileMetadata metadata(42, 5);
+    metadata.nanoseconds_ = 500;
+    metadata.inode_ = 1000;
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "/data/b/3.dcm", metadata));
+    db.TouchFile("/data/b/3.dcm", metadata);
+    db.FlushWriteBatch();
+
+    FileMetadata other = metadata;
+    other.nanoseconds_ = 501;
+    ASSERT_EQ(IndexerDatabase::FileStatus_AlreadyStored, db.LookupFile(s, "/data/b/3.dcm", metadata));
+    ASSERT_EQ(IndexerDatabase::FileStatus_Modified, db.LookupFile(s, "/data/b/3.dcm", other));
+
+    std::list<IndexerDatabase::Notification> n;
+    db.GetNotifications(n, 10);
+    ASSERT_EQ(1u, n.size());
+  }
+
+  ASSERT_EQ("2", ExecuteScalar(path, "SELECT value FROM GlobalProperties WHERE property=1"));
+  ASSERT_EQ("0", ExecuteScalar(path, "SELECT COUNT(*) FROM sqlite_master WHERE name='FilesV1'"));
+  ASSERT_EQ("blob", ExecuteScalar(path, "SELECT typeof(instanceId) FROM Attachments"));
+
+  const std::string directories = ExecuteScalar(path, "SELECT COUNT(*) FROM Directories");
+
+  {
+    // Reopening the database, the directories are reloaded
+    IndexerDatabase db;
+    db.Open(path, 0);
+
+    db.AddDicomInstance("/data/b/6.dcm", FileMetadata(42, 5), orthancId);
+    ASSERT_FALSE(db.RemoveFile("/data/a/1.dcm"));
+    ASSERT_FALSE(db.RemoveFile("/data/a/2.dcm"));
+    ASSERT_TRUE(db.RemoveFile("/data/b/6.dcm"));
+    ASSERT_THROW(db.RemoveFile("/unknown/7.dcm"), Orthanc::OrthancException);
+
+    files.erase("/data/a/1.dcm");
+    files.erase("/data/a/2.dcm");
+
+    MapVisitor visitor;
+    db.Apply(visitor);
+    ASSERT_EQ(files, visitor.instances_);
+  }
+
+  ASSERT_EQ(directories, ExecuteScalar(path, "SELECT COUNT(*) FROM Directories"));
+
+  {
+    // Unknown version of the schema
+    Orthanc::SQLite::Connection db;
+    db.Open(path);
+    db.Execute("UPDATE GlobalProperties SET value='3' WHERE property=1");
+  }
+
+  {
+    IndexerDatabase db;
+    ASSERT_THROW(db.Open(path, 0), Orthanc::OrthancException);
+  }
+
+  boost::filesystem::remove(path);
+  boost::filesystem::remove(path + "-wal");
+  boost::filesystem::remove(path + "-shm");
+}
+
+
+TEST(IndexerDatabase, Directories)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("/data/a/1.dcm", FileMetadata(10, 10), "instance1");
+  db.AddDicomInstance("/data/a/2.dcm", FileMetadata(10, 10), "instance2");
+  db.AddDicomInstance("/data/b/c/3.dcm", FileMetadata(10, 10), "instance3");
+
+  std::list<std::string> a, b, empty;
+  a.push_back("/data/a");
+  a.push_back("/data/b");
+  a.push_back("/data/d");
+  b.push_back("/data/b/c");
+
+  db.StoreDirectory("/data", 100, true, a);
+  db.StoreDirectory("/data/a", 200, true, empty);
+  db.StoreDirectory("/data/b", 300, false /* not stable */, b);
+  db.StoreDirectory("/data/d", 400, true, empty);  // Directory without files
+
+  std::list<std::string> s;
+  ASSERT_TRUE(db.LookupDirectory(s, "/data", 100));
+  ASSERT_EQ(3u, s.size());
+  ASSERT_TRUE(std::find(s.begin(), s.end(), "/data/a") != s.end());
+  ASSERT_TRUE(std::find(s.begin(), s.end(), "/data/b") != s.end());
+  ASSERT_TRUE(std::find(s.begin(), s.end(), "/data/d") != s.end());
+
+  ASSERT_FALSE(db.LookupDirectory(s, "/data", 101));
+  ASSERT_TRUE(db.LookupDirectory(s, "/data/a", 200));
+  ASSERT_TRUE(s.empty());
+  ASSERT_FALSE(db.LookupDirectory(s, "/data/b", 300));
+  ASSERT_FALSE(db.LookupDirectory(s, "/data/b/c", 0));
+  ASSERT_FALSE(db.LookupDirectory(s, "/nope", 100));
+  ASSERT_TRUE(db.LookupDirectory(s, "/data/d", 400));
+
+  // The files of the directories that are not listed are not stale
+  const int64_t generation = db.StartScan();
+  db.TouchDirectory("/data/a");
+  db.TouchDirectory("/data/d");
+  db.TouchDirectory("/nope");
+
+  StaleVisitor stale;
+  db.ApplyStale(stale, generation);
+  ASSERT_EQ(1u, stale.paths_.size());
+  ASSERT_EQ("/data/b/c/3.dcm", stale.paths_.front());
+
+  // "/data/d" was removed: It must be listed if it is created again
+  a.push_back("/data/e");
+  a.remove("/data/d");
+  db.StoreDirectory("/data", 500, true, a);
+  ASSERT_FALSE(db.LookupDirectory(s, "/data/d", 400));
+  ASSERT_TRUE(db.LookupDirectory(s, "/data", 500));
+  ASSERT_EQ(4u, s.size());  // The removed directories are still given back
+
+  // Non-canonical paths are never pruned
+  db.StoreDirectory("/data/a/", 600, true, empty);
+  ASSERT_FALSE(db.LookupDirectory(s, "/data/a/", 600));
+  db.StoreDirectory("/data/b", 700, true, a);  // Not the children of "/data/b"
+  ASSERT_FALSE(db.LookupDirectory(s, "/data/b", 700));
+}
+
+
+TEST(IndexerDatabase, Notifications)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  std::list<IndexerDatabase::Notification> n;
+  db.GetNotifications(n, 10);
+  ASSERT_TRUE(n.empty());
+
+  db.AppendNotification("a", true);
+  db.AppendNotification("a", true);   // Same as the pending one, ignored
+  db.AppendNotification("b", true);
+  db.AppendNotification("a", false);
+  db.AppendNotification("a", true);
+
+  db.GetNotifications(n, 10);
+  ASSERT_EQ(4u, n.size());
+  ASSERT_EQ(4u, db.CountNotifications());
+  ASSERT_EQ("a", n.front().filepath_);
+  ASSERT_TRUE(n.front().added_);
+  ASSERT_EQ("a", n.back().filepath_);
+  ASSERT_TRUE(n.back().added_);
+
+  int64_t previous = 0;
+  for (std::list<IndexerDatabase::Notification>::const_iterator it = n.begin(); it != n.end(); ++it)
+  {
+    ASSERT_LT(previous, it->sequence_);
+    previous = it->sequence_;
+  }
+
+  db.GetNotifications(n, 2);
+  ASSERT_EQ(2u, n.size());
+  ASSERT_EQ("b", n.back().filepath_);
+
+  db.RemoveNotification(n.front().sequence_);
+  db.RemoveNotification(n.back().sequence_);
+
+  db.GetNotifications(n, 10);
+  ASSERT_EQ(2u, n.size());
+  ASSERT_EQ(2u, db.CountNotifications());
+  ASSERT_EQ("a", n.front().filepath_);
+  ASSERT_FALSE(n.front().added_);
+
+  // The sequence numbers are never reused
+  db.RemoveNotification(n.front().sequence_);
+  db.RemoveNotification(n.back().sequence_);
+  db.AppendNotification("c", true);
+  db.GetNotifications(n, 10);
+  ASSERT_EQ(1u, n.size());
+  ASSERT_LT(previous, n.front().sequence_);
+}
+
+
+TEST(IndexerDatabase, Cache)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("a", FileMetadata(10, 10), "instance1");
+  db.AddDicomInstance("b", FileMetadata(10, 10), "instance2");
+  ASSERT_TRUE(db.AddAttachment("uuid1", "instance1"));
+
+  db.EnableCache(1024 * 1024);
+  ASSERT_EQ(1u, db.GetCacheSize());   // Preloaded
+
+  std::string s;
+  ASSERT_TRUE(db.LookupAttachment(s, "uuid1"));  ASSERT_EQ("a", s);
+  ASSERT_FALSE(db.LookupAttachment(s, "uuid2"));
+  ASSERT_EQ(1u, db.GetCacheSize());
+
+  ASSERT_TRUE(db.AddAttachment("uuid2", "instance2"));
+  ASSERT_TRUE(db.LookupAttachment(s, "uuid2"));  ASSERT_EQ("b", s);
+  ASSERT_EQ(2u, db.GetCacheSize());   // Stored by the lookup
+
+  // Another copy of the same instance
+  db.AddDicomInstance("c", FileMetadata(10, 10), "instance2");
+  ASSERT_FALSE(db.RemoveFile("b"));
+  ASSERT_TRUE(db.LookupAttachment(s, "uuid2"));  ASSERT_EQ("c", s);
+
+  ASSERT_TRUE(db.RemoveFile("c"));
+  ASSERT_FALSE(db.LookupAttachment(s, "uuid2"));
+
+  std::set<std::string> orphans;
+  std::list<std::string> paths;
+  paths.push_back("a");
+  db.RemoveFiles(orphans, paths);
+  ASSERT_EQ(1u, orphans.size());
+  ASSERT_FALSE(db.LookupAttachment(s, "uuid1"));
+
+  db.RemoveAttachment("uuid1");
+  db.RemoveAttachment("uuid2");
+  ASSERT_EQ(0u, db.GetCacheSize());
+
+  // A tiny budget only limits the mirror, not the results
+  db.AddDicomInstance("d", FileMetadata(10, 10), "instance3");
+  ASSERT_TRUE(db.AddAttachment("uuid3", "instance3"));
+  db.EnableCache(1);
+  ASSERT_TRUE(db.LookupAttachment(s, "uuid3"));  ASSERT_EQ("d", s);
+  ASSERT_EQ(0u, db.GetCacheSize());
+}
+
+
+static void IncrementUploads(unsigned int count)
+{
+  for (unsigned int i = 0; i < count; i++)
+  {
+    IndexerMetrics::Increment(IndexerMetrics::Counter_FilesUploaded);
+  }
+}
+
+
+TEST(IndexerMetrics, Basic)
+{
+  // The metrics are global to the process, hence the differences
+  const uint64_t uploaded = IndexerMetrics::GetCounter(IndexerMetrics::Counter_FilesUploaded);
+  const uint64_t scans = IndexerMetrics::GetCount(IndexerMetrics::Histogram_Scan);
+
+  {
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < 20; i++)
+    {
+      threads.create_thread(boost::bind(IncrementUploads, 1000));
+    }
+
+    threads.join_all();
+  }
+
+  ASSERT_EQ(uploaded + 20000u, IndexerMetrics::GetCounter(IndexerMetrics::Counter_FilesUploaded));
+
+  IndexerMetrics::Observe(IndexerMetrics::Histogram_Scan, 0);
+  IndexerMetrics::Observe(IndexerMetrics::Histogram_Scan, 10);
+  IndexerMetrics::Observe(IndexerMetrics::Histogram_Scan, 11);
+  IndexerMetrics::Observe(IndexerMetrics::Histogram_Scan, 2000000000000ull);  // Beyond the last bucket
+  ASSERT_EQ(scans + 4u, IndexerMetrics::GetCount(IndexerMetrics::Histogram_Scan));
+
+  {
+    IndexerMetrics::Timer timer(IndexerMetrics::Histogram_Scan);
+  }
+
+  ASSERT_EQ(scans + 5u, IndexerMetrics::GetCount(IndexerMetrics::Histogram_Scan));
+
+  std::string s;
+  IndexerMetrics::Format(s);
+  IndexerMetrics::FormatGauge(s, "indexer_test", "Test", 42);
+
+  ASSERT_NE(std::string::npos, s.find("# TYPE indexer_files_examined_total counter\n"));
+  ASSERT_NE(std::string::npos, s.find("indexer_files_examined_total{status=\"new\"} "));
+  ASSERT_NE(std::string::npos, s.find("indexer_files_uploaded_total " +
+                                      std::to_string(IndexerMetrics::GetCounter(IndexerMetrics::Counter_FilesUploaded)) + "\n"));
+  ASSERT_NE(std::string::npos, s.find("# TYPE indexer_scan_duration_seconds histogram\n"));
+  ASSERT_NE(std::string::npos, s.find("indexer_scan_duration_seconds_bucket{le=\"+Inf\"} " +
+                                      std::to_string(scans + 5) + "\n"));
+  ASSERT_NE(std::string::npos, s.find("indexer_scan_duration_seconds_count " + std::to_string(scans + 5) + "\n"));
+  ASSERT_NE(std::string::npos, s.find("indexer_database_duration_seconds_bucket{operation=\"lookup_file\",le=\"0.000010\"} "));
+  ASSERT_NE(std::string::npos, s.find("# TYPE indexer_test gauge\nindexer_test 42\n"));
+
+  // Only one header per family
+  ASSERT_EQ(s.find("# HELP indexer_storage_duration_seconds "), s.rfind("# HELP indexer_storage_duration_seconds "));
+}
+
+
+static void WaitWhilePaused(ScanController* controller,
+                            const bool* stop,
+                            bool* result)
+{
+  *result = controller->WaitWhilePaused(*stop);
+}
+
+
+TEST(ScanController, Basic)
+{
+  const bool stop = false;
+
+  ScanController controller;
+
+  Json::Value json;
+  controller.Format(json);
+  ASSERT_EQ("Idle", json["State"].asString());
+  ASSERT_TRUE(json["CurrentScan"].isNull());
+  ASSERT_TRUE(json["LastScan"].isNull());
+
+  // Periodic scan
+  std::list<std::string> targets;
+  bool requested = true;
+  ASSERT_TRUE(controller.WaitForNextScan(targets, requested, 0, stop));
+  ASSERT_FALSE(requested);
+  ASSERT_TRUE(targets.empty());
+
+  std::list<std::string> folders;
+  folders.push_back("/a");
+  folders.push_back("/b");
+
+  controller.StartScan(folders, true /* all folders */, false /* not pruned */);
+  controller.VisitDirectory("/a");
+  controller.VisitFile();
+  controller.VisitFile();
+
+  controller.Format(json);
+  ASSERT_EQ("Scanning", json["State"].asString());
+  ASSERT_EQ("/a", json["CurrentScan"]["CurrentDirectory"].asString());
+  ASSERT_EQ(2u, json["CurrentScan"]["VisitedFiles"].asUInt());
+  ASSERT_EQ(1u, json["CurrentScan"]["VisitedDirectories"].asUInt());
+  ASSERT_EQ(2u, json["CurrentScan"]["Targets"].size());
+  ASSERT_TRUE(json["CurrentScan"]["RemainingSeconds"].isNull());  // No previous scan
+
+  controller.VisitFile();
+  controller.VisitFile();
+  controller.FinishScan(true);
+
+  controller.Format(json);
+  ASSERT_EQ("Idle", json["State"].asString());
+  ASSERT_TRUE(json["CurrentScan"].isNull());
+  ASSERT_TRUE(json["LastScan"]["Completed"].asBool());
+  ASSERT_EQ(4u, json["LastScan"]["VisitedFiles"].asUInt());
+
+  // The remaining time is extrapolated from the previous scan
+  controller.StartScan(folders, true, false);
+  controller.VisitFile();
+  controller.Format(json);
+  ASSERT_EQ(4u, json["CurrentScan"]["ExpectedFiles"].asUInt());
+  ASSERT_FALSE(json["CurrentScan"]["RemainingSeconds"].isNull());
+  controller.FinishScan(false);
+
+  // Requested scans, that are deduplicated
+  controller.RequestScan("/a/x");
+  controller.RequestScan("/a/y");
+  controller.RequestScan("/a/x");
+  ASSERT_TRUE(controller.WaitForNextScan(targets, requested, 3600, stop));
+  ASSERT_TRUE(requested);
+  ASSERT_EQ(2u, targets.size());
+  ASSERT_EQ("/a/x", targets.front());
+  ASSERT_EQ("/a/y", targets.back());
+
+  // The scan of all the folders covers the subpaths
+  controller.RequestScan("/a/x");
+  controller.RequestScan("");
+  ASSERT_TRUE(controller.WaitForNextScan(targets, requested, 3600, stop));
+  ASSERT_TRUE(requested);
+  ASSERT_TRUE(targets.empty());
+
+  // While paused, the requests are kept, and the periodic scans wait
+  controller.Pause();
+  ASSERT_TRUE(controller.IsPaused());
+  controller.RequestScan("/b/z");
+
+  controller.Format(json);
+  ASSERT_EQ("Paused", json["State"].asString());
+  ASSERT_EQ(1u, json["PendingPaths"].size());
+
+  ASSERT_TRUE(controller.WaitForNextScan(targets, requested, 0, stop));
+  ASSERT_FALSE(requested);
+
+  bool resumed = false;
+  boost::thread waiting(WaitWhilePaused, &controller, &stop, &resumed);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  ASSERT_FALSE(resumed);
+  controller.Resume();
+  waiting.join();
+  ASSERT_TRUE(resumed);
+
+  ASSERT_TRUE(controller.WaitForNextScan(targets, requested, 3600, stop));
+  ASSERT_TRUE(requested);
+  ASSERT_EQ(1u, targets.size());
+  ASSERT_EQ("/b/z", targets.front());
+
+  // Stopping
+  const bool stopped = true;
+  ASSERT_FALSE(controller.WaitForNextScan(targets, requested, 3600, stopped));
+
+  controller.Pause();
+  ASSERT_FALSE(controller.WaitWhilePaused(stopped));
+}
+
+
 int main(int argc, char **argv)
 {
   Orthanc::Logging::Initialize();
   Orthanc::Logging::EnableInfoLevel(true);
 
+  // The storage area allocates its buffers through the Orthanc core
+  FakeOrthancContext::Install();
+
   ::testing::InitGoogleTest(&argc, argv);
   int result = RUN_ALL_TESTS();
 
@@ -1,8 +1,11 @@
 #include "camic_interact.h"
 #include "camic_md5.h"
 #include <stdlib.h>
-#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
-#include <SerializationToolbox.h>
+#include "IndexerDatabase.h"
+#include "IndexerMetrics.h"
+#include <algorithm>
+#include <list>
+#include <boost/thread.hpp>
 
 camic_notifier camicroscope;
 std::string camic_notifier::origin;
@@ -113,22 +116,70 @@ std::string camic_notifier::escape(std::string s) {
     return escaped;
 }
 
-void camic_notifier::notify(std::string url)
+// Delays between two attempts to deliver the notifications, while caMicroscope is unreachable
+static const unsigned int min_backoff_seconds = 1;
+static const unsigned int max_backoff_seconds = 300;
+
+// Number of notifications that are read at once from the outbox
+static const unsigned int batch_size = 100;
+
+static boost::mutex mutex;
+static boost::condition_variable wake_up;
+static bool pending = false;
+static bool stopping = false;
+static boost::thread worker;
+static IndexerDatabase *outbox = NULL;
+
+void camic_notifier::start(IndexerDatabase &database)
 {
-    if (!ready)
+    const char *caracal_host = getenv("CARACAL_BACK_HOST_PORT");
+    if (!caracal_host || caracal_host[0] == 0)
     {
+        // No caMicroscope, don't accumulate notifications that would never be delivered
         initialize();
-    }
-    if (!ready) {
-        // No caMicroscope
         return;
     }
-    CURL *curl = curl_easy_init();
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1); // Thread safety
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, response_handler);
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, CURL_VERBOSE);
-    url = origin + url;
+
+    boost::mutex::scoped_lock lock(mutex);
+    outbox = &database;
+    stopping = false;
+    pending = true; // Replay the notifications left by a previous run
+    worker = boost::thread(run);
+}
+
+void camic_notifier::notify_added(const std::string &filepath)
+{
+    enqueue(filepath, true);
+}
+
+void camic_notifier::notify_deleted(const std::string &filepath)
+{
+    enqueue(filepath, false);
+}
+
+void camic_notifier::enqueue(const std::string &filepath, bool added)
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    if (outbox == NULL) {
+        return; // No caMicroscope
+    }
+
+    outbox->AppendNotification(filepath, added);
+    pending = true;
+    wake_up.notify_one();
+}
+
+enum delivery {
+    delivery_done,
+    delivery_retry
+};
+
+static delivery send(CURL *curl, const std::string &origin, const IndexerDatabase::Notification &n)
+{
+    // The sequence number lets caMicroscope recognize the notifications that are sent again after a failure
+    std::string url = origin + (n.added_ ? "/fs/addedFile?filepath=" : "/fs/deletedFile?filepath=") +
+        camic_notifier::escape(n.filepath_) + "&seq=" + std::to_string(n.sequence_);
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 #ifdef CURL_VERBOSE
     fprintf(stderr, "--URL GET: %s\n", url.c_str());
@@ -137,11 +188,118 @@ void camic_notifier::notify(std::string url)
     if (res != CURLE_OK)
     {
         const char *err = curl_easy_strerror(res);
-        fprintf(stderr, "caMicroscope dicomsrv failed to call %s. Error: %s\n", url.c_str(), err);
+        fprintf(stderr, "caMicroscope dicomsrv failed to call %s, will retry. Error: %s\n", url.c_str(), err);
+        IndexerMetrics::Increment(IndexerMetrics::Counter_NotificationsRetried);
+        return delivery_retry;
+    }
+
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 500) {
+        fprintf(stderr, "caMicroscope dicomsrv failed to call %s, will retry. HTTP status: %ld\n", url.c_str(), status);
+        IndexerMetrics::Increment(IndexerMetrics::Counter_NotificationsRetried);
+        return delivery_retry;
+    }
+    else if (status >= 400) {
+        // Sending it again would not help
+        fprintf(stderr, "caMicroscope dicomsrv failed to call %s, dropping it. HTTP status: %ld\n", url.c_str(), status);
+        IndexerMetrics::Increment(IndexerMetrics::Counter_NotificationsDropped);
+    }
+    else {
+        IndexerMetrics::Increment(IndexerMetrics::Counter_NotificationsSent);
+    }
+
+    return delivery_done;
+}
+
+void camic_notifier::run()
+{
+    // A single handle for the lifetime of the thread, so that libcurl
+    // keeps the connection (and the TLS session) to caMicroscope alive
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1); // Thread safety
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, response_handler);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, CURL_VERBOSE);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+    unsigned int backoff = 0; // No failure so far
+
+    for (;;) {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+
+            if (backoff == 0) {
+                while (!pending && !stopping) {
+                    wake_up.wait(lock);
+                }
+            }
+            else if (!stopping) {
+                wake_up.timed_wait(lock, boost::posix_time::seconds(backoff));
+            }
+
+            if (stopping) {
+                break; // The pending notifications stay in the outbox for the next run
+            }
+
+            pending = false;
+        }
+
+        if (!ready)
+        {
+            initialize();
+        }
+
+        bool failure = !ready;
+
+        while (!failure && !stopping) {
+            std::list<IndexerDatabase::Notification> notifications;
+            outbox->GetNotifications(notifications, batch_size);
+
+            if (notifications.empty()) {
+                break;
+            }
+
+            for (std::list<IndexerDatabase::Notification>::const_iterator it = notifications.begin();
+                 it != notifications.end() && !failure; ++it) {
+                if (send(curl, origin, *it) == delivery_done) {
+                    outbox->RemoveNotification(it->sequence_);
+                }
+                else {
+                    failure = true;
+                }
+            }
+        }
+
+        if (failure) {
+            backoff = (backoff == 0 ? min_backoff_seconds : std::min(2 * backoff, max_backoff_seconds));
+        }
+        else {
+            backoff = 0;
+        }
     }
+
     curl_easy_cleanup(curl);
 }
 
+void camic_notifier::finalize()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        stopping = true;
+        wake_up.notify_all();
+    }
+
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    boost::mutex::scoped_lock lock(mutex);
+    outbox = NULL;
+}
+
 camic_notifier::~camic_notifier() {
     curl_global_cleanup();
 }
@@ -163,27 +321,8 @@ static std::string hash_id(std::string series_id) {
     return res;
 }
 
-// "" if not dicom
-// md5 of series instance id otherwise
-std::string folder_name(const char *file, unsigned long int file_len) {
-    if (file_len < 135)
-        return "";
-    if (file[128] != 'D' || file[129] != 'I' || file[130] != 'C' || file[131] != 'M')
-        return "";
-    try
-    {
-        OrthancPlugins::OrthancString s;
-        s.Assign(OrthancPluginDicomBufferToJson(OrthancPlugins::GetGlobalContext(), file, file_len,
-                                                OrthancPluginDicomToJsonFormat_Short,
-                                                OrthancPluginDicomToJsonFlags_None, 256));
-
-        Json::Value json;
-        s.ToJson(json);
-        static const char *const SERIES_INSTANCE_UID = "0020,000e";
-        return hash_id(Orthanc::SerializationToolbox::ReadString(json, SERIES_INSTANCE_UID)).substr(0, 10);
-    }
-    catch (const Orthanc::OrthancException &)
-    {
-        return "";
-    }
+// md5 of series instance id
+// The series instance uid is parsed by the caller, along with the other identifiers of the instance
+std::string folder_name(const std::string &series_instance_uid) {
+    return hash_id(series_instance_uid).substr(0, 10);
 }
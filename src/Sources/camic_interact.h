@@ -5,7 +5,10 @@
 #include <string>
 #include <curl/curl.h>
 
-std::string folder_name(const char *file, unsigned long int file_len);
+class IndexerDatabase;
+
+// md5 of the series instance uid, as caMicroscope names the folder of a series
+std::string folder_name(const std::string &series_instance_uid);
 
 class camic_notifier {
 public:
@@ -19,10 +22,29 @@ public:
     static void initialize();
 
     static std::string escape(std::string s);
-    static void notify(std::string url);
+
+    // Starts the background thread that delivers the notifications,
+    // if caMicroscope is configured. The notifications are stored in
+    // the outbox of the database until caMicroscope acknowledges them,
+    // so they survive the restarts and the outages of caMicroscope.
+    static void start(IndexerDatabase &database);
+
+    // The notifications are appended to the outbox, and sent by the
+    // background thread on a persistent connection, so that a slow
+    // caMicroscope does not slow down the storage of the DICOM files.
+    // "filepath" is relative to the storage directory.
+    static void notify_added(const std::string &filepath);
+    static void notify_deleted(const std::string &filepath);
+
+    // Stops the background thread, the undelivered notifications are
+    // sent again at the next start
+    static void finalize();
 
     ~camic_notifier();
 private:
     static bool ready;
     static std::string origin; // https://caracal etc.
+
+    static void enqueue(const std::string &filepath, bool added);
+    static void run();
 };